@@ -0,0 +1,207 @@
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include "dev_io.h"
+#include "async_io.h"
+
+// Models a device with a fixed service latency and unlimited internal
+// parallelism. Every read is queued on a timer thread and completes when it
+// is due; a blocking read simply waits for its own completion.
+class delay_dev : public dev_io::ram_dev
+{
+public:
+    delay_dev(uint64_t size, int latency_us)
+        : ram_dev(size), latency(latency_us), stop(false), timer(&delay_dev::run, this) {}
+    ~delay_dev()
+    {
+        {
+            std::lock_guard<std::mutex> g(mtx);
+            stop = true;
+        }
+        cv.notify_one();
+        timer.join();
+    }
+    int32_t read(uint64_t offset, uint32_t size, void *buf) override
+    {
+        std::mutex m;
+        std::condition_variable c;
+        bool finished = false;
+        std::exception_ptr result;
+        read_async(offset, size, buf, [&](std::exception_ptr error) {
+            std::lock_guard<std::mutex> g(m);
+            result = error;
+            finished = true;
+            c.notify_one();
+        });
+        std::unique_lock<std::mutex> g(m);
+        c.wait(g, [&] { return finished; });
+        if (result)
+            std::rethrow_exception(result);
+        return size;
+    }
+    void read_async(uint64_t offset, uint32_t size, void *buf, dev_io::io_done done) override
+    {
+        std::exception_ptr error;
+        try
+        {
+            ram_dev::read(offset, size, buf);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        auto due = std::chrono::steady_clock::now() + latency;
+        {
+            std::lock_guard<std::mutex> g(mtx);
+            pending.emplace(due, [done = std::move(done), error] { done(error); });
+        }
+        cv.notify_one();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> g(mtx);
+        while (!stop || !pending.empty())
+        {
+            if (pending.empty())
+            {
+                cv.wait(g);
+                continue;
+            }
+            auto first = pending.begin();
+            if (first->first > std::chrono::steady_clock::now())
+            {
+                cv.wait_until(g, first->first);
+                continue;
+            }
+            auto done = std::move(first->second);
+            pending.erase(first);
+            g.unlock();
+            done();
+            g.lock();
+        }
+    }
+
+    std::chrono::microseconds latency;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> pending;
+    bool stop;
+    std::thread timer;
+};
+
+const uint32_t file_size = 16 << 20;
+const uint32_t io_size = 4096;
+
+double run_blocking(dev_io::dev_t &dev, uint64_t fd, int threads, int millis)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> ops(0);
+    std::vector<std::thread> workers;
+    auto begin = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t] {
+            std::mt19937 rng(t + 1);
+            std::vector<char> buf(io_size);
+            uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                dev.read(fd, rng() % (file_size / io_size) * io_size, io_size, buf.data());
+                ++count;
+            }
+            ops += count;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+    stop = true;
+    for (auto &w : workers)
+        w.join();
+    auto end = std::chrono::steady_clock::now();
+    return ops / std::chrono::duration<double>(end - begin).count();
+}
+
+// Keeps depth reads in flight: every completion issues the next read. Unlike
+// the blocking path, which reads one cluster at a time, an async request
+// also coalesces physically contiguous clusters into one device transfer.
+double run_async(dev_io::dev_t &dev, uint64_t fd, int threads, int depth, int millis)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> ops(0);
+    std::atomic<int> inflight(0);
+    std::atomic<uint64_t> failed(0);
+    std::vector<std::vector<char>> bufs(depth, std::vector<char>(io_size));
+    auto begin = std::chrono::steady_clock::now();
+    {
+        dev_io::executor ex(threads);
+        dev_io::async_dev adev(dev, ex);
+        std::function<void(int, uint32_t)> issue = [&](int slot, uint32_t seed) {
+            uint64_t offset = seed % (file_size / io_size) * io_size;
+            adev.read(fd, offset, io_size, bufs[slot].data(), [&, slot, seed](uint32_t len, std::exception_ptr error) {
+                ops.fetch_add(1, std::memory_order_relaxed);
+                if (error || len != io_size)
+                {
+                    failed.fetch_add(1);
+                    inflight.fetch_sub(1);
+                }
+                else if (stop.load(std::memory_order_relaxed))
+                    inflight.fetch_sub(1);
+                else
+                    issue(slot, seed * 1103515245 + 12345);
+            });
+        };
+        for (int i = 0; i < depth; ++i)
+        {
+            inflight.fetch_add(1);
+            issue(i, i + 1);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+        stop = true;
+        while (inflight.load())
+            std::this_thread::yield();
+    }
+    if (failed)
+    {
+        fprintf(stderr, "%llu async reads failed or returned short\n", (unsigned long long)failed.load());
+        exit(EXIT_FAILURE);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return ops / std::chrono::duration<double>(end - begin).count();
+}
+
+int main(int argc, char *argv[])
+{
+    int latency_us = argc > 1 ? atoi(argv[1]) : 100;
+    int millis = argc > 2 ? atoi(argv[2]) : 500;
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+    if (threads < 1)
+        threads = 1;
+
+    uint32_t tot_block = (file_size + (64u << 20)) / 512;
+    dev_io::dev_t dev(std::make_unique<delay_dev>((uint64_t)tot_block * 512, latency_us), tot_block, 512);
+    bool exist;
+    bool isdir;
+    auto fd = dev.open({L"data"}, CREATE_NEW, 0x20, exist, isdir);
+    std::vector<char> data(file_size, 'x');
+    dev.write(fd, 0, file_size, data.data());
+
+    printf("latency %d us, %d threads, %d ms per step, 4 KiB random reads\n", latency_us, threads, millis);
+    printf("%-10s %8s %12s\n", "api", "depth", "ops/s");
+    printf("%-10s %8d %12.0f\n", "blocking", threads, run_blocking(dev, fd, threads, millis));
+    for (int depth : {1, 4, 16, 64, 256})
+    {
+        printf("%-10s %8d %12.0f\n", "async", depth, run_async(dev, fd, threads, depth, millis));
+        fflush(stdout);
+    }
+    dev.close(fd);
+    return 0;
+}
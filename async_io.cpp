@@ -0,0 +1,110 @@
+#include "async_io.h"
+
+namespace dev_io
+{
+
+executor::executor(unsigned threads) : stop(false)
+{
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers.emplace_back(&executor::run, this);
+    }
+}
+
+executor::~executor()
+{
+    {
+        std::lock_guard<std::mutex> g(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto &w : workers)
+    {
+        w.join();
+    }
+}
+
+void executor::post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> g(mtx);
+        tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+}
+
+void executor::run()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> g(mtx);
+            cv.wait(g, [this] { return stop || !tasks.empty(); });
+            if (tasks.empty())
+            {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void async_dev::open(fat32::path path, uint32_t create_disposition, uint32_t file_attr, open_done done)
+{
+    ex.post([this, path = std::move(path), create_disposition, file_attr, done = std::move(done)] {
+        bool exist = false;
+        bool isdir = false;
+        uint64_t fd = 0;
+        std::exception_ptr error;
+        try
+        {
+            fd = dev.open(path, create_disposition, file_attr, exist, isdir);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        done(fd, exist, isdir, error);
+    });
+}
+
+void async_dev::opendir(uint64_t fd, opendir_done done)
+{
+    ex.post([this, fd, done = std::move(done)] {
+        fat32::dir_info info;
+        std::exception_ptr error;
+        try
+        {
+            info = dev.opendir(fd);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        done(std::move(info), error);
+    });
+}
+
+void async_dev::read(uint64_t fd, int64_t offset, uint32_t len, void *buf, rw_done done)
+{
+    dev.read_async(fd, offset, len, buf, defer(std::move(done)));
+}
+
+void async_dev::write(uint64_t fd, int64_t offset, uint32_t len, const void *buf, rw_done done)
+{
+    dev.write_async(fd, offset, len, buf, defer(std::move(done)));
+}
+
+rw_done async_dev::defer(rw_done done)
+{
+    // Device completions may arrive on a backend thread; hop to the executor
+    // so callbacks never run there.
+    return [this, done = std::move(done)](uint32_t len, std::exception_ptr error) {
+        ex.post([done, len, error] { done(len, error); });
+    };
+}
+
+} // namespace dev_io
@@ -0,0 +1,62 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "dev_io.h"
+
+namespace dev_io
+{
+
+// Fixed pool of threads draining a FIFO of tasks. The destructor runs every
+// task already posted before joining.
+class executor
+{
+public:
+    explicit executor(unsigned threads);
+    executor(const executor &) = delete;
+    executor &operator=(const executor &) = delete;
+    ~executor();
+
+    void post(std::function<void()> task);
+
+private:
+    void run();
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    bool stop;
+    std::vector<std::thread> workers;
+};
+
+// Callback front end for dev_t. Reads and writes are submitted straight to
+// the device and never block a thread while the transfer is in flight;
+// open and opendir touch directory metadata synchronously, so they run on
+// the executor instead. Every callback is invoked on an executor thread.
+class async_dev
+{
+public:
+    typedef std::function<void(uint64_t fd, bool exist, bool isdir, std::exception_ptr)> open_done;
+    typedef std::function<void(fat32::dir_info, std::exception_ptr)> opendir_done;
+
+    async_dev(dev_t &dev, executor &ex) : dev(dev), ex(ex) {}
+
+    void open(fat32::path path, uint32_t create_disposition, uint32_t file_attr, open_done done);
+    void opendir(uint64_t fd, opendir_done done);
+    void read(uint64_t fd, int64_t offset, uint32_t len, void *buf, rw_done done);
+    void write(uint64_t fd, int64_t offset, uint32_t len, const void *buf, rw_done done);
+
+private:
+    rw_done defer(rw_done done);
+
+    dev_t &dev;
+    executor &ex;
+};
+
+} // namespace dev_io
+
+#endif
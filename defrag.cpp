@@ -0,0 +1,514 @@
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "volume.h"
+
+// Offline FAT32 defragmenter. The whole tree is walked once and kept in
+// memory; every pass then places the fragmented chains, largest first, into
+// the best fitting extent of clusters that were free when the pass began,
+// copies their data with large sequential requests and commits the new
+// chains. Each pass writes in an order that leaves a consistent volume at
+// every step: new chains into the FAT, then directories, then the old
+// chains freed.
+
+option long_options[] = {
+    {"dry-run", no_argument, NULL, 'n'},
+    {"passes", required_argument, NULL, 'p'},
+    {"threads", required_argument, NULL, 'j'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_help(char *argv0)
+{
+    printf(
+        "Usage: %s [OPTION]... IMAGE\n"
+        "Defragment the FAT32 volume in IMAGE, which must not be mounted and\n"
+        "should pass fsck first.\n"
+        "Arguments:\n"
+        "  -n, --dry-run              only report fragmentation\n"
+        "  -p, --passes               most passes to run, default 4\n"
+        "  -j, --threads              threads reading and writing the FAT, default one per core\n"
+        "  -h, --help                 show help messages\n"
+        "Files and directories are moved into contiguous extents and\n"
+        "directories are compacted. Space freed by one pass is only reused\n"
+        "by the next, so a crash never leaves data that nothing points to\n"
+        "overwritten.\n",
+        argv0);
+}
+
+// Every file and directory that owns clusters; 0 is the root.
+struct node
+{
+    uint32_t parent;
+    uint32_t slot; // short entry within the parent's entries
+    bool isdir;
+    bool dirty;
+    std::vector<uint32_t> chain;
+    std::vector<fat32::DIR_Entry> entries;
+    std::vector<uint32_t> children;
+};
+
+struct frag_stats
+{
+    uint64_t files = 0;
+    uint64_t frag_files = 0;
+    uint64_t fragments = 0;
+    uint64_t dirs = 0;
+    uint64_t frag_dirs = 0;
+    uint64_t free = 0;
+    uint64_t free_extents = 0;
+    uint32_t largest_free = 0;
+};
+
+size_t runs(const std::vector<uint32_t> &chain)
+{
+    size_t count = chain.empty() ? 0 : 1;
+    for (size_t i = 1; i < chain.size(); ++i)
+    {
+        if (chain[i] != chain[i - 1] + 1)
+            ++count;
+    }
+    return count;
+}
+
+void set_first_clus(fat32::DIR_Entry &entry, uint32_t clus)
+{
+    entry.DIR_FstClusHI = clus >> 16;
+    entry.DIR_FstClusLO = clus & 0xffff;
+}
+
+class defragmenter
+{
+public:
+    defragmenter(dev_io::volume &vol, unsigned threads) : vol(vol), threads(threads)
+    {
+        fat = vol.read_fat(0, threads);
+        entries_per_clus = vol.clus_size() / sizeof(fat32::DIR_Entry);
+        walk();
+    }
+
+    frag_stats stats() const
+    {
+        frag_stats res;
+        for (size_t i = 1; i < nodes.size(); ++i)
+        {
+            auto count = runs(nodes[i].chain);
+            if (nodes[i].isdir)
+            {
+                ++res.dirs;
+                res.frag_dirs += count > 1;
+            }
+            else
+            {
+                ++res.files;
+                res.frag_files += count > 1;
+                res.fragments += count;
+            }
+        }
+        for (auto &e : free_extents())
+        {
+            res.free += e.second;
+            ++res.free_extents;
+            res.largest_free = std::max(res.largest_free, e.second);
+        }
+        return res;
+    }
+
+    // Drops deleted entries and stray long name fragments from every
+    // directory and shortens chains that then hold unused clusters. The
+    // clusters are released by the next pass.
+    void compact()
+    {
+        for (auto &n : nodes)
+        {
+            if (n.isdir)
+                compact(n);
+        }
+    }
+
+    // Returns the number of chains moved.
+    size_t pass()
+    {
+        std::multimap<uint32_t, uint32_t> extents;
+        for (auto &e : free_extents())
+        {
+            extents.emplace(e.second, e.first);
+        }
+
+        std::vector<uint32_t> todo;
+        for (uint32_t i = 1; i < nodes.size(); ++i)
+        {
+            if (runs(nodes[i].chain) > 1)
+                todo.push_back(i);
+        }
+        std::stable_sort(todo.begin(), todo.end(), [this](uint32_t a, uint32_t b) {
+            return nodes[a].chain.size() > nodes[b].chain.size();
+        });
+
+        std::vector<uint32_t> moved;
+        std::vector<uint32_t> old_clusters;
+        skipped = 0;
+        for (auto id : todo)
+        {
+            auto &n = nodes[id];
+            uint32_t need = n.chain.size();
+            auto it = extents.lower_bound(need);
+            if (it == extents.end())
+            {
+                ++skipped;
+                continue;
+            }
+            auto start = it->second;
+            auto len = it->first;
+            extents.erase(it);
+            if (len > need)
+                extents.emplace(len - need, start + need);
+
+            std::vector<uint32_t> chain(need);
+            for (uint32_t k = 0; k < need; ++k)
+            {
+                chain[k] = start + k;
+            }
+            if (!n.isdir)
+                copy(n.chain, chain);
+            old_clusters.insert(old_clusters.end(), n.chain.begin(), n.chain.end());
+            relink(id, std::move(chain));
+            moved.push_back(id);
+            moved_bytes += (uint64_t)need * vol.clus_size();
+            ++(n.isdir ? moved_dirs : moved_files);
+        }
+
+        // the new chains, with the old ones still allocated
+        for (auto id : moved)
+        {
+            link(nodes[id].chain);
+        }
+        if (!moved.empty())
+            vol.write_fat(fat, threads);
+
+        // moved directories live in clusters nothing points to yet, so they
+        // go first; the rest are rewritten in place
+        for (auto id : moved)
+        {
+            if (nodes[id].isdir)
+                write_dir(nodes[id]);
+        }
+        for (auto &n : nodes)
+        {
+            if (n.dirty)
+                write_dir(n);
+        }
+
+        // a shortened directory may have moved as well
+        for (auto &t : tails)
+        {
+            fat[t.first] = 0x0fffffff;
+            for (auto clus : t.second)
+            {
+                fat[clus] = 0;
+            }
+        }
+        for (auto clus : old_clusters)
+        {
+            fat[clus] = 0;
+        }
+        if (!moved.empty() || !tails.empty())
+        {
+            tails.clear();
+            vol.write_fat(fat, threads);
+            update_fsinfo();
+        }
+        return moved.size();
+    }
+
+    uint64_t moved_files = 0;
+    uint64_t moved_dirs = 0;
+    uint64_t moved_bytes = 0;
+    uint64_t skipped = 0;
+
+private:
+    dev_io::volume &vol;
+    unsigned threads;
+    std::vector<uint32_t> fat;
+    std::vector<node> nodes;
+    uint32_t entries_per_clus;
+    // last cluster kept and clusters released by directories compact() shortened
+    std::vector<std::pair<uint32_t, std::vector<uint32_t>>> tails;
+
+    [[noreturn]] void inconsistent(uint32_t clus)
+    {
+        throw std::runtime_error("the chain at cluster " + std::to_string(clus) + " is damaged or shared, run fsck -r first");
+    }
+
+    void walk()
+    {
+        std::vector<bool> used(fat.size());
+        auto claim = [&](uint32_t first, std::vector<uint32_t> &chain) {
+            if (!dev_io::read_fat_chain(fat, first, chain))
+                inconsistent(first);
+            for (auto clus : chain)
+            {
+                if (used[clus])
+                    inconsistent(first);
+                used[clus] = true;
+            }
+        };
+
+        nodes.emplace_back();
+        nodes[0].parent = 0;
+        nodes[0].slot = 0;
+        nodes[0].isdir = true;
+        nodes[0].dirty = false;
+        claim(vol.bpb().BPB_RootClus, nodes[0].chain);
+        for (uint32_t id = 0; id < nodes.size(); ++id)
+        {
+            if (!nodes[id].isdir)
+                continue;
+            auto &dir = nodes[id];
+            dir.entries.resize(dir.chain.size() * entries_per_clus);
+            vol.read_chain(dir.chain, dir.entries.data());
+            for (auto &e : dev_io::parse_dir(dir.entries.data(), dir.entries.size()))
+            {
+                if (e.is_dot() || e.is_label() || !e.first_clus())
+                    continue;
+                node child;
+                child.parent = id;
+                child.slot = e.index + e.slots - 1;
+                child.isdir = e.isdir();
+                child.dirty = false;
+                claim(e.first_clus(), child.chain);
+                // push_back may reallocate, so dir is not used in this loop
+                nodes[id].children.push_back(nodes.size());
+                nodes.push_back(std::move(child));
+            }
+        }
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> free_extents() const
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> res;
+        uint32_t clus = 2;
+        while (clus < fat.size())
+        {
+            if (fat[clus])
+            {
+                ++clus;
+                continue;
+            }
+            auto start = clus;
+            while (clus < fat.size() && !fat[clus])
+            {
+                ++clus;
+            }
+            res.emplace_back(start, clus - start);
+        }
+        return res;
+    }
+
+    void compact(node &dir)
+    {
+        std::vector<fat32::DIR_Entry> packed;
+        std::vector<uint32_t> remap(dir.entries.size());
+        for (auto &e : dev_io::parse_dir(dir.entries.data(), dir.entries.size()))
+        {
+            for (uint32_t k = 0; k < e.slots; ++k)
+            {
+                remap[e.index + k] = packed.size();
+                packed.push_back(dir.entries[e.index + k]);
+            }
+        }
+        size_t need = std::max<size_t>(1, (packed.size() + entries_per_clus - 1) / entries_per_clus);
+        packed.resize(need * entries_per_clus);
+        if (packed.size() == dir.entries.size() &&
+            memcmp(packed.data(), dir.entries.data(), packed.size() * sizeof(fat32::DIR_Entry)) == 0)
+            return;
+        dir.entries = std::move(packed);
+        dir.dirty = true;
+        for (auto c : dir.children)
+        {
+            nodes[c].slot = remap[nodes[c].slot];
+        }
+        if (need < dir.chain.size())
+        {
+            tails.emplace_back(dir.chain[need - 1], std::vector<uint32_t>(dir.chain.begin() + need, dir.chain.end()));
+            dir.chain.resize(need);
+        }
+    }
+
+    void copy(const std::vector<uint32_t> &from, const std::vector<uint32_t> &to)
+    {
+        size_t batch = std::max<size_t>(1, (16 << 20) / vol.clus_size());
+        std::unique_ptr<char[]> buf(new char[std::min(batch, from.size()) * vol.clus_size()]);
+        for (size_t i = 0; i < from.size(); i += batch)
+        {
+            auto end = std::min(from.size(), i + batch);
+            std::vector<uint32_t> src(from.begin() + i, from.begin() + end);
+            std::vector<uint32_t> dst(to.begin() + i, to.begin() + end);
+            vol.read_chain(src, buf.get());
+            vol.write_chain(dst, buf.get());
+        }
+    }
+
+    // Points the entries that refer to node id at its new chain.
+    void relink(uint32_t id, std::vector<uint32_t> chain)
+    {
+        auto &n = nodes[id];
+        auto old_first = n.chain[0];
+        n.chain = std::move(chain);
+        auto first = n.chain[0];
+        auto &parent = nodes[n.parent];
+        set_first_clus(parent.entries[n.slot], first);
+        parent.dirty = true;
+        if (!n.isdir)
+            return;
+        n.dirty = true;
+        set_dot(n, ".", old_first, first);
+        for (auto c : n.children)
+        {
+            if (nodes[c].isdir)
+                set_dot(nodes[c], "..", old_first, first);
+        }
+    }
+
+    void set_dot(node &dir, const char *name, uint32_t from, uint32_t to)
+    {
+        char short_name[11];
+        memset(short_name, ' ', sizeof(short_name));
+        memcpy(short_name, name, strlen(name));
+        for (size_t i = 0; i < std::min<size_t>(2, dir.entries.size()); ++i)
+        {
+            auto &e = dir.entries[i];
+            if (memcmp(e.DIR_Name, short_name, sizeof(short_name)) == 0 &&
+                ((uint32_t)e.DIR_FstClusHI << 16) + e.DIR_FstClusLO == from)
+            {
+                set_first_clus(e, to);
+                dir.dirty = true;
+            }
+        }
+    }
+
+    void link(const std::vector<uint32_t> &chain)
+    {
+        for (size_t i = 0; i + 1 < chain.size(); ++i)
+        {
+            fat[chain[i]] = chain[i + 1];
+        }
+        fat[chain.back()] = 0x0fffffff;
+    }
+
+    void write_dir(node &dir)
+    {
+        vol.write_chain(dir.chain, dir.entries.data());
+        dir.dirty = false;
+    }
+
+    void update_fsinfo()
+    {
+        auto &info = vol.fsinfo();
+        info.FSI_FreeCount = std::count(fat.begin() + 2, fat.end(), 0u);
+        auto it = std::find(fat.begin() + 2, fat.end(), 0u);
+        info.FSI_Nxt_Free = it == fat.end() ? 0xffffffff : it - fat.begin();
+        vol.write_fsinfo();
+    }
+};
+
+void report(const char *when, const frag_stats &s)
+{
+    printf("%s: %llu files, %llu fragmented (%.1f%%), %.2f fragments per file; "
+           "%llu directories, %llu fragmented; %llu clusters free in %llu extents, largest %u\n",
+           when, (unsigned long long)s.files, (unsigned long long)s.frag_files,
+           s.files ? 100.0 * s.frag_files / s.files : 0.0, s.files ? (double)s.fragments / s.files : 0.0,
+           (unsigned long long)s.dirs, (unsigned long long)s.frag_dirs, (unsigned long long)s.free,
+           (unsigned long long)s.free_extents, s.largest_free);
+}
+
+int main(int argc, char *argv[])
+{
+    extern char *optarg;
+    extern int optind, opterr, optopt;
+
+    opterr = 0;
+    bool dry_run = false;
+    int passes = 4;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+    while (true)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "np:j:h", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 'n':
+            dry_run = true;
+            break;
+
+        case 'p':
+            passes = std::max(1, atoi(optarg));
+            break;
+
+        case 'j':
+            threads = std::max(1, atoi(optarg));
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            fprintf(stderr, "invalid argument %c\n", (char)optopt);
+            print_help(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "no enough arguments\n");
+        print_help(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    try
+    {
+        dev_io::volume vol(argv[optind]);
+        defragmenter defrag(vol, threads);
+        report("before", defrag.stats());
+        if (dry_run)
+            return EXIT_SUCCESS;
+
+        defrag.compact();
+        int pass = 0;
+        while (pass < passes)
+        {
+            ++pass;
+            if (!defrag.pass() || !defrag.skipped)
+                break;
+        }
+        report("after", defrag.stats());
+        printf("moved %llu files and %llu directories (%llu KiB) in %d passes",
+               (unsigned long long)defrag.moved_files, (unsigned long long)defrag.moved_dirs,
+               (unsigned long long)(defrag.moved_bytes >> 10), pass);
+        if (defrag.skipped)
+            printf(", %llu still fragmented for lack of contiguous space", (unsigned long long)defrag.skipped);
+        printf("\n");
+        return EXIT_SUCCESS;
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "defragment %s failed, %s\n", argv[optind], e.what());
+        return EXIT_FAILURE;
+    }
+}
@@ -1,13 +1,20 @@
+#include <algorithm>
 #include <mutex>
 #include <vector>
 #include <string>
 #include <utility>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include <windows.h>
+#include "win_compat.h"
 #include "dev_io.h"
-
-std::mutex m;
+#include "async_io.h"
+#include "stats.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 std::wstring local2wide(const char *s)
 {
@@ -15,7 +22,7 @@ std::wstring local2wide(const char *s)
     std::wstring res;
     res.resize(wide_size);
     wide_size = MultiByteToWideChar(CP_ACP, 0, s, -1, res.data(), wide_size);
-    return std::move(res);
+    return res;
 }
 
 namespace dev_io
@@ -56,7 +63,12 @@ void set_BPB_FATSz32(fat32::BPB_t *pBPB)
     pBPB->BPB_FATSz32 = (TmpVal1 + (TmpVal2 - 1)) / TmpVal2;
 }
 
-void set_BPB(uint32_t tot_block, uint16_t block_size, fat32::BPB_t *pBPB)
+static bool is_pow2(uint32_t value)
+{
+    return value && !(value & (value - 1));
+}
+
+void set_BPB(uint32_t tot_block, uint16_t block_size, fat32::BPB_t *pBPB, const format_options &opts)
 {
     memset(pBPB, 0, sizeof(fat32::BPB_t));
     pBPB->BS_jmpBoot[0] = 0xEB;
@@ -65,8 +77,27 @@ void set_BPB(uint32_t tot_block, uint16_t block_size, fat32::BPB_t *pBPB)
     strcpy(pBPB->BS_OEMName, "ALAN.FAT");
     pBPB->BPB_BytsPerSec = block_size;
     pBPB->BPB_TotSec32 = tot_block;
-    set_BPB_SecPerClus(pBPB);
-    pBPB->BPB_RsvdSecCnt = (31 + pBPB->BPB_SecPerClus) / pBPB->BPB_SecPerClus * pBPB->BPB_SecPerClus;
+    if (opts.clus_size)
+    {
+        if (!is_pow2(opts.clus_size) || opts.clus_size < block_size || opts.clus_size > 32768)
+            throw std::invalid_argument("cluster size must be a power of two from the block size up to 32768 bytes");
+        pBPB->BPB_SecPerClus = opts.clus_size / block_size;
+    }
+    else
+    {
+        set_BPB_SecPerClus(pBPB);
+        if (!pBPB->BPB_SecPerClus)
+            throw std::invalid_argument("a FAT32 volume needs more than 66600 blocks");
+    }
+    // in sectors
+    uint32_t align = pBPB->BPB_SecPerClus;
+    if (opts.align)
+    {
+        if (!is_pow2(opts.align) || opts.align < block_size || opts.align > (16 << 20))
+            throw std::invalid_argument("alignment must be a power of two from the block size up to 16 MiB");
+        align = opts.align / block_size;
+    }
+    pBPB->BPB_RsvdSecCnt = (31 + align) / align * align;
     pBPB->BPB_NumFATs = 2;
     // pBPB->BPB_RootEntCnt = 0;
     // pBPB->BPB_TotSec16 = 0;
@@ -75,7 +106,29 @@ void set_BPB(uint32_t tot_block, uint16_t block_size, fat32::BPB_t *pBPB)
     // pBPB->BPB_SecPerTrk = 0;
     // pBPB->BPB_NumHeads= 0;
     // pBPB->BPB_HiddSec = 0;
-    set_BPB_FATSz32(pBPB);
+    if (opts.max_block > tot_block)
+    {
+        // room in the FATs for clusters added by growing the volume later
+        pBPB->BPB_TotSec32 = opts.max_block;
+        set_BPB_FATSz32(pBPB);
+        pBPB->BPB_TotSec32 = tot_block;
+    }
+    else
+        set_BPB_FATSz32(pBPB);
+    if (opts.align)
+    {
+        // keeps the second FAT and the data region on the boundary too
+        pBPB->BPB_FATSz32 = (pBPB->BPB_FATSz32 + align - 1) / align * align;
+    }
+    uint64_t data_sec = pBPB->BPB_RsvdSecCnt + (uint64_t)pBPB->BPB_NumFATs * pBPB->BPB_FATSz32;
+    uint64_t count_of_cluster = data_sec < tot_block ? (tot_block - data_sec) / pBPB->BPB_SecPerClus : 0;
+    if (count_of_cluster < 65525 || count_of_cluster > 0x0ffffff4)
+    {
+        throw std::invalid_argument("the volume would have " + std::to_string(count_of_cluster) +
+                                    " clusters, FAT32 needs 65525 to 268435444");
+    }
+    if (opts.max_block > tot_block && (opts.max_block - data_sec) / pBPB->BPB_SecPerClus > 0x0ffffff4)
+        throw std::invalid_argument("the volume could not grow that far with this cluster size");
     // pBPB->BPB_ExtFlags = 0;
     // pBPB->BPB_FSVer = 0;
     pBPB->BPB_RootClus = 2;
@@ -107,86 +160,396 @@ void set_FSInfo(fat32::FSInfo_t *pFSInfo, fat32::BPB_t *pBPB)
     pFSInfo->FSI_TrailSig = 0xAA550000;
 }
 
-dev_t::dev_t(const char *dev_name, uint32_t tot_block, uint16_t block_size)
-    : dev_img(INVALID_HANDLE_VALUE), cleared(true)
+#ifdef _WIN32
+namespace
 {
-    try
+
+// An async request in flight on the completion port.
+struct overlapped_io
+{
+    OVERLAPPED ov;
+    uint32_t size;
+    bool write;
+    io_done done;
+};
+
+// A blocking request on the overlapped handle. The low bit of hEvent keeps
+// its completion off the port, so only the caller waits for it.
+struct sync_io
+{
+    explicit sync_io(uint64_t offset)
+    {
+        memset(&pos, 0, sizeof(OVERLAPPED));
+        pos.Offset = (DWORD)offset;
+        pos.OffsetHigh = (DWORD)(offset >> 32);
+        event = CreateEventW(NULL, TRUE, FALSE, NULL);
+        pos.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+    }
+    ~sync_io()
     {
-        auto wdev_name = local2wide(dev_name);
-        dev_img = CreateFileW(wdev_name.c_str(),
-                              GENERIC_READ | GENERIC_WRITE,
-                              FILE_SHARE_READ, NULL, CREATE_NEW,
-                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH,
-                              NULL);
-        if (dev_img == INVALID_HANDLE_VALUE)
+        if (event)
+            CloseHandle(event);
+    }
+    bool wait(HANDLE handle, BOOL started, DWORD *count)
+    {
+        if (!started && GetLastError() != ERROR_IO_PENDING)
+            return false;
+        return GetOverlappedResult(handle, &pos, count, TRUE);
+    }
+
+    OVERLAPPED pos;
+    HANDLE event;
+};
+
+} // namespace
+
+file_dev::file_dev(const char *dev_name, uint64_t size) : pending(0)
+{
+    auto wdev_name = local2wide(dev_name);
+    handle = CreateFileW(wdev_name.c_str(),
+                         GENERIC_READ | GENERIC_WRITE,
+                         FILE_SHARE_READ, NULL, CREATE_NEW,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED,
+                         NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        throw disk_error(disk_error::DISK_OPEN_ERROR);
+    FILE_END_OF_FILE_INFO eof;
+    eof.EndOfFile.QuadPart = size;
+    if (!SetFileInformationByHandle(handle, FileEndOfFileInfo, &eof, sizeof(eof)))
+    {
+        CloseHandle(handle);
+        throw disk_error(disk_error::DISK_EXTEND_ERROR);
+    }
+    start();
+}
+
+file_dev::file_dev(const char *dev_name) : pending(0)
+{
+    auto wdev_name = local2wide(dev_name);
+    handle = CreateFileW(wdev_name.c_str(),
+                         GENERIC_READ | GENERIC_WRITE,
+                         FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED,
+                         NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            throw disk_error(disk_error::DISK_NOT_FOUND);
+        else
             throw disk_error(disk_error::DISK_OPEN_ERROR);
-        LARGE_INTEGER file_size;
-        file_size.QuadPart = tot_block * block_size;
-        if (!SetFilePointerEx(dev_img, file_size, NULL, FILE_BEGIN))
-            throw disk_error(disk_error::DISK_SEEK_ERROR);
-        if (!SetEndOfFile(dev_img))
-            throw disk_error(disk_error::DISK_EXTEND_ERROR);
-        format(tot_block, block_size);
     }
-    catch (disk_error &e)
+    start();
+}
+
+void file_dev::start()
+{
+    // FILE_FLAG_NO_BUFFERING transfers whole logical sectors
+    FILE_STORAGE_INFO info;
+    if (GetFileInformationByHandleEx(handle, FileStorageInfo, &info, sizeof(info)))
+        sector = info.LogicalBytesPerSector;
+    else
+        sector = 512;
+    port = CreateIoCompletionPort(handle, NULL, 0, 0);
+    if (!port)
     {
-        if (dev_img != NULL && dev_img != INVALID_HANDLE_VALUE)
-            CloseHandle(dev_img);
-        throw e;
+        CloseHandle(handle);
+        throw disk_error(disk_error::DISK_OPEN_ERROR);
     }
+    completion = std::thread(&file_dev::complete, this);
 }
 
-dev_t::dev_t(const char *dev_name)
-    : dev_img(INVALID_HANDLE_VALUE), cleared(true)
+file_dev::~file_dev()
 {
-    try
+    while (pending.load(std::memory_order_acquire))
+        std::this_thread::yield();
+    PostQueuedCompletionStatus(port, 0, 0, NULL);
+    completion.join();
+    CloseHandle(port);
+    CloseHandle(handle);
+}
+
+int32_t file_dev::read(uint64_t offset, uint32_t size, void *buf)
+{
+    sync_io io(offset);
+    DWORD read_count;
+    if (io.event && io.wait(handle, ReadFile(handle, buf, size, NULL, &io.pos), &read_count))
+        return read_count;
+    else
+        throw disk_error(disk_error::DISK_READ_ERROR);
+}
+
+int32_t file_dev::write(uint64_t offset, uint32_t size, const void *buf)
+{
+    sync_io io(offset);
+    DWORD write_count;
+    if (io.event && io.wait(handle, WriteFile(handle, buf, size, NULL, &io.pos), &write_count))
+        return write_count;
+    else
+        throw disk_error(disk_error::DISK_WRITE_ERROR);
+}
+
+void file_dev::read_async(uint64_t offset, uint32_t size, void *buf, io_done done)
+{
+    auto io = new overlapped_io();
+    io->ov.Offset = (DWORD)offset;
+    io->ov.OffsetHigh = (DWORD)(offset >> 32);
+    io->size = size;
+    io->write = false;
+    io->done = std::move(done);
+    pending.fetch_add(1, std::memory_order_relaxed);
+    if (!ReadFile(handle, buf, size, NULL, &io->ov) && GetLastError() != ERROR_IO_PENDING)
     {
-        auto wdev_name = local2wide(dev_name);
-        dev_img = CreateFileW(wdev_name.c_str(),
-                              GENERIC_READ | GENERIC_WRITE,
-                              FILE_SHARE_READ, NULL, OPEN_EXISTING,
-                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH,
-                              NULL);
-        if (dev_img == INVALID_HANDLE_VALUE)
-        {
-            if (GetLastError() == ERROR_FILE_NOT_FOUND)
-                throw disk_error(disk_error::DISK_NOT_FOUND);
-            else
-                throw disk_error(disk_error::DISK_OPEN_ERROR);
-        }
-        dev_read(dev_img, 0, sizeof(fat32::BPB_t), &BPB);
-        if (BPB.Signature_word != 0xaa55)
-        {
-            throw disk_error(disk_error::DISK_SIGNATURE_ERROR);
-        }
-        dev_read(dev_img, BPB.BPB_FSInfo * BPB.BPB_BytsPerSec,
-                 sizeof(fat32::FSInfo_t), &FSInfo);
-        if (FSInfo.FSI_LeadSig != 0x41615252 || FSInfo.FSI_StrucSig != 0x61417272 ||
-            FSInfo.FSI_TrailSig != 0xAA550000)
+        done = std::move(io->done);
+        delete io;
+        pending.fetch_sub(1, std::memory_order_release);
+        done(std::make_exception_ptr(disk_error(disk_error::DISK_READ_ERROR)));
+    }
+}
+
+void file_dev::write_async(uint64_t offset, uint32_t size, const void *buf, io_done done)
+{
+    auto io = new overlapped_io();
+    io->ov.Offset = (DWORD)offset;
+    io->ov.OffsetHigh = (DWORD)(offset >> 32);
+    io->size = size;
+    io->write = true;
+    io->done = std::move(done);
+    pending.fetch_add(1, std::memory_order_relaxed);
+    if (!WriteFile(handle, buf, size, NULL, &io->ov) && GetLastError() != ERROR_IO_PENDING)
+    {
+        done = std::move(io->done);
+        delete io;
+        pending.fetch_sub(1, std::memory_order_release);
+        done(std::make_exception_ptr(disk_error(disk_error::DISK_WRITE_ERROR)));
+    }
+}
+
+void file_dev::complete()
+{
+    while (true)
+    {
+        DWORD count = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED *ov = NULL;
+        BOOL ok = GetQueuedCompletionStatus(port, &count, &key, &ov, INFINITE);
+        if (!ov)
         {
-            throw disk_error(disk_error::DISK_SIGNATURE_ERROR);
+            // the wake-up posted by the destructor
+            return;
         }
-        clac_info();
+        auto io = CONTAINING_RECORD(ov, overlapped_io, ov);
+        std::exception_ptr error;
+        if (!ok || count != io->size)
+            error = std::make_exception_ptr(disk_error(io->write ? disk_error::DISK_WRITE_ERROR : disk_error::DISK_READ_ERROR));
+        io->done(error);
+        delete io;
+        pending.fetch_sub(1, std::memory_order_release);
     }
-    catch (disk_error &e)
+}
+
+void file_dev::extend(uint64_t size)
+{
+    FILE_END_OF_FILE_INFO eof;
+    eof.EndOfFile.QuadPart = size;
+    if (!SetFileInformationByHandle(handle, FileEndOfFileInfo, &eof, sizeof(eof)))
+        throw disk_error(disk_error::DISK_EXTEND_ERROR);
+}
+
+uint32_t file_dev::align() const
+{
+    return sector;
+}
+#else
+// pread and pwrite block a thread each, so this many requests per image are
+// in flight at once
+static const unsigned io_threads = 8;
+
+file_dev::file_dev(const char *dev_name, uint64_t size)
+{
+    fd = ::open(dev_name, O_RDWR | O_CREAT | O_EXCL | O_DSYNC, 0644);
+    if (fd < 0)
+        throw disk_error(disk_error::DISK_OPEN_ERROR);
+    if (ftruncate(fd, size) != 0)
     {
-        CloseHandle(dev_img);
-        throw e;
+        ::close(fd);
+        throw disk_error(disk_error::DISK_EXTEND_ERROR);
     }
 }
 
+file_dev::file_dev(const char *dev_name)
+{
+    fd = ::open(dev_name, O_RDWR | O_DSYNC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            throw disk_error(disk_error::DISK_NOT_FOUND);
+        else
+            throw disk_error(disk_error::DISK_OPEN_ERROR);
+    }
+}
+
+file_dev::~file_dev()
+{
+    // runs the requests still queued before the descriptor goes away
+    workers.reset();
+    ::close(fd);
+}
+
+int32_t file_dev::read(uint64_t offset, uint32_t size, void *buf)
+{
+    auto read_count = pread(fd, buf, size, offset);
+    if (read_count >= 0)
+        return read_count;
+    else
+        throw disk_error(disk_error::DISK_READ_ERROR);
+}
+
+int32_t file_dev::write(uint64_t offset, uint32_t size, const void *buf)
+{
+    auto write_count = pwrite(fd, buf, size, offset);
+    if (write_count >= 0)
+        return write_count;
+    else
+        throw disk_error(disk_error::DISK_WRITE_ERROR);
+}
+
+void file_dev::read_async(uint64_t offset, uint32_t size, void *buf, io_done done)
+{
+    pool().post([this, offset, size, buf, done = std::move(done)] {
+        std::exception_ptr error;
+        if (pread(fd, buf, size, offset) != (ssize_t)size)
+            error = std::make_exception_ptr(disk_error(disk_error::DISK_READ_ERROR));
+        done(error);
+    });
+}
+
+void file_dev::write_async(uint64_t offset, uint32_t size, const void *buf, io_done done)
+{
+    pool().post([this, offset, size, buf, done = std::move(done)] {
+        std::exception_ptr error;
+        if (pwrite(fd, buf, size, offset) != (ssize_t)size)
+            error = std::make_exception_ptr(disk_error(disk_error::DISK_WRITE_ERROR));
+        done(error);
+    });
+}
+
+void file_dev::extend(uint64_t size)
+{
+    if (ftruncate(fd, size) != 0)
+        throw disk_error(disk_error::DISK_EXTEND_ERROR);
+}
+
+executor &file_dev::pool()
+{
+    // started on first use, so tools that never go async pay nothing
+    std::call_once(pool_once, [this] { workers = std::make_unique<executor>(io_threads); });
+    return *workers;
+}
+#endif
+
+void blk_dev::read_async(uint64_t offset, uint32_t size, void *buf, io_done done)
+{
+    std::exception_ptr error;
+    try
+    {
+        read(offset, size, buf);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    done(error);
+}
+
+void blk_dev::write_async(uint64_t offset, uint32_t size, const void *buf, io_done done)
+{
+    std::exception_ptr error;
+    try
+    {
+        write(offset, size, buf);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    done(error);
+}
+
+void blk_dev::extend(uint64_t)
+{
+    throw disk_error(disk_error::DISK_EXTEND_ERROR);
+}
+
+uint32_t blk_dev::align() const
+{
+    return 1;
+}
+
+ram_dev::ram_dev(uint64_t size) : img(size, 0) {}
+
+int32_t ram_dev::read(uint64_t offset, uint32_t size, void *buf)
+{
+    if (offset + size > img.size())
+        throw disk_error(disk_error::DISK_READ_ERROR);
+    memcpy(buf, img.data() + offset, size);
+    return size;
+}
+
+int32_t ram_dev::write(uint64_t offset, uint32_t size, const void *buf)
+{
+    if (offset + size > img.size())
+        throw disk_error(disk_error::DISK_WRITE_ERROR);
+    memcpy(img.data() + offset, buf, size);
+    return size;
+}
+
+dev_t::dev_t(std::unique_ptr<blk_dev> img, uint32_t tot_block, uint16_t block_size, const format_options &opts)
+    : img(std::move(img)), cleared(true)
+{
+    format(tot_block, block_size, opts);
+    clac_info();
+}
+
+dev_t::dev_t(std::unique_ptr<blk_dev> img)
+    : img(std::move(img)), cleared(true)
+{
+    dev_read(0, sizeof(fat32::BPB_t), &BPB);
+    if (BPB.Signature_word != 0xaa55)
+    {
+        throw disk_error(disk_error::DISK_SIGNATURE_ERROR);
+    }
+    dev_read(BPB.BPB_FSInfo * BPB.BPB_BytsPerSec, sizeof(fat32::FSInfo_t), &FSInfo);
+    if (FSInfo.FSI_LeadSig != 0x41615252 || FSInfo.FSI_StrucSig != 0x61417272 ||
+        FSInfo.FSI_TrailSig != 0xAA550000)
+    {
+        throw disk_error(disk_error::DISK_SIGNATURE_ERROR);
+    }
+    clac_info();
+}
+
+dev_t::dev_t(const char *dev_name, uint32_t tot_block, uint16_t block_size, const format_options &opts)
+    : dev_t(std::make_unique<file_dev>(dev_name, (uint64_t)tot_block * block_size), tot_block, block_size, opts)
+{
+}
+
+dev_t::dev_t(const char *dev_name)
+    : dev_t(std::make_unique<file_dev>(dev_name))
+{
+}
+
 dev_t::~dev_t()
 {
-    if (dev_img != NULL && dev_img != INVALID_HANDLE_VALUE)
+    if (img)
     {
         clear();
-        CloseHandle(dev_img);
     }
+    // retired nodes hold names from this device's arena
+    fat32::epoch::synchronize();
 }
 
 dev_t::operator bool() const noexcept
 {
-    return (dev_img != NULL && dev_img != INVALID_HANDLE_VALUE);
+    return img != nullptr;
 }
 
 uint32_t dev_t::get_root_clus() const noexcept
@@ -211,59 +574,54 @@ void dev_t::set_fat(uint32_t fat_no, uint32_t value)
 
 int32_t dev_t::read_block(uint32_t block_no, void *buf) const
 {
-    return dev_read(dev_img, block_no * block_size, block_size, buf);
+    return dev_read((uint64_t)block_no * block_size, block_size, buf);
 }
 
 int32_t dev_t::write_block(uint32_t block_no, const void *buf) const
 {
-    return dev_write(dev_img, block_no * block_size, block_size, buf);
+    return dev_write((uint64_t)block_no * block_size, block_size, buf);
 }
 
 int32_t dev_t::read_clus(uint32_t clus_no, void *buf) const
 {
-    clus_no -= 2;
-    return dev_read(dev_img, (data_begin + sec_per_clus * clus_no) * block_size, clus_size, buf);
+    return dev_read(clus_offset(clus_no), clus_size, buf);
 }
 
 int32_t dev_t::write_clus(uint32_t clus_no, const void *buf) const
 {
-    clus_no -= 2;
-    return dev_write(dev_img, (data_begin + sec_per_clus * clus_no) * block_size, clus_size, buf);
+    return dev_write(clus_offset(clus_no), clus_size, buf);
 }
 
-int32_t dev_t::dev_read(void *handle, uint64_t offset, uint32_t size,
-                        void *buf)
+uint64_t dev_t::clus_offset(uint32_t clus_no) const noexcept
 {
-    LARGE_INTEGER start_pos;
-    start_pos.QuadPart = offset;
-    std::lock_guard<std::mutex> g(m);
-    if (!SetFilePointerEx(handle, start_pos, NULL, FILE_BEGIN))
-        throw disk_error(disk_error::DISK_SEEK_ERROR);
-    DWORD read_count;
-    if (ReadFile(handle, buf, size, &read_count, NULL))
-        return read_count;
-    else
-        throw disk_error(disk_error::DISK_READ_ERROR);
+    return (uint64_t)(data_begin + sec_per_clus * (clus_no - 2)) * block_size;
 }
 
-int32_t dev_t::dev_write(void *handle, uint64_t offset, uint32_t size,
-                         const void *buf)
+int32_t dev_t::dev_read(uint64_t offset, uint32_t size, void *buf) const
 {
-    LARGE_INTEGER start_pos;
-    start_pos.QuadPart = offset;
-    std::lock_guard<std::mutex> g(m);
-    if (!SetFilePointerEx(handle, start_pos, NULL, FILE_BEGIN))
-        throw disk_error(disk_error::DISK_SEEK_ERROR);
-    DWORD write_count;
-    if (WriteFile(handle, buf, size, &write_count, NULL))
-        return write_count;
-    else
-        throw disk_error(disk_error::DISK_WRITE_ERROR);
+    fat32::stats::add(fat32::stats::DEV_READS);
+    fat32::stats::add(fat32::stats::DEV_READ_BYTES, size);
+    return img->read(offset, size, buf);
 }
 
-void dev_t::format(uint32_t tot_block, uint16_t block_size)
+int32_t dev_t::dev_write(uint64_t offset, uint32_t size, const void *buf) const
 {
-    set_BPB(tot_block, block_size, &BPB);
+    fat32::stats::add(fat32::stats::DEV_WRITES);
+    fat32::stats::add(fat32::stats::DEV_WRITE_BYTES, size);
+    return img->write(offset, size, buf);
+}
+
+void dev_t::touch() noexcept
+{
+    if (cleared.load(std::memory_order_relaxed))
+    {
+        cleared.store(false, std::memory_order_relaxed);
+    }
+}
+
+void dev_t::format(uint32_t tot_block, uint16_t block_size, const format_options &opts)
+{
+    set_BPB(tot_block, block_size, &BPB, opts);
     set_FSInfo(&FSInfo, &BPB);
     std::vector<uint32_t> FirstSec(block_size / sizeof(uint32_t), 0);
     std::vector<uint8_t> EmptySec(block_size * BPB.BPB_SecPerClus, 0);
@@ -274,15 +632,15 @@ void dev_t::format(uint32_t tot_block, uint16_t block_size)
     uint32_t data_begin = BPB.BPB_FATSz32 * BPB.BPB_NumFATs + BPB.BPB_RsvdSecCnt;
     for (uint32_t i = 0; i < data_begin; ++i)
     {
-        dev_write(dev_img, i * block_size, block_size, EmptySec.data());
+        dev_write(i * block_size, block_size, EmptySec.data());
     }
-    dev_write(dev_img, 0 * block_size, 512, &BPB);
-    dev_write(dev_img, 6 * block_size, 512, &BPB);
-    dev_write(dev_img, 1 * block_size, 512, &FSInfo);
-    dev_write(dev_img, 7 * block_size, 512, &FSInfo);
-    dev_write(dev_img, BPB.BPB_RsvdSecCnt * block_size, block_size, FirstSec.data());
-    dev_write(dev_img, (BPB.BPB_FATSz32 + BPB.BPB_RsvdSecCnt) * block_size, block_size, FirstSec.data());
-    dev_write(dev_img, data_begin * block_size, BPB.BPB_SecPerClus * block_size, EmptySec.data());
+    dev_write(0 * block_size, 512, &BPB);
+    dev_write(6 * block_size, 512, &BPB);
+    dev_write(1 * block_size, 512, &FSInfo);
+    dev_write(7 * block_size, 512, &FSInfo);
+    dev_write(BPB.BPB_RsvdSecCnt * block_size, block_size, FirstSec.data());
+    dev_write((BPB.BPB_FATSz32 + BPB.BPB_RsvdSecCnt) * block_size, block_size, FirstSec.data());
+    dev_write(data_begin * block_size, BPB.BPB_SecPerClus * block_size, EmptySec.data());
 }
 
 void dev_t::clac_info()
@@ -291,7 +649,7 @@ void dev_t::clac_info()
     for (uint32_t i = 0; i < BPB.BPB_FATSz32; ++i)
     {
         auto byte = i * BPB.BPB_BytsPerSec;
-        dev_read(dev_img, (i + BPB.BPB_RsvdSecCnt) * BPB.BPB_BytsPerSec, BPB.BPB_BytsPerSec,
+        dev_read((i + BPB.BPB_RsvdSecCnt) * BPB.BPB_BytsPerSec, BPB.BPB_BytsPerSec,
                  FAT_Table.data() + byte / sizeof(uint32_t));
     }
     tot_block = BPB.BPB_TotSec32;
@@ -300,38 +658,76 @@ void dev_t::clac_info()
     clus_size = block_size * sec_per_clus;
     data_begin = BPB.BPB_RsvdSecCnt + BPB.BPB_NumFATs * BPB.BPB_FATSz32;
     count_of_cluster = (tot_block - data_begin) / sec_per_clus;
-    memset(&root_info, 0, sizeof(fat32::Entry_Info));
-    root_info.first_clus = get_root_clus();
-    root_info.info.dwFileAttributes = 0x10;
-    root_info.info.dwVolumeSerialNumber = get_vol_id();
-    ULARGE_INTEGER file_index;
-    file_index.QuadPart = get_root_clus();
-    root_info.info.nFileIndexHigh = file_index.HighPart;
-    root_info.info.nFileIndexLow = file_index.LowPart;
-    root_info.info.nNumberOfLinks = 2;
-    root = open_file(nullptr, &root_info);
-    open_file_table.insert((uint64_t)root.get());
+    memset(&root_attr, 0, sizeof(fat32::node_attr));
+    root_attr.first_clus = get_root_clus();
+    root_attr.attr = 0x10;
+    root = open_file(nullptr, L"", &root_attr);
 }
 
 void dev_t::clear()
 {
+    std::lock_guard<std::shared_mutex> t(tree_mtx);
     if (!cleared)
     {
-        write_block(0, &BPB);
-        fat32::BPB_t BPB_Backup;
-        memcpy(&BPB_Backup, &BPB, sizeof(BPB));
-        BPB_Backup.BPB_BkBootSec = 0;
-        write_block(0, &BPB_Backup);
-        write_block(BPB.BPB_FSInfo, &FSInfo);
+        save(root.get());
+        std::lock_guard<std::mutex> g(alloc_mtx);
+        write_boot();
         for (uint32_t i = 0; i < BPB.BPB_FATSz32; ++i)
         {
             write_block(i + BPB.BPB_RsvdSecCnt, FAT_Table.data() + i * block_size / sizeof(uint32_t));
             write_block(i + BPB.BPB_RsvdSecCnt + BPB.BPB_FATSz32, FAT_Table.data() + i * block_size / sizeof(uint32_t));
         }
-        save(root.get());
         flush();
         cleared = true;
     }
 }
 
+void dev_t::grow(uint64_t size)
+{
+    std::lock_guard<std::shared_mutex> t(tree_mtx);
+    std::lock_guard<std::mutex> g(alloc_mtx);
+    uint64_t new_tot = (size + block_size - 1) / block_size;
+    if (new_tot <= tot_block)
+        throw std::invalid_argument("the volume is already " + std::to_string((uint64_t)tot_block * block_size) + " bytes");
+    uint64_t max_count = std::min<uint64_t>(FAT_Table.size() - 2, 0x0ffffff4);
+    uint64_t max_tot = std::min<uint64_t>(data_begin + max_count * sec_per_clus, UINT32_MAX);
+    if (new_tot > max_tot)
+    {
+        throw std::invalid_argument("the FATs only have room for " + std::to_string(max_tot * block_size) +
+                                    " bytes, format with a larger maximum size");
+    }
+    uint32_t new_count = (uint32_t)((new_tot - data_begin) / sec_per_clus);
+    img->extend(new_tot * block_size);
+
+    // entries past the old end are zero on a freshly formatted volume
+    for (uint32_t clus = count_of_cluster + 2; clus < new_count + 2; ++clus)
+    {
+        if (FAT_Table[clus])
+        {
+            FAT_Table[clus] = 0;
+            touch();
+        }
+    }
+    // on a full volume the only free clusters are the new ones
+    if (!FSInfo.FSI_FreeCount || FSInfo.FSI_Nxt_Free < 2 || FSInfo.FSI_Nxt_Free >= count_of_cluster + 2)
+        FSInfo.FSI_Nxt_Free = count_of_cluster + 2;
+    FSInfo.FSI_FreeCount += new_count - count_of_cluster;
+    count_of_cluster = new_count;
+    tot_block = (uint32_t)new_tot;
+    BPB.BPB_TotSec32 = tot_block;
+    write_boot();
+}
+
+void dev_t::write_boot() const
+{
+    dev_write(0, sizeof(BPB), &BPB);
+    dev_write((uint64_t)BPB.BPB_FSInfo * block_size, sizeof(FSInfo), &FSInfo);
+    // the backup FSInfo sits in the sector after the backup boot sector
+    if (BPB.BPB_BkBootSec)
+    {
+        dev_write((uint64_t)BPB.BPB_BkBootSec * block_size, sizeof(BPB), &BPB);
+        dev_write((uint64_t)(BPB.BPB_BkBootSec + 1) * block_size, sizeof(FSInfo), &FSInfo);
+    }
+}
+
 } // namespace dev_io
\ No newline at end of file
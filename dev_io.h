@@ -1,10 +1,17 @@
 #ifndef DEV_IO_H
 #define DEV_IO_H
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <memory>
 #include <map>
+#include <functional>
+#include <thread>
+#include <exception>
 #include <stdexcept>
 #include <stdint.h>
 #include "fat32.h"
+#include "handle_table.h"
 
 namespace dev_io
 {
@@ -46,10 +53,135 @@ private:
     error_t err;
 };
 
+// Completion callbacks may run on any thread, possibly before the
+// submitting call returns; a failed request passes its exception.
+typedef std::function<void(std::exception_ptr)> io_done;
+typedef std::function<void(uint32_t, std::exception_ptr)> rw_done;
+
+class blk_dev
+{
+public:
+    virtual ~blk_dev() {}
+    virtual int32_t read(uint64_t offset, uint32_t size, void *buf) = 0;
+    virtual int32_t write(uint64_t offset, uint32_t size, const void *buf) = 0;
+    // Backends without native asynchronous I/O complete inline.
+    virtual void read_async(uint64_t offset, uint32_t size, void *buf, io_done done);
+    virtual void write_async(uint64_t offset, uint32_t size, const void *buf, io_done done);
+    // Grows the device to size bytes, leaving the new range unallocated
+    // where the backend allows it. Fixed-size backends throw disk_error.
+    virtual void extend(uint64_t size);
+    // Async transfers must start, end and sit in memory on multiples of
+    // this many bytes; dev_t bounces the ones that do not.
+    virtual uint32_t align() const;
+};
+
+class executor;
+
+// Async requests go to a completion port on Windows and to a pool of
+// threads doing pread and pwrite elsewhere.
+class file_dev : public blk_dev
+{
+public:
+    file_dev(const char *dev_name, uint64_t size);
+    file_dev(const char *dev_name);
+    ~file_dev();
+    int32_t read(uint64_t offset, uint32_t size, void *buf) override;
+    int32_t write(uint64_t offset, uint32_t size, const void *buf) override;
+    void read_async(uint64_t offset, uint32_t size, void *buf, io_done done) override;
+    void write_async(uint64_t offset, uint32_t size, const void *buf, io_done done) override;
+    void extend(uint64_t size) override;
+#ifdef _WIN32
+    uint32_t align() const override;
+#endif
+
+private:
+#ifdef _WIN32
+    void start();
+    void complete();
+
+    void *handle;
+    void *port;
+    uint32_t sector;
+    std::atomic<size_t> pending;
+    std::thread completion;
+#else
+    executor &pool();
+
+    int fd;
+    std::once_flag pool_once;
+    std::unique_ptr<executor> workers;
+#endif
+};
+
+class ram_dev : public blk_dev
+{
+public:
+    ram_dev(uint64_t size);
+    int32_t read(uint64_t offset, uint32_t size, void *buf) override;
+    int32_t write(uint64_t offset, uint32_t size, const void *buf) override;
+
+private:
+    std::vector<uint8_t> img;
+};
+
+// Directory entry helpers, shared with the offline image tools.
+unsigned char ChkSum(unsigned char *pFcbName);
+size_t utf16_len(std::wstring_view name);
+size_t utf16_decode(const uint16_t *in, size_t len, wchar_t *out);
+// pentry needs room for the long name fragments when have_long is set
+void Attr2DirEntry(std::wstring_view name, const fat32::node_attr *pattr, fat32::DIR_Entry *pentry, int have_long);
+
+// Layout of a new volume; zero keeps the default.
+struct format_options
+{
+    // bytes per cluster, a power of two from the block size up to 32 KiB;
+    // by default it is picked from the volume size
+    uint32_t clus_size = 0;
+    // the FATs and the data region start on multiples of this many bytes, a
+    // power of two from the block size up to 16 MiB; by default only the
+    // reserved region is rounded to the cluster size
+    uint32_t align = 0;
+    // the FATs are sized for a volume of this many blocks, so dev_t::grow
+    // can later extend the volume up to it; by default they only cover
+    // tot_block
+    uint32_t max_block = 0;
+};
+
+// Boot sector and FSInfo of a freshly formatted volume. set_BPB throws
+// std::invalid_argument if the options or the size do not make a valid
+// FAT32 volume.
+void set_BPB(uint32_t tot_block, uint16_t block_size, fat32::BPB_t *pBPB, const format_options &opts = format_options());
+void set_FSInfo(fat32::FSInfo_t *pFSInfo, fat32::BPB_t *pBPB);
+
+// One step of dev_t::run_batch. Operations name files by path and run in
+// order; a later step sees the effects of earlier ones.
+struct batch_op
+{
+    enum op_t
+    {
+        CREATE,
+        WRITE,
+        SETATTR,
+        RENAME,
+        UNLINK,
+    };
+    op_t op;
+    fat32::path path;
+    uint32_t attr;         // CREATE, SETATTR
+    int64_t offset;        // WRITE
+    uint32_t len;          // WRITE
+    const void *data;      // WRITE
+    fat32::path new_path;  // RENAME
+    bool replace;          // RENAME
+};
+
 class dev_t
 {
 public:
-    dev_t(const char *dev_name, uint32_t tot_block, uint16_t block_size);
+    dev_t(std::unique_ptr<blk_dev> img, uint32_t tot_block, uint16_t block_size,
+          const format_options &opts = format_options());
+    dev_t(std::unique_ptr<blk_dev> img);
+    dev_t(const char *dev_name, uint32_t tot_block, uint16_t block_size, const format_options &opts = format_options());
     dev_t(const char *dev_name);
     dev_t(dev_t &&dev) = delete;
     dev_t(const dev_t &dev) = delete;
@@ -59,21 +191,60 @@ public:
 
     operator bool() const noexcept;
 
-    uint64_t open(const fat32::path &path, uint32_t create_disposition, uint32_t file_attr, bool &exist, bool &isdir);
+    uint64_t open(const fat32::path_view &path, uint32_t create_disposition, uint32_t file_attr, bool &exist, bool &isdir);
+    // path is relative to the directory behind dir_fd
+    uint64_t openat(uint64_t dir_fd, const fat32::path_view &path, uint32_t create_disposition, uint32_t file_attr, bool &exist, bool &isdir);
+    // The try_ calls report file_error codes as values instead of throwing;
+    // disk errors still throw.
+    fat32::result<uint64_t> try_open(const fat32::path_view &path, uint32_t create_disposition, uint32_t file_attr,
+                                     bool &exist, bool &isdir);
+    fat32::result<uint64_t> try_openat(uint64_t dir_fd, const fat32::path_view &path, uint32_t create_disposition,
+                                       uint32_t file_attr, bool &exist, bool &isdir);
     void unlink(uint64_t fd);
-    bool rename(uint64_t fd, const fat32::path &newpath, bool replace);
+    // Unlinks at once instead of on close; open handles keep working and the
+    // clusters are freed when the last one is closed.
+    void remove(uint64_t fd);
+    bool rename(uint64_t fd, const fat32::path_view &newpath, bool replace);
+    fat32::result<bool> try_rename(uint64_t fd, const fat32::path_view &newpath, bool replace);
+    // POSIX-style rename into dir_fd; a replaced target is removed as above.
+    bool renameat(uint64_t fd, uint64_t dir_fd, const std::wstring &name, bool replace);
+    // Stable for as long as any handle to the file is open.
+    uint64_t file_id(uint64_t fd);
     fat32::dir_info opendir(const fat32::path &path);
     void close(uint64_t fd);
     uint32_t read(uint64_t fd, int64_t offset, uint32_t len, void *buf);
     uint32_t write(uint64_t fd, int64_t offset, uint32_t len, const void *buf);
+    fat32::result<uint32_t> try_read(uint64_t fd, int64_t offset, uint32_t len, void *buf);
+    fat32::result<uint32_t> try_write(uint64_t fd, int64_t offset, uint32_t len, const void *buf);
+    // Map the range under the node lock, then hand the data transfer to the
+    // device without blocking. The fd must stay open until done runs.
+    void read_async(uint64_t fd, int64_t offset, uint32_t len, void *buf, rw_done done);
+    void write_async(uint64_t fd, int64_t offset, uint32_t len, const void *buf, rw_done done);
     void fstat(uint64_t fd, LPBY_HANDLE_FILE_INFORMATION statbuf);
+    fat32::status try_fstat(uint64_t fd, LPBY_HANDLE_FILE_INFORMATION statbuf);
     void setattr(uint64_t fd, uint32_t attr);
     void settime(uint64_t fd, CONST FILETIME *CreationTime, CONST FILETIME *LastAccessTime, CONST FILETIME *LastWriteTime);
     void setend(uint64_t fd, int64_t offset);
     void setalloc(uint64_t fd, int64_t alloc);
+    fat32::status try_setattr(uint64_t fd, uint32_t attr);
+    fat32::status try_settime(uint64_t fd, CONST FILETIME *CreationTime, CONST FILETIME *LastAccessTime, CONST FILETIME *LastWriteTime);
+    fat32::status try_setend(uint64_t fd, int64_t offset);
+    fat32::status try_setalloc(uint64_t fd, int64_t alloc);
+    // Each file touched stays loaded until the end of the batch, so
+    // directory entries are written back once per parent. Only namespace
+    // steps take the tree lock exclusively; writes share it with other
+    // callers. Returns one slot per operation, null on success.
+    std::vector<std::exception_ptr> run_batch(const std::vector<batch_op> &ops);
 
     fat32::dir_info opendir(uint64_t fd);
+    fat32::result<fat32::dir_info> try_opendir(uint64_t fd);
     void get_disk_info(uint64_t *free_avilable, uint64_t *tot_size, uint64_t *tot_free);
+    // Extends the image to size bytes and hands the new clusters to the
+    // allocator while the volume stays mounted. Only the boot sectors and
+    // FSInfo are written; the FATs must already have room for the new
+    // clusters (see format_options::max_block), otherwise it throws
+    // std::invalid_argument.
+    void grow(uint64_t size);
     void flush();
     void clear();
 
@@ -83,41 +254,96 @@ public:
     void set_fat(uint32_t fat_no, uint32_t value);
 
 private:
-    static int32_t dev_read(void *handle, uint64_t offset, uint32_t size, void *buf);
-    static int32_t dev_write(void *handle, uint64_t offset, uint32_t size, const void *buf);
+    int32_t dev_read(uint64_t offset, uint32_t size, void *buf) const;
+    int32_t dev_write(uint64_t offset, uint32_t size, const void *buf) const;
     int32_t read_block(uint32_t block_no, void *buf) const;
     int32_t write_block(uint32_t block_no, const void *buf) const;
     int32_t read_clus(uint32_t clus_no, void *buf) const;
     int32_t write_clus(uint32_t clus_no, const void *buf) const;
-    void format(uint32_t tot_block, uint16_t block_size);
+    uint64_t clus_offset(uint32_t clus_no) const noexcept;
+    void write_boot() const;
+    void format(uint32_t tot_block, uint16_t block_size, const format_options &opts);
     void clac_info();
+    void touch() noexcept;
 
-    std::unique_ptr<fat32::file_node> open_file(fat32::file_node *parent, fat32::Entry_Info *pinfo);
+    fat32::file_node *get_node(uint64_t fd);
+    fat32::result<uint64_t> open_from(fat32::file_node *start, const fat32::path_view &path, uint32_t create_disposition,
+                                      uint32_t file_attr, bool &exist, bool &isdir);
+    // A null value means the path is not fully loaded; fall back to walk().
+    fat32::result<fat32::file_node *> lookup(fat32::file_node *start, const fat32::path_view &path, uint32_t create_disposition,
+                                             bool &exist, bool &isdir);
+    fat32::result<fat32::file_node *> walk(fat32::file_node *start, const fat32::path_view &path, uint32_t create_disposition,
+                                           uint32_t file_attr, bool &exist, bool &isdir, fat32::file_node *&last);
+    void release(fat32::file_node *node);
+    fat32::result<uint32_t> write_node(fat32::file_node *p, int64_t offset, uint32_t len, const void *buf);
+    bool rename_node(fat32::file_node *p, fat32::file_node *start, const fat32::path_view &newpath, bool replace);
+    bool dir_empty(fat32::file_node *node);
+    void orphan(fat32::file_node *node);
+    struct extent
+    {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t index;
+    };
+    std::vector<extent> map_range(fat32::file_node *node, uint64_t left_border, uint64_t right_border) const;
+    char *bounce(fat32::file_node *node, std::vector<extent> &extents, void *read_buf, const void *write_buf,
+                 rw_done &done) const;
+    void submit(fat32::file_node *node, const std::vector<extent> &extents, void *read_buf, const void *write_buf,
+                uint32_t total, rw_done done);
+    void drain_io(fat32::file_node *node) const noexcept;
+    void end_io(fat32::file_node *node);
+    fat32::node_attr get_attr(fat32::file_node *node);
+    std::unique_ptr<fat32::file_node> open_file(fat32::file_node *parent, std::wstring_view name, const fat32::node_attr *pattr);
+    void add_dot_entries(fat32::file_node *node);
+    void sync_dir(fat32::file_node *node);
+    void fill_info(const fat32::node_attr &attr, LPBY_HANDLE_FILE_INFORMATION pinfo) const;
     void save(fat32::file_node *node);
     void clear_node(fat32::file_node *node);
     uint32_t next_free();
     void free_clus(uint32_t clus_no);
     void extend(fat32::file_node *node, uint32_t clus_count);
     void shrink(fat32::file_node *node, uint32_t clus_count);
-    void add_entry(fat32::file_node *node, fat32::Entry_Info *pinfo, int have_long, bool replace);
+    void add_entry(fat32::file_node *node, std::wstring_view name, const fat32::node_attr &attr, int have_long, bool replace);
     void remove_entry(fat32::file_node *node, std::wstring_view name);
+    bool write_entry(fat32::file_node *node, size_t index, std::wstring_view name, const fat32::node_attr &attr,
+                     int have_long, size_t entry_len);
+    bool set_entries(fat32::file_node *node, size_t index, const fat32::DIR_Entry *pentry, size_t count);
+    void mark_deleted(fat32::file_node *node, size_t begin, size_t end);
+    void mark_dirty(fat32::file_node *node, size_t begin, size_t end);
+    void write_dir(fat32::file_node *node);
+    void compact(fat32::file_node *node);
+    void load_cache(fat32::file_node *node);
+    void update_cache(fat32::file_node *node, size_t index);
+    fat32::dir_cache::iterator find_record(fat32::file_node *node, std::wstring_view name);
     void gen_short(std::wstring_view name, fat32::file_node *node, char *short_name);
-    int32_t DirEntry2EntryInfo(const fat32::DIR_Entry *pdir, fat32::Entry_Info *pinfo);
+    int32_t DirEntry2Attr(const fat32::DIR_Entry *pdir, wchar_t *name, fat32::node_attr *pattr);
 
-    void *dev_img;
+    std::unique_ptr<blk_dev> img;
     fat32::BPB_t BPB;
     fat32::FSInfo_t FSInfo;
     std::vector<uint32_t> FAT_Table;
-    std::set<uint64_t> open_file_table;
+    handle_table handles;
+    fat32::name_arena names;
     std::unique_ptr<fat32::file_node> root;
+    // Removed nodes that still have open handles.
+    std::vector<std::unique_ptr<fat32::file_node>> orphans;
     uint32_t tot_block;
     uint16_t block_size;
     uint8_t sec_per_clus;
     uint32_t clus_size;
     uint32_t data_begin;
     uint32_t count_of_cluster;
-    fat32::Entry_Info root_info;
-    bool cleared;
+    fat32::node_attr root_attr;
+    std::atomic<bool> cleared;
+
+    // Lock order: tree_mtx, then a directory's dir->mtx, then a node's mtx,
+    // then alloc_mtx. Nodes are only unlinked from the tree with tree_mtx
+    // held exclusively, so holding it shared keeps every node reachable;
+    // an open fd keeps its node alive by itself. lookup() takes no lock at
+    // all: it walks the child tables under an epoch guard and falls back to
+    // walk() for anything not already loaded.
+    std::shared_mutex tree_mtx;
+    std::mutex alloc_mtx;
 };
 
 } // namespace dev_io
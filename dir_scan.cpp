@@ -0,0 +1,176 @@
+#include <vector>
+#include <string.h>
+#include "dir_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIR_SCAN_X86
+#endif
+
+namespace dir_scan
+{
+
+static bool use_simd =
+#ifdef DIR_SCAN_X86
+    __builtin_cpu_supports("avx2");
+#else
+    false;
+#endif
+
+void set_simd(bool enable)
+{
+#ifdef DIR_SCAN_X86
+    use_simd = enable && __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool simd_enabled()
+{
+    return use_simd;
+}
+
+static uint8_t classify_one(const fat32::DIR_Entry &e)
+{
+    if (e.DIR_Name[0] == 0)
+        return ENTRY_END;
+    if ((uint8_t)e.DIR_Name[0] == 0xe5)
+        return ENTRY_DELETED;
+    if ((e.DIR_Attr & 0x3f) == 0x0f)
+        return ENTRY_LONG;
+    return ENTRY_SHORT;
+}
+
+static void classify_scalar(const fat32::DIR_Entry *entries, size_t count, uint8_t *types)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        types[i] = classify_one(entries[i]);
+    }
+}
+
+static void match_byte_scalar(const fat32::DIR_Entry *entries, size_t begin, size_t count, size_t offset,
+                              uint8_t mask, uint8_t value, uint64_t *bits)
+{
+    for (size_t i = begin; i < count; ++i)
+    {
+        if ((((const uint8_t *)(entries + i))[offset] & mask) == value)
+        {
+            bits[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+}
+
+#ifdef DIR_SCAN_X86
+// one entry is 8 dwords, so a stride-8 gather picks the same dword out of 8 entries
+__attribute__((target("avx2"))) static inline __m256i gather_dword(const fat32::DIR_Entry *entries, size_t dword)
+{
+    const __m256i index = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+    return _mm256_i32gather_epi32((const int *)entries + dword, index, 4);
+}
+
+__attribute__((target("avx2"))) static void classify_avx2(const fat32::DIR_Entry *entries, size_t count, uint8_t *types)
+{
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        auto first = _mm256_and_si256(gather_dword(entries + i, 0), byte_mask);
+        auto attr = _mm256_and_si256(_mm256_srli_epi32(gather_dword(entries + i, 2), 24), _mm256_set1_epi32(0x3f));
+        auto type = _mm256_set1_epi32(ENTRY_SHORT);
+        type = _mm256_blendv_epi8(type, _mm256_set1_epi32(ENTRY_LONG), _mm256_cmpeq_epi32(attr, _mm256_set1_epi32(0x0f)));
+        type = _mm256_blendv_epi8(type, _mm256_set1_epi32(ENTRY_DELETED), _mm256_cmpeq_epi32(first, _mm256_set1_epi32(0xe5)));
+        type = _mm256_blendv_epi8(type, _mm256_set1_epi32(ENTRY_END), _mm256_cmpeq_epi32(first, _mm256_setzero_si256()));
+        auto packed = _mm256_packus_epi32(type, type);
+        packed = _mm256_packus_epi16(packed, packed);
+        uint32_t lo = _mm256_extract_epi32(packed, 0);
+        uint32_t hi = _mm256_extract_epi32(packed, 4);
+        memcpy(types + i, &lo, 4);
+        memcpy(types + i + 4, &hi, 4);
+    }
+    classify_scalar(entries + i, count - i, types + i);
+}
+
+__attribute__((target("avx2"))) static void match_byte_avx2(const fat32::DIR_Entry *entries, size_t count, size_t offset,
+                                                             uint8_t mask, uint8_t value, uint64_t *bits)
+{
+    const auto shift = _mm_cvtsi32_si128((offset % 4) * 8);
+    const auto vmask = _mm256_set1_epi32(mask);
+    const auto vvalue = _mm256_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        auto byte = _mm256_and_si256(_mm256_srl_epi32(gather_dword(entries + i, offset / 4), shift), vmask);
+        uint64_t hit = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(byte, vvalue)));
+        bits[i / 64] |= hit << (i % 64);
+    }
+    match_byte_scalar(entries, i, count, offset, mask, value, bits);
+}
+#endif
+
+void classify(const fat32::DIR_Entry *entries, size_t count, uint8_t *types)
+{
+#ifdef DIR_SCAN_X86
+    if (use_simd)
+    {
+        classify_avx2(entries, count, types);
+        return;
+    }
+#endif
+    classify_scalar(entries, count, types);
+}
+
+void match_byte(const fat32::DIR_Entry *entries, size_t count, size_t offset, uint8_t mask, uint8_t value, uint64_t *bits)
+{
+    memset(bits, 0, (count + 63) / 64 * sizeof(uint64_t));
+#ifdef DIR_SCAN_X86
+    if (use_simd)
+    {
+        match_byte_avx2(entries, count, offset, mask, value, bits);
+        return;
+    }
+#endif
+    match_byte_scalar(entries, 0, count, offset, mask, value, bits);
+}
+
+size_t find_free_run(const fat32::DIR_Entry *entries, size_t count, size_t run)
+{
+    std::vector<uint64_t> bits((count + 63) / 64);
+    match_byte(entries, count, 0, 0xff, 0xe5, bits.data());
+    size_t begin = 0, len = 0;
+    for (size_t w = 0; w < bits.size(); ++w)
+    {
+        auto word = bits[w];
+        size_t pos = 0;
+        while (pos < 64)
+        {
+            if (!word)
+            {
+                // the rest of this word is live, any run is broken
+                len = 0;
+                break;
+            }
+            size_t zeros = __builtin_ctzll(word);
+            if (zeros)
+            {
+                len = 0;
+                pos += zeros;
+                word >>= zeros;
+            }
+            size_t ones = (~word) ? __builtin_ctzll(~word) : 64 - pos;
+            if (!len)
+            {
+                begin = w * 64 + pos;
+            }
+            len += ones;
+            if (len >= run)
+            {
+                return begin;
+            }
+            pos += ones;
+            word = ones < 64 ? word >> ones : 0;
+        }
+    }
+    return count;
+}
+
+} // namespace dir_scan
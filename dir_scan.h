@@ -0,0 +1,33 @@
+#ifndef DIR_SCAN_H
+#define DIR_SCAN_H
+#include <stddef.h>
+#include <stdint.h>
+#include "fat32.h"
+
+namespace dir_scan
+{
+
+enum entry_type : uint8_t
+{
+    ENTRY_END,
+    ENTRY_DELETED,
+    ENTRY_LONG,
+    ENTRY_SHORT,
+};
+
+// writes one entry_type per directory entry
+void classify(const fat32::DIR_Entry *entries, size_t count, uint8_t *types);
+
+// sets bit i of bits[i / 64] when (byte `offset` of entry i & mask) == value
+void match_byte(const fat32::DIR_Entry *entries, size_t count, size_t offset, uint8_t mask, uint8_t value, uint64_t *bits);
+
+// index of the first run of `run` deleted entries, or count if there is none
+size_t find_free_run(const fat32::DIR_Entry *entries, size_t count, size_t run);
+
+// lets the benchmark compare the vector kernels against the scalar ones
+void set_simd(bool enable);
+bool simd_enabled();
+
+} // namespace dir_scan
+
+#endif
@@ -0,0 +1,68 @@
+#include <chrono>
+#include <vector>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dir_scan.h"
+
+std::vector<fat32::DIR_Entry> make_dir(size_t count, unsigned deleted_percent)
+{
+    std::vector<fat32::DIR_Entry> entries(count);
+    std::mt19937 rng(count);
+    size_t i = 0;
+    while (i < count)
+    {
+        // a live group is two LFN fragments followed by its short entry
+        size_t len = 3 < count - i ? 3 : count - i;
+        bool deleted = rng() % 100 < deleted_percent;
+        for (size_t k = 0; k < len; ++k)
+        {
+            auto &e = entries[i + k];
+            memset(e.DIR_Name, 'A', sizeof(e.DIR_Name));
+            e.DIR_Attr = k + 1 < len ? 0x0f : 0x20;
+            if (deleted)
+                e.DIR_Name[0] = (char)0xe5;
+        }
+        i += len;
+    }
+    return entries;
+}
+
+template <typename F>
+double run(F &&f, int rounds)
+{
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i)
+    {
+        f();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() / rounds;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = argc > 1 ? atoi(argv[1]) : 65536;
+    int rounds = argc > 2 ? atoi(argv[2]) : 200;
+    auto entries = make_dir(count, 40);
+    std::vector<uint8_t> types(count);
+    std::vector<uint64_t> bits((count + 63) / 64);
+    size_t sink = 0;
+
+    printf("entries: %zu, avx2: %s\n", count, dir_scan::simd_enabled() ? "yes" : "no");
+    for (int simd = 0; simd < 2; ++simd)
+    {
+        dir_scan::set_simd(simd);
+        if (simd && !dir_scan::simd_enabled())
+            break;
+        auto name = simd ? "avx2" : "scalar";
+        auto t = run([&] { dir_scan::classify(entries.data(), count, types.data()); sink += types[count / 2]; }, rounds);
+        printf("%-8s classify       %10.1f ns  %6.2f ns/entry\n", name, t, t / count);
+        t = run([&] { dir_scan::match_byte(entries.data(), count, 11, 0x3f, 0x0f, bits.data()); sink += bits[0]; }, rounds);
+        printf("%-8s match_byte     %10.1f ns  %6.2f ns/entry\n", name, t, t / count);
+        t = run([&] { sink += dir_scan::find_free_run(entries.data(), count, 20); }, rounds);
+        printf("%-8s find_free_run  %10.1f ns  %6.2f ns/entry\n", name, t, t / count);
+    }
+    return sink == 0xffffffff;
+}
@@ -1,60 +1,162 @@
 #include <dokan/dokan.h>
 #include <dokan/fileinfo.h>
 #include <Winbase.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <queue>
 #include <string>
 #include <memory>
-#include <mutex>
 #include <utility>
 #include "dokan_log.h"
 #include "dev_io.h"
-
-std::mutex global_mtx;
-
-std::vector<std::wstring> parse_path(LPCWSTR FileName, bool *ads = nullptr)
+#include "io_trace.h"
+#include "fs_trace.h"
+#include "stats.h"
+
+// Times the enclosing callback as "dokan.<name>" in the stats dump.
+#define STATS_CALLBACK(name)                                                     \
+    static const uint32_t stats_op = fat32::stats::register_op("dokan." #name); \
+    fat32::stats::timer stats_timer(stats_op)
+
+// Splits FileName in place; the view borrows FileName, which outlives the
+// callback. A stream suffix after ':' is cut off and reported through ads.
+fat32::path_view parse_path(LPCWSTR FileName, bool *ads = nullptr)
 {
-    std::vector<std::wstring> res;
-    wchar_t buf[256];
-    int index = 0;
-    while (*FileName != L'\0' && *FileName != L':')
+    std::wstring_view name(FileName);
+    auto colon = name.find(L':');
+    if (colon != std::wstring_view::npos)
     {
-        if (*FileName == L'\\')
-        {
-            index = 0;
-            memset(buf, 0, sizeof(buf));
-        }
-        else
+        name = name.substr(0, colon);
+        if (ads)
         {
-            buf[index++] = *FileName;
-            if (FileName[1] == L'\\' || FileName[1] == L'\0')
-            {
-                res.emplace_back(buf);
-            }
+            *ads = true;
         }
-        ++FileName;
     }
-    if (*FileName == L':' && ads)
+    return fat32::path_view(name);
+}
+
+const char *image_name = "test.img";
+const char *trace_name = nullptr;
+
+std::unique_ptr<dev_io::blk_dev> open_image()
+{
+    std::unique_ptr<dev_io::blk_dev> img = std::make_unique<dev_io::file_dev>(image_name);
+    if (trace_name)
     {
-        *ads = true;
+        img = std::make_unique<dev_io::trace_dev>(std::move(img), trace_name);
     }
-    return res;
+    return img;
 }
 
 dev_io::dev_t &get_dev()
 {
-    static dev_io::dev_t dev("test.img");
+    static dev_io::dev_t dev(open_image());
     if (!dev)
     {
-        log_msg("open disk error");
+        log_error("open disk error\n");
         exit(EXIT_FAILURE);
     }
     return dev;
 }
 
+std::unique_ptr<fs_trace::writer> op_tracer;
+
+// Appends the enclosing callback to the -R trace when it returns. The
+// handle is read at that point, so an open records the fd it produced.
+class traced_op
+{
+public:
+    traced_op(fs_trace::op_t op, LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) noexcept
+        : info(DokanFileInfo), path(FileName ? FileName : L"")
+    {
+        memset(&rec, 0, sizeof(rec));
+        if (op_tracer)
+        {
+            rec.op = op;
+            rec.time = op_tracer->now();
+        }
+    }
+    ~traced_op()
+    {
+        if (!op_tracer)
+            return;
+        rec.handle = info->Context;
+        rec.isdir = info->IsDirectory;
+        rec.thread = op_tracer->thread_id();
+        rec.latency = std::min<uint64_t>(op_tracer->now() - rec.time, UINT32_MAX);
+        try
+        {
+            op_tracer->write(rec, path, new_path);
+        }
+        catch (const std::exception &)
+        {
+        }
+    }
+    traced_op(const traced_op &) = delete;
+    traced_op &operator=(const traced_op &) = delete;
+
+    fs_trace::record rec;
+    std::wstring_view new_path;
+
+private:
+    PDOKAN_FILE_INFO info;
+    std::wstring_view path;
+};
+
+NTSTATUS to_ntstatus(fat32::file_error::error_t err)
+{
+    switch (err)
+    {
+    case fat32::file_error::FILE_NOT_FOUND:
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    case fat32::file_error::FILE_NOT_DIR:
+        return STATUS_NOT_A_DIRECTORY;
+
+    case fat32::file_error::FILE_ALREADY_EXISTS:
+        return STATUS_OBJECT_NAME_COLLISION;
+
+    case fat32::file_error::INVALID_FILE_DISCRIPTOR:
+        return STATUS_INVALID_HANDLE;
+
+    case fat32::file_error::TOO_MANY_OPEN_FILES:
+        return STATUS_TOO_MANY_OPENED_FILES;
+
+    case fat32::file_error::DIR_NOT_EMPTY:
+        return STATUS_DIRECTORY_NOT_EMPTY;
+
+    case fat32::file_error::DISK_FULL:
+        return STATUS_DISK_FULL;
+
+    case fat32::file_error::FILE_IS_DIR:
+        return STATUS_FILE_IS_A_DIRECTORY;
+
+    case fat32::file_error::INVALID_ARGUMENT:
+        return STATUS_INVALID_PARAMETER;
+    }
+    return STATUS_INTERNAL_ERROR;
+}
+
+// Opens FileName again for a callback whose handle has gone stale.
+fat32::status reopen(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo)
+{
+    bool exist;
+    bool isdir;
+    auto file = get_dev().try_open(parse_path(FileName), OPEN_EXISTING, 0, exist, isdir);
+    if (!file)
+    {
+        return file.error();
+    }
+    DokanFileInfo->Context = *file;
+    DokanFileInfo->IsDirectory = isdir;
+    return {};
+}
+
 NTSTATUS DOKAN_CALLBACK VFATZwCreateFile(LPCWSTR FileName,
                                          PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
                                          ACCESS_MASK DesiredAccess,
@@ -64,70 +166,58 @@ NTSTATUS DOKAN_CALLBACK VFATZwCreateFile(LPCWSTR FileName,
                                          ULONG CreateOptions,
                                          PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(ZwCreateFile);
     LOG_ZwCreateFile();
-    try
+    bool exist;
+    bool isdir;
+    bool ads = false;
+    auto path = parse_path(FileName, &ads);
+    if (ads)
     {
-        bool exist;
-        bool isdir;
-        bool ads = false;
-        auto path = parse_path(FileName, &ads);
-        if (ads)
-        {
-            log_pdokan_file_info("", DokanFileInfo);
-            LOG_RETURN(ZwCreateFile, STATUS_OBJECT_NAME_INVALID);
-        }
-        ACCESS_MASK genericDesiredAccess;
-        DWORD fileAttributesAndFlags;
-        DWORD creationDisposition;
-        DokanMapKernelToUserCreateFileFlags(
-            DesiredAccess, FileAttributes, CreateOptions, CreateDisposition,
-            &genericDesiredAccess, &fileAttributesAndFlags, &creationDisposition);
-        log_uint32("    ", fileAttributesAndFlags);
-        log_uint32("    ", creationDisposition);
-        if (DokanFileInfo->IsDirectory)
-        {
-            fileAttributesAndFlags = 0x10;
-        }
-        else
-        {
-            fileAttributesAndFlags &= 0xffff;
-        }
-        auto file = get_dev().open(path, creationDisposition, fileAttributesAndFlags, exist, isdir);
-        if (isdir && (CreateOptions & FILE_NON_DIRECTORY_FILE))
-        {
-            log_pdokan_file_info("", DokanFileInfo);
-            LOG_RETURN(ZwCreateFile, STATUS_FILE_IS_A_DIRECTORY);
-        }
-        if (!isdir && (CreateOptions & FILE_DIRECTORY_FILE))
-        {
-            log_pdokan_file_info("", DokanFileInfo);
-            LOG_RETURN(ZwCreateFile, STATUS_NOT_A_DIRECTORY);
-        }
-        DokanFileInfo->Context = file;
-        DokanFileInfo->IsDirectory = isdir;
-        if ((CreateDisposition == CREATE_ALWAYS || CreateDisposition == OPEN_ALWAYS) && exist)
-        {
-            log_pdokan_file_info("", DokanFileInfo);
-            LOG_RETURN(ZwCreateFile, STATUS_OBJECT_NAME_COLLISION);
-        }
+        log_pdokan_file_info("", DokanFileInfo);
+        LOG_RETURN(ZwCreateFile, STATUS_OBJECT_NAME_INVALID);
     }
-    catch (fat32::file_error &e)
+    ACCESS_MASK genericDesiredAccess;
+    DWORD fileAttributesAndFlags;
+    DWORD creationDisposition;
+    DokanMapKernelToUserCreateFileFlags(
+        DesiredAccess, FileAttributes, CreateOptions, CreateDisposition,
+        &genericDesiredAccess, &fileAttributesAndFlags, &creationDisposition);
+    log_uint32("    ", fileAttributesAndFlags);
+    log_uint32("    ", creationDisposition);
+    if (DokanFileInfo->IsDirectory)
     {
-        switch (e.get_error_type())
-        {
-        case fat32::file_error::FILE_NOT_FOUND:
-            log_pdokan_file_info("", DokanFileInfo);
-            LOG_RETURN(ZwCreateFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            log_pdokan_file_info("", DokanFileInfo);
-            LOG_RETURN(ZwCreateFile, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            log_pdokan_file_info("", DokanFileInfo);
-            LOG_RETURN(ZwCreateFile, STATUS_OBJECT_NAME_COLLISION);
-        }
+        fileAttributesAndFlags = 0x10;
+    }
+    else
+    {
+        fileAttributesAndFlags &= 0xffff;
+    }
+    traced_op trace(fs_trace::FS_OPEN, FileName, DokanFileInfo);
+    trace.rec.arg = creationDisposition;
+    trace.rec.attr = fileAttributesAndFlags;
+    auto file = get_dev().try_open(path, creationDisposition, fileAttributesAndFlags, exist, isdir);
+    if (!file)
+    {
+        log_pdokan_file_info("", DokanFileInfo);
+        LOG_RETURN(ZwCreateFile, to_ntstatus(file.error()));
+    }
+    if (isdir && (CreateOptions & FILE_NON_DIRECTORY_FILE))
+    {
+        log_pdokan_file_info("", DokanFileInfo);
+        LOG_RETURN(ZwCreateFile, STATUS_FILE_IS_A_DIRECTORY);
+    }
+    if (!isdir && (CreateOptions & FILE_DIRECTORY_FILE))
+    {
+        log_pdokan_file_info("", DokanFileInfo);
+        LOG_RETURN(ZwCreateFile, STATUS_NOT_A_DIRECTORY);
+    }
+    DokanFileInfo->Context = *file;
+    DokanFileInfo->IsDirectory = isdir;
+    if ((CreateDisposition == CREATE_ALWAYS || CreateDisposition == OPEN_ALWAYS) && exist)
+    {
+        log_pdokan_file_info("", DokanFileInfo);
+        LOG_RETURN(ZwCreateFile, STATUS_OBJECT_NAME_COLLISION);
     }
     log_pdokan_file_info("", DokanFileInfo);
     LOG_RETURN(ZwCreateFile, STATUS_SUCCESS);
@@ -136,7 +226,9 @@ NTSTATUS DOKAN_CALLBACK VFATZwCreateFile(LPCWSTR FileName,
 void DOKAN_CALLBACK VFATCleanup(LPCWSTR FileName,
                                 PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(Cleanup);
+    traced_op trace(fs_trace::FS_CLOSE, FileName, DokanFileInfo);
+    trace.rec.arg = DokanFileInfo->DeleteOnClose;
     LOG_CleanUp();
     try
     {
@@ -154,6 +246,7 @@ void DOKAN_CALLBACK VFATCleanup(LPCWSTR FileName,
 void DOKAN_CALLBACK VFATCloseFile(LPCWSTR FileName,
                                   PDOKAN_FILE_INFO DokanFileInfo)
 {
+    STATS_CALLBACK(CloseFile);
     return;
 }
 
@@ -164,65 +257,30 @@ NTSTATUS DOKAN_CALLBACK VFATReadFile(LPCWSTR FileName,
                                      LONGLONG Offset,
                                      PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(ReadFile);
+    traced_op trace(fs_trace::FS_READ, FileName, DokanFileInfo);
+    trace.rec.offset = Offset;
+    trace.rec.length = BufferLength;
     LOG_ReadFile();
-    try
-    {
-        *ReadLength = get_dev().read(DokanFileInfo->Context, Offset, BufferLength, Buffer);
-        log_uint32("", *ReadLength);
-        LOG_RETURN(ReadFile, STATUS_SUCCESS);
-    }
-    catch (fat32::file_error &e)
+    auto len = get_dev().try_read(DokanFileInfo->Context, Offset, BufferLength, Buffer);
+    if (!len && len.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        switch (e.get_error_type())
+        auto st = reopen(FileName, DokanFileInfo);
+        if (!st)
         {
-        case fat32::file_error::FILE_NOT_FOUND:
-            log_uint32("", *ReadLength);
-            LOG_RETURN(ReadFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            log_uint32("", *ReadLength);
-            LOG_RETURN(ReadFile, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
             log_uint32("", *ReadLength);
-            LOG_RETURN(ReadFile, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                *ReadLength = get_dev().read(DokanFileInfo->Context, Offset, BufferLength, Buffer);
-                LOG_RETURN(ReadFile, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    log_uint32("", *ReadLength);
-                    LOG_RETURN(ReadFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    log_uint32("", *ReadLength);
-                    LOG_RETURN(ReadFile, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    log_uint32("", *ReadLength);
-                    LOG_RETURN(ReadFile, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("ReadFile invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
+            LOG_RETURN(ReadFile, to_ntstatus(st.error()));
         }
+        len = get_dev().try_read(DokanFileInfo->Context, Offset, BufferLength, Buffer);
+    }
+    if (!len)
+    {
+        log_uint32("", *ReadLength);
+        LOG_RETURN(ReadFile, to_ntstatus(len.error()));
     }
+    *ReadLength = *len;
+    log_uint32("", *ReadLength);
+    LOG_RETURN(ReadFile, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATWriteFile(LPCWSTR FileName,
@@ -232,218 +290,100 @@ NTSTATUS DOKAN_CALLBACK VFATWriteFile(LPCWSTR FileName,
                                       LONGLONG Offset,
                                       PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(WriteFile);
+    traced_op trace(fs_trace::FS_WRITE, FileName, DokanFileInfo);
+    trace.rec.offset = Offset;
+    trace.rec.length = NumberOfBytesToWrite;
     LOG_WriteFile();
-    try
+    BY_HANDLE_FILE_INFORMATION info;
+    auto st = get_dev().try_fstat(DokanFileInfo->Context, &info);
+    if (!st && st.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
+    {
+        st = reopen(FileName, DokanFileInfo);
+        if (st)
+        {
+            st = get_dev().try_fstat(DokanFileInfo->Context, &info);
+        }
+    }
+    if (!st)
     {
-        BY_HANDLE_FILE_INFORMATION info;
-        get_dev().fstat(DokanFileInfo->Context, &info);
-        *NumberOfBytesWritten = get_dev().write(DokanFileInfo->Context, DokanFileInfo->WriteToEndOfFile ? info.nFileSizeLow : Offset, NumberOfBytesToWrite, Buffer);
         log_uint32("", *NumberOfBytesWritten);
-        LOG_RETURN(WriteFile, STATUS_SUCCESS);
+        LOG_RETURN(WriteFile, to_ntstatus(st.error()));
     }
-    catch (fat32::file_error &e)
+    if (DokanFileInfo->WriteToEndOfFile)
     {
-        switch (e.get_error_type())
-        {
-        case fat32::file_error::FILE_NOT_FOUND:
-            log_uint32("", *NumberOfBytesWritten);
-            LOG_RETURN(WriteFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            log_uint32("", *NumberOfBytesWritten);
-            LOG_RETURN(WriteFile, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            log_uint32("", *NumberOfBytesWritten);
-            LOG_RETURN(WriteFile, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                BY_HANDLE_FILE_INFORMATION info;
-                get_dev().fstat(DokanFileInfo->Context, &info);
-                *NumberOfBytesWritten = get_dev().write(DokanFileInfo->Context, DokanFileInfo->WriteToEndOfFile ? info.nFileSizeLow : Offset, NumberOfBytesToWrite, Buffer);
-                LOG_RETURN(WriteFile, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    log_uint32("", *NumberOfBytesWritten);
-                    LOG_RETURN(WriteFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    log_uint32("", *NumberOfBytesWritten);
-                    LOG_RETURN(WriteFile, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    log_uint32("", *NumberOfBytesWritten);
-                    LOG_RETURN(WriteFile, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("WriteFile invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
-        }
+        trace.rec.offset = info.nFileSizeLow;
     }
+    auto len = get_dev().try_write(DokanFileInfo->Context, DokanFileInfo->WriteToEndOfFile ? info.nFileSizeLow : Offset, NumberOfBytesToWrite, Buffer);
+    if (!len)
+    {
+        log_uint32("", *NumberOfBytesWritten);
+        LOG_RETURN(WriteFile, to_ntstatus(len.error()));
+    }
+    *NumberOfBytesWritten = *len;
+    log_uint32("", *NumberOfBytesWritten);
+    LOG_RETURN(WriteFile, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATGetFileInformation(LPCWSTR FileName,
                                                LPBY_HANDLE_FILE_INFORMATION Buffer,
                                                PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(GetFileInformation);
+    traced_op trace(fs_trace::FS_STAT, FileName, DokanFileInfo);
     LOG_GetFileInformation();
-    try
+    auto st = get_dev().try_fstat(DokanFileInfo->Context, Buffer);
+    if (!st && st.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        get_dev().fstat(DokanFileInfo->Context, Buffer);
-        log_lpby_handle_information("", Buffer);
-        LOG_RETURN(GetFileInformation, STATUS_SUCCESS);
-    }
-    catch (fat32::file_error &e)
-    {
-        switch (e.get_error_type())
+        st = reopen(FileName, DokanFileInfo);
+        if (st)
         {
-        case fat32::file_error::FILE_NOT_FOUND:
-            log_lpby_handle_information("", Buffer);
-            LOG_RETURN(GetFileInformation, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            log_lpby_handle_information("", Buffer);
-            LOG_RETURN(GetFileInformation, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            log_lpby_handle_information("", Buffer);
-            LOG_RETURN(GetFileInformation, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                get_dev().fstat(DokanFileInfo->Context, Buffer);
-                log_lpby_handle_information("", Buffer);
-                LOG_RETURN(GetFileInformation, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    log_lpby_handle_information("", Buffer);
-                    LOG_RETURN(GetFileInformation, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    log_lpby_handle_information("", Buffer);
-                    LOG_RETURN(GetFileInformation, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    log_lpby_handle_information("", Buffer);
-                    LOG_RETURN(GetFileInformation, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("GetFileInformation invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
+            st = get_dev().try_fstat(DokanFileInfo->Context, Buffer);
         }
     }
+    log_lpby_handle_information("", Buffer);
+    if (!st)
+    {
+        LOG_RETURN(GetFileInformation, to_ntstatus(st.error()));
+    }
+    LOG_RETURN(GetFileInformation, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATFindFiles(LPCWSTR FileName,
                                       PFillFindData FillFindData,
                                       PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(FindFiles);
+    traced_op trace(fs_trace::FS_ENUM, FileName, DokanFileInfo);
     LOG_FindFiles();
-    WIN32_FIND_DATAW findData;
-    try
+    auto ret = get_dev().try_opendir(DokanFileInfo->Context);
+    if (!ret && ret.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        auto ret = get_dev().opendir(DokanFileInfo->Context);
-        for (const auto &entry : ret)
+        auto st = reopen(FileName, DokanFileInfo);
+        if (!st)
         {
-            memset(&findData, 0, sizeof(WIN32_FIND_DATAW));
-            wcsncpy(findData.cFileName, entry.name, MAX_PATH - 1);
-            findData.dwFileAttributes = entry.info.dwFileAttributes;
-            findData.ftCreationTime = entry.info.ftCreationTime;
-            findData.ftLastAccessTime = entry.info.ftLastWriteTime;
-            findData.ftLastWriteTime = entry.info.ftLastWriteTime;
-            findData.nFileSizeHigh = entry.info.nFileSizeHigh;
-            findData.nFileSizeLow = entry.info.nFileSizeLow;
-            FillFindData(&findData, DokanFileInfo);
+            LOG_RETURN(FindFiles, to_ntstatus(st.error()));
         }
-        LOG_RETURN(FindFiles, STATUS_SUCCESS);
+        ret = get_dev().try_opendir(DokanFileInfo->Context);
     }
-    catch (fat32::file_error &e)
+    if (!ret)
     {
-        switch (e.get_error_type())
-        {
-        case fat32::file_error::FILE_NOT_FOUND:
-            LOG_RETURN(FindFiles, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            LOG_RETURN(FindFiles, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            LOG_RETURN(FindFiles, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                auto ret = get_dev().opendir(DokanFileInfo->Context);
-                for (const auto &entry : ret)
-                {
-                    memset(&findData, 0, sizeof(WIN32_FIND_DATAW));
-                    wcsncpy(findData.cFileName, entry.name, MAX_PATH - 1);
-                    findData.dwFileAttributes = entry.info.dwFileAttributes;
-                    findData.ftCreationTime = entry.info.ftCreationTime;
-                    findData.ftLastAccessTime = entry.info.ftLastWriteTime;
-                    findData.ftLastWriteTime = entry.info.ftLastWriteTime;
-                    findData.nFileSizeHigh = entry.info.nFileSizeHigh;
-                    findData.nFileSizeLow = entry.info.nFileSizeLow;
-                    FillFindData(&findData, DokanFileInfo);
-                }
-                LOG_RETURN(FindFiles, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    LOG_RETURN(FindFiles, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    LOG_RETURN(FindFiles, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    LOG_RETURN(FindFiles, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("FindFiles invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
-        }
+        LOG_RETURN(FindFiles, to_ntstatus(ret.error()));
     }
+    WIN32_FIND_DATAW findData;
+    for (const auto &entry : *ret)
+    {
+        memset(&findData, 0, sizeof(WIN32_FIND_DATAW));
+        wcsncpy(findData.cFileName, entry.name.c_str(), MAX_PATH - 1);
+        findData.dwFileAttributes = entry.attr.attr;
+        findData.ftCreationTime = entry.attr.crt_time;
+        findData.ftLastAccessTime = entry.attr.wrt_time;
+        findData.ftLastWriteTime = entry.attr.wrt_time;
+        findData.nFileSizeHigh = (DWORD)(entry.attr.size >> 32);
+        findData.nFileSizeLow = (DWORD)entry.attr.size;
+        FillFindData(&findData, DokanFileInfo);
+    }
+    LOG_RETURN(FindFiles, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATFindFilesWithPattern(LPCWSTR PathName,
@@ -451,6 +391,7 @@ NTSTATUS DOKAN_CALLBACK VFATFindFilesWithPattern(LPCWSTR PathName,
                                                  PFillFindData FillFindData,
                                                  PDOKAN_FILE_INFO DokanFileInfo)
 {
+    STATS_CALLBACK(FindFilesWithPattern);
     return STATUS_NOT_IMPLEMENTED;
 }
 
@@ -458,58 +399,24 @@ NTSTATUS DOKAN_CALLBACK VFATSetFileAttributes(LPCWSTR FileName,
                                               DWORD FileAttributes,
                                               PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(SetFileAttributes);
+    traced_op trace(fs_trace::FS_SETATTR, FileName, DokanFileInfo);
+    trace.rec.arg = FileAttributes;
     LOG_SetFileAttributes();
-    try
+    auto st = get_dev().try_setattr(DokanFileInfo->Context, FileAttributes);
+    if (!st && st.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        get_dev().setattr(DokanFileInfo->Context, FileAttributes);
-        LOG_RETURN(SetFileAttributes, STATUS_SUCCESS);
-    }
-    catch (fat32::file_error &e)
-    {
-        switch (e.get_error_type())
+        st = reopen(FileName, DokanFileInfo);
+        if (st)
         {
-        case fat32::file_error::FILE_NOT_FOUND:
-            LOG_RETURN(SetFileAttributes, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            LOG_RETURN(SetFileAttributes, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            LOG_RETURN(SetFileAttributes, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                get_dev().setattr(DokanFileInfo->Context, FileAttributes);
-                LOG_RETURN(SetFileAttributes, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    LOG_RETURN(SetFileAttributes, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    LOG_RETURN(SetFileAttributes, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    LOG_RETURN(SetFileAttributes, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("GetFileInformation invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
+            st = get_dev().try_setattr(DokanFileInfo->Context, FileAttributes);
         }
     }
+    if (!st)
+    {
+        LOG_RETURN(SetFileAttributes, to_ntstatus(st.error()));
+    }
+    LOG_RETURN(SetFileAttributes, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATSetFileTime(LPCWSTR FileName,
@@ -518,212 +425,91 @@ NTSTATUS DOKAN_CALLBACK VFATSetFileTime(LPCWSTR FileName,
                                         CONST FILETIME *LastWriteTime,
                                         PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(SetFileTime);
+    traced_op trace(fs_trace::FS_SETTIME, FileName, DokanFileInfo);
     LOG_SetFileTime();
-    try
-    {
-        get_dev().settime(DokanFileInfo->Context, CreationTime, LastAccessTime, LastWriteTime);
-        LOG_RETURN(SetFileAttributes, STATUS_SUCCESS);
-    }
-    catch (fat32::file_error &e)
+    auto st = get_dev().try_settime(DokanFileInfo->Context, CreationTime, LastAccessTime, LastWriteTime);
+    if (!st && st.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        switch (e.get_error_type())
+        st = reopen(FileName, DokanFileInfo);
+        if (st)
         {
-        case fat32::file_error::FILE_NOT_FOUND:
-            LOG_RETURN(SetFileTime, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            LOG_RETURN(SetFileTime, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            LOG_RETURN(SetFileTime, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                get_dev().settime(DokanFileInfo->Context, CreationTime, LastAccessTime, LastWriteTime);
-                LOG_RETURN(SetFileTime, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    LOG_RETURN(SetFileTime, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    LOG_RETURN(SetFileTime, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    LOG_RETURN(SetFileTime, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("GetFileInformation invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
+            st = get_dev().try_settime(DokanFileInfo->Context, CreationTime, LastAccessTime, LastWriteTime);
         }
     }
+    if (!st)
+    {
+        LOG_RETURN(SetFileTime, to_ntstatus(st.error()));
+    }
+    LOG_RETURN(SetFileTime, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATDeleteFile(LPCWSTR FileName,
                                        PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(DeleteFile);
+    traced_op trace(fs_trace::FS_DELETE, FileName, DokanFileInfo);
     LOG_DeleteFile();
-    try
+    BY_HANDLE_FILE_INFORMATION info;
+    auto st = get_dev().try_fstat(DokanFileInfo->Context, &info);
+    if (!st && st.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        BY_HANDLE_FILE_INFORMATION info;
-        get_dev().fstat(DokanFileInfo->Context, &info);
-        if (info.dwFileAttributes & 0x10)
+        st = reopen(FileName, DokanFileInfo);
+        if (st)
         {
-            LOG_RETURN(DeleteFile, STATUS_ACCESS_DENIED);
+            st = get_dev().try_fstat(DokanFileInfo->Context, &info);
         }
-        DokanFileInfo->DeleteOnClose = TRUE;
-        LOG_RETURN(DeleteFile, STATUS_SUCCESS);
     }
-    catch (fat32::file_error &e)
+    if (!st)
     {
-        switch (e.get_error_type())
-        {
-        case fat32::file_error::FILE_NOT_FOUND:
-            LOG_RETURN(DeleteFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            LOG_RETURN(DeleteFile, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            LOG_RETURN(DeleteFile, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                BY_HANDLE_FILE_INFORMATION info;
-                get_dev().fstat(DokanFileInfo->Context, &info);
-                if (info.dwFileAttributes & 0x10)
-                {
-                    LOG_RETURN(DeleteFile, STATUS_ACCESS_DENIED);
-                }
-                DokanFileInfo->DeleteOnClose = TRUE;
-                LOG_RETURN(DeleteFile, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    LOG_RETURN(DeleteFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    LOG_RETURN(DeleteFile, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    LOG_RETURN(DeleteFile, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("DeleteFile invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
-        }
+        LOG_RETURN(DeleteFile, to_ntstatus(st.error()));
     }
+    if (info.dwFileAttributes & 0x10)
+    {
+        LOG_RETURN(DeleteFile, STATUS_ACCESS_DENIED);
+    }
+    DokanFileInfo->DeleteOnClose = TRUE;
+    LOG_RETURN(DeleteFile, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATDeleteDirectory(LPCWSTR FileName,
                                             PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(DeleteDirectory);
+    traced_op trace(fs_trace::FS_DELETE, FileName, DokanFileInfo);
     LOG_DeleteDirectory();
-    try
+    BY_HANDLE_FILE_INFORMATION info;
+    auto st = get_dev().try_fstat(DokanFileInfo->Context, &info);
+    if (!st && st.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        BY_HANDLE_FILE_INFORMATION info;
-        get_dev().fstat(DokanFileInfo->Context, &info);
-        if (!(info.dwFileAttributes & 0x10))
-        {
-            LOG_RETURN(DeleteFile, STATUS_ACCESS_DENIED);
-        }
-        auto ret = get_dev().opendir(DokanFileInfo->Context);
-        for (const auto &entry : ret)
+        st = reopen(FileName, DokanFileInfo);
+        if (st)
         {
-            if (wcscmp(entry.name, L".") != 0 && wcscmp(entry.name, L"..") != 0)
-            {
-                LOG_RETURN(DeleteDirectory, STATUS_DIRECTORY_NOT_EMPTY);
-            }
+            st = get_dev().try_fstat(DokanFileInfo->Context, &info);
         }
-        DokanFileInfo->DeleteOnClose = TRUE;
-        LOG_RETURN(DeleteDirectory, STATUS_SUCCESS);
     }
-    catch (fat32::file_error &e)
+    if (!st)
+    {
+        LOG_RETURN(DeleteDirectory, to_ntstatus(st.error()));
+    }
+    if (!(info.dwFileAttributes & 0x10))
     {
-        switch (e.get_error_type())
+        LOG_RETURN(DeleteDirectory, STATUS_ACCESS_DENIED);
+    }
+    auto ret = get_dev().try_opendir(DokanFileInfo->Context);
+    if (!ret)
+    {
+        LOG_RETURN(DeleteDirectory, to_ntstatus(ret.error()));
+    }
+    for (const auto &entry : *ret)
+    {
+        if (entry.name != L"." && entry.name != L"..")
         {
-        case fat32::file_error::FILE_NOT_FOUND:
-            LOG_RETURN(DeleteDirectory, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            LOG_RETURN(DeleteDirectory, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            LOG_RETURN(DeleteDirectory, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                BY_HANDLE_FILE_INFORMATION info;
-                get_dev().fstat(DokanFileInfo->Context, &info);
-                if (!(info.dwFileAttributes & 0x10))
-                {
-                    LOG_RETURN(DeleteFile, STATUS_ACCESS_DENIED);
-                }
-                auto ret = get_dev().opendir(DokanFileInfo->Context);
-                for (const auto &entry : ret)
-                {
-                    if (wcscmp(entry.name, L".") != 0 && wcscmp(entry.name, L"..") != 0)
-                    {
-                        LOG_RETURN(DeleteDirectory, STATUS_DIRECTORY_NOT_EMPTY);
-                    }
-                }
-                DokanFileInfo->DeleteOnClose = TRUE;
-                LOG_RETURN(DeleteDirectory, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    LOG_RETURN(DeleteDirectory, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    LOG_RETURN(DeleteDirectory, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    LOG_RETURN(DeleteDirectory, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("DeleteDirectory invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
+            LOG_RETURN(DeleteDirectory, STATUS_DIRECTORY_NOT_EMPTY);
         }
     }
+    DokanFileInfo->DeleteOnClose = TRUE;
+    LOG_RETURN(DeleteDirectory, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATMoveFile(LPCWSTR FileName,
@@ -731,179 +517,79 @@ NTSTATUS DOKAN_CALLBACK VFATMoveFile(LPCWSTR FileName,
                                      BOOL ReplaceIfExisting,
                                      PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(MoveFile);
+    traced_op trace(fs_trace::FS_RENAME, FileName, DokanFileInfo);
+    trace.new_path = NewFileName;
+    trace.rec.arg = ReplaceIfExisting;
     LOG_MoveFile();
     auto newpath = parse_path(NewFileName);
-    try
+    auto ok = get_dev().try_rename(DokanFileInfo->Context, newpath, ReplaceIfExisting);
+    if (!ok && ok.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        bool ok = get_dev().rename(DokanFileInfo->Context, newpath, ReplaceIfExisting);
-        if (!ok)
+        auto st = reopen(FileName, DokanFileInfo);
+        if (!st)
         {
-            LOG_RETURN(MoveFile, STATUS_ACCESS_DENIED);
+            LOG_RETURN(MoveFile, to_ntstatus(st.error()));
         }
-        LOG_RETURN(MoveFile, STATUS_SUCCESS);
+        ok = get_dev().try_rename(DokanFileInfo->Context, newpath, ReplaceIfExisting);
     }
-    catch (fat32::file_error &e)
+    if (!ok)
     {
-        switch (e.get_error_type())
-        {
-        case fat32::file_error::FILE_NOT_FOUND:
-            LOG_RETURN(MoveFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            LOG_RETURN(MoveFile, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            LOG_RETURN(MoveFile, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                get_dev().rename(DokanFileInfo->Context, newpath, ReplaceIfExisting);
-                LOG_RETURN(MoveFile, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    LOG_RETURN(MoveFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    LOG_RETURN(MoveFile, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    LOG_RETURN(MoveFile, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("MoveFile invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
-        }
+        LOG_RETURN(MoveFile, to_ntstatus(ok.error()));
     }
+    if (!*ok)
+    {
+        LOG_RETURN(MoveFile, STATUS_ACCESS_DENIED);
+    }
+    LOG_RETURN(MoveFile, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATSetEndOfFile(LPCWSTR FileName,
                                          LONGLONG ByteOffset,
                                          PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(SetEndOfFile);
+    traced_op trace(fs_trace::FS_SETEND, FileName, DokanFileInfo);
+    trace.rec.offset = ByteOffset;
     LOG_SetEndOfFile();
-    try
+    auto st = get_dev().try_setend(DokanFileInfo->Context, ByteOffset);
+    if (!st && st.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        get_dev().setend(DokanFileInfo->Context, ByteOffset);
-        LOG_RETURN(SetEndOfFile, STATUS_SUCCESS);
-    }
-    catch (fat32::file_error &e)
-    {
-        switch (e.get_error_type())
+        st = reopen(FileName, DokanFileInfo);
+        if (st)
         {
-        case fat32::file_error::FILE_NOT_FOUND:
-            LOG_RETURN(SetEndOfFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            LOG_RETURN(SetEndOfFile, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            LOG_RETURN(SetEndOfFile, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                get_dev().setend(DokanFileInfo->Context, ByteOffset);
-                LOG_RETURN(SetEndOfFile, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    LOG_RETURN(SetEndOfFile, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    LOG_RETURN(SetEndOfFile, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    LOG_RETURN(SetEndOfFile, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("GetFileInformation invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
+            st = get_dev().try_setend(DokanFileInfo->Context, ByteOffset);
         }
     }
+    if (!st)
+    {
+        LOG_RETURN(SetEndOfFile, to_ntstatus(st.error()));
+    }
+    LOG_RETURN(SetEndOfFile, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATSetAllocationSize(LPCWSTR FileName,
                                               LONGLONG AllocSize,
                                               PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
+    STATS_CALLBACK(SetAllocationSize);
+    traced_op trace(fs_trace::FS_SETALLOC, FileName, DokanFileInfo);
+    trace.rec.offset = AllocSize;
     LOG_SetAllocationSize();
-    try
-    {
-        get_dev().setalloc(DokanFileInfo->Context, AllocSize);
-        LOG_RETURN(SetAllocationSize, STATUS_SUCCESS);
-    }
-    catch (fat32::file_error &e)
+    auto st = get_dev().try_setalloc(DokanFileInfo->Context, AllocSize);
+    if (!st && st.error() == fat32::file_error::INVALID_FILE_DISCRIPTOR)
     {
-        switch (e.get_error_type())
+        st = reopen(FileName, DokanFileInfo);
+        if (st)
         {
-        case fat32::file_error::FILE_NOT_FOUND:
-            LOG_RETURN(SetAllocationSize, STATUS_OBJECT_NAME_NOT_FOUND);
-
-        case fat32::file_error::FILE_NOT_DIR:
-            LOG_RETURN(SetAllocationSize, STATUS_NOT_A_DIRECTORY);
-
-        case fat32::file_error::FILE_ALREADY_EXISTS:
-            LOG_RETURN(SetAllocationSize, STATUS_OBJECT_NAME_COLLISION);
-
-        default:
-            try
-            {
-                bool exist;
-                bool isdir;
-                auto path = parse_path(FileName);
-                auto file = get_dev().open(path, OPEN_EXISTING, 0, exist, isdir);
-                DokanFileInfo->Context = file;
-                DokanFileInfo->IsDirectory = isdir;
-                get_dev().setalloc(DokanFileInfo->Context, AllocSize);
-                LOG_RETURN(SetAllocationSize, STATUS_SUCCESS);
-            }
-            catch (fat32::file_error &e2)
-            {
-                switch (e2.get_error_type())
-                {
-                case fat32::file_error::FILE_NOT_FOUND:
-                    LOG_RETURN(SetAllocationSize, STATUS_OBJECT_NAME_NOT_FOUND);
-
-                case fat32::file_error::FILE_NOT_DIR:
-                    LOG_RETURN(SetAllocationSize, STATUS_NOT_A_DIRECTORY);
-
-                case fat32::file_error::FILE_ALREADY_EXISTS:
-                    LOG_RETURN(SetAllocationSize, STATUS_OBJECT_NAME_COLLISION);
-
-                default:
-                    log_msg("GetFileInformation invalid file discriptor\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
+            st = get_dev().try_setalloc(DokanFileInfo->Context, AllocSize);
         }
     }
+    if (!st)
+    {
+        LOG_RETURN(SetAllocationSize, to_ntstatus(st.error()));
+    }
+    LOG_RETURN(SetAllocationSize, STATUS_SUCCESS);
 }
 
 NTSTATUS DOKAN_CALLBACK VFATGetDiskFreeSpace(PULONGLONG FreeBytesAvailable,
@@ -911,13 +597,13 @@ NTSTATUS DOKAN_CALLBACK VFATGetDiskFreeSpace(PULONGLONG FreeBytesAvailable,
                                              PULONGLONG TotalNumberOfFreeBytes,
                                              PDOKAN_FILE_INFO DokanFileInfo)
 {
+    STATS_CALLBACK(GetDiskFreeSpace);
     get_dev().get_disk_info(FreeBytesAvailable, TotalNumberOfBytes, TotalNumberOfFreeBytes);
     return STATUS_SUCCESS;
 }
 
 NTSTATUS DOKAN_CALLBACK VFATUnmounted(PDOKAN_FILE_INFO DokanFileInfo)
 {
-    std::lock_guard<std::mutex> g(global_mtx);
     log_msg("Unmounted\nclearing...\n");
     get_dev().clear();
     return STATUS_SUCCESS;
@@ -949,7 +635,134 @@ DOKAN_OPTIONS dokanOptions = {
     .MountPoint = L"E:\\",
 };
 
+option long_options[] = {
+    {"threads", required_argument, NULL, 't'},
+    {"mount", required_argument, NULL, 'm'},
+    {"log-level", required_argument, NULL, 'l'},
+    {"stats", required_argument, NULL, 's'},
+    {"trace", required_argument, NULL, 'T'},
+    {"record", required_argument, NULL, 'R'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_help(char *argv0)
+{
+    printf(
+        "Usage: %s [OPTION]... [IMAGE]\n"
+        "Mount the FAT32 disk IMAGE, test.img by default.\n"
+        "Arguments:\n"
+        "  -t, --threads              number of worker threads serving requests,\n"
+        "                             default 0 lets Dokan decide\n"
+        "  -m, --mount                mount point, default E:\\\n"
+        "  -l, --log-level            trace, debug, info, warn, error or off,\n"
+        "                             default info\n"
+        "  -s, --stats                write latency histograms and counters\n"
+        "                             as JSON to this file every second\n"
+        "  -T, --trace                record every device request to this file,\n"
+        "                             see io_replay\n"
+        "  -R, --record               record every filesystem operation to this\n"
+        "                             file, see op_replay\n"
+        "  -h, --help                 show help messages\n",
+        argv0);
+}
+
 int main(int argc, char *argv[])
 {
-    DokanMain(&dokanOptions, &operations);
+    extern char *optarg;
+    extern int optind, opterr, optopt;
+
+    opterr = 0;
+    int threads = 0;
+    std::wstring mount_point = L"E:\\";
+
+    while (true)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "t:m:l:s:T:R:h", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+
+        case 'm':
+            mount_point.resize(strlen(optarg) + 1);
+            mount_point.resize(mbstowcs(mount_point.data(), optarg, mount_point.size()));
+            break;
+
+        case 'l':
+        {
+            static const char *levels[] = {"trace", "debug", "info", "warn", "error", "off"};
+            int level = LEVEL_TRACE;
+            while (level <= LEVEL_OFF && strcmp(optarg, levels[level]))
+                ++level;
+            if (level > LEVEL_OFF)
+            {
+                fprintf(stderr, "%s is not a valid log level\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            set_log_level((log_level_t)level);
+            break;
+        }
+
+        case 's':
+            if (!fat32::stats::start_dump(optarg, 1000))
+            {
+                fprintf(stderr, "cannot write stats to %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'T':
+            trace_name = optarg;
+            break;
+
+        case 'R':
+            try
+            {
+                op_tracer = std::make_unique<fs_trace::writer>(optarg);
+            }
+            catch (const std::exception &e)
+            {
+                fprintf(stderr, "%s\n", e.what());
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            fprintf(stderr, "invalid argument %c\n", (char)optopt);
+            print_help(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (threads < 0 || threads > 0xffff)
+    {
+        fprintf(stderr, "%d is not a valid thread count\n", threads);
+        exit(EXIT_FAILURE);
+    }
+    if (optind < argc)
+    {
+        image_name = argv[optind];
+    }
+
+    get_dev();
+    dokanOptions.ThreadCount = threads;
+    dokanOptions.MountPoint = mount_point.c_str();
+    int status = DokanMain(&dokanOptions, &operations);
+    if (status != DOKAN_SUCCESS)
+    {
+        fprintf(stderr, "DokanMain failed with %d\n", status);
+        return EXIT_FAILURE;
+    }
+    return 0;
 }
\ No newline at end of file
@@ -1,8 +1,14 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
-#include <stringapiset.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "win_compat.h"
 #include "dokan_log.h"
 
 std::string wide2local(const wchar_t *s)
@@ -11,22 +17,21 @@ std::string wide2local(const wchar_t *s)
     std::string res;
     res.resize(size);
     size = WideCharToMultiByte(CP_ACP, 0, s, -1, res.data(), size, NULL, FALSE);
-    return std::move(res);
+    return res;
 }
 
 FILE *open_log_file(void)
 {
-    static FILE *log_file;
-    if (!log_file)
-    {
-        log_file = fopen(set_log_name(NULL), "w");
-        if (!log_file)
+    static FILE *log_file = [] {
+        auto file = fopen(set_log_name(NULL), "w");
+        if (!file)
         {
             fprintf(stderr, "open log failed!\n");
             exit(EXIT_FAILURE);
         }
-        setvbuf(log_file, NULL, _IOLBF, 0);
-    }
+        setvbuf(file, NULL, _IOFBF, 1 << 16);
+        return file;
+    }();
 
     return log_file;
 }
@@ -42,10 +47,407 @@ const char *set_log_name(const char *log_name)
     return name;
 }
 
-void log_msg(const char *format, ...)
+std::atomic<int> log_threshold(LEVEL_INFO);
+
+void set_log_level(log_level_t level) noexcept
+{
+    log_threshold.store(level, std::memory_order_relaxed);
+}
+
+void log_writer::put_int(char tag, uint64_t v) noexcept
+{
+    if (rec.used + 1 + sizeof(v) > sizeof(rec.data))
+        return;
+    rec.data[rec.used] = tag;
+    memcpy(rec.data + rec.used + 1, &v, sizeof(v));
+    rec.used += 1 + sizeof(v);
+}
+
+void log_writer::put(double v) noexcept
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_int('f', bits);
+}
+
+void log_writer::put(const char *s) noexcept
+{
+    put(std::string_view(s ? s : "(null)"));
+}
+
+void log_writer::put(std::string_view s) noexcept
+{
+    if (rec.used + 3u > sizeof(rec.data))
+        return;
+    uint16_t n = std::min(s.size(), sizeof(rec.data) - rec.used - 3);
+    rec.data[rec.used] = 's';
+    memcpy(rec.data + rec.used + 1, &n, sizeof(n));
+    memcpy(rec.data + rec.used + 3, s.data(), n);
+    rec.used += 3 + n;
+}
+
+void log_writer::put(const wchar_t *s) noexcept
+{
+    if (s)
+        put(std::wstring_view(s));
+    else
+        put("(null)");
+}
+
+void log_writer::put(std::wstring_view s) noexcept
+{
+    if (rec.used + 3u > sizeof(rec.data))
+        return;
+    char *out = rec.data + rec.used + 3;
+    int avail = sizeof(rec.data) - rec.used - 3;
+    int n = s.empty() ? 0 : WideCharToMultiByte(CP_ACP, 0, s.data(), s.size(), out, avail, NULL, FALSE);
+    if (n <= 0)
+    {
+        // too long for the record: keep the ascii prefix
+        n = std::min<size_t>(s.size(), avail);
+        for (int i = 0; i < n; ++i)
+            out[i] = s[i] < 0x80 ? (char)s[i] : '?';
+    }
+    uint16_t len = n;
+    rec.data[rec.used] = 's';
+    memcpy(rec.data + rec.used + 1, &len, sizeof(len));
+    rec.used += 3 + len;
+}
+
+namespace
+{
+    // Single producer (the owning thread), single consumer (the writer).
+    struct log_ring
+    {
+        static constexpr uint32_t capacity = 1024;
+        log_record slots[capacity];
+        alignas(64) std::atomic<uint32_t> head{0};
+        alignas(64) std::atomic<uint32_t> tail{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> owned{false};
+    };
+
+    class log_backend
+    {
+    public:
+        log_ring *acquire()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!started)
+            {
+                started = true;
+                worker = std::thread(&log_backend::run, this);
+                atexit([] { instance().stop(); });
+            }
+            for (auto &r : rings)
+            {
+                bool expected = false;
+                if (r->owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                    return r.get();
+            }
+            rings.push_back(std::make_unique<log_ring>());
+            rings.back()->owned.store(true, std::memory_order_relaxed);
+            return rings.back().get();
+        }
+
+        void flush()
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (!started || stopped)
+                return;
+            auto ticket = ++requested;
+            cv.notify_all();
+            done_cv.wait(lock, [&] { return completed >= ticket; });
+        }
+
+        // lets a filling ring be drained before the next poll
+        void wake() noexcept
+        {
+            pending.store(true, std::memory_order_relaxed);
+            cv.notify_one();
+        }
+
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!started || stopped)
+                    return;
+                stopped = true;
+            }
+            cv.notify_all();
+            worker.join();
+        }
+
+        static log_backend &instance()
+        {
+            // never destroyed: threads may still log while statics are torn down
+            static log_backend *backend = new log_backend;
+            return *backend;
+        }
+
+    private:
+        void run()
+        {
+            std::vector<log_record> batch;
+            std::string out;
+            for (;;)
+            {
+                uint64_t ticket;
+                bool last;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait_for(lock, std::chrono::milliseconds(2), [&] { return stopped || requested > completed || pending.load(std::memory_order_relaxed); });
+                    pending.store(false, std::memory_order_relaxed);
+                    ticket = requested;
+                    last = stopped;
+                    uint64_t lost = 0;
+                    for (auto &r : rings)
+                    {
+                        auto t = r->tail.load(std::memory_order_relaxed);
+                        auto h = r->head.load(std::memory_order_acquire);
+                        for (; t != h; ++t)
+                            batch.push_back(r->slots[t % log_ring::capacity]);
+                        r->tail.store(t, std::memory_order_release);
+                        lost += r->dropped.exchange(0, std::memory_order_relaxed);
+                    }
+                    if (lost)
+                        fprintf(open_log_file(), "log: %llu messages dropped\n", (unsigned long long)lost);
+                }
+                if (!batch.empty())
+                {
+                    std::stable_sort(batch.begin(), batch.end(), [](const log_record &a, const log_record &b) { return a.time < b.time; });
+                    for (auto &rec : batch)
+                        format(rec, out);
+                    fwrite(out.data(), 1, out.size(), open_log_file());
+                    fflush(open_log_file());
+                    batch.clear();
+                    out.clear();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    completed = ticket;
+                }
+                done_cv.notify_all();
+                if (last)
+                    return;
+            }
+        }
+
+        struct arg_reader
+        {
+            const log_record &rec;
+            size_t pos = 0;
+
+            bool next(char &tag, uint64_t &v, std::string_view &s)
+            {
+                if (pos >= rec.used)
+                    return false;
+                tag = rec.data[pos];
+                if (tag == 's')
+                {
+                    uint16_t n;
+                    memcpy(&n, rec.data + pos + 1, sizeof(n));
+                    s = std::string_view(rec.data + pos + 3, n);
+                    pos += 3 + n;
+                }
+                else
+                {
+                    memcpy(&v, rec.data + pos + 1, sizeof(v));
+                    pos += 1 + sizeof(v);
+                }
+                return true;
+            }
+
+            int64_t next_int()
+            {
+                char tag;
+                uint64_t v = 0;
+                std::string_view s;
+                if (!next(tag, v, s) || tag == 's')
+                    return 0;
+                if (tag == 'f')
+                {
+                    double d;
+                    memcpy(&d, &v, sizeof(d));
+                    return (int64_t)d;
+                }
+                return v;
+            }
+        };
+
+        // Re-runs printf on one conversion at a time, widening every
+        // integer conversion to long long since arguments are stored as
+        // 64-bit values.
+        static void format(const log_record &rec, std::string &out)
+        {
+            arg_reader args{rec};
+            char buf[512];
+            const char *p = rec.format;
+            while (*p)
+            {
+                if (*p != '%')
+                {
+                    auto q = strchr(p, '%');
+                    size_t n = q ? q - p : strlen(p);
+                    out.append(p, n);
+                    p += n;
+                    continue;
+                }
+                if (p[1] == '%')
+                {
+                    out.push_back('%');
+                    p += 2;
+                    continue;
+                }
+                std::string spec = "%";
+                ++p;
+                while (*p && strchr("-+ #0", *p))
+                    spec.push_back(*p++);
+                if (*p == '*')
+                {
+                    spec += std::to_string(args.next_int());
+                    ++p;
+                }
+                while (*p >= '0' && *p <= '9')
+                    spec.push_back(*p++);
+                int precision = -1;
+                if (*p == '.')
+                {
+                    ++p;
+                    precision = 0;
+                    if (*p == '*')
+                    {
+                        precision = std::max<int64_t>(args.next_int(), -1);
+                        ++p;
+                    }
+                    while (*p >= '0' && *p <= '9')
+                        precision = precision * 10 + *p++ - '0';
+                }
+                size_t width_end = spec.size();
+                if (precision >= 0)
+                    spec += "." + std::to_string(precision);
+                while (*p && strchr("hlLqjzt", *p))
+                    ++p;
+                char conv = *p;
+                if (!conv)
+                    break;
+                ++p;
+                char tag;
+                uint64_t v = 0;
+                std::string_view s;
+                if (!args.next(tag, v, s))
+                    continue;
+                int n = 0;
+                switch (conv)
+                {
+                case 'd':
+                case 'i':
+                    spec += "ll";
+                    spec.push_back(conv);
+                    n = snprintf(buf, sizeof(buf), spec.c_str(), (long long)v);
+                    break;
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                    spec += "ll";
+                    spec.push_back(conv);
+                    n = snprintf(buf, sizeof(buf), spec.c_str(), (unsigned long long)v);
+                    break;
+                case 'c':
+                    spec.push_back(conv);
+                    n = snprintf(buf, sizeof(buf), spec.c_str(), (int)v);
+                    break;
+                case 'p':
+                    spec.push_back(conv);
+                    n = snprintf(buf, sizeof(buf), spec.c_str(), (void *)(uintptr_t)v);
+                    break;
+                case 's':
+                    if (tag != 's')
+                        s = "(?)";
+                    if (precision >= 0)
+                        s = s.substr(0, precision);
+                    spec.resize(width_end);
+                    spec += ".*s";
+                    n = snprintf(buf, sizeof(buf), spec.c_str(), (int)s.size(), s.data());
+                    break;
+                default:
+                {
+                    double d;
+                    memcpy(&d, &v, sizeof(d));
+                    if (tag != 'f')
+                        d = tag == 'i' ? (double)(int64_t)v : (double)v;
+                    spec.push_back(conv);
+                    n = snprintf(buf, sizeof(buf), spec.c_str(), d);
+                }
+                }
+                if (n > 0)
+                    out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+            }
+        }
+
+        std::mutex mtx;
+        std::condition_variable cv, done_cv;
+        std::vector<std::unique_ptr<log_ring>> rings;
+        std::thread worker;
+        uint64_t requested = 0, completed = 0;
+        bool started = false, stopped = false;
+        std::atomic<bool> pending{false};
+    };
+
+    struct ring_owner
+    {
+        log_ring *ring = nullptr;
+        uint32_t head = 0;
+
+        ~ring_owner()
+        {
+            if (ring)
+                ring->owned.store(false, std::memory_order_release);
+        }
+    };
+
+    thread_local ring_owner current;
+}
+
+log_record *log_begin(int level, const char *format) noexcept
 {
-    va_list ap;
-    va_start(ap, format);
-    vfprintf(open_log_file(), format, ap);
-    va_end(ap);
-}
\ No newline at end of file
+    auto &self = current;
+    if (!self.ring)
+    {
+        try
+        {
+            self.ring = log_backend::instance().acquire();
+        }
+        catch (...)
+        {
+            return nullptr;
+        }
+    }
+    auto r = self.ring;
+    self.head = r->head.load(std::memory_order_relaxed);
+    if (self.head - r->tail.load(std::memory_order_acquire) == log_ring::capacity)
+    {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    if (self.head - r->tail.load(std::memory_order_relaxed) == log_ring::capacity / 2)
+        log_backend::instance().wake();
+    auto &rec = r->slots[self.head % log_ring::capacity];
+    rec.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    rec.format = format;
+    rec.level = level;
+    rec.used = 0;
+    return &rec;
+}
+
+void log_commit() noexcept
+{
+    current.ring->head.store(current.head + 1, std::memory_order_release);
+}
+
+void log_flush()
+{
+    log_backend::instance().flush();
+}
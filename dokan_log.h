@@ -1,6 +1,38 @@
 #ifndef DOKAN_LOG_H
 #define DOKAN_LOG_H
+#include <atomic>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <stdint.h>
+
+enum log_level_t
+{
+    LEVEL_TRACE,
+    LEVEL_DEBUG,
+    LEVEL_INFO,
+    LEVEL_WARN,
+    LEVEL_ERROR,
+    LEVEL_OFF,
+};
+
+// Levels below LOG_MIN_LEVEL are compiled out; set_log_level() filters the
+// rest at run time. Neither evaluates the arguments of a dropped message.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LEVEL_DEBUG
+#endif
+
+#define log_at(level, ...)                                  \
+    do                                                      \
+    {                                                       \
+        if ((level) >= LOG_MIN_LEVEL && log_enabled(level)) \
+            log_event(level, __VA_ARGS__);                  \
+    } while (0)
+
+#define log_trace(...) log_at(LEVEL_TRACE, __VA_ARGS__)
+#define log_msg(...) log_at(LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LEVEL_INFO, __VA_ARGS__)
+#define log_error(...) log_at(LEVEL_ERROR, __VA_ARGS__)
 
 #define LOG_RETURN(func_name, ret_val)             \
     log_msg(#func_name " return: " #ret_val "\n"); \
@@ -9,7 +41,7 @@
 #define log_struct(indent, st, field, format, ...) \
     log_msg(indent "(" #st ")->" #field " = " format "\n", __VA_ARGS__(st->field))
 
-#define log_wstring(indent, name) log_msg(indent #name " = %s\n", wide2local(name).c_str())
+#define log_wstring(indent, name) log_msg(indent #name " = %s\n", name)
 
 #define log_int32(indent, name) log_msg(indent #name " = %d\n", name)
 
@@ -177,6 +209,78 @@ std::string wide2local(const wchar_t *s);
 
 const char *set_log_name(const char *name);
 
-void log_msg(const char *format, ...);
+extern std::atomic<int> log_threshold;
+
+inline bool log_enabled(int level) noexcept
+{
+    return level >= log_threshold.load(std::memory_order_relaxed);
+}
+
+void set_log_level(log_level_t level) noexcept;
+
+// Blocks until every message logged so far is written out.
+void log_flush();
+
+// A message is stored as one fixed-size binary record in a ring owned by
+// the logging thread: the format pointer plus tagged arguments, with
+// strings copied in. A background thread formats and writes the records,
+// so the caller never takes a lock or touches the file. When a ring is
+// full the message is dropped and counted.
+struct log_record
+{
+    static constexpr size_t size = 256;
+    uint64_t time;
+    const char *format;
+    uint16_t used;
+    uint8_t level;
+    char data[size - 19];
+};
+
+class log_writer
+{
+public:
+    explicit log_writer(log_record &rec) noexcept : rec(rec) {}
+    void put(bool v) noexcept { put_int('u', v); }
+    void put(char v) noexcept { put_int('i', v); }
+    void put(double v) noexcept;
+    void put(const char *s) noexcept;
+    void put(const std::string &s) noexcept { put(std::string_view(s)); }
+    void put(std::string_view s) noexcept;
+    void put(const wchar_t *s) noexcept;
+    void put(const std::wstring &s) noexcept { put(std::wstring_view(s)); }
+    void put(std::wstring_view s) noexcept;
+    template <typename T>
+    void put(T v) noexcept
+    {
+        if constexpr (std::is_enum_v<T>)
+            put_int('i', (int64_t)v);
+        else if constexpr (std::is_pointer_v<T>)
+            put_int('p', (uint64_t)(uintptr_t)v);
+        else if constexpr (std::is_floating_point_v<T>)
+            put((double)v);
+        else if constexpr (std::is_signed_v<T>)
+            put_int('i', (int64_t)v);
+        else
+            put_int('u', (uint64_t)v);
+    }
+
+private:
+    void put_int(char tag, uint64_t v) noexcept;
+    log_record &rec;
+};
+
+log_record *log_begin(int level, const char *format) noexcept;
+void log_commit() noexcept;
+
+template <typename... Args>
+void log_event(int level, const char *format, const Args &...args) noexcept
+{
+    auto rec = log_begin(level, format);
+    if (!rec)
+        return;
+    log_writer w(*rec);
+    (w.put(args), ...);
+    log_commit();
+}
 
 #endif
\ No newline at end of file
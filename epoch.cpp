@@ -0,0 +1,170 @@
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "epoch.h"
+
+namespace fat32
+{
+
+namespace
+{
+
+struct retired
+{
+    uint64_t epoch;
+    void *ptr;
+    void (*deleter)(void *);
+};
+
+const size_t reclaim_batch = 64;
+
+} // namespace
+
+struct alignas(64) epoch::record
+{
+    std::atomic<uint64_t> pinned;
+    std::atomic<bool> used;
+    record *next;
+};
+
+struct epoch::shared_state
+{
+    std::atomic<uint64_t> global{1};
+    std::atomic<record *> head{nullptr};
+    std::mutex mtx;
+    std::vector<retired> list;
+};
+
+// Never destroyed: thread exit may still release records after statics die.
+epoch::shared_state &epoch::state()
+{
+    static auto s = new shared_state;
+    return *s;
+}
+
+struct epoch::local_state
+{
+    record *rec = nullptr;
+    unsigned depth = 0;
+    ~local_state()
+    {
+        if (rec)
+            rec->used.store(false, std::memory_order_release);
+    }
+};
+
+epoch::local_state &epoch::local() noexcept
+{
+    thread_local local_state l;
+    return l;
+}
+
+epoch::guard::guard()
+{
+    auto &l = local();
+    if (!l.rec)
+    {
+        auto &s = state();
+        for (auto r = s.head.load(std::memory_order_acquire); r; r = r->next)
+        {
+            bool expected = false;
+            if (!r->used.load(std::memory_order_relaxed) && r->used.compare_exchange_strong(expected, true))
+            {
+                l.rec = r;
+                break;
+            }
+        }
+        if (!l.rec)
+        {
+            auto r = new record;
+            r->pinned.store(0, std::memory_order_relaxed);
+            r->used.store(true, std::memory_order_relaxed);
+            auto head = s.head.load(std::memory_order_relaxed);
+            do
+            {
+                r->next = head;
+            } while (!s.head.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+            l.rec = r;
+        }
+    }
+    if (l.depth++ == 0)
+    {
+        l.rec->pinned.store(state().global.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+epoch::guard::~guard()
+{
+    auto &l = local();
+    if (--l.depth == 0)
+    {
+        l.rec->pinned.store(0, std::memory_order_release);
+    }
+}
+
+void epoch::retire(void *p, void (*deleter)(void *))
+{
+    auto &s = state();
+    bool full;
+    {
+        std::lock_guard<std::mutex> g(s.mtx);
+        s.list.push_back(retired{s.global.load(std::memory_order_relaxed), p, deleter});
+        full = s.list.size() % reclaim_batch == 0;
+    }
+    if (full)
+    {
+        reclaim();
+    }
+}
+
+void epoch::synchronize()
+{
+    auto &s = state();
+    auto target = s.global.fetch_add(1, std::memory_order_seq_cst) + 1;
+    for (auto r = s.head.load(std::memory_order_acquire); r; r = r->next)
+    {
+        uint64_t pinned;
+        while ((pinned = r->pinned.load(std::memory_order_acquire)) && pinned < target)
+        {
+            std::this_thread::yield();
+        }
+    }
+    reclaim();
+}
+
+void epoch::reclaim()
+{
+    auto &s = state();
+    std::vector<retired> ready;
+    {
+        std::lock_guard<std::mutex> g(s.mtx);
+        // An object retired in epoch e can only be held by a guard pinned at e
+        // or earlier; guards pinned later started after it was unlinked.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto oldest = UINT64_MAX;
+        for (auto r = s.head.load(std::memory_order_acquire); r; r = r->next)
+        {
+            auto pinned = r->pinned.load(std::memory_order_acquire);
+            if (pinned && pinned < oldest)
+                oldest = pinned;
+        }
+        s.global.fetch_add(1, std::memory_order_relaxed);
+        size_t kept = 0;
+        for (auto &item : s.list)
+        {
+            if (item.epoch < oldest)
+                ready.push_back(item);
+            else
+                s.list[kept++] = item;
+        }
+        s.list.resize(kept);
+    }
+    // Deleters may retire more objects, so they run without the lock held.
+    for (auto &item : ready)
+    {
+        item.deleter(item.ptr);
+    }
+}
+
+} // namespace fat32
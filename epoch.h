@@ -0,0 +1,48 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+#include <atomic>
+#include <stdint.h>
+
+namespace fat32
+{
+
+// Epoch-based reclamation for data read without locks. A reader holds a
+// guard while it dereferences shared pointers; a writer unlinks an object
+// and retires it, and the object is freed only once every guard that could
+// still see it has been released.
+class epoch
+{
+public:
+    class guard
+    {
+    public:
+        guard();
+        ~guard();
+        guard(const guard &) = delete;
+        guard &operator=(const guard &) = delete;
+    };
+
+    template <typename T>
+    static void retire(T *p)
+    {
+        if (p)
+            retire(p, [](void *p) { delete (T *)p; });
+    }
+    static void retire(void *p, void (*deleter)(void *));
+    // Waits for every guard taken before the call, then frees whatever
+    // became unreachable. Must not be called while holding a guard.
+    static void synchronize();
+
+private:
+    struct record;
+    struct local_state;
+    struct shared_state;
+
+    static local_state &local() noexcept;
+    static shared_state &state();
+    static void reclaim();
+};
+
+} // namespace fat32
+
+#endif
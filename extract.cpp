@@ -0,0 +1,524 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "win_compat.h"
+#include "volume.h"
+
+// Copies files out of a FAT32 image without mounting it. The tree is walked
+// first and every extent of the selected files is gathered; the extents are
+// then read in cluster order, so the image is swept front to back in large
+// requests, while writer threads store the pieces into host files.
+
+namespace fs = std::filesystem;
+
+option long_options[] = {
+    {"include", required_argument, NULL, 'i'},
+    {"exclude", required_argument, NULL, 'x'},
+    {"threads", required_argument, NULL, 'j'},
+    {"verbose", no_argument, NULL, 'v'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_help(char *argv0)
+{
+    printf(
+        "Usage: %s [OPTION]... IMAGE DEST\n"
+        "Copy the files in the FAT32 volume in IMAGE into the host directory DEST.\n"
+        "Arguments:\n"
+        "  -i, --include              only copy paths matching this glob, may be repeated\n"
+        "  -x, --exclude              skip paths matching this glob, may be repeated\n"
+        "  -j, --threads              threads writing host files, default one per core\n"
+        "  -v, --verbose              print every file copied\n"
+        "  -h, --help                 show help messages\n"
+        "Globs are matched against paths like dir/file.txt, ignoring case. '*' and\n"
+        "'?' stay within one name and '**' spans directories. A glob matching a\n"
+        "directory matches everything under it.\n",
+        argv0);
+}
+
+const uint64_t max_read = 16 << 20;
+// gaps between extents up to this many bytes are read through, not skipped
+const uint64_t max_gap = 256 << 10;
+
+std::wstring to_wide(const char *s)
+{
+    std::wstring res(strlen(s), 0);
+    res.resize(MultiByteToWideChar(CP_ACP, 0, s, res.size(), res.data(), res.size()));
+    return res;
+}
+
+std::string to_local(const std::wstring &s)
+{
+    std::string res(s.size() * 4, 0);
+    res.resize(WideCharToMultiByte(CP_ACP, 0, s.data(), s.size(), res.data(), res.size(), NULL, NULL));
+    return res;
+}
+
+wchar_t fold(wchar_t c)
+{
+    return c >= L'a' && c <= L'z' ? c - (L'a' - L'A') : c;
+}
+
+bool glob_match(std::wstring_view pat, std::wstring_view str)
+{
+    while (!pat.empty())
+    {
+        if (pat[0] == L'*')
+        {
+            bool deep = pat.size() > 1 && pat[1] == L'*';
+            auto rest = pat.substr(deep ? 2 : 1);
+            // "**/" also matches no directory at all
+            if (deep && !rest.empty() && rest[0] == L'/' && glob_match(rest.substr(1), str))
+                return true;
+            for (size_t i = 0; i <= str.size(); ++i)
+            {
+                if (glob_match(rest, str.substr(i)))
+                    return true;
+                if (i < str.size() && !deep && str[i] == L'/')
+                    break;
+            }
+            return false;
+        }
+        if (str.empty() || (pat[0] == L'?' ? str[0] == L'/' : fold(pat[0]) != fold(str[0])))
+            return false;
+        pat.remove_prefix(1);
+        str.remove_prefix(1);
+    }
+    return str.empty();
+}
+
+// True if a glob matches path or one of the directories above it.
+bool match_any(const std::vector<std::wstring> &globs, const std::wstring &path)
+{
+    for (auto &g : globs)
+    {
+        for (size_t end = path.find(L'/'); ; end = path.find(L'/', end + 1))
+        {
+            if (glob_match(g, std::wstring_view(path).substr(0, end)))
+                return true;
+            if (end == std::wstring::npos)
+                break;
+        }
+    }
+    return false;
+}
+
+fs::file_time_type to_file_time(uint16_t date, uint16_t time)
+{
+    tm t;
+    memset(&t, 0, sizeof(t));
+    t.tm_year = (date >> 9) + 80;
+    t.tm_mon = ((date >> 5) & 0xf) - 1;
+    t.tm_mday = date & 0x1f;
+    t.tm_hour = time >> 11;
+    t.tm_min = (time >> 5) & 0x3f;
+    t.tm_sec = (time & 0x1f) * 2;
+    t.tm_isdst = -1;
+    auto sys = std::chrono::system_clock::from_time_t(mktime(&t));
+    return fs::file_time_type::clock::now() +
+           std::chrono::duration_cast<fs::file_time_type::duration>(sys - std::chrono::system_clock::now());
+}
+
+struct target
+{
+    std::wstring path; // relative, '/' separated
+    fs::path host;
+    uint32_t size;
+    uint16_t wrt_date;
+    uint16_t wrt_time;
+    uint64_t remaining; // bytes not yet written
+    std::unique_ptr<std::ofstream> out;
+};
+
+struct extent
+{
+    uint32_t clus;
+    uint32_t count;
+    uint32_t file;
+    uint64_t offset; // within the file
+};
+
+// A buffer shared by the pieces cut from one read.
+struct chunk
+{
+    std::vector<char> data;
+};
+
+struct piece
+{
+    std::shared_ptr<chunk> buf;
+    const char *data;
+    uint32_t file;
+    uint64_t offset;
+    uint32_t len;
+};
+
+class extractor
+{
+public:
+    extractor(dev_io::volume &vol, const fs::path &dest, std::vector<std::wstring> includes,
+              std::vector<std::wstring> excludes, unsigned threads, bool verbose)
+        : vol(vol), dest(dest), includes(std::move(includes)), excludes(std::move(excludes)),
+          threads(threads), verbose(verbose), queues(threads)
+    {
+    }
+
+    int run()
+    {
+        fat = vol.read_fat(0, threads);
+        fs::create_directories(dest);
+        walk();
+        for (auto &t : targets)
+        {
+            fs::create_directories(t.host.parent_path());
+            if (!t.size)
+            {
+                std::ofstream(t.host, std::ios::binary | std::ios::trunc);
+                done(t);
+            }
+        }
+        sweep();
+        printf("%zu files (%llu KiB) and %llu directories copied in %llu reads", targets.size(),
+               (unsigned long long)(bytes >> 10), (unsigned long long)dirs, (unsigned long long)reads);
+        if (problems)
+            printf(", %llu damaged entries skipped", (unsigned long long)problems);
+        printf("\n");
+        return problems ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+private:
+    dev_io::volume &vol;
+    fs::path dest;
+    std::vector<std::wstring> includes;
+    std::vector<std::wstring> excludes;
+    unsigned threads;
+    bool verbose;
+    std::vector<uint32_t> fat;
+    std::vector<target> targets;
+    std::vector<extent> extents;
+    uint64_t bytes = 0;
+    uint64_t dirs = 0;
+    uint64_t reads = 0;
+    uint64_t problems = 0;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::deque<piece>> queues;
+    size_t in_flight = 0;
+    bool finished = false;
+    std::exception_ptr error;
+
+    bool selected(const std::wstring &path)
+    {
+        return (includes.empty() || match_any(includes, path)) && !match_any(excludes, path);
+    }
+
+    void damaged(const std::wstring &path, const char *what)
+    {
+        fprintf(stderr, "skipped %s, %s\n", to_local(path).c_str(), what);
+        ++problems;
+    }
+
+    void walk()
+    {
+        struct dir
+        {
+            std::wstring path;
+            uint32_t first;
+        };
+        std::vector<dir> todo{{L"", vol.bpb().BPB_RootClus}};
+        // a directory that links back to one above it would loop forever
+        std::vector<bool> seen(fat.size());
+        auto entries_per_clus = vol.clus_size() / sizeof(fat32::DIR_Entry);
+        while (!todo.empty())
+        {
+            auto d = std::move(todo.back());
+            todo.pop_back();
+            std::vector<uint32_t> chain;
+            if (!dev_io::read_fat_chain(fat, d.first, chain) || seen[d.first])
+            {
+                damaged(d.path.empty() ? L"/" : d.path, "its cluster chain is broken or shared");
+                continue;
+            }
+            seen[d.first] = true;
+            std::vector<fat32::DIR_Entry> entries(chain.size() * entries_per_clus);
+            vol.read_chain(chain, entries.data());
+            for (auto &e : dev_io::parse_dir(entries.data(), entries.size()))
+            {
+                if (e.is_dot() || e.is_label())
+                    continue;
+                auto path = d.path.empty() ? e.name : d.path + L"/" + e.name;
+                if (e.name == L".." || e.name.find_first_of(L"/\\") != std::wstring::npos)
+                {
+                    damaged(path, "its name is not valid");
+                    continue;
+                }
+                if (match_any(excludes, path))
+                    continue;
+                if (e.isdir())
+                {
+                    if (selected(path))
+                    {
+                        fs::create_directories(host_path(path));
+                        ++dirs;
+                    }
+                    todo.push_back(dir{path, e.first_clus()});
+                    continue;
+                }
+                if (selected(path))
+                    add_file(path, e.entry);
+            }
+        }
+    }
+
+    fs::path host_path(const std::wstring &path)
+    {
+#ifdef _WIN32
+        return dest / fs::path(path);
+#else
+        return dest / fs::path(to_local(path));
+#endif
+    }
+
+    void add_file(const std::wstring &path, const fat32::DIR_Entry &entry)
+    {
+        uint32_t size = entry.DIR_FileSize;
+        uint32_t first = ((uint32_t)entry.DIR_FstClusHI << 16) + entry.DIR_FstClusLO;
+        std::vector<uint32_t> chain;
+        if (size && !dev_io::read_fat_chain(fat, first, chain))
+        {
+            damaged(path, "its cluster chain is broken");
+            return;
+        }
+        if ((uint64_t)chain.size() * vol.clus_size() < size)
+        {
+            damaged(path, "its cluster chain is shorter than its size");
+            return;
+        }
+        uint32_t id = targets.size();
+        targets.push_back(target{path, host_path(path), size, entry.DIR_WrtDate, entry.DIR_WrtTime, size, nullptr});
+        bytes += size;
+
+        // one extent per contiguous run, cut so that each fits in one read
+        uint32_t used = (size + vol.clus_size() - 1) / vol.clus_size();
+        uint32_t run_limit = std::max<uint64_t>(1, max_read / vol.clus_size());
+        size_t i = 0;
+        while (i < used)
+        {
+            size_t run = 1;
+            while (i + run < used && chain[i + run] == chain[i] + run && run < run_limit)
+            {
+                ++run;
+            }
+            extents.push_back(extent{chain[i], (uint32_t)run, id, (uint64_t)i * vol.clus_size()});
+            i += run;
+        }
+    }
+
+    void sweep()
+    {
+        std::sort(extents.begin(), extents.end(), [](const extent &a, const extent &b) { return a.clus < b.clus; });
+
+        std::vector<std::thread> writers;
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            writers.emplace_back([this, t] { write_pieces(t); });
+        }
+        try
+        {
+            uint64_t clus_size = vol.clus_size();
+            size_t i = 0;
+            while (i < extents.size())
+            {
+                auto begin = extents[i].clus;
+                auto end = begin + extents[i].count;
+                size_t j = i + 1;
+                while (j < extents.size() && (uint64_t)(extents[j].clus - end) * clus_size <= max_gap &&
+                       (uint64_t)(extents[j].clus + extents[j].count - begin) * clus_size <= max_read)
+                {
+                    end = extents[j].clus + extents[j].count;
+                    ++j;
+                }
+
+                {
+                    // keep the memory held by reads the writers have not finished bounded
+                    std::unique_lock<std::mutex> lk(mtx);
+                    cv.wait(lk, [this] { return in_flight < 2 * threads + 2 || error; });
+                    if (error)
+                        break;
+                    ++in_flight;
+                }
+                auto buf = std::shared_ptr<chunk>(new chunk, [this](chunk *c) {
+                    delete c;
+                    std::lock_guard<std::mutex> lk(mtx);
+                    --in_flight;
+                    cv.notify_all();
+                });
+                buf->data.resize((uint64_t)(end - begin) * clus_size);
+                vol.device().read(vol.clus_offset(begin), buf->data.size(), buf->data.data());
+                ++reads;
+
+                std::lock_guard<std::mutex> lk(mtx);
+                for (; i < j; ++i)
+                {
+                    auto &e = extents[i];
+                    auto len = std::min<uint64_t>((uint64_t)e.count * clus_size, targets[e.file].size - e.offset);
+                    auto data = buf->data.data() + (uint64_t)(e.clus - begin) * clus_size;
+                    queues[e.file % threads].push_back(piece{buf, data, e.file, e.offset, (uint32_t)len});
+                }
+                cv.notify_all();
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (!error)
+                error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            finished = true;
+            cv.notify_all();
+        }
+        for (auto &w : writers)
+            w.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Files are spread over the writers by id, so each file has one writer
+    // and its stream needs no locking.
+    void write_pieces(unsigned t)
+    {
+        try
+        {
+            while (true)
+            {
+                piece p;
+                {
+                    std::unique_lock<std::mutex> lk(mtx);
+                    cv.wait(lk, [&] { return !queues[t].empty() || finished || error; });
+                    if (error || queues[t].empty())
+                        return;
+                    p = std::move(queues[t].front());
+                    queues[t].pop_front();
+                }
+                auto &f = targets[p.file];
+                if (!f.out)
+                {
+                    f.out = std::make_unique<std::ofstream>(f.host, std::ios::binary | std::ios::trunc);
+                    if (!*f.out)
+                        throw std::runtime_error("cannot create " + f.host.string());
+                }
+                f.out->seekp(p.offset);
+                f.out->write(p.data, p.len);
+                if (!*f.out)
+                    throw std::runtime_error("cannot write " + f.host.string());
+                p.buf.reset();
+                f.remaining -= p.len;
+                if (!f.remaining)
+                    done(f);
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (!error)
+                error = std::current_exception();
+            cv.notify_all();
+        }
+    }
+
+    void done(target &t)
+    {
+        t.out.reset();
+        std::error_code ec;
+        fs::last_write_time(t.host, to_file_time(t.wrt_date, t.wrt_time), ec);
+        if (verbose)
+            printf("%s\n", to_local(t.path).c_str());
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    extern char *optarg;
+    extern int optind, opterr, optopt;
+
+    opterr = 0;
+    std::vector<std::wstring> includes;
+    std::vector<std::wstring> excludes;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool verbose = false;
+
+    while (true)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "i:x:j:vh", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 'i':
+            includes.push_back(to_wide(optarg));
+            break;
+
+        case 'x':
+            excludes.push_back(to_wide(optarg));
+            break;
+
+        case 'j':
+            threads = std::max(1, atoi(optarg));
+            break;
+
+        case 'v':
+            verbose = true;
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            fprintf(stderr, "invalid argument %c\n", (char)optopt);
+            print_help(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 2)
+    {
+        fprintf(stderr, "no enough arguments\n");
+        print_help(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    try
+    {
+        dev_io::volume vol(argv[optind]);
+        extractor ex(vol, argv[optind + 1], std::move(includes), std::move(excludes), threads, verbose);
+        return ex.run();
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "extract %s failed, %s\n", argv[optind], e.what());
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,226 @@
+#include <string.h>
+#include <mutex>
+#include "fat32.h"
+
+namespace fat32
+{
+
+wchar_t *name_arena::alloc(size_t len)
+{
+    std::lock_guard<std::mutex> g(mtx);
+    auto cls = size_class(len);
+    if (!free_list[cls].empty())
+    {
+        auto str = free_list[cls].back();
+        free_list[cls].pop_back();
+        return str;
+    }
+    auto size = cls * granule;
+    if (chunk_used + size > chunk_size)
+    {
+        chunks.emplace_back(new wchar_t[chunk_size]);
+        chunk_used = 0;
+    }
+    auto str = chunks.back().get() + chunk_used;
+    chunk_used += size;
+    return str;
+}
+
+void name_arena::free(wchar_t *str, size_t len) noexcept
+{
+    std::lock_guard<std::mutex> g(mtx);
+    free_list[size_class(len)].push_back(str);
+}
+
+pooled_name::pooled_name(name_arena *arena, std::wstring_view name)
+    : arena(arena), str(arena->alloc(name.length())), len(name.length())
+{
+    memcpy(str, name.data(), len * sizeof(wchar_t));
+    str[len] = L'\0';
+}
+
+pooled_name::pooled_name(pooled_name &&other) noexcept
+    : arena(other.arena), str(other.str), len(other.len)
+{
+    other.arena = nullptr;
+    other.str = nullptr;
+    other.len = 0;
+}
+
+pooled_name &pooled_name::operator=(pooled_name &&other) noexcept
+{
+    if (this != &other)
+    {
+        if (str)
+            arena->free(str, len);
+        arena = other.arena;
+        str = other.str;
+        len = other.len;
+        other.arena = nullptr;
+        other.str = nullptr;
+        other.len = 0;
+    }
+    return *this;
+}
+
+pooled_name::~pooled_name()
+{
+    if (str)
+        arena->free(str, len);
+}
+
+child_table::slot_array::slot_array(size_t size) : mask(size - 1), slots(new slot[size])
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        slots[i].hash.store(0, std::memory_order_relaxed);
+        slots[i].node.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+child_table::~child_table()
+{
+    for_each([](file_node *node) { delete node; });
+    delete table.load(std::memory_order_relaxed);
+}
+
+std::wstring_view path_view::back() const noexcept
+{
+    if (parts)
+    {
+        return parts[count - 1];
+    }
+    auto end = str.find_last_not_of(L"\\/");
+    auto begin = str.find_last_of(L"\\/", end);
+    begin = begin == std::wstring_view::npos ? 0 : begin + 1;
+    return str.substr(begin, end + 1 - begin);
+}
+
+path_view path_view::parent() const noexcept
+{
+    path_view res = *this;
+    if (parts)
+    {
+        res.count = count ? count - 1 : 0;
+        return res;
+    }
+    auto end = str.find_last_not_of(L"\\/");
+    if (end == std::wstring_view::npos)
+    {
+        return res;
+    }
+    auto begin = str.find_last_of(L"\\/", end);
+    res.str = str.substr(0, begin == std::wstring_view::npos ? 0 : begin);
+    return res;
+}
+
+file_node *child_table::tombstone() noexcept
+{
+    static char tag;
+    return reinterpret_cast<file_node *>(&tag);
+}
+
+size_t child_table::probe(std::wstring_view name, size_t hash) const noexcept
+{
+    auto t = table.load(std::memory_order_acquire);
+    auto i = hash & t->mask;
+    while (true)
+    {
+        auto node = t->slots[i].node.load(std::memory_order_acquire);
+        if (!node)
+            return i;
+        if (node != tombstone() && t->slots[i].hash.load(std::memory_order_relaxed) == hash && node->name.view() == name)
+            return i;
+        i = (i + 1) & t->mask;
+    }
+}
+
+file_node *child_table::find(std::wstring_view name, size_t hash) const noexcept
+{
+    auto t = table.load(std::memory_order_acquire);
+    if (!t)
+        return nullptr;
+    // Return the node that matched rather than reloading the slot: a writer
+    // may fill or tombstone it between the two loads.
+    auto i = hash & t->mask;
+    while (true)
+    {
+        auto node = t->slots[i].node.load(std::memory_order_acquire);
+        if (!node)
+            return nullptr;
+        if (node != tombstone() && t->slots[i].hash.load(std::memory_order_relaxed) == hash && node->name.view() == name)
+            return node;
+        i = (i + 1) & t->mask;
+    }
+}
+
+void child_table::insert(std::unique_ptr<file_node> node)
+{
+    auto t = table.load(std::memory_order_relaxed);
+    if (!t || (used + 1) * 4 > (t->mask + 1) * 3)
+    {
+        rehash();
+        t = table.load(std::memory_order_relaxed);
+    }
+    auto hash = hash_name(node->name.view());
+    auto i = probe(node->name.view(), hash);
+    auto old = t->slots[i].node.load(std::memory_order_relaxed);
+    if (old)
+    {
+        epoch::retire(old);
+    }
+    else
+    {
+        // a fresh insert never reuses a tombstone, so a probing reader can
+        // only miss a name that was inserted after it started
+        ++count;
+        ++used;
+    }
+    t->slots[i].hash.store(hash, std::memory_order_relaxed);
+    t->slots[i].node.store(node.release(), std::memory_order_release);
+}
+
+std::unique_ptr<file_node> child_table::erase(std::wstring_view name)
+{
+    auto t = table.load(std::memory_order_relaxed);
+    if (!t)
+        return nullptr;
+    auto i = probe(name, hash_name(name));
+    auto node = t->slots[i].node.load(std::memory_order_relaxed);
+    if (!node)
+        return nullptr;
+    --count;
+    t->slots[i].node.store(tombstone(), std::memory_order_release);
+    return std::unique_ptr<file_node>(node);
+}
+
+void child_table::rehash()
+{
+    auto old = table.load(std::memory_order_relaxed);
+    size_t size = 8;
+    while ((count + 1) * 2 > size)
+    {
+        size *= 2;
+    }
+    auto t = new slot_array(size);
+    for (size_t i = 0; old && i <= old->mask; ++i)
+    {
+        auto node = old->slots[i].node.load(std::memory_order_relaxed);
+        if (node && node != tombstone())
+        {
+            auto hash = old->slots[i].hash.load(std::memory_order_relaxed);
+            auto j = hash & t->mask;
+            while (t->slots[j].node.load(std::memory_order_relaxed))
+            {
+                j = (j + 1) & t->mask;
+            }
+            t->slots[j].hash.store(hash, std::memory_order_relaxed);
+            t->slots[j].node.store(node, std::memory_order_relaxed);
+        }
+    }
+    used = count;
+    table.store(t, std::memory_order_release);
+    epoch::retire(old);
+}
+
+} // namespace fat32
@@ -1,14 +1,20 @@
 #ifndef FILE_H
 #define FILE_H
 #include <vector>
+#include <utility>
 #include <string>
+#include <string_view>
+#include <initializer_list>
+#include <iterator>
 #include <atomic>
-#include <map>
+#include <mutex>
+#include <shared_mutex>
 #include <set>
 #include <memory>
 #include <stdexcept>
 #include <stdint.h>
-#include <fileapi.h>
+#include "win_compat.h"
+#include "epoch.h"
 
 namespace fat32
 {
@@ -76,22 +82,32 @@ struct DIR_Entry
 struct LDIR_Entry
 {
     uint8_t LDIR_Ord;
-    wchar_t LDIR_Name1[5];
+    uint16_t LDIR_Name1[5];
     uint8_t LDIR_Attr;
     uint8_t LDIR_Type;
     uint8_t LDIR_Chksum;
-    wchar_t LDIR_Name2[6];
+    uint16_t LDIR_Name2[6];
     uint16_t LDIR_FstClusLO;
-    wchar_t LDIR_Name3[2];
+    uint16_t LDIR_Name3[2];
 } __attribute__((packed));
 
-struct Entry_Info
+struct node_attr
 {
-    wchar_t name[256];
-    char short_name[11];
+    uint64_t size;
+    FILETIME crt_time;
+    FILETIME acc_time;
+    FILETIME wrt_time;
     uint32_t first_clus;
-    BY_HANDLE_FILE_INFORMATION info;
-    bool isdir() const noexcept { return info.dwFileAttributes & 0x10; }
+    uint8_t attr;
+    char short_name[11];
+    bool isdir() const noexcept { return attr & 0x10; }
+};
+
+struct Entry_Info
+{
+    std::wstring name;
+    node_attr attr;
+    bool isdir() const noexcept { return attr.isdir(); }
 };
 
 typedef std::vector<uint32_t> file_alloc;
@@ -100,21 +116,265 @@ typedef std::vector<Entry_Info> dir_info;
 
 typedef std::vector<std::wstring> path;
 
+// FNV-1a over the name with ASCII letters folded to upper case, so names
+// that differ only in case land in the same bucket.
+inline size_t hash_name(std::wstring_view name) noexcept
+{
+    size_t hash = 14695981039346656037ull;
+    for (auto c : name)
+    {
+        if (c >= L'a' && c <= L'z')
+        {
+            c -= L'a' - L'A';
+        }
+        hash = (hash ^ (size_t)c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+struct path_component
+{
+    std::wstring_view name;
+    size_t hash;
+};
+
+// Non-owning view of a path, split into components while it is walked.
+// It either tokenizes a string on '\\' and '/' in place or steps through a
+// fat32::path; nothing is copied or allocated, so the source must outlive
+// the view. A view built from a braced list is only good as a call argument.
+class path_view
+{
+public:
+    class iterator
+    {
+    public:
+        const path_component &operator*() const noexcept { return cur; }
+        const path_component *operator->() const noexcept { return &cur; }
+        iterator &operator++() noexcept
+        {
+            pos = owner->skip(next);
+            load();
+            return *this;
+        }
+        bool operator==(const iterator &other) const noexcept { return pos == other.pos; }
+        bool operator!=(const iterator &other) const noexcept { return pos != other.pos; }
+        // true on the final component
+        bool last() const noexcept { return owner->skip(next) == owner->size(); }
+
+    private:
+        friend class path_view;
+        iterator(const path_view *owner, size_t pos) noexcept : owner(owner), pos(owner->skip(pos)) { load(); }
+        void load() noexcept
+        {
+            if (pos == owner->size())
+            {
+                next = pos;
+                return;
+            }
+            if (owner->parts)
+            {
+                cur.name = owner->parts[pos];
+                next = pos + 1;
+            }
+            else
+            {
+                next = owner->str.find_first_of(L"\\/", pos);
+                if (next > owner->str.size())
+                {
+                    next = owner->str.size();
+                }
+                cur.name = owner->str.substr(pos, next - pos);
+            }
+            cur.hash = hash_name(cur.name);
+        }
+
+        const path_view *owner;
+        size_t pos;
+        size_t next;
+        path_component cur;
+    };
+
+    path_view() noexcept : parts(nullptr), count(0) {}
+    explicit path_view(std::wstring_view str) noexcept : str(str), parts(nullptr), count(0) {}
+    path_view(const path &p) noexcept : parts(p.data()), count(p.size()) {}
+    path_view(std::initializer_list<std::wstring> il) noexcept : parts(std::data(il)), count(il.size()) {}
+
+    iterator begin() const noexcept { return iterator(this, 0); }
+    iterator end() const noexcept { return iterator(this, size()); }
+    bool empty() const noexcept { return begin() == end(); }
+    // Last component; the path must not be empty.
+    std::wstring_view back() const noexcept;
+    // Everything before the last component.
+    path_view parent() const noexcept;
+
+private:
+    size_t size() const noexcept { return parts ? count : str.size(); }
+    size_t skip(size_t pos) const noexcept
+    {
+        if (parts)
+        {
+            return pos;
+        }
+        while (pos < str.size() && (str[pos] == L'\\' || str[pos] == L'/'))
+        {
+            ++pos;
+        }
+        return pos;
+    }
+
+    std::wstring_view str;
+    const std::wstring *parts;
+    size_t count;
+};
+
 struct file_ref
 {
     uint64_t fd;
 };
 
+class name_arena
+{
+public:
+    name_arena() : chunk_used(chunk_size) {}
+    name_arena(const name_arena &) = delete;
+    name_arena &operator=(const name_arena &) = delete;
+
+    wchar_t *alloc(size_t len);
+    void free(wchar_t *str, size_t len) noexcept;
+
+private:
+    static constexpr size_t chunk_size = 16384;
+    static constexpr size_t granule = 8;
+    static size_t size_class(size_t len) noexcept { return (len + granule) / granule; }
+
+    std::mutex mtx;
+    std::vector<std::unique_ptr<wchar_t[]>> chunks;
+    size_t chunk_used;
+    std::vector<wchar_t *> free_list[256 / granule + 1];
+};
+
+class pooled_name
+{
+public:
+    pooled_name() noexcept : arena(nullptr), str(nullptr), len(0) {}
+    pooled_name(name_arena *arena, std::wstring_view name);
+    pooled_name(pooled_name &&other) noexcept;
+    pooled_name &operator=(pooled_name &&other) noexcept;
+    pooled_name(const pooled_name &) = delete;
+    pooled_name &operator=(const pooled_name &) = delete;
+    ~pooled_name();
+
+    std::wstring_view view() const noexcept { return std::wstring_view(c_str(), len); }
+    const wchar_t *c_str() const noexcept { return str ? str : L""; }
+
+private:
+    name_arena *arena;
+    wchar_t *str;
+    uint32_t len;
+};
+
+struct file_node;
+
+// Open-addressing table of a directory's loaded children. Writers are
+// serialized by the caller; find() takes no lock and may run concurrently
+// with them inside an epoch::guard. Erased slots become tombstones and a
+// rehash publishes a new slot array, retiring the old one, so a reader
+// never sees an entry move. Erased nodes must be retired, not deleted.
+class child_table
+{
+public:
+    child_table() noexcept : table(nullptr), count(0), used(0) {}
+    child_table(const child_table &) = delete;
+    child_table &operator=(const child_table &) = delete;
+    ~child_table();
+
+    file_node *find(std::wstring_view name) const noexcept { return find(name, hash_name(name)); }
+    file_node *find(std::wstring_view name, size_t hash) const noexcept;
+    void insert(std::unique_ptr<file_node> node);
+    std::unique_ptr<file_node> erase(std::wstring_view name);
+    bool empty() const noexcept { return count == 0; }
+    size_t size() const noexcept { return count; }
+    template <typename F>
+    void for_each(F &&f) const
+    {
+        auto t = table.load(std::memory_order_acquire);
+        for (size_t i = 0; t && i <= t->mask; ++i)
+        {
+            auto node = t->slots[i].node.load(std::memory_order_acquire);
+            if (node && node != tombstone())
+                f(node);
+        }
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<size_t> hash;
+        std::atomic<file_node *> node;
+    };
+    struct slot_array
+    {
+        explicit slot_array(size_t size);
+        size_t mask;
+        std::unique_ptr<slot[]> slots;
+    };
+    static file_node *tombstone() noexcept;
+    size_t probe(std::wstring_view name, size_t hash) const noexcept;
+    void rehash();
+
+    std::atomic<slot_array *> table;
+    size_t count;
+    size_t used;
+};
+
+struct dir_record
+{
+    uint32_t index;
+    uint32_t len;
+    pooled_name name;
+    node_attr attr;
+};
+
+typedef std::vector<dir_record> dir_cache;
+
+struct dir_data
+{
+    dir_data() : deleted_count(0), cache_valid(false) {}
+    std::vector<DIR_Entry> entries;
+    std::vector<bool> dirty;
+    size_t deleted_count;
+    dir_cache cache;
+    bool cache_valid;
+    child_table children;
+    std::shared_mutex mtx;
+};
+
 struct file_node
 {
-    file_node(file_node *parent) : parent(parent), ref_count(0) {}
+    // Set in ref_count once the node is unlinked; try_pin() then fails.
+    static constexpr uint64_t dead = 1ull << 63;
+    file_node(file_node *parent) : parent(parent), ref_count(0), io_count(0), delete_on_close(false) {}
+    bool isdir() const noexcept { return dir != nullptr; }
+    bool try_pin() noexcept
+    {
+        auto ref = ref_count.load(std::memory_order_relaxed);
+        do
+        {
+            if (ref & dead)
+                return false;
+        } while (!ref_count.compare_exchange_weak(ref, ref + 1, std::memory_order_acquire, std::memory_order_relaxed));
+        return true;
+    }
     file_alloc alloc;
-    Entry_Info info;
-    std::vector<DIR_Entry> entries;
+    pooled_name name;
+    node_attr attr;
+    std::unique_ptr<dir_data> dir;
     file_node *parent;
-    std::map<std::wstring, std::unique_ptr<file_node>> children;
     std::atomic<uint64_t> ref_count;
-    bool delete_on_close;
+    // Asynchronous transfers still using the clusters in alloc.
+    std::atomic<uint32_t> io_count;
+    std::atomic<bool> delete_on_close;
+    std::shared_mutex mtx;
 };
 
 class file_error : public std::runtime_error
@@ -126,6 +386,11 @@ public:
         FILE_NOT_DIR,
         FILE_ALREADY_EXISTS,
         INVALID_FILE_DISCRIPTOR,
+        TOO_MANY_OPEN_FILES,
+        DIR_NOT_EMPTY,
+        DISK_FULL,
+        FILE_IS_DIR,
+        INVALID_ARGUMENT,
     };
     file_error(error_t err) noexcept : std::runtime_error(err_msg(err)), err(err) {}
     error_t get_error_type() const noexcept { return err; }
@@ -139,6 +404,11 @@ private:
                 "file not dir",
                 "file already exists",
                 "invalid file discriptor",
+                "too many open files",
+                "directory not empty",
+                "disk full",
+                "file is dir",
+                "invalid argument",
             };
         return msg_table[static_cast<int>(err)];
     }
@@ -146,6 +416,57 @@ private:
     error_t err;
 };
 
+// Value or file_error code, returned by the try_ calls on hot paths so an
+// expected miss costs no more than a hit. value() throws what the throwing
+// call would have thrown.
+template <typename T>
+class result
+{
+public:
+    result(const T &val) : val(val), err(), ok(true) {}
+    result(T &&val) noexcept : val(std::move(val)), err(), ok(true) {}
+    result(file_error::error_t err) noexcept : val(), err(err), ok(false) {}
+    explicit operator bool() const noexcept { return ok; }
+    file_error::error_t error() const noexcept { return err; }
+    T value() const
+    {
+        if (!ok)
+        {
+            throw file_error(err);
+        }
+        return val;
+    }
+    const T &operator*() const noexcept { return val; }
+
+private:
+    T val;
+    file_error::error_t err;
+    bool ok;
+};
+
+template <>
+class result<void>
+{
+public:
+    result() noexcept : err(), ok(true) {}
+    result(file_error::error_t err) noexcept : err(err), ok(false) {}
+    explicit operator bool() const noexcept { return ok; }
+    file_error::error_t error() const noexcept { return err; }
+    void value() const
+    {
+        if (!ok)
+        {
+            throw file_error(err);
+        }
+    }
+
+private:
+    file_error::error_t err;
+    bool ok;
+};
+
+typedef result<void> status;
+
 } // namespace fat32
 
 #endif
\ No newline at end of file
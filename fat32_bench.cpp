@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "dev_io.h"
+
+// Benchmark suite for dev_t on a RAM and a file image: data throughput per
+// cluster size, metadata rates, directory listing, path lookup and mount
+// time. Prints one JSON object so runs can be compared across commits.
+
+typedef std::chrono::steady_clock bench_clock;
+
+option long_options[] = {
+    {"backend", required_argument, NULL, 'b'},
+    {"file", required_argument, NULL, 'f'},
+    {"seq-size", required_argument, NULL, 's'},
+    {"random", required_argument, NULL, 'r'},
+    {"files", required_argument, NULL, 'n'},
+    {"max-dir", required_argument, NULL, 'd'},
+    {"depth", required_argument, NULL, 'D'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_help(char *argv0)
+{
+    printf(
+        "Usage: %s [OPTION]...\n"
+        "Run the dev_t benchmark suite and print the results as JSON.\n"
+        "Arguments:\n"
+        "  -b, --backend              ram, file or all, default all\n"
+        "  -f, --file                 scratch image for the file backend,\n"
+        "                             default fat32_bench.img, removed afterwards\n"
+        "  -s, --seq-size             sequential file size in MiB, default 16\n"
+        "  -r, --random               random 4K reads and writes, default 2000\n"
+        "  -n, --files                files created, stated and deleted, default 10000\n"
+        "  -d, --max-dir              largest directory listed out of 1000, 10000\n"
+        "                             and 100000 entries, default 100000\n"
+        "  -D, --depth                directories above the deep lookup, default 32\n"
+        "  -h, --help                 show help messages\n",
+        argv0);
+}
+
+struct config
+{
+    uint64_t seq_size = 16ull << 20;
+    uint32_t random_ops = 2000;
+    uint32_t files = 10000;
+    uint32_t max_dir = 100000;
+    uint32_t depth = 32;
+};
+
+// Forwards to an image the bench keeps, so the image outlives the dev_t
+// that formatted it and can be mounted again.
+class shared_dev : public dev_io::blk_dev
+{
+public:
+    explicit shared_dev(std::shared_ptr<dev_io::blk_dev> dev) : dev(std::move(dev)) {}
+    int32_t read(uint64_t offset, uint32_t size, void *buf) override
+    {
+        return dev->read(offset, size, buf);
+    }
+    int32_t write(uint64_t offset, uint32_t size, const void *buf) override
+    {
+        return dev->write(offset, size, buf);
+    }
+    void read_async(uint64_t offset, uint32_t size, void *buf, dev_io::io_done done) override
+    {
+        dev->read_async(offset, size, buf, std::move(done));
+    }
+    void write_async(uint64_t offset, uint32_t size, const void *buf, dev_io::io_done done) override
+    {
+        dev->write_async(offset, size, buf, std::move(done));
+    }
+    uint32_t align() const override
+    {
+        return dev->align();
+    }
+
+private:
+    std::shared_ptr<dev_io::blk_dev> dev;
+};
+
+struct backend
+{
+    const char *name;
+    const char *path; // null for RAM
+
+    std::shared_ptr<dev_io::blk_dev> create(uint64_t size) const
+    {
+        if (!path)
+            return std::make_shared<dev_io::ram_dev>(size);
+        ::remove(path);
+        return std::make_shared<dev_io::file_dev>(path, size);
+    }
+
+    void release() const
+    {
+        if (path)
+            ::remove(path);
+    }
+};
+
+std::string strf(const char *fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return buf;
+}
+
+double since(bench_clock::time_point begin)
+{
+    return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+std::unique_ptr<dev_io::dev_t> mount(const std::shared_ptr<dev_io::blk_dev> &img, double &secs)
+{
+    auto begin = bench_clock::now();
+    auto dev = std::make_unique<dev_io::dev_t>(std::make_unique<shared_dev>(img));
+    secs = since(begin);
+    return dev;
+}
+
+void unmount(std::unique_ptr<dev_io::dev_t> &dev, double &secs)
+{
+    auto begin = bench_clock::now();
+    dev.reset();
+    secs = since(begin);
+}
+
+// Names stay within 8.3 so short name generation never probes ~N tails,
+// which rescans the directory per probe and would dominate large listings.
+std::wstring entry_name(const wchar_t *prefix, uint32_t i)
+{
+    return prefix + std::to_wstring(i);
+}
+
+// Sequential and random I/O on one file, on 512-byte sectors with the given
+// cluster size.
+std::string bench_data(const backend &b, const config &cfg, uint32_t clus_size)
+{
+    const uint16_t block_size = 512;
+    const uint32_t chunk = 1 << 20;
+    const uint32_t io_size = 4096;
+    // FAT32 needs at least 65525 clusters
+    uint32_t tot_block = std::max<uint64_t>(67000ull * (clus_size / block_size),
+                                            (cfg.seq_size * 2 + (32ull << 20)) / block_size);
+    auto img = b.create((uint64_t)tot_block * block_size);
+    dev_io::format_options opts;
+    opts.clus_size = clus_size;
+    dev_io::dev_t dev(std::make_unique<shared_dev>(img), tot_block, block_size, opts);
+    fat32::BPB_t BPB;
+    img->read(0, sizeof(BPB), &BPB);
+
+    bool exist;
+    bool isdir;
+    std::vector<char> buf(chunk, 'x');
+    auto fd = dev.open({L"seq"}, CREATE_NEW, 0x20, exist, isdir);
+    auto begin = bench_clock::now();
+    for (uint64_t off = 0; off < cfg.seq_size; off += chunk)
+        dev.write(fd, off, std::min<uint64_t>(chunk, cfg.seq_size - off), buf.data());
+    dev.close(fd);
+    double seq_write = since(begin);
+
+    fd = dev.open({L"seq"}, OPEN_EXISTING, 0, exist, isdir);
+    begin = bench_clock::now();
+    for (uint64_t off = 0; off < cfg.seq_size; off += chunk)
+        dev.read(fd, off, std::min<uint64_t>(chunk, cfg.seq_size - off), buf.data());
+    double seq_read = since(begin);
+
+    std::mt19937_64 rng(clus_size);
+    uint64_t slots = std::max<uint64_t>(1, cfg.seq_size / io_size);
+    begin = bench_clock::now();
+    for (uint32_t i = 0; i < cfg.random_ops; ++i)
+        dev.read(fd, rng() % slots * io_size, io_size, buf.data());
+    double rand_read = since(begin);
+    begin = bench_clock::now();
+    for (uint32_t i = 0; i < cfg.random_ops; ++i)
+        dev.write(fd, rng() % slots * io_size, io_size, buf.data());
+    double rand_write = since(begin);
+    dev.close(fd);
+
+    double mib = cfg.seq_size / 1048576.0;
+    return strf("{\"block_size\":%u,\"cluster_size\":%u,\"seq_write_mib_s\":%.1f,\"seq_read_mib_s\":%.1f,"
+                "\"rand_read_iops\":%.0f,\"rand_write_iops\":%.0f}",
+                block_size, (uint32_t)BPB.BPB_BytsPerSec * BPB.BPB_SecPerClus, mib / seq_write, mib / seq_read,
+                cfg.random_ops / rand_read, cfg.random_ops / rand_write);
+}
+
+std::string bench_metadata(dev_io::dev_t &dev, const config &cfg)
+{
+    bool exist;
+    bool isdir;
+    BY_HANDLE_FILE_INFORMATION info;
+    // a directory without open handles is written back and dropped when its
+    // last child closes; keep it loaded to measure the per-file cost
+    auto dir = dev.open({L"meta"}, CREATE_NEW, 0x10, exist, isdir);
+
+    auto begin = bench_clock::now();
+    for (uint32_t i = 0; i < cfg.files; ++i)
+        dev.close(dev.open({L"meta", entry_name(L"f", i)}, CREATE_NEW, 0x20, exist, isdir));
+    double create = since(begin);
+
+    begin = bench_clock::now();
+    for (uint32_t i = 0; i < cfg.files; ++i)
+    {
+        auto fd = dev.open({L"meta", entry_name(L"f", i)}, OPEN_EXISTING, 0, exist, isdir);
+        dev.fstat(fd, &info);
+        dev.close(fd);
+    }
+    double stat = since(begin);
+
+    begin = bench_clock::now();
+    for (uint32_t i = 0; i < cfg.files; ++i)
+    {
+        auto fd = dev.open({L"meta", entry_name(L"f", i)}, OPEN_EXISTING, 0, exist, isdir);
+        dev.unlink(fd);
+        dev.close(fd);
+    }
+    double del = since(begin);
+    dev.close(dir);
+
+    return strf("{\"files\":%u,\"create_per_s\":%.0f,\"stat_per_s\":%.0f,\"delete_per_s\":%.0f}", cfg.files,
+                cfg.files / create, cfg.files / stat, cfg.files / del);
+}
+
+fat32::path deep_path(uint32_t depth)
+{
+    fat32::path path;
+    for (uint32_t i = 0; i < depth; ++i)
+        path.push_back(entry_name(L"level", i));
+    path.push_back(L"leaf");
+    return path;
+}
+
+void make_deep(dev_io::dev_t &dev, uint32_t depth)
+{
+    bool exist;
+    bool isdir;
+    auto path = deep_path(depth);
+    fat32::path prefix;
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        prefix.push_back(path[i]);
+        dev.close(dev.open(prefix, CREATE_NEW, i + 1 < path.size() ? 0x10 : 0x20, exist, isdir));
+    }
+}
+
+// Seconds per call, repeating fn for at least min_secs.
+template <typename F>
+double repeat(F fn, double min_secs)
+{
+    uint64_t calls = 0;
+    auto begin = bench_clock::now();
+    double secs;
+    do
+    {
+        fn();
+        ++calls;
+    } while ((secs = since(begin)) < min_secs);
+    return secs / calls;
+}
+
+void make_listing(dev_io::dev_t &dev, uint32_t entries)
+{
+    bool exist;
+    bool isdir;
+    auto dir = entry_name(L"d", entries);
+    dev.close(dev.open({dir}, CREATE_NEW, 0x10, exist, isdir));
+    std::vector<dev_io::batch_op> ops;
+    for (uint32_t i = 0; i < entries; i += 1024)
+    {
+        ops.clear();
+        for (uint32_t k = i; k < entries && k < i + 1024; ++k)
+            ops.push_back(dev_io::batch_op{dev_io::batch_op::CREATE, {dir, entry_name(L"e", k)}, 0x20, 0, 0, nullptr, {}, false});
+        for (auto &e : dev.run_batch(ops))
+        {
+            if (e)
+                std::rethrow_exception(e);
+        }
+    }
+}
+
+size_t list(dev_io::dev_t &dev, uint64_t fd, uint32_t entries)
+{
+    auto count = dev.opendir(fd).size();
+    // . and ..
+    if (count != (size_t)entries + 2)
+        throw std::runtime_error(strf("listed %zu entries of %u", count, entries));
+    return count;
+}
+
+// Metadata, lookup, listing and mount on one image, so the last mount sees
+// every directory the other phases left behind.
+std::string bench_volume(const backend &b, const config &cfg)
+{
+    const uint32_t block_size = 512;
+    const double min_secs = 0.2;
+    std::vector<uint32_t> sizes;
+    for (uint32_t n : {1000, 10000, 100000})
+    {
+        if (n <= cfg.max_dir)
+            sizes.push_back(n);
+    }
+    uint64_t dir_bytes = 0;
+    for (auto n : sizes)
+        dir_bytes += n * 128ull;
+    uint32_t tot_block = std::max<uint64_t>(67000, (dir_bytes + cfg.files * 128ull + (64ull << 20)) / block_size);
+    auto img = b.create((uint64_t)tot_block * block_size);
+
+    auto begin = bench_clock::now();
+    auto dev = std::make_unique<dev_io::dev_t>(std::make_unique<shared_dev>(img), tot_block, block_size);
+    double format = since(begin);
+    double empty_unmount, empty_mount;
+    unmount(dev, empty_unmount);
+    dev = mount(img, empty_mount);
+
+    auto metadata = bench_metadata(*dev, cfg);
+
+    bool exist;
+    bool isdir;
+    auto path = deep_path(cfg.depth);
+    make_deep(*dev, cfg.depth);
+    // closing the leaf unloads the whole chain, so every open reads it back
+    double reload_lookup = repeat([&] { dev->close(dev->open(path, OPEN_EXISTING, 0, exist, isdir)); }, min_secs);
+    auto pin = dev->open(path, OPEN_EXISTING, 0, exist, isdir);
+    double resident_lookup = repeat([&] { dev->close(dev->open(path, OPEN_EXISTING, 0, exist, isdir)); }, min_secs);
+    dev->close(pin);
+
+    std::vector<double> populate, warm;
+    for (auto n : sizes)
+    {
+        begin = bench_clock::now();
+        make_listing(*dev, n);
+        populate.push_back(since(begin));
+        auto fd = dev->open({entry_name(L"d", n)}, OPEN_EXISTING, 0, exist, isdir);
+        warm.push_back(repeat([&] { list(*dev, fd, n); }, min_secs));
+        dev->close(fd);
+    }
+
+    double full_unmount, full_mount;
+    unmount(dev, full_unmount);
+    dev = mount(img, full_mount);
+    std::string lists;
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        begin = bench_clock::now();
+        auto fd = dev->open({entry_name(L"d", sizes[i])}, OPEN_EXISTING, 0, exist, isdir);
+        list(*dev, fd, sizes[i]);
+        dev->close(fd);
+        double cold = since(begin);
+        lists += strf("%s{\"entries\":%u,\"create_per_s\":%.0f,\"cold_ms\":%.3f,\"warm_ms\":%.3f}", i ? "," : "",
+                      sizes[i], sizes[i] / populate[i], cold * 1e3, warm[i] * 1e3);
+    }
+    begin = bench_clock::now();
+    dev->close(dev->open(path, OPEN_EXISTING, 0, exist, isdir));
+    double cold_lookup = since(begin);
+    dev.reset();
+
+    return strf("\"metadata\":%s,\"listing\":[", metadata.c_str()) + lists +
+           strf("],\"lookup\":{\"depth\":%u,\"cold_us\":%.1f,\"reload_us\":%.1f,\"resident_ns\":%.0f},"
+                "\"mount\":{\"format_ms\":%.3f,\"empty_mount_ms\":%.3f,\"empty_unmount_ms\":%.3f,"
+                "\"full_mount_ms\":%.3f,\"full_unmount_ms\":%.3f}",
+                cfg.depth, cold_lookup * 1e6, reload_lookup * 1e6, resident_lookup * 1e9, format * 1e3,
+                empty_mount * 1e3, empty_unmount * 1e3, full_mount * 1e3, full_unmount * 1e3);
+}
+
+std::string run(const backend &b, const config &cfg)
+{
+    std::string data;
+    for (uint32_t clus_size : {512, 1024, 2048, 4096})
+    {
+        data += data.empty() ? "" : ",";
+        data += bench_data(b, cfg, clus_size);
+        b.release();
+    }
+    auto volume = bench_volume(b, cfg);
+    b.release();
+    return strf("\"%s\":{\"data\":[", b.name) + data + "]," + volume + "}";
+}
+
+int main(int argc, char *argv[])
+{
+    extern char *optarg;
+    extern int opterr, optopt;
+
+    opterr = 0;
+    config cfg;
+    const char *which = "all";
+    const char *image = "fat32_bench.img";
+
+    while (true)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "b:f:s:r:n:d:D:h", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 'b':
+            which = optarg;
+            break;
+
+        case 'f':
+            image = optarg;
+            break;
+
+        case 's':
+            cfg.seq_size = strtoull(optarg, NULL, 10) << 20;
+            break;
+
+        case 'r':
+            cfg.random_ops = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'n':
+            cfg.files = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'd':
+            cfg.max_dir = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'D':
+            cfg.depth = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            fprintf(stderr, "invalid argument %c\n", (char)optopt);
+            print_help(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (strcmp(which, "all") && strcmp(which, "ram") && strcmp(which, "file"))
+    {
+        fprintf(stderr, "%s is not a valid backend\n", which);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg.seq_size == 0 || cfg.seq_size > (1ull << 30))
+    {
+        fprintf(stderr, "sequential size must be between 1 and 1024 MiB\n");
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<backend> backends;
+    if (strcmp(which, "file"))
+        backends.push_back({"ram", nullptr});
+    if (strcmp(which, "ram"))
+        backends.push_back({"file", image});
+
+    std::string out = strf("{\"config\":{\"seq_mib\":%llu,\"random_ops\":%u,\"files\":%u,\"max_dir\":%u,\"depth\":%u}",
+                           (unsigned long long)(cfg.seq_size >> 20), cfg.random_ops, cfg.files, cfg.max_dir, cfg.depth);
+    for (const auto &b : backends)
+    {
+        try
+        {
+            out += "," + run(b, cfg);
+        }
+        catch (std::exception &e)
+        {
+            b.release();
+            fprintf(stderr, "%s backend failed, %s\n", b.name, e.what());
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("%s}\n", out.c_str());
+    return 0;
+}
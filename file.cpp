@@ -1,11 +1,17 @@
 #include <numeric>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <thread>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
-#include <timezoneapi.h>
-#include <sysinfoapi.h>
+#include "win_compat.h"
 #include "dev_io.h"
+#include "dir_scan.h"
 #include "dokan_log.h"
+#include "stats.h"
 
 static const char this_folder[] = {0x2e, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20};
 static const char parent_folder[] = {0x2e, 0x2e, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20};
@@ -26,6 +32,67 @@ unsigned char ChkSum(unsigned char *pFcbName)
     return (Sum);
 }
 
+static void stamp_write(fat32::node_attr &attr)
+{
+    SYSTEMTIME time;
+    GetSystemTime(&time);
+    time.wMilliseconds = 0;
+    time.wSecond &= 0xfffffffe;
+    SystemTimeToFileTime(&time, &attr.wrt_time);
+    time.wHour = 0;
+    time.wMinute = 0;
+    time.wSecond = 0;
+    SystemTimeToFileTime(&time, &attr.acc_time);
+}
+
+// Long names are stored as UTF-16; wchar_t is UTF-32 outside Windows.
+size_t utf16_len(std::wstring_view name)
+{
+    size_t len = 0;
+    for (auto c : name)
+    {
+        len += (uint32_t)c > 0xffff ? 2 : 1;
+    }
+    return len;
+}
+
+size_t utf16_encode(std::wstring_view name, uint16_t *out)
+{
+    size_t len = 0;
+    for (auto c : name)
+    {
+        uint32_t code = c;
+        if (code > 0xffff)
+        {
+            code -= 0x10000;
+            out[len++] = 0xd800 + (code >> 10);
+            out[len++] = 0xdc00 + (code & 0x3ff);
+        }
+        else
+        {
+            out[len++] = code;
+        }
+    }
+    return len;
+}
+
+size_t utf16_decode(const uint16_t *in, size_t len, wchar_t *out)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        uint32_t code = in[i];
+        if (sizeof(wchar_t) == 4 && code >= 0xd800 && code < 0xdc00 &&
+            i + 1 < len && in[i + 1] >= 0xdc00 && in[i + 1] < 0xe000)
+        {
+            code = 0x10000 + ((code - 0xd800) << 10) + (in[++i] - 0xdc00);
+        }
+        out[count++] = code;
+    }
+    out[count] = 0;
+    return count;
+}
+
 DWORD FatAttr2FileAttr(uint8_t attr)
 {
     DWORD res = 0;
@@ -33,58 +100,56 @@ DWORD FatAttr2FileAttr(uint8_t attr)
     return res;
 }
 
-void EntryInfo2DirEntry(fat32::Entry_Info *pinfo, fat32::DIR_Entry *pentry, int have_long)
+void Attr2DirEntry(std::wstring_view name, const fat32::node_attr *pattr, fat32::DIR_Entry *pentry, int have_long)
 {
     if (have_long)
     {
         size_t index = 0;
-        auto name_len = wcslen(pinfo->name);
+        uint16_t name_buf[260];
+        auto name_len = utf16_encode(name, name_buf);
         auto len = (name_len + 13 - 1) / 13;
-        auto padding_len = (len * 13 < 256 ? len * 13 : 256) - name_len;
-        if (padding_len > 1)
+        name_buf[name_len] = 0;
+        if (len * 13 > name_len + 1)
         {
-            memset(pinfo->name + name_len + 1, 0xff, (padding_len - 1) * sizeof(wchar_t));
+            memset(name_buf + name_len + 1, 0xff, (len * 13 - name_len - 1) * sizeof(uint16_t));
         }
         auto ldir = (fat32::LDIR_Entry *)pentry;
         pentry += len;
-        auto chksum = ChkSum((unsigned char *)pinfo->short_name);
+        auto chksum = ChkSum((unsigned char *)pattr->short_name);
         memset(ldir, 0xff, len * sizeof(fat32::LDIR_Entry));
         for (size_t i = 0; i < len; ++i)
         {
             ldir[len - i - 1].LDIR_Ord = i + 1;
-            memcpy(ldir[len - i - 1].LDIR_Name1, pinfo->name + index, sizeof(ldir[len - i - 1].LDIR_Name1));
+            memcpy(ldir[len - i - 1].LDIR_Name1, name_buf + index, sizeof(ldir[len - i - 1].LDIR_Name1));
             ldir[len - i - 1].LDIR_Attr = 0xf;
             ldir[len - i - 1].LDIR_Type = 0;
             ldir[len - i - 1].LDIR_Chksum = chksum;
-            memcpy(ldir[len - i - 1].LDIR_Name2, pinfo->name + index + 5, sizeof(ldir[len - i - 1].LDIR_Name2));
+            memcpy(ldir[len - i - 1].LDIR_Name2, name_buf + index + 5, sizeof(ldir[len - i - 1].LDIR_Name2));
             ldir[len - i - 1].LDIR_FstClusLO = 0;
-            memcpy(ldir[len - i - 1].LDIR_Name3, pinfo->name + index + 11, sizeof(ldir[len - i - 1].LDIR_Name3));
+            memcpy(ldir[len - i - 1].LDIR_Name3, name_buf + index + 11, sizeof(ldir[len - i - 1].LDIR_Name3));
             index += 13;
         }
         ldir[0].LDIR_Ord |= 0x40;
     }
-    memcpy(pentry->DIR_Name, pinfo->short_name, sizeof(pinfo->short_name));
-    pentry->DIR_Attr = (pinfo->info.dwFileAttributes & 0x37);
-    pentry->DIR_FstClusHI = ((pinfo->first_clus >> 16) & 0xffff);
-    pentry->DIR_FstClusLO = (pinfo->first_clus & 0xffff);
-    ULARGE_INTEGER int_tmp;
-    int_tmp.HighPart = pinfo->info.nFileSizeHigh;
-    int_tmp.LowPart = pinfo->info.nFileSizeLow;
-    pentry->DIR_FileSize = int_tmp.QuadPart;
+    memcpy(pentry->DIR_Name, pattr->short_name, sizeof(pattr->short_name));
+    pentry->DIR_Attr = (pattr->attr & 0x37);
+    pentry->DIR_FstClusHI = ((pattr->first_clus >> 16) & 0xffff);
+    pentry->DIR_FstClusLO = (pattr->first_clus & 0xffff);
+    pentry->DIR_FileSize = pattr->size;
     SYSTEMTIME systime;
     FILETIME filetime;
-    FileTimeToLocalFileTime(&pinfo->info.ftCreationTime, &filetime);
+    FileTimeToLocalFileTime(&pattr->crt_time, &filetime);
     FileTimeToSystemTime(&filetime, &systime);
-    pentry->DIR_CrtDate = ((systime.wYear - 1980) << 9) + (systime.wMonth << 5) + systime.wDay;
+    pentry->DIR_CrtDate = ((uint16_t)(systime.wYear - 1980) << 9) + (systime.wMonth << 5) + systime.wDay;
     pentry->DIR_CrtTime = (systime.wHour << 11) + (systime.wMinute << 5) + (systime.wSecond / 2);
     pentry->DIR_CrtTimeTenth = (systime.wSecond % 2) * 100 + systime.wMilliseconds / 10;
-    FileTimeToLocalFileTime(&pinfo->info.ftLastWriteTime, &filetime);
+    FileTimeToLocalFileTime(&pattr->wrt_time, &filetime);
     FileTimeToSystemTime(&filetime, &systime);
-    pentry->DIR_WrtDate = ((systime.wYear - 1980) << 9) + (systime.wMonth << 5) + systime.wDay;
+    pentry->DIR_WrtDate = ((uint16_t)(systime.wYear - 1980) << 9) + (systime.wMonth << 5) + systime.wDay;
     pentry->DIR_WrtTime = (systime.wHour << 11) + (systime.wMinute << 5) + (systime.wSecond / 2);
-    FileTimeToLocalFileTime(&pinfo->info.ftLastAccessTime, &filetime);
+    FileTimeToLocalFileTime(&pattr->acc_time, &filetime);
     FileTimeToSystemTime(&filetime, &systime);
-    pentry->DIR_LstAccDate = ((systime.wYear - 1980) << 9) + (systime.wMonth << 5) + systime.wDay;
+    pentry->DIR_LstAccDate = ((uint16_t)(systime.wYear - 1980) << 9) + (systime.wMonth << 5) + systime.wDay;
 }
 
 void dev_t::gen_short(std::wstring_view name, fat32::file_node *node, char *short_name)
@@ -107,7 +172,7 @@ void dev_t::gen_short(std::wstring_view name, fat32::file_node *node, char *shor
                 }
                 else
                 {
-                    *(wchar_t *)(ext_part + index) = name[i];
+                    *(uint16_t *)(ext_part + index) = name[i];
                     index += 2;
                 }
             }
@@ -136,6 +201,8 @@ void dev_t::gen_short(std::wstring_view name, fat32::file_node *node, char *shor
     }
     int dup = len > 8;
     bool ok;
+    // loaded children may not have their entries written back yet
+    load_cache(node);
     do
     {
         ok = true;
@@ -160,7 +227,7 @@ void dev_t::gen_short(std::wstring_view name, fat32::file_node *node, char *shor
                     }
                     else
                     {
-                        *(wchar_t *)(main_part + index) = name[i];
+                        *(uint16_t *)(main_part + index) = name[i];
                         index += 2;
                     }
                 }
@@ -193,7 +260,7 @@ void dev_t::gen_short(std::wstring_view name, fat32::file_node *node, char *shor
             {
                 if (name[i] >= 256)
                 {
-                    *(wchar_t *)(main_part + index) = name[i];
+                    *(uint16_t *)(main_part + index) = name[i];
                     index += 2;
                 }
                 else
@@ -203,259 +270,331 @@ void dev_t::gen_short(std::wstring_view name, fat32::file_node *node, char *shor
                 }
             }
         }
-        fat32::Entry_Info info;
-        int ret;
-        size_t entry_index = 0;
-        auto dir_entries = opendir((uint64_t)node);
-        for (const auto &e: dir_entries)
+        for (const auto &e : node->dir->cache)
         {
-            if (memcmp(name_tmp, e.short_name, sizeof(name_tmp)) == 0 && name != e.name)
+            if (memcmp(name_tmp, e.attr.short_name, sizeof(name_tmp)) == 0 && name != e.name.view())
             {
                 ++dup;
                 ok = false;
                 break;
             }
         }
+        node->dir->children.for_each([&](fat32::file_node *child) {
+            if (ok && memcmp(name_tmp, child->attr.short_name, sizeof(name_tmp)) == 0 && name != child->name.view())
+            {
+                ++dup;
+                ok = false;
+            }
+        });
     } while (!ok);
     memcpy(short_name, name_tmp, sizeof(name_tmp));
 }
 
-uint64_t dev_t::open(const fat32::path &path, uint32_t create_disposition, uint32_t file_attr, bool &exist, bool &isdir)
+uint64_t dev_t::open(const fat32::path_view &path, uint32_t create_disposition, uint32_t file_attr, bool &exist, bool &isdir)
 {
-    cleared = false;
-    if (path.empty())
+    return try_open(path, create_disposition, file_attr, exist, isdir).value();
+}
+
+fat32::result<uint64_t> dev_t::try_open(const fat32::path_view &path, uint32_t create_disposition, uint32_t file_attr,
+                                        bool &exist, bool &isdir)
+{
+    fat32::stats::timer st(fat32::stats::OP_OPEN);
+    touch();
+    return open_from(root.get(), path, create_disposition, file_attr, exist, isdir);
+}
+
+uint64_t dev_t::openat(uint64_t dir_fd, const fat32::path_view &path, uint32_t create_disposition, uint32_t file_attr, bool &exist, bool &isdir)
+{
+    return try_openat(dir_fd, path, create_disposition, file_attr, exist, isdir).value();
+}
+
+fat32::result<uint64_t> dev_t::try_openat(uint64_t dir_fd, const fat32::path_view &path, uint32_t create_disposition,
+                                          uint32_t file_attr, bool &exist, bool &isdir)
+{
+    fat32::stats::timer st(fat32::stats::OP_OPENAT);
+    touch();
+    auto start = handles.get(dir_fd);
+    if (!start)
+    {
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
+    }
+    return open_from(start, path, create_disposition, file_attr, exist, isdir);
+}
+
+fat32::result<uint64_t> dev_t::open_from(fat32::file_node *start, const fat32::path_view &path, uint32_t create_disposition,
+                                         uint32_t file_attr, bool &exist, bool &isdir)
+{
+    std::shared_lock<std::shared_mutex> t(tree_mtx, std::defer_lock);
+    auto found = lookup(start, path, create_disposition, exist, isdir);
+    if (!found)
+    {
+        return found.error();
+    }
+    auto node = *found;
+    if (!node)
     {
-        if (create_disposition == CREATE_NEW)
+        fat32::stats::add(fat32::stats::LOOKUP_SLOW);
+        t.lock();
+        if (start != root.get() && !start->parent)
         {
-            throw fat32::file_error(fat32::file_error::FILE_ALREADY_EXISTS);
+            return fat32::file_error::FILE_NOT_FOUND;
         }
-        exist = true;
-        isdir = true;
-        root->ref_count.fetch_add(1, std::memory_order_relaxed);
-        return (uint64_t)root.get();
+        fat32::file_node *last;
+        auto walked = walk(start, path, create_disposition, file_attr, exist, isdir, last);
+        if (!walked)
+        {
+            last->ref_count.fetch_add(1, std::memory_order_relaxed);
+            t.unlock();
+            std::lock_guard<std::shared_mutex> u(tree_mtx);
+            release(last);
+            return walked.error();
+        }
+        node = *walked;
     }
     else
     {
-        auto last = root.get();
-        decltype(last->children.begin()) itr;
-        bool end = false;
-        for (const auto &name : path)
+        fat32::stats::add(fat32::stats::LOOKUP_FAST);
+    }
+    if (exist && (create_disposition == CREATE_ALWAYS || create_disposition == TRUNCATE_EXISTING))
+    {
+        std::lock_guard<std::shared_mutex> g(node->mtx);
+        node->attr.size = 0;
+    }
+    auto fd = handles.insert(node);
+    if (!fd)
+    {
+        if (t)
+            t.unlock();
+        std::lock_guard<std::shared_mutex> u(tree_mtx);
+        release(node);
+        return fat32::file_error::TOO_MANY_OPEN_FILES;
+    }
+    return fd;
+}
+
+void dev_t::unlink(uint64_t fd)
+{
+    fat32::stats::timer st(fat32::stats::OP_UNLINK);
+    touch();
+    get_node(fd)->delete_on_close = true;
+}
+
+void dev_t::remove(uint64_t fd)
+{
+    fat32::stats::timer st(fat32::stats::OP_REMOVE);
+    touch();
+    auto p = get_node(fd);
+    std::lock_guard<std::shared_mutex> t(tree_mtx);
+    if (!p->parent)
+    {
+        return;
+    }
+    if (p->isdir() && !dir_empty(p))
+    {
+        throw fat32::file_error(fat32::file_error::DIR_NOT_EMPTY);
+    }
+    orphan(p);
+}
+
+bool dev_t::renameat(uint64_t fd, uint64_t dir_fd, const std::wstring &name, bool replace)
+{
+    fat32::stats::timer st(fat32::stats::OP_RENAMEAT);
+    touch();
+    auto p = get_node(fd);
+    auto dir = get_node(dir_fd);
+    std::lock_guard<std::shared_mutex> t(tree_mtx);
+    if (!p->parent || (dir != root.get() && !dir->parent))
+    {
+        return false;
+    }
+    bool exist;
+    bool isdir;
+    fat32::file_node *last;
+    auto walked = walk(dir, {name}, OPEN_EXISTING, 0, exist, isdir, last);
+    if (!walked)
+    {
+        clear_node(last);
+        if (walked.error() != fat32::file_error::FILE_NOT_FOUND)
         {
-            if (!end)
-            {
-                end = (itr = last->children.find(name)) == last->children.end();
-            }
-            if (!end)
-            {
-                last = itr->second.get();
-            }
-            else
-            {
-                if (last->info.info.dwFileAttributes & 0x10)
-                {
-                    fat32::Entry_Info buf;
-                    size_t index = 0;
-                    auto find = false;
-                    int32_t ret;
-                    while (index < last->entries.size() && (ret = DirEntry2EntryInfo(last->entries.data() + index, &buf)))
-                    {
-                        if (ret < 0)
-                        {
-                            index -= ret;
-                        }
-                        else
-                        {
-                            if (name == buf.name)
-                            {
-                                auto ptr = open_file(last, &buf);
-                                auto temp = ptr.get();
-                                last->children.insert(std::make_pair(name, std::move(ptr)));
-                                open_file_table.insert((uint64_t)temp);
-                                last = temp;
-                                find = true;
-                                break;
-                            }
-                            index += ret;
-                        }
-                    }
-                    if (!find)
-                    {
-                        if ((create_disposition == CREATE_ALWAYS || create_disposition == CREATE_NEW) && &name == &path.back())
-                        {
-                            exist = false;
-                            isdir = file_attr & 0x10;
-                            fat32::Entry_Info info;
-                            wcscpy(info.name, name.c_str());
-                            gen_short(name, last, info.short_name);
-                            info.first_clus = 0;
-                            info.info.dwFileAttributes = (file_attr & 0x37);
-                            info.info.dwVolumeSerialNumber = get_vol_id();
-                            SYSTEMTIME time;
-                            GetSystemTime(&time);
-                            time.wMilliseconds = time.wMilliseconds / 10 * 10;
-                            SystemTimeToFileTime(&time, &info.info.ftCreationTime);
-                            time.wMilliseconds = 0;
-                            time.wSecond &= 0xfffffffe;
-                            SystemTimeToFileTime(&time, &info.info.ftLastWriteTime);
-                            time.wHour = 0;
-                            time.wMinute = 0;
-                            time.wSecond = 0;
-                            SystemTimeToFileTime(&time, &info.info.ftLastAccessTime);
-                            info.info.nFileIndexHigh = 0;
-                            info.info.nFileIndexLow = 0;
-                            info.info.nFileSizeHigh = 0;
-                            info.info.nFileSizeLow = 0;
-                            info.info.nNumberOfLinks = 1;
-                            add_entry(last, &info, 1, true);
-                            auto ptr = open_file(last, &info);
-                            ptr->ref_count.fetch_add(1, std::memory_order_relaxed);
-                            auto temp = ptr.get();
-                            if (isdir)
-                            {
-                                fat32::Entry_Info tmp_info;
-                                memcpy(&tmp_info, &temp->info, sizeof(fat32::Entry_Info));
-                                wcscpy(tmp_info.name, L".");
-                                memcpy(tmp_info.short_name, this_folder, sizeof(this_folder));
-                                add_entry(temp, &tmp_info, 0, true);
-                                memcpy(&tmp_info, &last->info, sizeof(fat32::Entry_Info));
-                                wcscpy(tmp_info.name, L"..");
-                                memcpy(tmp_info.short_name, parent_folder, sizeof(parent_folder));
-                                add_entry(temp, &tmp_info, 0, true);
-                            }
-                            last->children.insert(std::make_pair(name, std::move(ptr)));
-                            open_file_table.insert((uint64_t)temp);
-                            return (uint64_t)temp;
-                        }
-                        else
-                        {
-                            clear_node(last);
-                            throw fat32::file_error(fat32::file_error::FILE_NOT_FOUND);
-                        }
-                    }
-                }
-                else
-                {
-                    clear_node(last);
-                    throw fat32::file_error(fat32::file_error::FILE_NOT_FOUND);
-                }
-            }
+            walked.value();
         }
-        if (create_disposition == CREATE_NEW)
+    }
+    auto target = *walked;
+    if (target == p)
+    {
+        release(target);
+        return true;
+    }
+    if (target)
+    {
+        if (!replace || target->isdir() != p->isdir())
         {
-            clear_node(last);
-            throw fat32::file_error(fat32::file_error::FILE_ALREADY_EXISTS);
+            release(target);
+            return false;
         }
-        if (create_disposition == CREATE_ALWAYS || create_disposition == TRUNCATE_EXISTING)
+        if (target->isdir() && !dir_empty(target))
         {
-            ULARGE_INTEGER int_tmp;
-            int_tmp.QuadPart = 0;
-            last->info.info.nFileSizeHigh = int_tmp.HighPart;
-            last->info.info.nFileSizeLow = int_tmp.LowPart;
+            release(target);
+            throw fat32::file_error(fat32::file_error::DIR_NOT_EMPTY);
         }
-        exist = true;
-        isdir = (last->info.info.dwFileAttributes & 0x10);
-        last->ref_count.fetch_add(1, std::memory_order_relaxed);
-        open_file_table.insert((uint64_t)last);
-        return (uint64_t)last;
+        orphan(target);
+        release(target);
     }
-    return 0;
+    return rename_node(p, dir, {name}, false);
 }
 
-void dev_t::unlink(uint64_t fd)
+uint64_t dev_t::file_id(uint64_t fd)
+{
+    return (uint64_t)get_node(fd);
+}
+
+bool dev_t::dir_empty(fat32::file_node *node)
 {
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
+    if (!node->dir->children.empty())
     {
-        auto p = (fat32::file_node *)fd;
-        p->delete_on_close = true;
+        return false;
     }
-    else
+    load_cache(node);
+    for (const auto &r : node->dir->cache)
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        if (r.name.view() != L"." && r.name.view() != L"..")
+        {
+            return false;
+        }
     }
+    return true;
+}
+
+void dev_t::orphan(fat32::file_node *node)
+{
+    auto parent = node->parent;
+    remove_entry(parent, node->name.view());
+    orphans.push_back(parent->dir->children.erase(node->name.view()));
+    node->parent = nullptr;
+    node->delete_on_close = true;
+    clear_node(parent);
+}
+
+bool dev_t::rename(uint64_t fd, const fat32::path_view &newpath, bool replace)
+{
+    return try_rename(fd, newpath, replace).value();
 }
 
-bool dev_t::rename(uint64_t fd, const fat32::path &newpath, bool replace)
+fat32::result<bool> dev_t::try_rename(uint64_t fd, const fat32::path_view &newpath, bool replace)
 {
+    fat32::stats::timer st(fat32::stats::OP_RENAME);
     if (newpath.empty())
         return false;
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
     {
-        auto p = (fat32::file_node *)fd;
-        if (!p->parent)
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
+    }
+    std::lock_guard<std::shared_mutex> t(tree_mtx);
+    try
+    {
+        return rename_node(p, root.get(), newpath, replace);
+    }
+    catch (const fat32::file_error &e)
+    {
+        return e.get_error_type();
+    }
+}
+
+bool dev_t::rename_node(fat32::file_node *p, fat32::file_node *start, const fat32::path_view &newpath, bool replace)
+{
+    if (!p->parent || newpath.empty())
+        return false;
+    auto name = newpath.back();
+    bool exist;
+    bool isdir;
+    fat32::file_node *last;
+    auto walked = walk(start, newpath.parent(), OPEN_EXISTING, 0, exist, isdir, last);
+    if (!walked)
+    {
+        clear_node(last);
+        walked.value();
+    }
+    auto new_parent = *walked;
+    if (!new_parent->isdir())
+    {
+        release(new_parent);
+        throw fat32::file_error(fat32::file_error::FILE_NOT_DIR);
+    }
+    sync_dir(new_parent);
+    load_cache(new_parent);
+    auto rec = find_record(new_parent, name);
+    if (rec != new_parent->dir->cache.end())
+    {
+        if (rec->attr.isdir() != p->isdir())
+        {
+            release(new_parent);
             return false;
-        auto copy = newpath;
-        copy.pop_back();
-        bool exist;
-        bool isdir;
-        auto file = open(copy, OPEN_EXISTING, 0, exist, isdir);
-        auto new_parent = (fat32::file_node *)file;
-        auto ret = opendir((uint64_t)new_parent);
-        for (const auto &e : ret)
+        }
+        else if (!replace)
         {
-            if (newpath.back() == e.name)
-            {
-                if (((e.info.dwFileAttributes & 0x10) && !(p->info.info.dwFileAttributes & 0x10)) ||
-                    (!(e.info.dwFileAttributes & 0x10) && (p->info.info.dwFileAttributes & 0x10)))
-                {
-                    return false;
-                }
-                else if (replace)
-                {
-                    break;
-                }
-                else
-                {
-                    close((uint64_t)new_parent);
-                    return true;
-                }
-            }
+            release(new_parent);
+            return true;
         }
-        auto origin_parent = p->parent;
-        auto itr = origin_parent->children.find(p->info.name);
-        auto ptr = std::move(itr->second);
-        origin_parent->children.erase(itr);
-        remove_entry(origin_parent, p->info.name);
-        p->parent = new_parent;
-        wcscpy(p->info.name, newpath.back().c_str());
-        gen_short(newpath.back(), new_parent, p->info.short_name);
-        new_parent->children.insert(std::make_pair(std::wstring(p->info.name), std::move(ptr)));
-        close((uint64_t)new_parent);
-        return true;
     }
-    else
+    auto origin_parent = p->parent;
+    auto ptr = origin_parent->dir->children.erase(p->name.view());
+    remove_entry(origin_parent, p->name.view());
+    // lock-free lookups may still be comparing against the old name
+    fat32::epoch::synchronize();
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        std::lock_guard<std::shared_mutex> g(p->mtx);
+        p->parent = new_parent;
+        p->name = fat32::pooled_name(&names, name);
+        gen_short(name, new_parent, p->attr.short_name);
     }
+    new_parent->dir->children.insert(std::move(ptr));
+    release(new_parent);
+    return true;
 }
 
 void dev_t::close(uint64_t fd)
 {
-    if (open_file_table.find(fd) != open_file_table.end())
-    {
-        auto p = (fat32::file_node *)fd;
-        p->ref_count.fetch_sub(1, std::memory_order_acquire);
-        clear_node(p);
-    }
-    else
+    fat32::stats::timer st(fat32::stats::OP_CLOSE);
+    auto p = handles.remove(fd);
+    if (!p)
     {
         throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
     }
+    std::lock_guard<std::shared_mutex> t(tree_mtx);
+    release(p);
 }
 
 uint32_t dev_t::read(uint64_t fd, int64_t offset, uint32_t len, void *buffer)
 {
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
+    return try_read(fd, offset, len, buffer).value();
+}
+
+fat32::result<uint32_t> dev_t::try_read(uint64_t fd, int64_t offset, uint32_t len, void *buffer)
+{
+    fat32::stats::timer st(fat32::stats::OP_READ);
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
+    {
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
+    }
+    SYSTEMTIME time;
+    GetSystemTime(&time);
+    time.wMilliseconds = 0;
+    time.wHour = 0;
+    time.wMinute = 0;
+    time.wSecond = 0;
+    FILETIME acc_time;
+    SystemTimeToFileTime(&time, &acc_time);
+    uint32_t index = 0;
     {
-        auto p = (fat32::file_node *)fd;
-        ULARGE_INTEGER tmp;
-        tmp.HighPart = p->info.info.nFileSizeHigh;
-        tmp.LowPart = p->info.info.nFileSizeLow;
-        uint64_t file_size = tmp.QuadPart;
-        int64_t left_border = offset > 0 ? offset : 0;
-        int64_t right_border = (offset + len) < file_size ? (offset + len) : file_size;
+        std::shared_lock<std::shared_mutex> g(p->mtx);
+        uint64_t file_size = p->attr.size;
+        int64_t end = offset + len;
+        uint64_t left_border = offset > 0 ? offset : 0;
+        uint64_t right_border = end > 0 ? std::min<uint64_t>(end, file_size) : 0;
         if (left_border >= right_border)
         {
             return 0;
@@ -463,7 +602,6 @@ uint32_t dev_t::read(uint64_t fd, int64_t offset, uint32_t len, void *buffer)
         std::vector<char> buf(clus_size);
         uint32_t begin_clus = left_border / clus_size;
         uint32_t end_clus = (right_border + clus_size - 1) / clus_size;
-        uint32_t index = 0;
         for (auto i = begin_clus; i < end_clus; ++i)
         {
             read_clus(p->alloc[i], buf.data());
@@ -480,276 +618,710 @@ uint32_t dev_t::read(uint64_t fd, int64_t offset, uint32_t len, void *buffer)
             memcpy((char *)buffer + index, buf.data() + begin, size);
             index += size;
         }
-        SYSTEMTIME time;
-        GetSystemTime(&time);
-        time.wMilliseconds = 0;
-        time.wHour = 0;
-        time.wMinute = 0;
-        time.wSecond = 0;
-        SystemTimeToFileTime(&time, &p->info.info.ftLastAccessTime);
-        return index;
+        if (memcmp(&p->attr.acc_time, &acc_time, sizeof(FILETIME)) == 0)
+        {
+            return index;
+        }
     }
-    else
+    std::lock_guard<std::shared_mutex> g(p->mtx);
+    p->attr.acc_time = acc_time;
+    return index;
+}
+
+uint32_t dev_t::write(uint64_t fd, int64_t offset, uint32_t len, const void *buffer)
+{
+    return try_write(fd, offset, len, buffer).value();
+}
+
+fat32::result<uint32_t> dev_t::try_write(uint64_t fd, int64_t offset, uint32_t len, const void *buffer)
+{
+    fat32::stats::timer st(fat32::stats::OP_WRITE);
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
     }
+    return write_node(p, offset, len, buffer);
 }
 
-uint32_t dev_t::write(uint64_t fd, int64_t offset, uint32_t len, const void *buffer)
+fat32::result<uint32_t> dev_t::write_node(fat32::file_node *p, int64_t offset, uint32_t len, const void *buffer)
 {
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
+    if (!len)
+    {
+        return 0;
+    }
+    std::lock_guard<std::shared_mutex> g(p->mtx);
+    // partial clusters are read back and rewritten whole
+    drain_io(p);
+    uint64_t file_size = p->attr.size;
+    uint64_t left_border = (offset > 0 ? offset : 0);
+    uint64_t right_border = left_border + len;
+    std::vector<char> buf(clus_size, 0);
+    uint32_t begin_clus = left_border / clus_size;
+    uint32_t end_clus = (right_border + clus_size - 1) / clus_size;
+    uint32_t index = 0;
+    if (end_clus > p->alloc.size())
     {
-        auto p = (fat32::file_node *)fd;
-        if (!len)
+        auto origin = p->alloc.size();
+        try
         {
-            return 0;
+            extend(p, end_clus);
         }
-        ULARGE_INTEGER tmp;
-        tmp.HighPart = p->info.info.nFileSizeHigh;
-        tmp.LowPart = p->info.info.nFileSizeLow;
-        uint64_t file_size = tmp.QuadPart;
-        uint64_t left_border = (offset > 0 ? offset : 0);
-        uint64_t right_border = left_border + len;
-        std::vector<char> buf(clus_size, 0);
-        uint32_t begin_clus = left_border / clus_size;
-        uint32_t end_clus = (right_border + clus_size - 1) / clus_size;
-        uint32_t index = 0;
-        if (end_clus > p->alloc.size())
+        catch (const fat32::file_error &e)
         {
-            auto origin = p->alloc.size();
-            extend(p, end_clus);
-            if (begin_clus >= origin)
-            {
-                for (auto i = origin; i < begin_clus; ++i)
-                {
-                    write_clus(p->alloc[i], buf.data());
-                }
-            }
+            return e.get_error_type();
         }
-        for (auto i = begin_clus; i < end_clus; ++i)
+        if (begin_clus >= origin)
         {
-            int read = 0;
-            uint32_t begin = 0, end = clus_size;
-            if (i == begin_clus)
-            {
-                begin = left_border % clus_size;
-                read = 1;
-            }
-            if (i == end_clus - 1)
-            {
-                end = (right_border - 1) % clus_size + 1;
-                read = 1;
-            }
-            auto size = end - begin;
-            if (read)
+            for (auto i = origin; i < begin_clus; ++i)
             {
-                read_clus(p->alloc[i], buf.data());
-                memcpy(buf.data() + begin, (char *)buffer + i * clus_size + begin, size);
                 write_clus(p->alloc[i], buf.data());
             }
-            else
-            {
-                write_clus(p->alloc[i], (char *)buffer + i * clus_size);
-            }
-            index += size;
         }
-        if (right_border > file_size)
+    }
+    for (auto i = begin_clus; i < end_clus; ++i)
+    {
+        int read = 0;
+        uint32_t begin = 0, end = clus_size;
+        if (i == begin_clus)
+        {
+            begin = left_border % clus_size;
+            read = 1;
+        }
+        if (i == end_clus - 1)
+        {
+            end = (right_border - 1) % clus_size + 1;
+            read = 1;
+        }
+        auto size = end - begin;
+        if (read)
+        {
+            read_clus(p->alloc[i], buf.data());
+            memcpy(buf.data() + begin, (char *)buffer + index, size);
+            write_clus(p->alloc[i], buf.data());
+        }
+        else
         {
-            tmp.QuadPart = right_border;
-            p->info.info.nFileSizeHigh = tmp.HighPart;
-            p->info.info.nFileSizeLow = tmp.LowPart;
+            write_clus(p->alloc[i], (char *)buffer + index);
         }
+        index += size;
+    }
+    if (right_border > file_size)
+    {
+        p->attr.size = right_border;
+    }
+    stamp_write(p->attr);
+    return index;
+}
+
+namespace
+{
+
+struct async_op
+{
+    std::atomic<size_t> left;
+    std::mutex mtx;
+    std::exception_ptr error;
+    uint32_t total;
+    dev_io::rw_done done;
+};
+
+} // namespace
+
+void dev_t::read_async(uint64_t fd, int64_t offset, uint32_t len, void *buffer, rw_done done)
+{
+    fat32::stats::timer st(fat32::stats::OP_READ_ASYNC);
+    fat32::file_node *p;
+    std::vector<extent> extents;
+    uint32_t total = 0;
+    try
+    {
+        touch();
+        p = get_node(fd);
         SYSTEMTIME time;
         GetSystemTime(&time);
         time.wMilliseconds = 0;
-        time.wSecond &= 0xfffffffe;
-        SystemTimeToFileTime(&time, &p->info.info.ftLastWriteTime);
         time.wHour = 0;
         time.wMinute = 0;
         time.wSecond = 0;
-        SystemTimeToFileTime(&time, &p->info.info.ftLastAccessTime);
-        return index;
-    }
-    else
-    {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        FILETIME acc_time;
+        SystemTimeToFileTime(&time, &acc_time);
+        std::shared_lock<std::shared_mutex> g(p->mtx);
+        if (memcmp(&p->attr.acc_time, &acc_time, sizeof(FILETIME)) != 0)
+        {
+            g.unlock();
+            {
+                std::lock_guard<std::shared_mutex> u(p->mtx);
+                p->attr.acc_time = acc_time;
+            }
+            g.lock();
+        }
+        uint64_t file_size = p->attr.size;
+        int64_t end = offset + len;
+        uint64_t left_border = offset > 0 ? offset : 0;
+        uint64_t right_border = end > 0 ? std::min<uint64_t>(end, file_size) : 0;
+        if (left_border < right_border)
+        {
+            extents = map_range(p, left_border, right_border);
+            total = right_border - left_border;
+            if (auto copy = bounce(p, extents, buffer, nullptr, done))
+                buffer = copy;
+            p->ref_count.fetch_add(1, std::memory_order_relaxed);
+            p->io_count.fetch_add(1, std::memory_order_relaxed);
+        }
     }
-}
-
-void dev_t::fstat(uint64_t fd, LPBY_HANDLE_FILE_INFORMATION statbuf)
-{
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
+    catch (...)
     {
-        auto p = (fat32::file_node *)fd;
-        memcpy(statbuf, &p->info.info, sizeof(BY_HANDLE_FILE_INFORMATION));
+        done(0, std::current_exception());
+        return;
     }
-    else
+    if (extents.empty())
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        done(0, nullptr);
+        return;
     }
+    submit(p, extents, buffer, nullptr, total, std::move(done));
 }
 
-void dev_t::setattr(uint64_t fd, uint32_t attr)
+void dev_t::write_async(uint64_t fd, int64_t offset, uint32_t len, const void *buffer, rw_done done)
 {
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
+    fat32::stats::timer st(fat32::stats::OP_WRITE_ASYNC);
+    fat32::file_node *p;
+    std::vector<extent> extents;
+    try
     {
-        auto p = (fat32::file_node *)fd;
-        p->info.info.dwFileAttributes = (attr & 0x37);
-    }
-    else
+        touch();
+        p = get_node(fd);
+        if (len)
+        {
+            std::lock_guard<std::shared_mutex> g(p->mtx);
+            uint64_t left_border = (offset > 0 ? offset : 0);
+            uint64_t right_border = left_border + len;
+            uint32_t begin_clus = left_border / clus_size;
+            uint32_t end_clus = (right_border + clus_size - 1) / clus_size;
+            if (end_clus > p->alloc.size())
+            {
+                uint32_t origin = p->alloc.size();
+                extend(p, end_clus);
+                // only the bytes in range are transferred, so new clusters
+                // are zeroed wherever the write leaves a gap
+                std::vector<char> buf(clus_size, 0);
+                for (auto i = origin; i < end_clus; ++i)
+                {
+                    if (i < begin_clus || (i == begin_clus && left_border % clus_size) ||
+                        (i == end_clus - 1 && right_border % clus_size))
+                    {
+                        write_clus(p->alloc[i], buf.data());
+                    }
+                }
+            }
+            extents = map_range(p, left_border, right_border);
+            if (auto copy = bounce(p, extents, nullptr, buffer, done))
+                buffer = copy;
+            if (right_border > p->attr.size)
+            {
+                p->attr.size = right_border;
+            }
+            stamp_write(p->attr);
+            p->ref_count.fetch_add(1, std::memory_order_relaxed);
+            p->io_count.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    catch (...)
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        done(0, std::current_exception());
+        return;
     }
+    if (extents.empty())
+    {
+        done(0, nullptr);
+        return;
+    }
+    submit(p, extents, nullptr, buffer, len, std::move(done));
 }
 
-void dev_t::settime(uint64_t fd, CONST FILETIME *CreationTime, CONST FILETIME *LastAccessTime, CONST FILETIME *LastWriteTime)
+std::vector<dev_t::extent> dev_t::map_range(fat32::file_node *node, uint64_t left_border, uint64_t right_border) const
+{
+    std::vector<extent> res;
+    uint32_t begin_clus = left_border / clus_size;
+    uint32_t end_clus = (right_border + clus_size - 1) / clus_size;
+    uint32_t index = 0;
+    for (auto i = begin_clus; i < end_clus; ++i)
+    {
+        uint32_t begin = i == begin_clus ? left_border % clus_size : 0;
+        uint32_t end = i == end_clus - 1 ? (right_border - 1) % clus_size + 1 : clus_size;
+        if (!res.empty() && node->alloc[i] == node->alloc[i - 1] + 1)
+        {
+            res.back().size += end - begin;
+        }
+        else
+        {
+            res.push_back(extent{clus_offset(node->alloc[i]) + begin, end - begin, index});
+        }
+        index += end - begin;
+    }
+    return res;
+}
+
+// Moves a transfer the device cannot take as is into an aligned copy that
+// lives until done runs, widening the first and last extents to whole
+// sectors. Returns the copy, or null if the transfer is aligned already.
+char *dev_t::bounce(fat32::file_node *node, std::vector<extent> &extents, void *read_buf, const void *write_buf,
+                    rw_done &done) const
 {
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
-    {
-        auto p = (fat32::file_node *)fd;
-        SYSTEMTIME systime;
-        FileTimeToSystemTime(CreationTime, &systime);
-        systime.wMilliseconds = systime.wMilliseconds / 10 * 10;
-        SystemTimeToFileTime(&systime, &p->info.info.ftCreationTime);
-        FileTimeToSystemTime(LastWriteTime, &systime);
-        systime.wMilliseconds = 0;
-        systime.wSecond &= 0xfffffffe;
-        SystemTimeToFileTime(&systime, &p->info.info.ftLastWriteTime);
-        FileTimeToSystemTime(LastAccessTime, &systime);
-        systime.wMilliseconds = 0;
-        systime.wSecond = 0;
-        systime.wMinute = 0;
-        systime.wHour = 0;
-        SystemTimeToFileTime(&systime, &p->info.info.ftLastAccessTime);
+    uint32_t align = img->align();
+    uint64_t end = extents.back().offset + extents.back().size;
+    uint32_t total = extents.back().index + extents.back().size;
+    uint32_t head = extents.front().offset % align;
+    uint32_t tail = (align - end % align) % align;
+    auto buf = read_buf ? read_buf : write_buf;
+    if (!head && !tail && (uintptr_t)buf % align == 0)
+    {
+        return nullptr;
+    }
+    uint32_t size = head + total + tail;
+    std::shared_ptr<char> copy((char *)::operator new(size, std::align_val_t(align)),
+                               [align](char *ptr) { ::operator delete(ptr, std::align_val_t(align)); });
+    if (write_buf)
+    {
+        // the edge sectors are read back and rewritten whole, so nothing
+        // else may be writing them meanwhile
+        drain_io(node);
+        if (head)
+            dev_read(extents.front().offset - head, align, copy.get());
+        if (tail)
+            dev_read(end + tail - align, align, copy.get() + size - align);
+        memcpy(copy.get() + head, write_buf, total);
+        done = [copy, done = std::move(done)](uint32_t len, std::exception_ptr error) { done(len, error); };
     }
     else
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        done = [copy, read_buf, head, total, done = std::move(done)](uint32_t len, std::exception_ptr error) {
+            if (!error)
+                memcpy(read_buf, copy.get() + head, total);
+            done(len, error);
+        };
+    }
+    extents.front().offset -= head;
+    extents.front().size += head;
+    for (size_t i = 1; i < extents.size(); ++i)
+    {
+        extents[i].index += head;
+    }
+    extents.back().size += tail;
+    return copy.get();
+}
+
+void dev_t::submit(fat32::file_node *node, const std::vector<extent> &extents, void *read_buf, const void *write_buf,
+                   uint32_t total, rw_done done)
+{
+    auto op = std::make_shared<async_op>();
+    op->left = extents.size();
+    op->total = total;
+    op->done = std::move(done);
+    auto finish = [this, node, op](std::exception_ptr error) {
+        if (error)
+        {
+            std::lock_guard<std::mutex> g(op->mtx);
+            if (!op->error)
+                op->error = error;
+        }
+        if (op->left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            end_io(node);
+            op->done(op->error ? 0 : op->total, op->error);
+        }
+    };
+    for (const auto &e : extents)
+    {
+        fat32::stats::add(read_buf ? fat32::stats::DEV_READS : fat32::stats::DEV_WRITES);
+        fat32::stats::add(read_buf ? fat32::stats::DEV_READ_BYTES : fat32::stats::DEV_WRITE_BYTES, e.size);
+        if (read_buf)
+            img->read_async(e.offset, e.size, (char *)read_buf + e.index, finish);
+        else
+            img->write_async(e.offset, e.size, (const char *)write_buf + e.index, finish);
+    }
+}
+
+void dev_t::drain_io(fat32::file_node *node) const noexcept
+{
+    while (node->io_count.load(std::memory_order_acquire))
+    {
+        std::this_thread::yield();
+    }
+}
+
+void dev_t::end_io(fat32::file_node *node)
+{
+    node->io_count.fetch_sub(1, std::memory_order_release);
+    if (node->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        std::lock_guard<std::shared_mutex> t(tree_mtx);
+        clear_node(node);
+    }
+}
+
+void dev_t::fstat(uint64_t fd, LPBY_HANDLE_FILE_INFORMATION statbuf)
+{
+    try_fstat(fd, statbuf).value();
+}
+
+fat32::status dev_t::try_fstat(uint64_t fd, LPBY_HANDLE_FILE_INFORMATION statbuf)
+{
+    fat32::stats::timer st(fat32::stats::OP_FSTAT);
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
+    {
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
+    }
+    fill_info(get_attr(p), statbuf);
+    return {};
+}
+
+void dev_t::setattr(uint64_t fd, uint32_t attr)
+{
+    try_setattr(fd, attr).value();
+}
+
+fat32::status dev_t::try_setattr(uint64_t fd, uint32_t attr)
+{
+    fat32::stats::timer st(fat32::stats::OP_SETATTR);
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
+    {
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
+    }
+    std::lock_guard<std::shared_mutex> g(p->mtx);
+    p->attr.attr = (p->attr.attr & 0x10) | (attr & 0x27);
+    return {};
+}
+
+void dev_t::settime(uint64_t fd, CONST FILETIME *CreationTime, CONST FILETIME *LastAccessTime, CONST FILETIME *LastWriteTime)
+{
+    try_settime(fd, CreationTime, LastAccessTime, LastWriteTime).value();
+}
+
+fat32::status dev_t::try_settime(uint64_t fd, CONST FILETIME *CreationTime, CONST FILETIME *LastAccessTime, CONST FILETIME *LastWriteTime)
+{
+    fat32::stats::timer st(fat32::stats::OP_SETTIME);
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
+    {
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
     }
+    std::lock_guard<std::shared_mutex> g(p->mtx);
+    SYSTEMTIME systime;
+    FileTimeToSystemTime(CreationTime, &systime);
+    systime.wMilliseconds = systime.wMilliseconds / 10 * 10;
+    SystemTimeToFileTime(&systime, &p->attr.crt_time);
+    FileTimeToSystemTime(LastWriteTime, &systime);
+    systime.wMilliseconds = 0;
+    systime.wSecond &= 0xfffffffe;
+    SystemTimeToFileTime(&systime, &p->attr.wrt_time);
+    FileTimeToSystemTime(LastAccessTime, &systime);
+    systime.wMilliseconds = 0;
+    systime.wSecond = 0;
+    systime.wMinute = 0;
+    systime.wHour = 0;
+    SystemTimeToFileTime(&systime, &p->attr.acc_time);
+    return {};
 }
 
 void dev_t::setend(uint64_t fd, int64_t offset)
 {
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
+    try_setend(fd, offset).value();
+}
+
+fat32::status dev_t::try_setend(uint64_t fd, int64_t offset)
+{
+    fat32::stats::timer st(fat32::stats::OP_SETEND);
+    if (offset < 0)
+    {
+        return fat32::file_error::INVALID_ARGUMENT;
+    }
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
+    {
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
+    }
+    std::lock_guard<std::shared_mutex> g(p->mtx);
+    uint64_t clus_end = ((uint64_t)offset + clus_size - 1) / clus_size;
+    if (clus_end > p->alloc.size())
     {
-        auto p = (fat32::file_node *)fd;
-        auto clus_end = (offset + clus_size - 1) / clus_size;
-        if (clus_end > p->alloc.size())
+        if (clus_end > count_of_cluster)
         {
-            auto origin = p->alloc.size();
-            extend(p, clus_end);
-            std::vector<char> buf(clus_size, 0);
-            for (uint32_t i = origin; i < clus_end; ++i)
-            {
-                write_clus(p->alloc[i], buf.data());
-            }
-            ULARGE_INTEGER tmp;
-            tmp.QuadPart = offset;
-            p->info.info.nFileSizeHigh = tmp.HighPart;
-            p->info.info.nFileSizeLow = tmp.LowPart;
+            return fat32::file_error::DISK_FULL;
         }
-        if (clus_end < p->alloc.size())
+        auto origin = p->alloc.size();
+        try
         {
-            shrink(p, clus_end);
-            ULARGE_INTEGER tmp;
-            tmp.QuadPart = offset;
-            p->info.info.nFileSizeHigh = tmp.HighPart;
-            p->info.info.nFileSizeLow = tmp.LowPart;
+            extend(p, (uint32_t)clus_end);
+        }
+        catch (const fat32::file_error &e)
+        {
+            return e.get_error_type();
+        }
+        std::vector<char> buf(clus_size, 0);
+        for (uint32_t i = origin; i < clus_end; ++i)
+        {
+            write_clus(p->alloc[i], buf.data());
         }
     }
-    else
+    if (clus_end < p->alloc.size())
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        shrink(p, clus_end);
     }
+    p->attr.size = offset;
+    return {};
 }
 
 void dev_t::setalloc(uint64_t fd, int64_t alloc)
 {
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
+    try_setalloc(fd, alloc).value();
+}
+
+fat32::status dev_t::try_setalloc(uint64_t fd, int64_t alloc)
+{
+    fat32::stats::timer st(fat32::stats::OP_SETALLOC);
+    if (alloc < 0)
+    {
+        return fat32::file_error::INVALID_ARGUMENT;
+    }
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
     {
-        auto p = (fat32::file_node *)fd;
-        auto clus_end = (alloc + clus_size - 1) / clus_size;
-        if (clus_end > p->alloc.size())
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
+    }
+    std::lock_guard<std::shared_mutex> g(p->mtx);
+    uint64_t clus_end = ((uint64_t)alloc + clus_size - 1) / clus_size;
+    if (clus_end > p->alloc.size())
+    {
+        if (clus_end > count_of_cluster)
         {
-            auto origin = p->alloc.size();
-            extend(p, clus_end);
-            std::vector<char> buf(clus_size, 0);
-            for (uint32_t i = origin; i < clus_end; ++i)
-            {
-                write_clus(p->alloc[i], buf.data());
-            }
+            return fat32::file_error::DISK_FULL;
+        }
+        auto origin = p->alloc.size();
+        try
+        {
+            extend(p, (uint32_t)clus_end);
+        }
+        catch (const fat32::file_error &e)
+        {
+            return e.get_error_type();
         }
-        if (clus_end < p->alloc.size())
+        std::vector<char> buf(clus_size, 0);
+        for (uint32_t i = origin; i < clus_end; ++i)
         {
-            shrink(p, clus_end);
+            write_clus(p->alloc[i], buf.data());
         }
     }
-    else
+    if (clus_end < p->alloc.size())
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        shrink(p, clus_end);
     }
+    return {};
 }
 
-fat32::dir_info dev_t::opendir(uint64_t fd)
+std::vector<std::exception_ptr> dev_t::run_batch(const std::vector<batch_op> &ops)
 {
-    cleared = false;
-    if (open_file_table.find(fd) != open_file_table.end())
-    {
-        auto p = (fat32::file_node *)fd;
-        if (!(p->info.info.dwFileAttributes & 0x10))
+    fat32::stats::timer st(fat32::stats::OP_RUN_BATCH);
+    touch();
+    std::vector<std::exception_ptr> res(ops.size());
+    std::vector<fat32::file_node *> held;
+    // only this call touches pinned, so looking it up needs no lock
+    std::map<fat32::path, fat32::file_node *> pinned;
+    // the caller holds tree_mtx exclusively unless the path is pinned
+    auto resolve = [&](const fat32::path &path, uint32_t create_disposition, uint32_t file_attr) {
+        auto itr = pinned.find(path);
+        if (itr != pinned.end())
         {
-            throw fat32::file_error(fat32::file_error::FILE_NOT_DIR);
+            if (create_disposition == CREATE_NEW)
+            {
+                throw fat32::file_error(fat32::file_error::FILE_ALREADY_EXISTS);
+            }
+            return itr->second;
         }
-        if (p->parent)
+        bool exist;
+        bool isdir;
+        fat32::file_node *last;
+        auto walked = walk(root.get(), path, create_disposition, file_attr, exist, isdir, last);
+        if (!walked)
         {
-            fat32::Entry_Info tmp_info;
-            memcpy(&tmp_info, &p->info, sizeof(fat32::Entry_Info));
-            wcscpy(tmp_info.name, L".");
-            memcpy(tmp_info.short_name, this_folder, sizeof(this_folder));
-            add_entry(p, &tmp_info, 0, true);
-            memcpy(&tmp_info, &p->parent->info, sizeof(fat32::Entry_Info));
-            wcscpy(tmp_info.name, L"..");
-            memcpy(tmp_info.short_name, parent_folder, sizeof(parent_folder));
-            add_entry(p, &tmp_info, 0, true);
+            clear_node(last);
+            walked.value();
         }
-        for (const auto &c : p->children)
+        auto node = *walked;
+        held.push_back(node);
+        pinned.emplace(path, node);
+        return node;
+    };
+    // Data and attribute updates run under the shared lock like write(), so
+    // the rest of the volume keeps going; only a path seen for the first
+    // time needs the exclusive lock to walk.
+    auto resolve_shared = [&](const fat32::path &path) {
+        auto itr = pinned.find(path);
+        if (itr != pinned.end())
         {
-            add_entry(p, &c.second->info, 1, true);
+            return itr->second;
         }
-        fat32::dir_info res;
-        fat32::Entry_Info buf;
-        size_t index = 0;
-        int32_t ret;
-        while (index < p->entries.size() && (ret = DirEntry2EntryInfo(p->entries.data() + index, &buf)))
+        std::lock_guard<std::shared_mutex> t(tree_mtx);
+        return resolve(path, OPEN_EXISTING, 0);
+    };
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        const auto &op = ops[i];
+        try
         {
-            if (ret < 0)
+            switch (op.op)
             {
-                index -= ret;
+            case batch_op::CREATE:
+            {
+                std::lock_guard<std::shared_mutex> t(tree_mtx);
+                resolve(op.path, CREATE_NEW, op.attr);
+                break;
             }
-            else
+
+            case batch_op::WRITE:
+            {
+                auto p = resolve_shared(op.path);
+                std::shared_lock<std::shared_mutex> t(tree_mtx);
+                write_node(p, op.offset, op.len, op.data).value();
+                break;
+            }
+
+            case batch_op::SETATTR:
             {
-                res.push_back(buf);
-                index += ret;
+                auto p = resolve_shared(op.path);
+                std::shared_lock<std::shared_mutex> t(tree_mtx);
+                std::lock_guard<std::shared_mutex> g(p->mtx);
+                p->attr.attr = (p->attr.attr & 0x10) | (op.attr & 0x27);
+                break;
             }
+
+            case batch_op::RENAME:
+            {
+                std::lock_guard<std::shared_mutex> t(tree_mtx);
+                auto p = resolve(op.path, OPEN_EXISTING, 0);
+                if (op.new_path.empty() || !p->parent)
+                {
+                    throw fat32::file_error(fat32::file_error::FILE_NOT_FOUND);
+                }
+                bool exist;
+                bool isdir;
+                fat32::file_node *last;
+                auto walked = walk(root.get(), op.new_path, OPEN_EXISTING, 0, exist, isdir, last);
+                if (!walked)
+                {
+                    clear_node(last);
+                    if (walked.error() != fat32::file_error::FILE_NOT_FOUND)
+                    {
+                        walked.value();
+                    }
+                }
+                auto target = *walked;
+                if (target == p)
+                {
+                    // only the case of the name changes
+                    release(target);
+                    rename_node(p, root.get(), op.new_path, true);
+                }
+                else
+                {
+                    if (target)
+                    {
+                        fat32::status ok;
+                        if (!op.replace)
+                            ok = fat32::file_error::FILE_ALREADY_EXISTS;
+                        else if (target->isdir() != p->isdir())
+                            ok = p->isdir() ? fat32::file_error::FILE_NOT_DIR : fat32::file_error::FILE_IS_DIR;
+                        else if (target->isdir() && !dir_empty(target))
+                            ok = fat32::file_error::DIR_NOT_EMPTY;
+                        else
+                        {
+                            // removed as renameat does; open handles keep it
+                            orphan(target);
+                            for (auto itr = pinned.begin(); itr != pinned.end();)
+                            {
+                                itr = itr->second == target ? pinned.erase(itr) : std::next(itr);
+                            }
+                        }
+                        release(target);
+                        ok.value();
+                    }
+                    // every case rename_node refuses was ruled out above
+                    rename_node(p, root.get(), op.new_path, false);
+                }
+                pinned.erase(op.path);
+                pinned[op.new_path] = p;
+                break;
+            }
+
+            case batch_op::UNLINK:
+            {
+                std::lock_guard<std::shared_mutex> t(tree_mtx);
+                resolve(op.path, OPEN_EXISTING, 0)->delete_on_close = true;
+                break;
+            }
+            }
+        }
+        catch (...)
+        {
+            res[i] = std::current_exception();
         }
-        return std::move(res);
     }
-    else
+    // Releasing in one pass lets each parent write its entries back once,
+    // when its last pinned child goes.
+    std::lock_guard<std::shared_mutex> t(tree_mtx);
+    for (auto p : held)
     {
-        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+        release(p);
     }
+    return res;
+}
+
+fat32::dir_info dev_t::opendir(uint64_t fd)
+{
+    return try_opendir(fd).value();
+}
+
+fat32::result<fat32::dir_info> dev_t::try_opendir(uint64_t fd)
+{
+    fat32::stats::timer st(fat32::stats::OP_OPENDIR);
+    touch();
+    auto p = handles.get(fd);
+    if (!p)
+    {
+        return fat32::file_error::INVALID_FILE_DISCRIPTOR;
+    }
+    if (!p->isdir())
+    {
+        return fat32::file_error::FILE_NOT_DIR;
+    }
+    std::shared_lock<std::shared_mutex> t(tree_mtx);
+    std::lock_guard<std::shared_mutex> g(p->dir->mtx);
+    sync_dir(p);
+    load_cache(p);
+    fat32::dir_info res;
+    res.reserve(p->dir->cache.size());
+    for (const auto &r : p->dir->cache)
+    {
+        res.push_back(fat32::Entry_Info{std::wstring(r.name.view()), r.attr});
+    }
+    return res;
 }
 
 void dev_t::flush() {}
 
 void dev_t::get_disk_info(uint64_t *free_avilable, uint64_t *tot_size, uint64_t *tot_free)
 {
+    fat32::stats::timer st(fat32::stats::OP_GET_DISK_INFO);
+    std::lock_guard<std::mutex> g(alloc_mtx);
     if (free_avilable)
         *free_avilable = FSInfo.FSI_FreeCount * clus_size;
     if (tot_size)
@@ -758,113 +1330,291 @@ void dev_t::get_disk_info(uint64_t *free_avilable, uint64_t *tot_size, uint64_t
         *tot_free = FSInfo.FSI_FreeCount * clus_size;
 }
 
-std::unique_ptr<fat32::file_node> dev_t::open_file(fat32::file_node *parent, fat32::Entry_Info *pinfo)
+fat32::file_node *dev_t::get_node(uint64_t fd)
+{
+    auto p = handles.get(fd);
+    if (!p)
+    {
+        throw fat32::file_error(fat32::file_error::INVALID_FILE_DISCRIPTOR);
+    }
+    return p;
+}
+
+fat32::result<fat32::file_node *> dev_t::lookup(fat32::file_node *start, const fat32::path_view &path, uint32_t create_disposition,
+                                                bool &exist, bool &isdir)
+{
+    fat32::epoch::guard g;
+    auto last = start;
+    for (const auto &comp : path)
+    {
+        if (!last->isdir() || !(last = last->dir->children.find(comp.name, comp.hash)))
+        {
+            return nullptr;
+        }
+    }
+    if (create_disposition == CREATE_NEW)
+    {
+        if (last->ref_count.load(std::memory_order_acquire) & fat32::file_node::dead)
+        {
+            return nullptr;
+        }
+        return fat32::file_error::FILE_ALREADY_EXISTS;
+    }
+    if (!last->try_pin())
+    {
+        return nullptr;
+    }
+    exist = true;
+    isdir = last->isdir();
+    return last;
+}
+
+fat32::result<fat32::file_node *> dev_t::walk(fat32::file_node *start, const fat32::path_view &path, uint32_t create_disposition,
+                                              uint32_t file_attr, bool &exist, bool &isdir, fat32::file_node *&last)
+{
+    // find() outside dir->mtx races with a rehash by another walker, so the
+    // old slot array must stay alive until this walk is done with it.
+    fat32::epoch::guard g;
+    last = start;
+    for (auto itr = path.begin(); itr != path.end(); ++itr)
+    {
+        auto name = itr->name;
+        if (!last->isdir())
+        {
+            return fat32::file_error::FILE_NOT_FOUND;
+        }
+        auto child = last->dir->children.find(name, itr->hash);
+        if (!child)
+        {
+            std::lock_guard<std::shared_mutex> g(last->dir->mtx);
+            child = last->dir->children.find(name, itr->hash);
+            if (!child)
+            {
+                fat32::stats::add(fat32::stats::INDEX_MISSES);
+                load_cache(last);
+                auto rec = find_record(last, name);
+                if (rec != last->dir->cache.end())
+                {
+                    auto ptr = open_file(last, name, &rec->attr);
+                    child = ptr.get();
+                    last->dir->children.insert(std::move(ptr));
+                }
+                else if ((create_disposition == CREATE_ALWAYS || create_disposition == CREATE_NEW) && itr.last())
+                {
+                    exist = false;
+                    isdir = file_attr & 0x10;
+                    fat32::node_attr attr;
+                    memset(&attr, 0, sizeof(fat32::node_attr));
+                    gen_short(name, last, attr.short_name);
+                    attr.attr = (file_attr & 0x37);
+                    SYSTEMTIME time;
+                    GetSystemTime(&time);
+                    time.wMilliseconds = time.wMilliseconds / 10 * 10;
+                    SystemTimeToFileTime(&time, &attr.crt_time);
+                    time.wMilliseconds = 0;
+                    time.wSecond &= 0xfffffffe;
+                    SystemTimeToFileTime(&time, &attr.wrt_time);
+                    time.wHour = 0;
+                    time.wMinute = 0;
+                    time.wSecond = 0;
+                    SystemTimeToFileTime(&time, &attr.acc_time);
+                    try
+                    {
+                        add_entry(last, name, attr, 1, true);
+                    }
+                    catch (const fat32::file_error &e)
+                    {
+                        return e.get_error_type();
+                    }
+                    auto ptr = open_file(last, name, &attr);
+                    ptr->ref_count.fetch_add(1, std::memory_order_relaxed);
+                    auto temp = ptr.get();
+                    if (temp->isdir())
+                    {
+                        try
+                        {
+                            add_dot_entries(temp);
+                        }
+                        catch (const fat32::file_error &e)
+                        {
+                            remove_entry(last, name);
+                            return e.get_error_type();
+                        }
+                    }
+                    last->dir->children.insert(std::move(ptr));
+                    return temp;
+                }
+                else
+                {
+                    return fat32::file_error::FILE_NOT_FOUND;
+                }
+            }
+        }
+        else
+        {
+            fat32::stats::add(fat32::stats::INDEX_HITS);
+        }
+        last = child;
+    }
+    if (create_disposition == CREATE_NEW)
+    {
+        return fat32::file_error::FILE_ALREADY_EXISTS;
+    }
+    exist = true;
+    isdir = last->isdir();
+    last->ref_count.fetch_add(1, std::memory_order_relaxed);
+    return last;
+}
+
+void dev_t::release(fat32::file_node *node)
+{
+    node->ref_count.fetch_sub(1, std::memory_order_acq_rel);
+    clear_node(node);
+}
+
+fat32::node_attr dev_t::get_attr(fat32::file_node *node)
+{
+    std::shared_lock<std::shared_mutex> g(node->mtx);
+    return node->attr;
+}
+
+std::unique_ptr<fat32::file_node> dev_t::open_file(fat32::file_node *parent, std::wstring_view name, const fat32::node_attr *pattr)
 {
     auto res = std::make_unique<fat32::file_node>(parent);
-    auto first_clus = pinfo->first_clus;
+    res->name = fat32::pooled_name(&names, name);
+    res->attr = *pattr;
+    auto first_clus = pattr->first_clus;
     while (first_clus >= 2 && first_clus < count_of_cluster + 2)
     {
         res->alloc.push_back(first_clus);
         first_clus = get_fat(first_clus);
     }
-    memcpy(&res->info, parent ? pinfo : &root_info, sizeof(fat32::Entry_Info));
-    if (res->info.info.dwFileAttributes & 0x10)
+    if (res->attr.isdir())
     {
-        res->entries.resize(res->alloc.size() * clus_size / sizeof(fat32::DIR_Entry));
+        res->dir = std::make_unique<fat32::dir_data>();
+        auto &entries = res->dir->entries;
+        entries.resize(res->alloc.size() * clus_size / sizeof(fat32::DIR_Entry));
         size_t count = 0;
         for (auto clus_no : res->alloc)
         {
-            read_clus(clus_no, res->entries.data() + count);
+            read_clus(clus_no, entries.data() + count);
             count += clus_size / sizeof(fat32::DIR_Entry);
         }
+        res->dir->dirty.assign(res->alloc.size(), false);
+        for (const auto &e : entries)
+        {
+            if ((uint8_t)e.DIR_Name[0] == 0xe5)
+            {
+                ++res->dir->deleted_count;
+            }
+        }
     }
-    res->delete_on_close = false;
-    return std::move(res);
+    return res;
 }
 
 void dev_t::save(fat32::file_node *node)
 {
     if (node)
     {
-        if (node->info.info.dwFileAttributes & 0x10)
+        if (node->isdir())
         {
-            if (node->parent)
-            {
-                fat32::Entry_Info tmp_info;
-                memcpy(&tmp_info, &node->info, sizeof(fat32::Entry_Info));
-                wcscpy(tmp_info.name, L".");
-                memcpy(tmp_info.short_name, this_folder, sizeof(this_folder));
-                add_entry(node, &tmp_info, 0, true);
-                memcpy(&tmp_info, &node->parent->info, sizeof(fat32::Entry_Info));
-                wcscpy(tmp_info.name, L"..");
-                memcpy(tmp_info.short_name, parent_folder, sizeof(parent_folder));
-                add_entry(node, &tmp_info, 0, true);
-            }
-            for (auto &p : node->children)
-            {
-                save(p.second.get());
-            }
-            size_t index = 0;
-            for (auto clus : node->alloc)
-            {
-                write_clus(clus, node->entries.data() + index * (clus_size / sizeof(fat32::DIR_Entry)));
-                ++index;
-            }
+            add_dot_entries(node);
+            node->dir->children.for_each([this](fat32::file_node *child) { save(child); });
+            write_dir(node);
         }
         if (node->parent)
         {
-            add_entry(node->parent, &node->info, 1, true);
+            add_entry(node->parent, node->name.view(), get_attr(node), 1, true);
         }
     }
 }
 
+void dev_t::add_dot_entries(fat32::file_node *node)
+{
+    if (node->parent)
+    {
+        auto attr = get_attr(node);
+        memcpy(attr.short_name, this_folder, sizeof(this_folder));
+        add_entry(node, L".", attr, 0, true);
+        attr = get_attr(node->parent);
+        memcpy(attr.short_name, parent_folder, sizeof(parent_folder));
+        add_entry(node, L"..", attr, 0, true);
+    }
+}
+
+void dev_t::sync_dir(fat32::file_node *node)
+{
+    add_dot_entries(node);
+    node->dir->children.for_each([this, node](fat32::file_node *child) {
+        add_entry(node, child->name.view(), get_attr(child), 1, true);
+    });
+}
+
+void dev_t::fill_info(const fat32::node_attr &attr, LPBY_HANDLE_FILE_INFORMATION pinfo) const
+{
+    pinfo->dwFileAttributes = attr.attr;
+    pinfo->ftCreationTime = attr.crt_time;
+    pinfo->ftLastAccessTime = attr.acc_time;
+    pinfo->ftLastWriteTime = attr.wrt_time;
+    pinfo->dwVolumeSerialNumber = get_vol_id();
+    ULARGE_INTEGER int_tmp;
+    int_tmp.QuadPart = attr.size;
+    pinfo->nFileSizeHigh = int_tmp.HighPart;
+    pinfo->nFileSizeLow = int_tmp.LowPart;
+    pinfo->nNumberOfLinks = attr.isdir() ? 2 : 1;
+    int_tmp.QuadPart = attr.first_clus;
+    pinfo->nFileIndexHigh = int_tmp.HighPart;
+    pinfo->nFileIndexLow = int_tmp.LowPart;
+}
+
 void dev_t::clear_node(fat32::file_node *node)
 {
-    if (!node->ref_count.load(std::memory_order_acquire) && node->children.empty())
+    if (node->dir && !node->dir->children.empty())
+    {
+        return;
+    }
+    if (!node->parent && node != root.get())
+    {
+        uint64_t idle = 0;
+        if (node->ref_count.compare_exchange_strong(idle, fat32::file_node::dead, std::memory_order_acq_rel))
+        {
+            shrink(node, 0);
+            auto itr = std::find_if(orphans.begin(), orphans.end(),
+                                    [node](const std::unique_ptr<fat32::file_node> &p) { return p.get() == node; });
+            fat32::epoch::retire(itr->release());
+            orphans.erase(itr);
+        }
+        return;
+    }
+    // Lock-free lookups may pin a linked node at any time, so the last
+    // reference is claimed by marking it dead rather than by reading zero.
+    uint64_t idle = 0;
+    if (node->parent ? node->ref_count.compare_exchange_strong(idle, fat32::file_node::dead, std::memory_order_acq_rel)
+                     : !node->ref_count.load(std::memory_order_acquire))
     {
         if (node->delete_on_close)
         {
             if (node->parent)
             {
-                std::wstring name = node->info.name;
                 auto parent = node->parent;
                 shrink(node, 0);
-                open_file_table.erase((uint64_t)node);
-                parent->children.erase(name);
-                remove_entry(parent, name);
+                remove_entry(parent, node->name.view());
+                fat32::epoch::retire(parent->dir->children.erase(node->name.view()).release());
                 clear_node(parent);
             }
         }
         else
         {
-            if (node->info.info.dwFileAttributes & 0x10)
+            if (node->isdir())
             {
-                if (node->parent)
-                {
-                    fat32::Entry_Info tmp_info;
-                    memcpy(&tmp_info, &node->info, sizeof(fat32::Entry_Info));
-                    wcscpy(tmp_info.name, L".");
-                    memcpy(tmp_info.short_name, this_folder, sizeof(this_folder));
-                    add_entry(node, &tmp_info, 0, true);
-                    memcpy(&tmp_info, &node->parent->info, sizeof(fat32::Entry_Info));
-                    wcscpy(tmp_info.name, L"..");
-                    memcpy(tmp_info.short_name, parent_folder, sizeof(parent_folder));
-                    add_entry(node, &tmp_info, 0, true);
-                }
-                size_t index = 0;
-                for (auto clus : node->alloc)
-                {
-                    write_clus(clus, node->entries.data() + index * (clus_size / sizeof(fat32::DIR_Entry)));
-                    ++index;
-                }
+                add_dot_entries(node);
+                write_dir(node);
             }
             if (node->parent)
             {
-                std::wstring name = node->info.name;
                 auto parent = node->parent;
-                add_entry(parent, &node->info, 1, true);
-                open_file_table.erase((uint64_t)node);
-                parent->children.erase(name);
+                add_entry(parent, node->name.view(), node->attr, 1, true);
+                fat32::epoch::retire(parent->dir->children.erase(node->name.view()).release());
                 clear_node(parent);
             }
         }
@@ -873,13 +1623,33 @@ void dev_t::clear_node(fat32::file_node *node)
 
 uint32_t dev_t::next_free()
 {
+    if (!FSInfo.FSI_FreeCount)
+    {
+        throw fat32::file_error(fat32::file_error::DISK_FULL);
+    }
+    // FAT entries past count_of_cluster + 1 are room reserved for grow()
+    auto end = count_of_cluster + 2;
     auto clus = FSInfo.FSI_Nxt_Free;
+    if (clus < 2 || clus >= end)
+    {
+        clus = 2;
+    }
+    auto start = clus;
     while (get_fat(clus))
     {
-        ++clus;
+        if (++clus == end)
+        {
+            clus = 2;
+        }
+        if (clus == start)
+        {
+            // FSI_FreeCount was stale
+            FSInfo.FSI_FreeCount = 0;
+            throw fat32::file_error(fat32::file_error::DISK_FULL);
+        }
     }
     set_fat(clus, 0x0fffffff);
-    FSInfo.FSI_Nxt_Free = clus + 1;
+    FSInfo.FSI_Nxt_Free = (clus + 1 == end ? 2 : clus + 1);
     --FSInfo.FSI_FreeCount;
     return clus;
 }
@@ -898,15 +1668,18 @@ void dev_t::extend(fat32::file_node *node, uint32_t clus_count)
 {
     if (node->alloc.size() < clus_count)
     {
+        std::lock_guard<std::mutex> g(alloc_mtx);
         size_t extend_size = clus_count - node->alloc.size();
+        if (extend_size > FSInfo.FSI_FreeCount)
+        {
+            throw fat32::file_error(fat32::file_error::DISK_FULL);
+        }
         for (size_t i = 0; i < extend_size; ++i)
         {
             auto next = next_free();
             if (node->alloc.empty())
             {
-                node->info.first_clus = next;
-                node->info.info.nFileIndexHigh = 0;
-                node->info.info.nFileIndexLow = next;
+                node->attr.first_clus = next;
             }
             else
             {
@@ -921,6 +1694,8 @@ void dev_t::shrink(fat32::file_node *node, uint32_t clus_count)
 {
     if (node->alloc.size() > clus_count)
     {
+        drain_io(node);
+        std::lock_guard<std::mutex> g(alloc_mtx);
         size_t shrink_size = node->alloc.size() - clus_count;
         for (size_t i = 0; i < shrink_size; ++i)
         {
@@ -929,9 +1704,7 @@ void dev_t::shrink(fat32::file_node *node, uint32_t clus_count)
         }
         if (node->alloc.empty())
         {
-            node->info.first_clus = 0;
-            node->info.info.nFileIndexHigh = 0;
-            node->info.info.nFileIndexLow = 0;
+            node->attr.first_clus = 0;
         }
         else
         {
@@ -940,101 +1713,250 @@ void dev_t::shrink(fat32::file_node *node, uint32_t clus_count)
     }
 }
 
-void dev_t::add_entry(fat32::file_node *node, fat32::Entry_Info *pinfo, int have_long, bool replace)
+void dev_t::add_entry(fat32::file_node *node, std::wstring_view name, const fat32::node_attr &attr, int have_long, bool replace)
 {
-    log_msg("add_entry: %s\n", wide2local(pinfo->name).c_str());
-    log_pointer("    ", pinfo);
-    log_int32("    ", have_long);
-    log_bool("    ", replace);
+    log_trace("add_entry: %s\n    &attr = %p\n    have_long = %d\n    replace = %s\n", name, &attr, have_long, replace ? "true" : "false");
     size_t entry_len = 1;
     if (have_long)
     {
-        entry_len += (wcslen(pinfo->name) + 13 - 1) / 13;
+        entry_len += (utf16_len(name) + 13 - 1) / 13;
     }
-    size_t index = 0;
-    fat32::Entry_Info buf;
-    int32_t ret;
-    while (index < node->entries.size() && (ret = DirEntry2EntryInfo(node->entries.data() + index, &buf)))
+    load_cache(node);
+    auto itr = find_record(node, name);
+    if (itr != node->dir->cache.end())
     {
-        if (ret < 0)
+        if (!replace)
         {
-            index -= ret;
+            return;
         }
-        else
+        if (itr->len >= entry_len)
         {
-            if (wcscmp(buf.name, pinfo->name) == 0)
+            size_t index = itr->index;
+            size_t ret = itr->len;
+            if (write_entry(node, index, name, attr, have_long, entry_len))
             {
-                if (replace)
-                {
-                    if (ret >= entry_len)
-                    {
-                        EntryInfo2DirEntry(pinfo, node->entries.data() + index, have_long);
-                        for (size_t i = index + entry_len; i < index + ret; ++i)
-                        {
-                            *(uint8_t *)node->entries[i].DIR_Name = 0xe5;
-                        }
-                        return;
-                    }
-                    else
-                    {
-                        for (size_t i = index; i < index + ret; ++i)
-                        {
-                            *(uint8_t *)node->entries[i].DIR_Name = 0xe5;
-                        }
-                    }
-                }
-                else
-                {
-                    return;
-                }
+                mark_deleted(node, index + entry_len, index + ret);
+                update_cache(node, index);
             }
-            index += ret;
+            return;
         }
+        mark_deleted(node, itr->index, itr->index + itr->len);
+        node->dir->cache.erase(itr);
     }
-    if (node->entries.size() - index < entry_len)
+    size_t index = node->dir->cache.empty() ? 0 : node->dir->cache.back().index + node->dir->cache.back().len;
+    if (node->dir->deleted_count >= entry_len)
+    {
+        auto hole = dir_scan::find_free_run(node->dir->entries.data(), index, entry_len);
+        if (hole < index)
+        {
+            write_entry(node, hole, name, attr, have_long, entry_len);
+            node->dir->deleted_count -= entry_len;
+            update_cache(node, hole);
+            return;
+        }
+    }
+    if (node->dir->entries.size() - index < entry_len)
     {
         size_t new_clus_count = ((index + entry_len) * sizeof(fat32::DIR_Entry) + clus_size - 1) / clus_size;
         extend(node, new_clus_count);
-        node->entries.resize(new_clus_count * clus_size / sizeof(fat32::DIR_Entry));
-        memset(node->entries.data() + index + entry_len, 0, (node->entries.size() - index - entry_len) * sizeof(fat32::DIR_Entry));
+        node->dir->entries.resize(new_clus_count * clus_size / sizeof(fat32::DIR_Entry));
+        node->dir->dirty.resize(new_clus_count, true);
+        memset(node->dir->entries.data() + index + entry_len, 0, (node->dir->entries.size() - index - entry_len) * sizeof(fat32::DIR_Entry));
+    }
+    // deleted slots left between the last record and the end marker
+    for (size_t i = index; i < std::min(index + entry_len, node->dir->entries.size()); ++i)
+    {
+        if ((uint8_t)node->dir->entries[i].DIR_Name[0] == 0xe5)
+        {
+            --node->dir->deleted_count;
+        }
     }
-    EntryInfo2DirEntry(pinfo, node->entries.data() + index, have_long);
+    write_entry(node, index, name, attr, have_long, entry_len);
+    update_cache(node, index);
 }
 
 void dev_t::remove_entry(fat32::file_node *node, std::wstring_view name)
 {
-    size_t index = 0;
-    fat32::Entry_Info buf;
-    int32_t ret;
-    while (index < node->entries.size() && (ret = DirEntry2EntryInfo(node->entries.data() + index, &buf)))
+    // the classify pass runs once when the cache is built; after that the
+    // name is found among decoded records, so there is no raw scan to speed up
+    load_cache(node);
+    auto itr = find_record(node, name);
+    if (itr != node->dir->cache.end())
     {
-        if (ret < 0)
+        size_t index = itr->index;
+        size_t ret = itr->len;
+        node->dir->cache.erase(itr);
+        if (index + ret == node->dir->entries.size() || *(uint8_t *)node->dir->entries[index + ret].DIR_Name == 0)
         {
-            index -= ret;
+            memset(&node->dir->entries[index], 0, ret * sizeof(fat32::DIR_Entry));
+            mark_dirty(node, index, index + ret);
         }
         else
         {
-            if (buf.name == name)
+            mark_deleted(node, index, index + ret);
+        }
+        size_t per_clus = clus_size / sizeof(fat32::DIR_Entry);
+        if (node->dir->deleted_count >= per_clus && node->dir->deleted_count * 4 >= node->dir->entries.size())
+        {
+            compact(node);
+        }
+    }
+}
+
+bool dev_t::write_entry(fat32::file_node *node, size_t index, std::wstring_view name, const fat32::node_attr &attr,
+                        int have_long, size_t entry_len)
+{
+    fat32::DIR_Entry tmp[21];
+    memcpy(tmp, node->dir->entries.data() + index, entry_len * sizeof(fat32::DIR_Entry));
+    Attr2DirEntry(name, &attr, tmp, have_long);
+    return set_entries(node, index, tmp, entry_len);
+}
+
+bool dev_t::set_entries(fat32::file_node *node, size_t index, const fat32::DIR_Entry *pentry, size_t count)
+{
+    if (memcmp(node->dir->entries.data() + index, pentry, count * sizeof(fat32::DIR_Entry)) != 0)
+    {
+        memcpy(node->dir->entries.data() + index, pentry, count * sizeof(fat32::DIR_Entry));
+        mark_dirty(node, index, index + count);
+        return true;
+    }
+    return false;
+}
+
+void dev_t::mark_deleted(fat32::file_node *node, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        auto first = (uint8_t *)node->dir->entries[i].DIR_Name;
+        if (*first != 0xe5)
+        {
+            *first = 0xe5;
+            ++node->dir->deleted_count;
+        }
+    }
+    mark_dirty(node, begin, end);
+}
+
+void dev_t::mark_dirty(fat32::file_node *node, size_t begin, size_t end)
+{
+    if (begin < end)
+    {
+        size_t per_clus = clus_size / sizeof(fat32::DIR_Entry);
+        for (size_t i = begin / per_clus; i <= (end - 1) / per_clus; ++i)
+        {
+            node->dir->dirty[i] = true;
+        }
+    }
+}
+
+void dev_t::write_dir(fat32::file_node *node)
+{
+    size_t per_clus = clus_size / sizeof(fat32::DIR_Entry);
+    for (size_t i = 0; i < node->alloc.size(); ++i)
+    {
+        if (node->dir->dirty[i])
+        {
+            write_clus(node->alloc[i], node->dir->entries.data() + i * per_clus);
+            node->dir->dirty[i] = false;
+        }
+    }
+}
+
+void dev_t::compact(fat32::file_node *node)
+{
+    // entries are moved verbatim, so every LFN group keeps its SFN and checksum
+    auto &entries = node->dir->entries;
+    std::vector<uint8_t> types(entries.size());
+    dir_scan::classify(entries.data(), entries.size(), types.data());
+    size_t src = 0, dst = 0, first = entries.size();
+    while (src < entries.size() && types[src] != dir_scan::ENTRY_END)
+    {
+        if (types[src] == dir_scan::ENTRY_DELETED)
+        {
+            first = std::min(first, dst);
+            ++src;
+            continue;
+        }
+        auto begin = src;
+        while (src < entries.size() && types[src] == dir_scan::ENTRY_LONG)
+        {
+            ++src;
+        }
+        if (src == entries.size() || types[src] != dir_scan::ENTRY_SHORT)
+        {
+            // orphaned long name fragments, drop them
+            first = std::min(first, dst);
+            continue;
+        }
+        ++src;
+        if (dst != begin)
+        {
+            memmove(&entries[dst], &entries[begin], (src - begin) * sizeof(fat32::DIR_Entry));
+        }
+        dst += src - begin;
+    }
+    node->dir->deleted_count = 0;
+    if (first == entries.size())
+    {
+        return;
+    }
+    memset(entries.data() + dst, 0, (entries.size() - dst) * sizeof(fat32::DIR_Entry));
+    size_t per_clus = clus_size / sizeof(fat32::DIR_Entry);
+    size_t clus_count = std::max<size_t>((dst + per_clus - 1) / per_clus, 1);
+    shrink(node, clus_count);
+    entries.resize(node->alloc.size() * per_clus);
+    node->dir->dirty.resize(node->alloc.size());
+    node->dir->cache_valid = false;
+    mark_dirty(node, first, entries.size());
+}
+
+void dev_t::load_cache(fat32::file_node *node)
+{
+    fat32::stats::add(node->dir->cache_valid ? fat32::stats::DIR_CACHE_HITS : fat32::stats::DIR_CACHE_MISSES);
+    if (!node->dir->cache_valid)
+    {
+        node->dir->cache.clear();
+        std::vector<uint8_t> types(node->dir->entries.size());
+        dir_scan::classify(node->dir->entries.data(), types.size(), types.data());
+        wchar_t name[256];
+        fat32::node_attr attr;
+        size_t index = 0;
+        while (index < types.size() && types[index] != dir_scan::ENTRY_END)
+        {
+            if (types[index] == dir_scan::ENTRY_DELETED)
             {
-                if (*(uint8_t *)node->entries[index + ret].DIR_Name == 0)
-                {
-                    memset(&node->entries[index], 0, ret * sizeof(fat32::DIR_Entry));
-                }
-                else
-                {
-                    for (size_t i = index; i < index + ret; ++i)
-                    {
-                        *(uint8_t *)node->entries[i].DIR_Name = 0xe5;
-                    }
-                }
-                return;
+                ++index;
+                continue;
             }
-            index += ret;
+            size_t len = DirEntry2Attr(node->dir->entries.data() + index, name, &attr);
+            node->dir->cache.push_back(fat32::dir_record{(uint32_t)index, (uint32_t)len, fat32::pooled_name(&names, name), attr});
+            index += len;
         }
+        node->dir->cache_valid = true;
     }
 }
 
-int32_t dev_t::DirEntry2EntryInfo(const fat32::DIR_Entry *pdir, fat32::Entry_Info *pinfo)
+void dev_t::update_cache(fat32::file_node *node, size_t index)
+{
+    auto itr = std::lower_bound(node->dir->cache.begin(), node->dir->cache.end(), index,
+                                [](const fat32::dir_record &r, size_t i) { return r.index < i; });
+    if (itr == node->dir->cache.end() || itr->index != index)
+    {
+        itr = node->dir->cache.emplace(itr);
+    }
+    wchar_t name[256];
+    itr->index = index;
+    itr->len = DirEntry2Attr(node->dir->entries.data() + index, name, &itr->attr);
+    itr->name = fat32::pooled_name(&names, name);
+}
+
+fat32::dir_cache::iterator dev_t::find_record(fat32::file_node *node, std::wstring_view name)
+{
+    return std::find_if(node->dir->cache.begin(), node->dir->cache.end(),
+                        [name](const fat32::dir_record &r) { return name == r.name.view(); });
+}
+
+int32_t dev_t::DirEntry2Attr(const fat32::DIR_Entry *pdir, wchar_t *out_name, fat32::node_attr *pattr)
 {
     if (pdir[0].DIR_Name[0] == 0)
     {
@@ -1053,7 +1975,7 @@ int32_t dev_t::DirEntry2EntryInfo(const fat32::DIR_Entry *pdir, fat32::Entry_Inf
         }
         return -count;
     }
-    wchar_t name[256];
+    uint16_t name[256];
     int name_pos = 255;
     int have_long_name = 0;
     fat32::LDIR_Entry *ldir = (fat32::LDIR_Entry *)pdir;
@@ -1061,13 +1983,17 @@ int32_t dev_t::DirEntry2EntryInfo(const fat32::DIR_Entry *pdir, fat32::Entry_Inf
     {
         if (ldir[count].LDIR_Ord & 0x40)
         {
-            wchar_t tmp[13];
+            uint16_t tmp[13];
             memcpy(tmp + 11, ldir[count].LDIR_Name3, sizeof(ldir[count].LDIR_Name3));
             memcpy(tmp + 5, ldir[count].LDIR_Name2, sizeof(ldir[count].LDIR_Name2));
             memcpy(tmp, ldir[count].LDIR_Name1, sizeof(ldir[count].LDIR_Name1));
-            size_t len = wcsnlen(tmp, 13);
+            size_t len = 0;
+            while (len < 13 && tmp[len])
+            {
+                ++len;
+            }
             name_pos = 255 - len;
-            wcsncpy(name + name_pos, tmp, 13);
+            memcpy(name + name_pos, tmp, len * sizeof(uint16_t));
             have_long_name = 1;
         }
         else
@@ -1079,10 +2005,10 @@ int32_t dev_t::DirEntry2EntryInfo(const fat32::DIR_Entry *pdir, fat32::Entry_Inf
         }
         ++count;
     }
-    memset(pinfo, 0, sizeof(fat32::Entry_Info));
+    memset(pattr, 0, sizeof(fat32::node_attr));
     if (have_long_name)
     {
-        wcscpy(pinfo->name, name + name_pos);
+        utf16_decode(name + name_pos, 255 - name_pos, out_name);
     }
     else
     {
@@ -1090,21 +2016,21 @@ int32_t dev_t::DirEntry2EntryInfo(const fat32::DIR_Entry *pdir, fat32::Entry_Inf
         int index = 0;
         for (int k = 0; k < 8 && (c = pdir[count].DIR_Name[k]) != 0x20; ++k)
         {
-            pinfo->name[index++] = c;
+            out_name[index++] = c;
         }
         if (pdir[count].DIR_Name[8] != 0x20)
         {
-            pinfo->name[index++] = L'.';
+            out_name[index++] = L'.';
             for (int k = 8; k < 11 && (c = pdir[count].DIR_Name[k]) != 0x20; ++k)
             {
-                pinfo->name[index++] = c;
+                out_name[index++] = c;
             }
         }
+        out_name[index] = 0;
     }
-    memcpy(pinfo->short_name, pdir[count].DIR_Name, sizeof(pinfo->short_name));
-    pinfo->first_clus = ((uint32_t)(pdir[count].DIR_FstClusHI) << 16) + pdir[count].DIR_FstClusLO;
-    pinfo->info.dwFileAttributes = FatAttr2FileAttr(pdir[count].DIR_Attr);
-    pinfo->info.dwVolumeSerialNumber = get_vol_id();
+    memcpy(pattr->short_name, pdir[count].DIR_Name, sizeof(pattr->short_name));
+    pattr->first_clus = ((uint32_t)(pdir[count].DIR_FstClusHI) << 16) + pdir[count].DIR_FstClusLO;
+    pattr->attr = FatAttr2FileAttr(pdir[count].DIR_Attr);
     SYSTEMTIME systime;
     FILETIME filetime;
     memset(&systime, 0, sizeof(SYSTEMTIME));
@@ -1116,7 +2042,7 @@ int32_t dev_t::DirEntry2EntryInfo(const fat32::DIR_Entry *pdir, fat32::Entry_Inf
     systime.wSecond = (pdir[count].DIR_CrtTime & 0x1f) * 2 + pdir[count].DIR_CrtTimeTenth / 100;
     systime.wMilliseconds = (pdir[count].DIR_CrtTimeTenth % 100) * 10;
     SystemTimeToFileTime(&systime, &filetime);
-    LocalFileTimeToFileTime(&filetime, &pinfo->info.ftCreationTime);
+    LocalFileTimeToFileTime(&filetime, &pattr->crt_time);
     memset(&systime, 0, sizeof(SYSTEMTIME));
     systime.wYear = (pdir[count].DIR_WrtDate >> 9) + 1980;
     systime.wMonth = ((pdir[count].DIR_WrtDate & 0x1e0) >> 5);
@@ -1125,22 +2051,14 @@ int32_t dev_t::DirEntry2EntryInfo(const fat32::DIR_Entry *pdir, fat32::Entry_Inf
     systime.wMinute = ((pdir[count].DIR_WrtTime & 0x7e0) >> 5);
     systime.wSecond = (pdir[count].DIR_WrtTime & 0x1f) * 2;
     SystemTimeToFileTime(&systime, &filetime);
-    LocalFileTimeToFileTime(&filetime, &pinfo->info.ftLastWriteTime);
+    LocalFileTimeToFileTime(&filetime, &pattr->wrt_time);
     memset(&systime, 0, sizeof(SYSTEMTIME));
     systime.wYear = (pdir[count].DIR_LstAccDate >> 9) + 1980;
     systime.wMonth = ((pdir[count].DIR_LstAccDate & 0x1e0) >> 5);
     systime.wDay = (pdir[count].DIR_LstAccDate & 0x1f);
     SystemTimeToFileTime(&systime, &filetime);
-    LocalFileTimeToFileTime(&filetime, &pinfo->info.ftLastAccessTime);
-    ULARGE_INTEGER file_index;
-    file_index.QuadPart = pinfo->first_clus;
-    pinfo->info.nFileIndexHigh = file_index.HighPart;
-    pinfo->info.nFileIndexLow = file_index.LowPart;
-    ULARGE_INTEGER file_size;
-    file_size.QuadPart = pdir[count].DIR_FileSize;
-    pinfo->info.nFileSizeHigh = file_size.HighPart;
-    pinfo->info.nFileSizeLow = file_size.LowPart;
-    pinfo->info.nNumberOfLinks = (pdir[count].DIR_Attr & 0x10) ? 2 : 1;
+    LocalFileTimeToFileTime(&filetime, &pattr->acc_time);
+    pattr->size = pdir[count].DIR_FileSize;
     return count + 1;
 }
 
@@ -1,15 +1,34 @@
+#include <algorithm>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <getopt.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "vfat_ioctl.h"
+#endif
 #include "dev_io.h"
+#include "image_builder.h"
 
 option long_options[] = {
     {"block", required_argument, NULL, 'b'},
+    {"cluster", required_argument, NULL, 'c'},
+    {"align", required_argument, NULL, 'a'},
+    {"max-size", required_argument, NULL, 'm'},
+    {"grow", no_argument, NULL, 'g'},
+    {"dir", required_argument, NULL, 'd'},
+    {"threads", required_argument, NULL, 'j'},
     {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
 };
 
 void print_help(char *argv0)
@@ -20,65 +39,94 @@ void print_help(char *argv0)
         "Arguments:\n"
         "  -b, --block                block size in bytes, default 512\n"
         "                             can be 512, 1024, 2048 or 4096\n"
+        "  -c, --cluster              cluster size, a power of two from the block\n"
+        "                             size up to 32KiB, default picked by FILESIZE\n"
+        "  -a, --align                start the FATs and the data region on this\n"
+        "                             boundary, a power of two from the block size\n"
+        "                             up to 16MiB, e.g. 4KiB or 1MiB\n"
+        "  -m, --max-size             reserve room in the FATs so the disk can\n"
+        "                             later grow up to this size\n"
+        "  -g, --grow                 grow the existing disk NAME to FILESIZE\n"
+        "                             instead of creating one; NAME may also be\n"
+        "                             the mount point of a disk served by\n"
+        "                             fuse_disk, which stays mounted\n"
+        "  -d, --dir                  copy the tree under this host directory\n"
+        "                             into the new disk\n"
+        "  -j, --threads              threads reading host files for --dir,\n"
+        "                             default one per core\n"
         "  -h, --help                 show help messages\n"
         "The FILESIZE argument is an integer and a unit.\n"
-        "Units are MiB,GiB (powers of 1024) or MB,GB (powers of 1000).\n",
+        "Units are KiB,MiB,GiB (powers of 1024) or KB,MB,GB (powers of 1000).\n"
+        "Sizes given to options may also be plain numbers of bytes.\n",
         argv0);
 }
 
 uint64_t get_size(const char *str)
 {
-    uint64_t res = atoi(str);
-    if (!res)
+    char *head;
+    errno = 0;
+    uint64_t res = strtoull(str, &head, 10);
+    if (head == str || !isdigit(*str))
     {
         auto msg = std::string(str) + " does not contain a valid number";
         throw std::runtime_error(msg.c_str());
     }
-    auto head = str;
-    while (isdigit(*head))
+    if (!res)
     {
-        ++head;
+        throw std::runtime_error("size must not be zero");
     }
-    auto len = strlen(str);
-    auto unit_len = len - (head - str);
-    if (unit_len == 2)
+    if (errno == ERANGE)
     {
-        if (strcmp(head, "MB") == 0)
-        {
-            res *= 1000000;
-        }
-        else if (strcmp(head, "GB") == 0)
-        {
-            res *= 1000000000;
-        }
-        else
-        {
-            auto msg = std::string(head) + " is not a valid unit";
-            throw std::runtime_error(msg.c_str());
-        }
-    }
-    else if (unit_len == 3)
-    {
-        if (strcmp(head, "MiB") == 0)
-        {
-            res *= 1024 * 1024;
-        }
-        else if (strcmp(head, "GiB") == 0)
-        {
-            res *= 1024 * 1024 * 1024;
-        }
-        else
-        {
-            auto msg = std::string(head) + " is not a valid unit";
-            throw std::runtime_error(msg.c_str());
-        }
+        auto msg = std::string(str) + " is too large";
+        throw std::runtime_error(msg.c_str());
     }
+    uint64_t unit;
+    if (*head == 0)
+        unit = 1;
+    else if (strcmp(head, "KB") == 0)
+        unit = 1000;
+    else if (strcmp(head, "MB") == 0)
+        unit = 1000000;
+    else if (strcmp(head, "GB") == 0)
+        unit = 1000000000;
+    else if (strcmp(head, "KiB") == 0)
+        unit = 1024;
+    else if (strcmp(head, "MiB") == 0)
+        unit = 1024 * 1024;
+    else if (strcmp(head, "GiB") == 0)
+        unit = 1024 * 1024 * 1024;
     else
     {
         auto msg = std::string(head) + " is not a valid unit";
         throw std::runtime_error(msg.c_str());
     }
-    return res;
+    if (res > UINT64_MAX / unit)
+    {
+        auto msg = std::string(str) + " is too large";
+        throw std::runtime_error(msg.c_str());
+    }
+    return res * unit;
+}
+
+void grow_disk(const char *name, uint64_t size)
+{
+#ifndef _WIN32
+    struct stat st;
+    if (stat(name, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        int fd = open(name, O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+            throw std::runtime_error(strerror(errno));
+        int res = ioctl(fd, VFAT_IOC_GROW, &size);
+        int err = errno;
+        close(fd);
+        if (res != 0)
+            throw std::runtime_error(strerror(err));
+        return;
+    }
+#endif
+    dev_io::dev_t dev(name);
+    dev.grow(size);
 }
 
 int main(int argc, char *argv[])
@@ -94,6 +142,13 @@ int main(int argc, char *argv[])
 
     opterr = 0;
     uint16_t block_size = 512;
+    dev_io::format_options opts;
+    const char *clus_str = nullptr;
+    const char *align_str = nullptr;
+    const char *max_str = nullptr;
+    bool grow = false;
+    const char *src = nullptr;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
     int invalid_opt = 0;
 
     while (true)
@@ -102,14 +157,38 @@ int main(int argc, char *argv[])
             break;
 
         int option_index;
-        int c = getopt_long(argc, argv, "b:h", long_options, &option_index);
+        int c = getopt_long(argc, argv, "b:c:a:m:gd:j:h", long_options, &option_index);
         if (c == -1)
             break;
 
         switch (c)
         {
         case 'b':
-            block_size = atoi(optarg);
+            block_size = (uint16_t)std::min(strtoul(optarg, NULL, 10), 65535ul);
+            break;
+
+        case 'c':
+            clus_str = optarg;
+            break;
+
+        case 'a':
+            align_str = optarg;
+            break;
+
+        case 'm':
+            max_str = optarg;
+            break;
+
+        case 'g':
+            grow = true;
+            break;
+
+        case 'd':
+            src = optarg;
+            break;
+
+        case 'j':
+            threads = std::max(1, atoi(optarg));
             break;
 
         case 'h':
@@ -139,7 +218,7 @@ int main(int argc, char *argv[])
 
     if (block_size != 512 && block_size != 1024 && block_size != 2048 && block_size != 4096)
     {
-        fprintf(stderr, "%hd is not a valid block size\nblock size must be one of 512, 1024, 2048 and 4096\n");
+        fprintf(stderr, "%hu is not a valid block size\nblock size must be one of 512, 1024, 2048 and 4096\n", block_size);
         exit(EXIT_FAILURE);
     }
 
@@ -155,11 +234,84 @@ int main(int argc, char *argv[])
         fprintf(stderr, "invalid size, %s\n", e.what());
         exit(EXIT_FAILURE);
     }
+
+    if (grow)
+    {
+        if (clus_str || align_str || max_str || src)
+        {
+            fprintf(stderr, "--grow keeps the layout of the disk and takes no other options\n");
+            exit(EXIT_FAILURE);
+        }
+        try
+        {
+            grow_disk(name, size);
+        }
+        catch (std::exception &e)
+        {
+            fprintf(stderr, "grow disk failed, %s\n", e.what());
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    if (size > (uint64_t)UINT32_MAX * block_size)
+    {
+        fprintf(stderr, "invalid size, %s is more than %u blocks\n", size_str, UINT32_MAX);
+        exit(EXIT_FAILURE);
+    }
     uint32_t tot_block = (size - 1 + block_size) / block_size;
 
     try
     {
-        dev_io::dev_t(name, tot_block, block_size);
+        // anything past 32 bits is out of range for set_BPB anyway
+        if (clus_str)
+            opts.clus_size = (uint32_t)std::min<uint64_t>(get_size(clus_str), UINT32_MAX);
+        if (align_str)
+            opts.align = (uint32_t)std::min<uint64_t>(get_size(align_str), UINT32_MAX);
+        if (max_str)
+        {
+            uint64_t max_size = get_size(max_str);
+            if (max_size > (uint64_t)UINT32_MAX * block_size)
+                throw std::invalid_argument("the maximum size is too large");
+            opts.max_block = (uint32_t)((max_size - 1 + block_size) / block_size);
+        }
+        // checked before anything is created
+        fat32::BPB_t BPB;
+        dev_io::set_BPB(tot_block, block_size, &BPB, opts);
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "invalid layout, %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+
+    if (src)
+    {
+        bool created = false;
+        try
+        {
+            dev_io::image_builder builder(src);
+            for (auto &path : builder.skipped())
+            {
+                fprintf(stderr, "skipped %s, only regular files and directories are copied\n", path.c_str());
+            }
+            auto img = std::make_unique<dev_io::file_dev>(name, (uint64_t)tot_block * block_size);
+            created = true;
+            builder.build(*img, tot_block, block_size, opts, threads);
+        }
+        catch (std::exception &e)
+        {
+            fprintf(stderr, "create disk image failed, %s\n", e.what());
+            if (created)
+                remove(name);
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    try
+    {
+        dev_io::dev_t(name, tot_block, block_size, opts);
     }
     catch (std::exception &e)
     {
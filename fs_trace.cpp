@@ -0,0 +1,147 @@
+#include <string.h>
+#include <stdexcept>
+#include "fs_trace.h"
+#include "stats.h"
+
+namespace fs_trace
+{
+
+namespace
+{
+
+const char magic[8] = {'F', 'A', 'T', 'O', 'P', 'T', 'R', 'C'};
+const uint32_t version = 1;
+
+struct header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+void to_utf16(std::wstring_view s, std::vector<uint16_t> &out)
+{
+    out.clear();
+    for (auto c : s)
+    {
+        uint32_t u = c;
+        if (u >= 0x10000)
+        {
+            u -= 0x10000;
+            out.push_back(0xd800 | (u >> 10));
+            out.push_back(0xdc00 | (u & 0x3ff));
+        }
+        else
+        {
+            out.push_back(u);
+        }
+    }
+}
+
+std::wstring from_utf16(const std::vector<uint16_t> &s)
+{
+    std::wstring out;
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        uint32_t u = s[i];
+        if (sizeof(wchar_t) == 4 && u >= 0xd800 && u < 0xdc00 && i + 1 < s.size())
+        {
+            u = 0x10000 + ((u - 0xd800) << 10) + (s[++i] - 0xdc00);
+        }
+        out.push_back(u);
+    }
+    return out;
+}
+
+} // namespace
+
+const char *op_name(op_t op) noexcept
+{
+    static const char *names[FS_OP_COUNT] = {
+        "open", "close", "read", "write", "stat", "setattr", "settime", "setend", "setalloc", "rename", "delete", "enum"};
+    return op < FS_OP_COUNT ? names[op] : "unknown";
+}
+
+writer::writer(const char *name) : file(fopen(name, "wb")), origin(fat32::stats::now())
+{
+    if (!file)
+    {
+        throw std::runtime_error(std::string("cannot create ") + name);
+    }
+    header h;
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.record_size = sizeof(record);
+    fwrite(&h, sizeof(h), 1, file);
+}
+
+writer::~writer()
+{
+    fclose(file);
+}
+
+uint64_t writer::now() const noexcept
+{
+    return fat32::stats::now() - origin;
+}
+
+uint16_t writer::thread_id() noexcept
+{
+    thread_local const writer *owner = nullptr;
+    thread_local uint16_t id;
+    if (owner != this)
+    {
+        owner = this;
+        id = threads.fetch_add(1, std::memory_order_relaxed);
+    }
+    return id;
+}
+
+void writer::write(const record &rec, std::wstring_view path, std::wstring_view new_path)
+{
+    thread_local std::vector<uint16_t> p, np;
+    to_utf16(path, p);
+    to_utf16(new_path, np);
+    record r = rec;
+    r.path_len = p.size();
+    r.new_path_len = np.size();
+    std::lock_guard<std::mutex> g(mtx);
+    fwrite(&r, sizeof(r), 1, file);
+    fwrite(p.data(), sizeof(uint16_t), p.size(), file);
+    fwrite(np.data(), sizeof(uint16_t), np.size(), file);
+}
+
+std::vector<event> load(const char *name)
+{
+    auto file = fopen(name, "rb");
+    if (!file)
+    {
+        throw std::runtime_error(std::string("cannot open ") + name);
+    }
+    header h;
+    if (fread(&h, sizeof(h), 1, file) != 1 || memcmp(h.magic, magic, sizeof(magic)) || h.version != version ||
+        h.record_size != sizeof(record))
+    {
+        fclose(file);
+        throw std::runtime_error(std::string(name) + " is not an operation trace");
+    }
+    std::vector<event> events;
+    std::vector<uint16_t> buf;
+    event e;
+    while (fread(&e.rec, sizeof(e.rec), 1, file) == 1)
+    {
+        buf.resize(e.rec.path_len);
+        if (fread(buf.data(), sizeof(uint16_t), buf.size(), file) != buf.size())
+            break;
+        e.path = from_utf16(buf);
+        buf.resize(e.rec.new_path_len);
+        if (fread(buf.data(), sizeof(uint16_t), buf.size(), file) != buf.size())
+            break;
+        e.new_path = from_utf16(buf);
+        events.push_back(e);
+    }
+    fclose(file);
+    return events;
+}
+
+} // namespace fs_trace
@@ -0,0 +1,88 @@
+#ifndef FS_TRACE_H
+#define FS_TRACE_H
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+// Filesystem-level operation traces: what a frontend asked dev_t to do,
+// as opposed to the block requests recorded by dev_io::trace_dev.
+namespace fs_trace
+{
+
+enum op_t : uint8_t
+{
+    FS_OPEN,
+    FS_CLOSE,
+    FS_READ,
+    FS_WRITE,
+    FS_STAT,
+    FS_SETATTR,
+    FS_SETTIME,
+    FS_SETEND,
+    FS_SETALLOC,
+    FS_RENAME,
+    FS_DELETE,
+    FS_ENUM,
+    FS_OP_COUNT,
+};
+
+const char *op_name(op_t op) noexcept;
+
+// Fixed part of a trace entry; path_len and new_path_len UTF-16 code units
+// of the two paths follow it in the file.
+struct record
+{
+    uint64_t time;      // ns from the start of the trace
+    uint64_t handle;    // fd the frontend used; the new fd for OPEN, 0 if it failed
+    int64_t offset;     // READ, WRITE, SETEND, SETALLOC
+    uint32_t length;    // READ, WRITE
+    uint32_t latency;   // ns spent in the frontend, saturated
+    uint32_t arg;       // OPEN: disposition, SETATTR: attributes, RENAME: replace, CLOSE: delete
+    uint32_t attr;      // OPEN: attributes passed to dev_t::open
+    uint16_t thread;    // small per-trace thread number
+    uint8_t op;
+    uint8_t isdir;      // OPEN: result was a directory
+    uint16_t path_len;
+    uint16_t new_path_len;
+};
+
+static_assert(sizeof(record) == 48, "record is part of the file format");
+
+struct event
+{
+    record rec;
+    std::wstring path;
+    std::wstring new_path;
+};
+
+class writer
+{
+public:
+    // Throws std::runtime_error if name cannot be created.
+    explicit writer(const char *name);
+    ~writer();
+    writer(const writer &) = delete;
+    writer &operator=(const writer &) = delete;
+
+    uint64_t now() const noexcept;
+    uint16_t thread_id() noexcept;
+    void write(const record &rec, std::wstring_view path, std::wstring_view new_path = {});
+
+private:
+    FILE *file;
+    uint64_t origin;
+    std::atomic<uint16_t> threads{0};
+    std::mutex mtx;
+};
+
+// Reads a whole trace in file order; throws std::runtime_error if name is
+// not one.
+std::vector<event> load(const char *name);
+
+} // namespace fs_trace
+
+#endif
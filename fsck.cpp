@@ -0,0 +1,764 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "win_compat.h"
+#include "volume.h"
+
+// Offline FAT32 checker. The FAT is scanned in parallel chunks, then a
+// work-stealing pool walks the directory tree and claims every cluster it
+// reaches in an ownership bitmap; whatever is allocated but unclaimed is
+// lost. Exit codes follow fsck(8).
+
+enum exit_code
+{
+    FSCK_OK = 0,
+    FSCK_FIXED = 1,
+    FSCK_UNFIXED = 4,
+    FSCK_FAILED = 8,
+};
+
+option long_options[] = {
+    {"repair", no_argument, NULL, 'r'},
+    {"threads", required_argument, NULL, 'j'},
+    {"verbose", no_argument, NULL, 'v'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_help(char *argv0)
+{
+    printf(
+        "Usage: %s [OPTION]... IMAGE\n"
+        "Check the FAT32 volume in IMAGE, which must not be mounted.\n"
+        "Arguments:\n"
+        "  -r, --repair               fix what is found instead of only reporting it\n"
+        "  -j, --threads              worker threads, default one per core\n"
+        "  -v, --verbose              print the time spent in each phase\n"
+        "  -h, --help                 show help messages\n"
+        "Repairs truncate cross-linked, looping and broken chains, fit chains\n"
+        "and sizes to each other, drop bad long names, free lost clusters and\n"
+        "rewrite FSInfo and every FAT copy.\n",
+        argv0);
+}
+
+enum problem_t
+{
+    CROSS_LINK,
+    CHAIN_LOOP,
+    BAD_CHAIN,
+    BAD_FIRST,
+    EMPTY_DIR,
+    SIZE_OVER,
+    CHAIN_OVER,
+    BAD_LONG_NAME,
+    ORPHAN_LONG_NAME,
+};
+
+struct problem
+{
+    problem_t type;
+    uint32_t node;
+    uint32_t clus;
+    uint64_t a;
+    uint64_t b;
+};
+
+// Every file and directory reached; 0 is the root.
+struct node
+{
+    uint32_t parent;
+    uint32_t first_clus;
+    std::wstring name;
+};
+
+struct dir_task
+{
+    uint32_t node;
+    std::vector<uint32_t> chain;
+};
+
+// Directories still to read, one deque per worker. A worker pushes and pops
+// at the back of its own deque, so it goes depth first through its subtree;
+// idle workers steal from the front, where the oldest and usually largest
+// unexplored subtrees wait.
+class work_pool
+{
+public:
+    explicit work_pool(unsigned threads) : queues(threads) {}
+
+    void push(unsigned self, dir_task task)
+    {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> g(queues[self].mtx);
+        queues[self].tasks.push_back(std::move(task));
+    }
+
+    template <typename F>
+    void run(F fn)
+    {
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < queues.size(); ++t)
+        {
+            workers.emplace_back([this, t, &fn] { work(t, fn); });
+        }
+        for (auto &w : workers)
+            w.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    struct queue
+    {
+        std::mutex mtx;
+        std::deque<dir_task> tasks;
+    };
+
+    bool take(unsigned self, dir_task &task)
+    {
+        {
+            std::lock_guard<std::mutex> g(queues[self].mtx);
+            if (!queues[self].tasks.empty())
+            {
+                task = std::move(queues[self].tasks.back());
+                queues[self].tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); ++k)
+        {
+            auto &victim = queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> g(victim.mtx);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename F>
+    void work(unsigned self, F &fn)
+    {
+        dir_task task;
+        // a task's subdirectories are pushed before it is counted as done
+        while (pending.load(std::memory_order_acquire) && !failed.load(std::memory_order_relaxed))
+        {
+            if (!take(self, task))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            try
+            {
+                fn(self, task);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> g(error_mtx);
+                if (!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    std::vector<queue> queues;
+    std::atomic<size_t> pending{0};
+    std::atomic<bool> failed{false};
+    std::mutex error_mtx;
+    std::exception_ptr error;
+};
+
+class checker
+{
+public:
+    checker(dev_io::volume &vol, unsigned threads, bool repair, bool verbose)
+        : vol(vol), threads(threads), repair(repair), verbose(verbose)
+    {
+    }
+
+    int run()
+    {
+        auto begin = std::chrono::steady_clock::now();
+        scan_fat();
+        phase("fat scan", begin);
+        if (!walk())
+            return FSCK_UNFIXED;
+        phase("directory walk", begin);
+        find_lost();
+        phase("lost clusters", begin);
+        resolve_cross_links();
+        report();
+        check_fsinfo();
+        if (repair && dirty)
+        {
+            vol.write_fat(fat, threads);
+            vol.write_fsinfo();
+            phase("write back", begin);
+        }
+        if (!errors)
+            return FSCK_OK;
+        return repair ? FSCK_FIXED : FSCK_UNFIXED;
+    }
+
+private:
+    enum chain_end
+    {
+        END_OK,
+        END_CROSS,
+        END_LOOP,
+        END_BAD,
+        END_LONG,
+    };
+
+    void phase(const char *name, std::chrono::steady_clock::time_point &begin)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (verbose)
+            fprintf(stderr, "%s: %.3f s\n", name, std::chrono::duration<double>(now - begin).count());
+        begin = now;
+    }
+
+    void scan_fat()
+    {
+        fat = vol.read_fat(0, threads);
+        owned = std::vector<std::atomic<uint64_t>>((fat.size() + 63) / 64);
+        // the other copies should match the first one
+        for (uint32_t copy = 1; copy < vol.bpb().BPB_NumFATs; ++copy)
+        {
+            auto other = vol.read_fat(copy, threads);
+            std::atomic<uint64_t> differ{0};
+            dev_io::for_chunks(fat.size() - 2, threads, [&](size_t begin, size_t end) {
+                uint64_t count = 0;
+                for (auto i = begin + 2; i < end + 2; ++i)
+                    count += fat[i] != other[i];
+                differ.fetch_add(count, std::memory_order_relaxed);
+            });
+            if (differ)
+            {
+                printf("FAT copy %u differs from the first in %llu entries%s\n", copy,
+                       (unsigned long long)differ.load(), repair ? ", rewritten" : "");
+                ++errors;
+                dirty = true;
+            }
+        }
+    }
+
+    bool claim(uint32_t clus)
+    {
+        uint64_t bit = (uint64_t)1 << (clus % 64);
+        return !(owned[clus / 64].fetch_or(bit, std::memory_order_relaxed) & bit);
+    }
+
+    bool is_owned(uint32_t clus) const
+    {
+        return owned[clus / 64].load(std::memory_order_relaxed) & ((uint64_t)1 << (clus % 64));
+    }
+
+    // Claims up to limit clusters of the chain from first, stopping early
+    // at its end, at a cluster someone already owns or at a pointer out of
+    // the chain. Only FAT entries of clusters this call claimed are read, so
+    // workers never touch the same entry.
+    chain_end follow(uint32_t first, size_t limit, std::vector<uint32_t> &chain, uint32_t &at)
+    {
+        uint32_t clus = first;
+        while (true)
+        {
+            at = clus;
+            if (chain.size() == limit)
+                return END_LONG;
+            if (!vol.valid(clus))
+                return END_BAD;
+            if (!claim(clus))
+                return std::find(chain.begin(), chain.end(), clus) != chain.end() ? END_LOOP : END_CROSS;
+            if (fat[clus] == 0 || fat[clus] == dev_io::bad_clus)
+                return END_BAD;
+            chain.push_back(clus);
+            if (dev_io::is_eoc(fat[clus]))
+                return END_OK;
+            clus = fat[clus];
+        }
+    }
+
+    void add_problem(problem_t type, uint32_t id, uint32_t clus, uint64_t a = 0, uint64_t b = 0)
+    {
+        std::lock_guard<std::mutex> g(problems_mtx);
+        problems.push_back(problem{type, id, clus, a, b});
+    }
+
+    void terminate(const std::vector<uint32_t> &chain)
+    {
+        if (repair)
+            fat[chain.back()] = 0x0fffffff;
+    }
+
+    void clear_first(dev_io::raw_entry &e, bool &changed)
+    {
+        e.entry.DIR_FstClusHI = 0;
+        e.entry.DIR_FstClusLO = 0;
+        changed = true;
+    }
+
+    // Checks the chain and size of one entry. Returns false if the entry
+    // has to go; e.entry is updated in place when repairing. A file claims
+    // only the clusters its size needs, so a chain that runs on into
+    // another file's clusters leaves them to that file.
+    bool check_entry(uint32_t id, dev_io::raw_entry &e, std::vector<uint32_t> &chain, bool &changed)
+    {
+        auto first = e.first_clus();
+        if (!first)
+        {
+            if (e.isdir())
+            {
+                add_problem(EMPTY_DIR, id, 0);
+                return false;
+            }
+            if (e.entry.DIR_FileSize)
+            {
+                add_problem(SIZE_OVER, id, 0, e.entry.DIR_FileSize, 0);
+                e.entry.DIR_FileSize = 0;
+                changed = true;
+            }
+            return true;
+        }
+        uint64_t clus_size = vol.clus_size();
+        size_t need = e.isdir() ? SIZE_MAX : ((uint64_t)e.entry.DIR_FileSize + clus_size - 1) / clus_size;
+        uint32_t at;
+        auto end = follow(first, need, chain, at);
+        if (end == END_LONG)
+        {
+            // the unclaimed tail is freed with the lost clusters
+            add_problem(CHAIN_OVER, id, first, need, e.entry.DIR_FileSize);
+            if (chain.empty())
+                clear_first(e, changed);
+            else
+                terminate(chain);
+            return true;
+        }
+        if (chain.empty())
+        {
+            add_problem(end == END_CROSS ? CROSS_LINK : BAD_FIRST, id, at);
+            if (e.isdir())
+                return false;
+            clear_first(e, changed);
+            e.entry.DIR_FileSize = 0;
+            return true;
+        }
+        if (end != END_OK)
+        {
+            add_problem(end == END_CROSS ? CROSS_LINK : end == END_LOOP ? CHAIN_LOOP : BAD_CHAIN, id, at,
+                        chain.back());
+            terminate(chain);
+        }
+        if (!e.isdir() && chain.size() < need)
+        {
+            add_problem(SIZE_OVER, id, first, e.entry.DIR_FileSize, chain.size());
+            e.entry.DIR_FileSize = chain.size() * clus_size;
+            changed = true;
+        }
+        return true;
+    }
+
+    void check_dir(unsigned self, dir_task &task)
+    {
+        uint32_t clus_size = vol.clus_size();
+        size_t per_clus = clus_size / sizeof(fat32::DIR_Entry);
+        std::vector<fat32::DIR_Entry> entries(task.chain.size() * per_clus);
+        vol.read_chain(task.chain, entries.data());
+        std::vector<dev_io::orphan_run> orphans;
+        auto found = dev_io::parse_dir(entries.data(), entries.size(), &orphans);
+        std::vector<bool> modified(task.chain.size());
+        auto erase = [&](uint32_t index, uint32_t slots) {
+            for (auto i = index; i < index + slots; ++i)
+            {
+                entries[i].DIR_Name[0] = (char)0xe5;
+                modified[i / per_clus] = true;
+            }
+        };
+
+        for (const auto &run : orphans)
+        {
+            add_problem(ORPHAN_LONG_NAME, task.node, 0, run.slots);
+            erase(run.index, run.slots);
+        }
+        found.erase(std::remove_if(found.begin(), found.end(),
+                                   [](const dev_io::raw_entry &e) { return e.is_dot() || e.is_label(); }),
+                    found.end());
+        uint32_t base;
+        {
+            std::lock_guard<std::mutex> g(nodes_mtx);
+            base = nodes.size();
+            for (const auto &e : found)
+                nodes.push_back(node{task.node, e.first_clus(), e.name});
+        }
+
+        std::vector<uint32_t> chain;
+        for (size_t k = 0; k < found.size(); ++k)
+        {
+            auto &e = found[k];
+            uint32_t id = base + k;
+            e.isdir() ? ++dirs : ++files;
+            if (e.bad_long)
+            {
+                add_problem(BAD_LONG_NAME, id, 0);
+                erase(e.index, e.slots - 1);
+            }
+            chain.clear();
+            bool changed = false;
+            if (!check_entry(id, e, chain, changed))
+            {
+                // clusters claimed for a dropped entry end up lost
+                if (repair)
+                {
+                    for (auto clus : chain)
+                        fat[clus] = 0;
+                }
+                erase(e.index, e.slots);
+                continue;
+            }
+            if (changed)
+            {
+                auto index = e.index + e.slots - 1;
+                entries[index] = e.entry;
+                modified[index / per_clus] = true;
+            }
+            if (e.isdir() && !chain.empty())
+                pool->push(self, dir_task{id, chain});
+        }
+
+        if (repair)
+        {
+            for (size_t i = 0; i < task.chain.size(); ++i)
+            {
+                if (modified[i])
+                    vol.write_clus(task.chain[i], entries.data() + i * per_clus);
+            }
+        }
+    }
+
+    bool walk()
+    {
+        nodes.push_back(node{0, vol.bpb().BPB_RootClus, L""});
+        dir_task root{0, {}};
+        uint32_t at;
+        auto end = follow(vol.bpb().BPB_RootClus, SIZE_MAX, root.chain, at);
+        if (root.chain.empty())
+        {
+            printf("root directory cluster %u is invalid, cannot continue\n", vol.bpb().BPB_RootClus);
+            return false;
+        }
+        if (end != END_OK)
+        {
+            add_problem(end == END_LOOP ? CHAIN_LOOP : BAD_CHAIN, 0, at, root.chain.back());
+            terminate(root.chain);
+        }
+        pool = std::make_unique<work_pool>(threads);
+        pool->push(0, std::move(root));
+        pool->run([this](unsigned self, dir_task &task) { check_dir(self, task); });
+        return true;
+    }
+
+    void find_lost()
+    {
+        std::atomic<uint64_t> lost{0};
+        std::atomic<uint64_t> heads{0};
+        auto is_lost = [this](uint32_t clus) {
+            return fat[clus] != 0 && fat[clus] != dev_io::bad_clus && !is_owned(clus);
+        };
+        // a chain head is a lost cluster no other lost cluster points to
+        std::vector<std::atomic<uint64_t>> pointed(owned.size());
+        dev_io::for_chunks(fat.size() - 2, threads, [&](size_t begin, size_t end) {
+            uint64_t count = 0;
+            for (auto clus = begin + 2; clus < end + 2; ++clus)
+            {
+                if (!is_lost(clus))
+                    continue;
+                ++count;
+                auto next = fat[clus];
+                if (vol.valid(next) && is_lost(next))
+                    pointed[next / 64].fetch_or((uint64_t)1 << (next % 64), std::memory_order_relaxed);
+            }
+            lost.fetch_add(count, std::memory_order_relaxed);
+        });
+        if (!lost)
+            return;
+        dev_io::for_chunks(fat.size() - 2, threads, [&](size_t begin, size_t end) {
+            uint64_t count = 0;
+            for (auto clus = begin + 2; clus < end + 2; ++clus)
+            {
+                if (is_lost(clus) && !(pointed[clus / 64].load(std::memory_order_relaxed) & ((uint64_t)1 << (clus % 64))))
+                    ++count;
+            }
+            heads.fetch_add(count, std::memory_order_relaxed);
+        });
+        if (repair)
+        {
+            dev_io::for_chunks(fat.size() - 2, threads, [&](size_t begin, size_t end) {
+                for (auto clus = begin + 2; clus < end + 2; ++clus)
+                {
+                    if (is_lost(clus))
+                        fat[clus] = 0;
+                }
+            });
+        }
+        printf("%llu lost clusters in %llu chains%s\n", (unsigned long long)lost.load(),
+               (unsigned long long)heads.load(), repair ? ", freed" : "");
+        ++errors;
+        dirty = true;
+    }
+
+    // Cross-links are found by whoever claims the shared cluster second;
+    // the files already holding it are found by following every chain.
+    void resolve_cross_links()
+    {
+        std::unordered_map<uint32_t, std::vector<uint32_t>> holders;
+        for (const auto &p : problems)
+        {
+            if (p.type == CROSS_LINK)
+                holders[p.clus];
+        }
+        if (holders.empty())
+            return;
+        std::mutex mtx;
+        dev_io::for_chunks(nodes.size(), threads, [&](size_t begin, size_t end) {
+            for (auto id = begin; id < end; ++id)
+            {
+                auto clus = nodes[id].first_clus;
+                for (uint32_t steps = 0; vol.valid(clus) && steps < vol.count_of_cluster(); ++steps)
+                {
+                    auto itr = holders.find(clus);
+                    if (itr != holders.end())
+                    {
+                        std::lock_guard<std::mutex> g(mtx);
+                        itr->second.push_back(id);
+                    }
+                    clus = fat[clus];
+                }
+            }
+        });
+        for (auto &p : problems)
+        {
+            if (p.type != CROSS_LINK)
+                continue;
+            p.a = UINT64_MAX;
+            for (auto id : holders[p.clus])
+            {
+                if (id != p.node)
+                    p.a = id;
+            }
+        }
+    }
+
+    std::string path(uint32_t id) const
+    {
+        std::wstring res;
+        while (id)
+        {
+            res = L"/" + nodes[id].name + res;
+            id = nodes[id].parent;
+        }
+        if (res.empty())
+            res = L"/";
+        std::string out(res.size() * 4 + 1, 0);
+        auto len = WideCharToMultiByte(CP_ACP, 0, res.c_str(), res.size(), &out[0], out.size(), NULL, NULL);
+        out.resize(len > 0 ? len : 0);
+        return out;
+    }
+
+    void report()
+    {
+        std::vector<std::pair<std::string, std::string>> lines;
+        char msg[256];
+        for (const auto &p : problems)
+        {
+            switch (p.type)
+            {
+            case CROSS_LINK:
+                snprintf(msg, sizeof(msg), "cross-linked with %s at cluster %u%s",
+                         p.a == UINT64_MAX ? "a freed chain" : path(p.a).c_str(), p.clus, repair ? ", truncated" : "");
+                break;
+            case CHAIN_LOOP:
+                snprintf(msg, sizeof(msg), "chain loops back to cluster %u%s", p.clus, repair ? ", truncated" : "");
+                break;
+            case BAD_CHAIN:
+                snprintf(msg, sizeof(msg), "cluster %llu links to %s cluster %u%s", (unsigned long long)p.a,
+                         vol.valid(p.clus) ? "free" : "invalid", p.clus, repair ? ", truncated" : "");
+                break;
+            case BAD_FIRST:
+                snprintf(msg, sizeof(msg), "first cluster %u is %s%s", p.clus, vol.valid(p.clus) ? "free" : "invalid",
+                         repair ? ", cleared" : "");
+                break;
+            case EMPTY_DIR:
+                snprintf(msg, sizeof(msg), "directory has no clusters%s", repair ? ", removed" : "");
+                break;
+            case SIZE_OVER:
+                snprintf(msg, sizeof(msg), "size %llu is beyond its %llu clusters%s", (unsigned long long)p.a,
+                         (unsigned long long)p.b, repair ? ", shrunk" : "");
+                break;
+            case CHAIN_OVER:
+                snprintf(msg, sizeof(msg), "chain runs past the %llu clusters size %llu needs%s", (unsigned long long)p.a,
+                         (unsigned long long)p.b, repair ? ", truncated" : "");
+                break;
+            case BAD_LONG_NAME:
+                snprintf(msg, sizeof(msg), "long name does not match its short entry%s", repair ? ", dropped" : "");
+                break;
+            case ORPHAN_LONG_NAME:
+                snprintf(msg, sizeof(msg), "%llu orphaned long name entries%s", (unsigned long long)p.a,
+                         repair ? ", dropped" : "");
+                break;
+            }
+            lines.emplace_back(path(p.node), msg);
+        }
+        std::sort(lines.begin(), lines.end());
+        for (const auto &l : lines)
+            printf("%s: %s\n", l.first.c_str(), l.second.c_str());
+        if (!problems.empty())
+        {
+            errors += problems.size();
+            dirty = true;
+        }
+    }
+
+    void check_fsinfo()
+    {
+        auto &info = vol.fsinfo();
+        std::atomic<uint64_t> free_count{0};
+        std::atomic<uint32_t> first_free{UINT32_MAX};
+        dev_io::for_chunks(fat.size() - 2, threads, [&](size_t begin, size_t end) {
+            uint64_t count = 0;
+            uint32_t first = UINT32_MAX;
+            for (auto clus = begin + 2; clus < end + 2; ++clus)
+            {
+                if (fat[clus] == 0)
+                {
+                    first = std::min<uint32_t>(first, clus);
+                    ++count;
+                }
+            }
+            free_count.fetch_add(count, std::memory_order_relaxed);
+            auto cur = first_free.load();
+            while (first < cur && !first_free.compare_exchange_weak(cur, first))
+                ;
+        });
+        bool sig = info.FSI_LeadSig == 0x41615252 && info.FSI_StrucSig == 0x61417272 && info.FSI_TrailSig == 0xAA550000;
+        // dev_t searches forward from the hint, so it must lie on the volume
+        bool hint = vol.valid(info.FSI_Nxt_Free) || info.FSI_Nxt_Free == 0xffffffff;
+        printf("%llu files, %llu directories, %llu/%u clusters free\n", (unsigned long long)files.load(),
+               (unsigned long long)dirs.load(), (unsigned long long)free_count.load(), vol.count_of_cluster());
+        if (!sig || !hint || info.FSI_FreeCount != free_count)
+        {
+            if (!sig)
+                printf("FSInfo signatures are damaged%s\n", repair ? ", rewritten" : "");
+            else if (info.FSI_FreeCount != free_count)
+                printf("FSInfo free count %u should be %llu%s\n", info.FSI_FreeCount,
+                       (unsigned long long)free_count.load(), repair ? ", fixed" : "");
+            else
+                printf("FSInfo next free cluster %u is off the volume%s\n", info.FSI_Nxt_Free, repair ? ", fixed" : "");
+            ++errors;
+            dirty = true;
+        }
+        if (repair && dirty)
+        {
+            info.FSI_LeadSig = 0x41615252;
+            info.FSI_StrucSig = 0x61417272;
+            info.FSI_TrailSig = 0xAA550000;
+            info.FSI_FreeCount = free_count;
+            info.FSI_Nxt_Free = first_free == UINT32_MAX ? 0xffffffff : first_free.load();
+        }
+    }
+
+    dev_io::volume &vol;
+    unsigned threads;
+    bool repair;
+    bool verbose;
+    std::vector<uint32_t> fat;
+    std::vector<std::atomic<uint64_t>> owned;
+    std::unique_ptr<work_pool> pool;
+    std::mutex nodes_mtx;
+    std::vector<node> nodes;
+    std::mutex problems_mtx;
+    std::vector<problem> problems;
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> dirs{0};
+    uint64_t errors = 0;
+    bool dirty = false;
+};
+
+int main(int argc, char *argv[])
+{
+    extern char *optarg;
+    extern int optind, opterr, optopt;
+
+    opterr = 0;
+    bool repair = false;
+    bool verbose = false;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+    while (true)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "rj:vh", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 'r':
+            repair = true;
+            break;
+
+        case 'j':
+            threads = std::max(1, atoi(optarg));
+            break;
+
+        case 'v':
+            verbose = true;
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            fprintf(stderr, "invalid argument %c\n", (char)optopt);
+            print_help(argv[0]);
+            exit(FSCK_FAILED);
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "no enough arguments\n");
+        print_help(argv[0]);
+        exit(FSCK_FAILED);
+    }
+
+    try
+    {
+        dev_io::volume vol(argv[optind]);
+        checker check(vol, threads, repair, verbose);
+        return check.run();
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "check %s failed, %s\n", argv[optind], e.what());
+        return FSCK_FAILED;
+    }
+}
@@ -0,0 +1,893 @@
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <filesystem>
+#include "dokan_log.h"
+#include "dev_io.h"
+#include "io_trace.h"
+#include "stats.h"
+#include "vfat_ioctl.h"
+
+// Times the enclosing request as "fuse.<name>" in the stats dump.
+#define STATS_CALLBACK(name)                                                    \
+    static const uint32_t stats_op = fat32::stats::register_op("fuse." #name); \
+    fat32::stats::timer stats_timer(stats_op)
+
+// Linux frontend over the FUSE low-level API. Every inode the kernel knows
+// about holds one open dev_t handle, so a file stays loaded, and keeps its
+// clusters after an unlink, until the kernel forgets it. The kernel's inode
+// number is the address of that record.
+
+struct inode
+{
+    uint64_t fd;
+    uint64_t id;
+    uint64_t nlookup;
+};
+
+struct fs_state
+{
+    std::unique_ptr<dev_io::dev_t> dev;
+    inode root;
+    std::mutex mtx;
+    std::unordered_map<uint64_t, inode *> inodes;
+    double timeout;
+};
+
+fs_state fs;
+
+inode *get_inode(fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID)
+    {
+        return &fs.root;
+    }
+    return (inode *)(uintptr_t)ino;
+}
+
+fuse_ino_t get_ino(inode *node)
+{
+    return node == &fs.root ? FUSE_ROOT_ID : (fuse_ino_t)(uintptr_t)node;
+}
+
+std::wstring to_wide(const char *s)
+{
+    auto size = MultiByteToWideChar(CP_ACP, 0, s, -1, NULL, 0);
+    std::wstring res;
+    res.resize(size);
+    size = MultiByteToWideChar(CP_ACP, 0, s, -1, res.data(), size);
+    res.resize(size ? size - 1 : 0);
+    return res;
+}
+
+int to_errno(fat32::file_error::error_t err)
+{
+    switch (err)
+    {
+    case fat32::file_error::FILE_NOT_FOUND:
+        return ENOENT;
+    case fat32::file_error::FILE_NOT_DIR:
+        return ENOTDIR;
+    case fat32::file_error::FILE_ALREADY_EXISTS:
+        return EEXIST;
+    case fat32::file_error::INVALID_FILE_DISCRIPTOR:
+        return EBADF;
+    case fat32::file_error::TOO_MANY_OPEN_FILES:
+        return EMFILE;
+    case fat32::file_error::DIR_NOT_EMPTY:
+        return ENOTEMPTY;
+    case fat32::file_error::DISK_FULL:
+        return ENOSPC;
+    case fat32::file_error::FILE_IS_DIR:
+        return EISDIR;
+    case fat32::file_error::INVALID_ARGUMENT:
+        return EINVAL;
+    }
+    return EIO;
+}
+
+int to_errno()
+{
+    try
+    {
+        throw;
+    }
+    catch (const fat32::file_error &e)
+    {
+        return to_errno(e.get_error_type());
+    }
+    catch (const dev_io::disk_error &e)
+    {
+        log_error("disk error: %s\n", e.what());
+        return EIO;
+    }
+    catch (const std::bad_alloc &)
+    {
+        return ENOMEM;
+    }
+    catch (...)
+    {
+        return EIO;
+    }
+}
+
+time_t to_timespec(const FILETIME &ft, long *nsec)
+{
+    ULARGE_INTEGER ticks;
+    ticks.LowPart = ft.dwLowDateTime;
+    ticks.HighPart = ft.dwHighDateTime;
+    *nsec = ticks.QuadPart % 10000000 * 100;
+    return (int64_t)(ticks.QuadPart / 10000000) - 11644473600ll;
+}
+
+FILETIME to_filetime(const timespec &ts)
+{
+    ULARGE_INTEGER ticks;
+    ticks.QuadPart = (ts.tv_sec + 11644473600ull) * 10000000 + ts.tv_nsec / 100;
+    FILETIME ft;
+    ft.dwLowDateTime = ticks.LowPart;
+    ft.dwHighDateTime = ticks.HighPart;
+    return ft;
+}
+
+void fill_stat(const BY_HANDLE_FILE_INFORMATION &info, fuse_ino_t ino, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = ino;
+    if (info.dwFileAttributes & 0x10)
+    {
+        st->st_mode = S_IFDIR | 0755;
+    }
+    else
+    {
+        st->st_mode = S_IFREG | 0644;
+    }
+    if (info.dwFileAttributes & 0x01)
+    {
+        st->st_mode &= ~0222;
+    }
+    st->st_nlink = info.nNumberOfLinks;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    st->st_blksize = 4096;
+    st->st_blocks = (st->st_size + 511) / 512;
+    st->st_atim.tv_sec = to_timespec(info.ftLastAccessTime, &st->st_atim.tv_nsec);
+    st->st_mtim.tv_sec = to_timespec(info.ftLastWriteTime, &st->st_mtim.tv_nsec);
+    st->st_ctim.tv_sec = to_timespec(info.ftCreationTime, &st->st_ctim.tv_nsec);
+}
+
+// Turns a freshly opened handle into a lookup reference. A file the kernel
+// already knows keeps its first handle and the new one is closed.
+void reply_entry(fuse_req_t req, uint64_t fd)
+{
+    inode *node = nullptr;
+    try
+    {
+        auto id = fs.dev->file_id(fd);
+        {
+            std::lock_guard<std::mutex> g(fs.mtx);
+            auto it = fs.inodes.find(id);
+            if (it != fs.inodes.end())
+            {
+                node = it->second;
+                ++node->nlookup;
+            }
+            else
+            {
+                node = new inode{fd, id, 1};
+                fs.inodes.emplace(id, node);
+                fd = 0;
+            }
+        }
+        if (fd)
+        {
+            fs.dev->close(fd);
+        }
+
+        BY_HANDLE_FILE_INFORMATION info;
+        fs.dev->fstat(node->fd, &info);
+        fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = get_ino(node);
+        e.attr_timeout = fs.timeout;
+        e.entry_timeout = fs.timeout;
+        fill_stat(info, e.ino, &e.attr);
+        fuse_reply_entry(req, &e);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+    auto node = get_inode(ino);
+    if (node == &fs.root)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> g(fs.mtx);
+        node->nlookup -= nlookup;
+        if (node->nlookup)
+        {
+            return;
+        }
+        fs.inodes.erase(node->id);
+    }
+    try
+    {
+        fs.dev->close(node->fd);
+    }
+    catch (...)
+    {
+        to_errno();
+    }
+    delete node;
+}
+
+void vfat_init(void *userdata, fuse_conn_info *conn)
+{
+    conn->max_write = 1 << 20;
+    conn->max_readahead = 1 << 20;
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+    {
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    }
+}
+
+void vfat_destroy(void *userdata)
+{
+    std::lock_guard<std::mutex> g(fs.mtx);
+    for (auto &p : fs.inodes)
+    {
+        fs.dev->close(p.second->fd);
+        delete p.second;
+    }
+    fs.inodes.clear();
+    fs.dev->close(fs.root.fd);
+    fs.dev->flush();
+}
+
+void vfat_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    STATS_CALLBACK(lookup);
+    try
+    {
+        bool exist;
+        bool isdir;
+        auto fd = fs.dev->try_openat(get_inode(parent)->fd, {to_wide(name)}, OPEN_EXISTING, 0, exist, isdir);
+        if (fd)
+        {
+            reply_entry(req, *fd);
+        }
+        else if (fd.error() == fat32::file_error::FILE_NOT_FOUND)
+        {
+            // Cache the miss, so repeated probes for absent names stay in the kernel.
+            fuse_entry_param neg;
+            memset(&neg, 0, sizeof(neg));
+            neg.entry_timeout = fs.timeout;
+            fuse_reply_entry(req, &neg);
+        }
+        else
+        {
+            fuse_reply_err(req, to_errno(fd.error()));
+        }
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void vfat_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    STATS_CALLBACK(forget);
+    forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+void vfat_forget_multi(fuse_req_t req, size_t count, fuse_forget_data *forgets)
+{
+    STATS_CALLBACK(forget_multi);
+    for (size_t i = 0; i < count; ++i)
+    {
+        forget_one(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+void vfat_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    STATS_CALLBACK(getattr);
+    try
+    {
+        BY_HANDLE_FILE_INFORMATION info;
+        fs.dev->fstat(get_inode(ino)->fd, &info);
+        struct stat st;
+        fill_stat(info, ino, &st);
+        fuse_reply_attr(req, &st, fs.timeout);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void vfat_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, fuse_file_info *fi)
+{
+    STATS_CALLBACK(setattr);
+    try
+    {
+        auto fd = get_inode(ino)->fd;
+        BY_HANDLE_FILE_INFORMATION info;
+        if (to_set & FUSE_SET_ATTR_SIZE)
+        {
+            fs.dev->setend(fd, attr->st_size);
+        }
+        if (to_set & FUSE_SET_ATTR_MODE)
+        {
+            fs.dev->fstat(fd, &info);
+            auto file_attr = info.dwFileAttributes & ~0x01u;
+            if (!(attr->st_mode & 0200))
+            {
+                file_attr |= 0x01;
+            }
+            fs.dev->setattr(fd, file_attr);
+        }
+        if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))
+        {
+            fs.dev->fstat(fd, &info);
+            timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            auto acc_time = info.ftLastAccessTime;
+            auto wrt_time = info.ftLastWriteTime;
+            if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                acc_time = to_filetime(now);
+            else if (to_set & FUSE_SET_ATTR_ATIME)
+                acc_time = to_filetime(attr->st_atim);
+            if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                wrt_time = to_filetime(now);
+            else if (to_set & FUSE_SET_ATTR_MTIME)
+                wrt_time = to_filetime(attr->st_mtim);
+            fs.dev->settime(fd, &info.ftCreationTime, &acc_time, &wrt_time);
+        }
+        fs.dev->fstat(fd, &info);
+        struct stat st;
+        fill_stat(info, ino, &st);
+        fuse_reply_attr(req, &st, fs.timeout);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void make_node(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, fuse_file_info *fi)
+{
+    try
+    {
+        uint32_t file_attr = S_ISDIR(mode) ? 0x10 : 0x20;
+        if (!(mode & 0200))
+        {
+            file_attr |= 0x01;
+        }
+        bool exist;
+        bool isdir;
+        auto fd = fs.dev->openat(get_inode(parent)->fd, {to_wide(name)}, CREATE_NEW, file_attr, exist, isdir);
+        if (!fi)
+        {
+            reply_entry(req, fd);
+            return;
+        }
+        inode *node;
+        {
+            std::lock_guard<std::mutex> g(fs.mtx);
+            node = new inode{fd, fs.dev->file_id(fd), 1};
+            fs.inodes.emplace(node->id, node);
+        }
+        BY_HANDLE_FILE_INFORMATION info;
+        fs.dev->fstat(fd, &info);
+        fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = get_ino(node);
+        e.attr_timeout = fs.timeout;
+        e.entry_timeout = fs.timeout;
+        fill_stat(info, e.ino, &e.attr);
+        fi->keep_cache = 1;
+        fuse_reply_create(req, &e, fi);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void vfat_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    STATS_CALLBACK(mknod);
+    if (!S_ISREG(mode))
+    {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    make_node(req, parent, name, mode, nullptr);
+}
+
+void vfat_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    STATS_CALLBACK(mkdir);
+    make_node(req, parent, name, mode | S_IFDIR, nullptr);
+}
+
+void vfat_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, fuse_file_info *fi)
+{
+    STATS_CALLBACK(create);
+    make_node(req, parent, name, mode, fi);
+}
+
+void remove_node(fuse_req_t req, fuse_ino_t parent, const char *name, bool dir)
+{
+    uint64_t fd = 0;
+    try
+    {
+        bool exist;
+        bool isdir;
+        fd = fs.dev->openat(get_inode(parent)->fd, {to_wide(name)}, OPEN_EXISTING, 0, exist, isdir);
+        if (isdir != dir)
+        {
+            fs.dev->close(fd);
+            fuse_reply_err(req, dir ? ENOTDIR : EISDIR);
+            return;
+        }
+        fs.dev->remove(fd);
+        fs.dev->close(fd);
+        fuse_reply_err(req, 0);
+    }
+    catch (...)
+    {
+        auto err = to_errno();
+        if (fd)
+        {
+            fs.dev->close(fd);
+        }
+        fuse_reply_err(req, err);
+    }
+}
+
+void vfat_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    STATS_CALLBACK(unlink);
+    remove_node(req, parent, name, false);
+}
+
+void vfat_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    STATS_CALLBACK(rmdir);
+    remove_node(req, parent, name, true);
+}
+
+void vfat_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname,
+                 unsigned int flags)
+{
+    STATS_CALLBACK(rename);
+    if (flags & RENAME_EXCHANGE)
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    uint64_t fd = 0;
+    try
+    {
+        bool exist;
+        bool isdir;
+        fd = fs.dev->openat(get_inode(parent)->fd, {to_wide(name)}, OPEN_EXISTING, 0, exist, isdir);
+        auto new_name = to_wide(newname);
+        int err = 0;
+        if (!fs.dev->renameat(fd, get_inode(newparent)->fd, new_name, !(flags & RENAME_NOREPLACE)))
+        {
+            err = EEXIST;
+            if (!(flags & RENAME_NOREPLACE))
+            {
+                bool target_isdir;
+                auto target = fs.dev->openat(get_inode(newparent)->fd, {new_name}, OPEN_EXISTING, 0, exist, target_isdir);
+                fs.dev->close(target);
+                err = target_isdir ? EISDIR : ENOTDIR;
+            }
+        }
+        fs.dev->close(fd);
+        fuse_reply_err(req, err);
+    }
+    catch (...)
+    {
+        auto err = to_errno();
+        if (fd)
+        {
+            fs.dev->close(fd);
+        }
+        fuse_reply_err(req, err);
+    }
+}
+
+void vfat_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    STATS_CALLBACK(open);
+    try
+    {
+        if (fi->flags & O_TRUNC)
+        {
+            fs.dev->setend(get_inode(ino)->fd, 0);
+        }
+        fi->keep_cache = 1;
+        fuse_reply_open(req, fi);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void vfat_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    STATS_CALLBACK(release);
+    fuse_reply_err(req, 0);
+}
+
+void vfat_flush(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    STATS_CALLBACK(flush);
+    fuse_reply_err(req, 0);
+}
+
+void vfat_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info *fi)
+{
+    STATS_CALLBACK(fsync);
+    fuse_reply_err(req, 0);
+}
+
+void vfat_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
+{
+    STATS_CALLBACK(read);
+    try
+    {
+        std::unique_ptr<char[]> buf(new char[size]);
+        auto len = fs.dev->read(get_inode(ino)->fd, off, size, buf.get());
+        fuse_reply_buf(req, buf.get(), len);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void vfat_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, fuse_file_info *fi)
+{
+    STATS_CALLBACK(write);
+    try
+    {
+        auto len = fs.dev->write(get_inode(ino)->fd, off, size, buf);
+        fuse_reply_write(req, len);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void vfat_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    STATS_CALLBACK(opendir);
+    try
+    {
+        auto entries = new fat32::dir_info(fs.dev->opendir(get_inode(ino)->fd));
+        fi->fh = (uint64_t)(uintptr_t)entries;
+        fi->keep_cache = 1;
+        fuse_reply_open(req, fi);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+// Offsets 0 and 1 are "." and "..", offset i + 2 is entry i of the snapshot
+// taken by opendir.
+void vfat_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
+{
+    STATS_CALLBACK(readdir);
+    auto entries = (fat32::dir_info *)(uintptr_t)fi->fh;
+    std::vector<char> buf(size);
+    size_t pos = 0;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    for (off_t i = off; i < (off_t)entries->size() + 2; ++i)
+    {
+        std::string name;
+        if (i < 2)
+        {
+            name = i ? ".." : ".";
+            st.st_mode = S_IFDIR;
+        }
+        else
+        {
+            auto &entry = (*entries)[i - 2];
+            if (entry.name == L"." || entry.name == L"..")
+            {
+                continue;
+            }
+            name = wide2local(entry.name.c_str()).c_str();
+            st.st_mode = entry.isdir() ? S_IFDIR : S_IFREG;
+        }
+        auto need = fuse_add_direntry(req, buf.data() + pos, size - pos, name.c_str(), &st, i + 1);
+        if (need > size - pos)
+        {
+            break;
+        }
+        pos += need;
+    }
+    fuse_reply_buf(req, buf.data(), pos);
+}
+
+void vfat_releasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    STATS_CALLBACK(releasedir);
+    delete (fat32::dir_info *)(uintptr_t)fi->fh;
+    fuse_reply_err(req, 0);
+}
+
+void vfat_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info *fi)
+{
+    STATS_CALLBACK(fsyncdir);
+    fuse_reply_err(req, 0);
+}
+
+void vfat_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    STATS_CALLBACK(statfs);
+    try
+    {
+        uint64_t free_available, tot_size, tot_free;
+        fs.dev->get_disk_info(&free_available, &tot_size, &tot_free);
+        struct statvfs st;
+        memset(&st, 0, sizeof(st));
+        st.f_bsize = 4096;
+        st.f_frsize = 4096;
+        st.f_blocks = tot_size / 4096;
+        st.f_bfree = tot_free / 4096;
+        st.f_bavail = free_available / 4096;
+        st.f_namemax = 255;
+        fuse_reply_statfs(req, &st);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+void vfat_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, fuse_file_info *fi, unsigned flags,
+                const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+    STATS_CALLBACK(ioctl);
+    if ((unsigned)cmd != VFAT_IOC_GROW || in_bufsz != sizeof(uint64_t))
+    {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    try
+    {
+        uint64_t size;
+        memcpy(&size, in_buf, sizeof(size));
+        fs.dev->grow(size);
+        fuse_reply_ioctl(req, 0, NULL, 0);
+    }
+    catch (const std::invalid_argument &e)
+    {
+        log_error("grow: %s\n", e.what());
+        fuse_reply_err(req, EINVAL);
+    }
+    catch (...)
+    {
+        fuse_reply_err(req, to_errno());
+    }
+}
+
+fuse_lowlevel_ops operations = {
+    .init = vfat_init,
+    .destroy = vfat_destroy,
+    .lookup = vfat_lookup,
+    .forget = vfat_forget,
+    .getattr = vfat_getattr,
+    .setattr = vfat_setattr,
+    .mknod = vfat_mknod,
+    .mkdir = vfat_mkdir,
+    .unlink = vfat_unlink,
+    .rmdir = vfat_rmdir,
+    .rename = vfat_rename,
+    .open = vfat_open,
+    .read = vfat_read,
+    .write = vfat_write,
+    .flush = vfat_flush,
+    .release = vfat_release,
+    .fsync = vfat_fsync,
+    .opendir = vfat_opendir,
+    .readdir = vfat_readdir,
+    .releasedir = vfat_releasedir,
+    .fsyncdir = vfat_fsyncdir,
+    .statfs = vfat_statfs,
+    .create = vfat_create,
+    .ioctl = vfat_ioctl,
+    .forget_multi = vfat_forget_multi,
+};
+
+struct options
+{
+    const char *image;
+    unsigned int threads;
+    double timeout;
+    const char *stats;
+    const char *trace;
+};
+
+#define VFAT_OPT(t, p) {t, offsetof(options, p), 1}
+
+const fuse_opt option_spec[] = {
+    VFAT_OPT("--threads=%u", threads),
+    VFAT_OPT("--timeout=%lf", timeout),
+    VFAT_OPT("--stats=%s", stats),
+    VFAT_OPT("--trace=%s", trace),
+    FUSE_OPT_END,
+};
+
+int opt_proc(void *data, const char *arg, int key, fuse_args *outargs)
+{
+    auto opts = (options *)data;
+    if (key == FUSE_OPT_KEY_NONOPT && !opts->image)
+    {
+        opts->image = strdup(arg);
+        return 0;
+    }
+    return 1;
+}
+
+void print_help(const char *argv0)
+{
+    printf(
+        "Usage: %s [OPTION]... IMAGE MOUNTPOINT\n"
+        "Mount the FAT32 disk IMAGE at MOUNTPOINT.\n"
+        "Arguments:\n"
+        "  --threads=N                maximum idle worker threads, default 10;\n"
+        "                             1 serves every request on one thread\n"
+        "  --timeout=SECONDS          attribute and entry cache timeout, default 1.0\n"
+        "  --stats=FILE               write latency histograms and counters as\n"
+        "                             JSON to FILE every second\n"
+        "  --trace=FILE               record every device request to FILE,\n"
+        "                             see io_replay\n",
+        argv0);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+}
+
+int main(int argc, char *argv[])
+{
+    fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    options opts = {nullptr, 10, 1.0, nullptr, nullptr};
+    if (fuse_opt_parse(&args, &opts, option_spec, opt_proc) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    fuse_cmdline_opts cmdline;
+    if (fuse_parse_cmdline(&args, &cmdline) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (cmdline.show_help)
+    {
+        print_help(argv[0]);
+        return EXIT_SUCCESS;
+    }
+    if (cmdline.show_version)
+    {
+        fuse_lowlevel_version();
+        return EXIT_SUCCESS;
+    }
+    if (!opts.image || !cmdline.mountpoint)
+    {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (opts.trace)
+    {
+        try
+        {
+            fs.dev = std::make_unique<dev_io::dev_t>(
+                std::make_unique<dev_io::trace_dev>(std::make_unique<dev_io::file_dev>(opts.image), opts.trace));
+        }
+        catch (const dev_io::disk_error &e)
+        {
+            fprintf(stderr, "open disk %s with trace %s error, %s\n", opts.image, opts.trace, e.what());
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        fs.dev = std::make_unique<dev_io::dev_t>(opts.image);
+    }
+    if (!*fs.dev)
+    {
+        fprintf(stderr, "open disk %s error\n", opts.image);
+        return EXIT_FAILURE;
+    }
+    fs.timeout = opts.timeout;
+    // daemonizing changes directory
+    std::string stats_path;
+    if (opts.stats)
+    {
+        stats_path = std::filesystem::absolute(opts.stats).string();
+    }
+    bool exist;
+    bool isdir;
+    fs.root.fd = fs.dev->open({}, OPEN_EXISTING, 0, exist, isdir);
+    fs.root.id = fs.dev->file_id(fs.root.fd);
+    fs.root.nlookup = 1;
+
+    // 1 MiB reads to match max_write in vfat_init; inserted first so a
+    // max_read given on the command line still wins
+    fuse_opt_insert_arg(&args, 1, "-omax_read=1048576");
+    int ret = EXIT_FAILURE;
+    auto se = fuse_session_new(&args, &operations, sizeof(operations), nullptr);
+    if (se)
+    {
+        if (fuse_set_signal_handlers(se) == 0)
+        {
+            if (fuse_session_mount(se, cmdline.mountpoint) == 0)
+            {
+                fuse_daemonize(cmdline.foreground);
+                if (!stats_path.empty() && !fat32::stats::start_dump(stats_path.c_str(), 1000))
+                {
+                    log_error("cannot write stats to %s\n", stats_path);
+                }
+                if (cmdline.singlethread || opts.threads <= 1)
+                {
+                    ret = fuse_session_loop(se);
+                }
+                else
+                {
+                    fuse_loop_config config;
+                    config.clone_fd = cmdline.clone_fd;
+                    config.max_idle_threads = opts.threads;
+                    ret = fuse_session_loop_mt(se, &config);
+                }
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+
+    free(cmdline.mountpoint);
+    free((void *)opts.image);
+    free((void *)opts.stats);
+    free((void *)opts.trace);
+    fuse_opt_free_args(&args);
+    fs.dev.reset();
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
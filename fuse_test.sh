@@ -0,0 +1,82 @@
+#!/bin/sh
+# Smoke test for fuse_disk: mounts a fresh image, creates, writes and reads
+# back files, remounts so the reads reach the image instead of the page
+# cache, unlinks them and checks the image with fsck.
+# Usage: fuse_test.sh FUSE_DISK FORMAT FSCK
+# Exits 77, which ctest reports as skipped, where FUSE cannot mount.
+
+fuse_disk=$1
+format=$2
+fsck=$3
+
+dir=$(mktemp -d) || exit 1
+image=$dir/disk.img
+mnt=$dir/mnt
+pid=
+
+cleanup()
+{
+    if [ -n "$pid" ]; then
+        fusermount3 -u "$mnt" 2>/dev/null
+        wait "$pid"
+    fi
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "fuse_test: $*" >&2
+    exit 1
+}
+
+mount_image()
+{
+    "$fuse_disk" -f "$image" "$mnt" &
+    pid=$!
+    i=0
+    while ! mountpoint -q "$mnt"; do
+        if ! kill -0 "$pid" 2>/dev/null; then
+            pid=
+            echo "fuse_test: cannot mount here, skipped"
+            exit 77
+        fi
+        i=$((i + 1))
+        [ $i -lt 100 ] || fail "mount timed out"
+        sleep 0.1
+    done
+}
+
+unmount_image()
+{
+    fusermount3 -u "$mnt" || fail "unmount failed"
+    wait "$pid" || fail "fuse_disk exited with an error"
+    pid=
+}
+
+if [ ! -c /dev/fuse ] || ! command -v fusermount3 >/dev/null; then
+    echo "fuse_test: no FUSE here, skipped"
+    exit 77
+fi
+
+mkdir "$mnt" || exit 1
+"$format" "$image" 64MiB >/dev/null || fail "format failed"
+# spans many clusters and more than one max_read request
+head -c 3000000 /dev/urandom >"$dir/big" || exit 1
+
+mount_image
+printf 'hello fat32\n' >"$mnt/hello.txt" || fail "create failed"
+mkdir "$mnt/sub" || fail "mkdir failed"
+cp "$dir/big" "$mnt/sub/big.bin" || fail "write failed"
+unmount_image
+
+mount_image
+[ "$(cat "$mnt/hello.txt")" = "hello fat32" ] || fail "small file reads back wrong"
+cmp -s "$dir/big" "$mnt/sub/big.bin" || fail "large file reads back wrong"
+rm "$mnt/hello.txt" "$mnt/sub/big.bin" || fail "unlink failed"
+rmdir "$mnt/sub" || fail "rmdir failed"
+[ -z "$(ls -A "$mnt")" ] || fail "root is not empty after unlink"
+unmount_image
+
+"$fsck" "$image" || fail "fsck found errors"
+echo "fuse_test: ok"
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "dev_io.h"
+
+namespace
+{
+
+const char *image = "grow_test.img";
+const uint16_t block_size = 512;
+const uint32_t old_block = 70000;
+const uint32_t new_block = 140000;
+
+int failed = 0;
+
+void check(bool cond, const char *what)
+{
+    if (!cond)
+    {
+        fprintf(stderr, "grow_test: %s\n", what);
+        ++failed;
+    }
+}
+
+// the backup boot sector and FSInfo must follow the primary ones
+void check_boot()
+{
+    auto fp = fopen(image, "rb");
+    if (!fp)
+    {
+        check(false, "cannot reopen the image");
+        return;
+    }
+    std::vector<char> sec(8 * block_size);
+    check(fread(sec.data(), 1, sec.size(), fp) == sec.size(), "short read of the reserved region");
+    fclose(fp);
+    fat32::BPB_t BPB;
+    memcpy(&BPB, sec.data(), sizeof(BPB));
+    check(BPB.BPB_TotSec32 == new_block, "primary BPB keeps the old size");
+    check(BPB.BPB_BkBootSec == 6, "primary BPB lost the backup boot sector");
+    check(!memcmp(sec.data(), sec.data() + 6 * block_size, sizeof(BPB)), "backup BPB differs from the primary");
+    check(!memcmp(sec.data() + block_size, sec.data() + 7 * block_size, sizeof(fat32::FSInfo_t)),
+          "backup FSInfo differs from the primary");
+}
+
+} // namespace
+
+int main()
+{
+    remove(image);
+    std::vector<char> buf(1 << 16, 'g');
+    bool exist, isdir;
+    {
+        dev_io::format_options opts;
+        opts.max_block = new_block;
+        dev_io::dev_t dev(image, old_block, block_size, opts);
+        auto fd = dev.open({L"before"}, CREATE_NEW, 0x20, exist, isdir);
+        dev.write(fd, 0, buf.size(), buf.data());
+        dev.close(fd);
+        dev.grow((uint64_t)new_block * block_size);
+    }
+    check_boot();
+    {
+        dev_io::dev_t dev(image);
+        uint64_t free_after, total, total_free;
+        auto fd = dev.open({L"filler"}, CREATE_NEW, 0x20, exist, isdir);
+        uint64_t offset = 0;
+        fat32::result<uint32_t> res = 0u;
+        // large writes first, then single blocks for the last few clusters
+        for (uint32_t len : {(uint32_t)buf.size(), (uint32_t)block_size})
+        {
+            while ((res = dev.try_write(fd, offset, len, buf.data())))
+            {
+                offset += *res;
+            }
+            check(res.error() == fat32::file_error::DISK_FULL, "filling the volume did not end in DISK_FULL");
+        }
+        check(offset > (uint64_t)old_block * block_size, "the grown part of the volume was not used");
+        dev.get_disk_info(&free_after, &total, &total_free);
+        check(free_after == 0, "DISK_FULL with free space left");
+        auto dir = dev.try_open({L"dir"}, CREATE_NEW, 0x10, exist, isdir);
+        check(!dir && dir.error() == fat32::file_error::DISK_FULL, "creating a directory on a full volume did not fail with DISK_FULL");
+        if (dir)
+        {
+            dev.close(*dir);
+        }
+        dev.close(fd);
+    }
+    check_boot();
+    remove(image);
+    if (failed)
+    {
+        return 1;
+    }
+    printf("grow_test: ok\n");
+    return 0;
+}
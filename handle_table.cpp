@@ -0,0 +1,114 @@
+#include "handle_table.h"
+
+namespace dev_io
+{
+
+handle_table::handle_table() : next(0)
+{
+    for (auto &p : pages)
+    {
+        p.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+handle_table::~handle_table()
+{
+    for (auto &p : pages)
+    {
+        delete[] p.load(std::memory_order_relaxed);
+    }
+}
+
+handle_table::shard &handle_table::local_shard() noexcept
+{
+    static std::atomic<uint32_t> counter(0);
+    thread_local uint32_t id = counter.fetch_add(1, std::memory_order_relaxed) % shard_count;
+    return shards[id];
+}
+
+bool handle_table::new_slot(uint32_t &index)
+{
+    std::lock_guard<std::mutex> g(grow_mtx);
+    index = next.load(std::memory_order_relaxed);
+    if (index >= max_pages * page_size)
+    {
+        return false;
+    }
+    auto &page = pages[index >> page_bits];
+    if (!page.load(std::memory_order_relaxed))
+    {
+        auto p = new slot[page_size];
+        for (uint32_t i = 0; i < page_size; ++i)
+        {
+            p[i].node.store(nullptr, std::memory_order_relaxed);
+            p[i].gen.store(1, std::memory_order_relaxed);
+        }
+        page.store(p, std::memory_order_release);
+    }
+    next.store(index + 1, std::memory_order_release);
+    return true;
+}
+
+uint64_t handle_table::insert(fat32::file_node *node)
+{
+    uint32_t index;
+    bool found = false;
+    auto &own = local_shard();
+    {
+        std::lock_guard<std::mutex> g(own.mtx);
+        if (!own.free.empty())
+        {
+            index = own.free.back();
+            own.free.pop_back();
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        found = new_slot(index);
+    }
+    for (uint32_t i = 0; !found && i < shard_count; ++i)
+    {
+        std::lock_guard<std::mutex> g(shards[i].mtx);
+        if (!shards[i].free.empty())
+        {
+            index = shards[i].free.back();
+            shards[i].free.pop_back();
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        return 0;
+    }
+    auto &s = pages[index >> page_bits].load(std::memory_order_relaxed)[index & page_mask];
+    s.node.store(node, std::memory_order_release);
+    return ((uint64_t)s.gen.load(std::memory_order_relaxed) << 32) | index;
+}
+
+fat32::file_node *handle_table::remove(uint64_t handle) noexcept
+{
+    uint32_t index = (uint32_t)handle;
+    uint32_t gen = handle >> 32;
+    if (index >= next.load(std::memory_order_acquire))
+    {
+        return nullptr;
+    }
+    auto &s = pages[index >> page_bits].load(std::memory_order_acquire)[index & page_mask];
+    // Only the caller that moves gen forward owns the slot's node.
+    if (gen == 0 || !s.gen.compare_exchange_strong(gen, gen + 1, std::memory_order_acq_rel))
+    {
+        return nullptr;
+    }
+    auto node = s.node.exchange(nullptr, std::memory_order_acq_rel);
+    // A slot whose generation would wrap is retired instead of reused.
+    if (gen + 1 != UINT32_MAX)
+    {
+        auto &own = local_shard();
+        std::lock_guard<std::mutex> g(own.mtx);
+        own.free.push_back(index);
+    }
+    return node;
+}
+
+} // namespace dev_io
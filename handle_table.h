@@ -0,0 +1,75 @@
+#ifndef HANDLE_TABLE_H
+#define HANDLE_TABLE_H
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include "fat32.h"
+
+namespace dev_io
+{
+
+// Maps 64-bit handles (generation << 32 | slot index) to open nodes.
+// Slots live in fixed pages that are never freed, so get() validates a
+// handle with two atomic loads from one slot and no lock. Each removal
+// bumps the slot generation, so a stale handle never resolves to a
+// node that reused its slot.
+class handle_table
+{
+public:
+    handle_table();
+    handle_table(const handle_table &) = delete;
+    handle_table &operator=(const handle_table &) = delete;
+    ~handle_table();
+
+    // Returns 0, never a valid handle, once every slot is taken.
+    uint64_t insert(fat32::file_node *node);
+    fat32::file_node *remove(uint64_t handle) noexcept;
+    fat32::file_node *get(uint64_t handle) const noexcept
+    {
+        uint32_t index = (uint32_t)handle;
+        if (index >= next.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        auto &s = pages[index >> page_bits].load(std::memory_order_acquire)[index & page_mask];
+        auto node = s.node.load(std::memory_order_acquire);
+        if (s.gen.load(std::memory_order_acquire) != (uint32_t)(handle >> 32))
+        {
+            return nullptr;
+        }
+        return node;
+    }
+
+private:
+    static constexpr uint32_t page_bits = 10;
+    static constexpr uint32_t page_size = 1u << page_bits;
+    static constexpr uint32_t page_mask = page_size - 1;
+    static constexpr uint32_t max_pages = 4096;
+    static constexpr uint32_t shard_count = 16;
+
+    struct alignas(16) slot
+    {
+        std::atomic<fat32::file_node *> node;
+        std::atomic<uint32_t> gen;
+    };
+
+    struct alignas(64) shard
+    {
+        std::mutex mtx;
+        std::vector<uint32_t> free;
+    };
+
+    shard &local_shard() noexcept;
+    bool new_slot(uint32_t &index);
+
+    std::atomic<slot *> pages[max_pages];
+    std::atomic<uint32_t> next;
+    std::mutex grow_mtx;
+    shard shards[shard_count];
+};
+
+} // namespace dev_io
+
+#endif
@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <ctype.h>
+#include <string.h>
+#include <wchar.h>
+#include "win_compat.h"
+#include "image_builder.h"
+
+namespace fs = std::filesystem;
+
+namespace dev_io
+{
+
+namespace
+{
+
+const uint64_t max_request = 16 << 20;
+
+const char this_folder[] = {0x2e, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20};
+const char parent_folder[] = {0x2e, 0x2e, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20};
+
+void write_range(blk_dev &img, uint64_t offset, uint64_t size, const void *buf)
+{
+    for (uint64_t done = 0; done < size; done += max_request)
+    {
+        img.write(offset + done, std::min(max_request, size - done), (const char *)buf + done);
+    }
+}
+
+FILETIME to_filetime(fs::file_time_type time)
+{
+    // file_time_type has no portable epoch in C++17, so go through now()
+    auto sys = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+        time - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
+    auto secs = std::chrono::duration_cast<std::chrono::seconds>(sys.time_since_epoch()).count();
+    // FILETIME counts 100ns intervals since 1601-01-01
+    uint64_t ticks = (uint64_t)std::max<int64_t>(secs + 11644473600ll, 0) * 10000000;
+    FILETIME res;
+    res.dwLowDateTime = (DWORD)ticks;
+    res.dwHighDateTime = (DWORD)(ticks >> 32);
+    return res;
+}
+
+std::wstring host_name(const fs::path &path)
+{
+#ifdef _WIN32
+    return path.filename().wstring();
+#else
+    // path::wstring() depends on the C++ locale; host names are UTF-8 here
+    auto name = path.filename().string();
+    std::wstring res(name.size(), 0);
+    res.resize(MultiByteToWideChar(CP_ACP, 0, name.data(), name.size(), res.data(), res.size()));
+    return res;
+#endif
+}
+
+std::wstring fold_case(std::wstring_view name)
+{
+    std::wstring res(name);
+    for (auto &c : res)
+    {
+        if (c >= L'a' && c <= L'z')
+            c -= L'a' - L'A';
+    }
+    return res;
+}
+
+bool long_name_char(wchar_t c)
+{
+    return c >= 0x20 && !wcschr(L"\\/:*?\"<>|", c);
+}
+
+bool short_name_char(wchar_t c)
+{
+    return c < 0x80 && (isalnum(c) || strchr("$%'-_@~`!(){}^#&", (int)c));
+}
+
+// Short names of one directory. Every entry also gets a long name, so the
+// short one only has to be valid and unique; numeric tails are counted per
+// basis so that a directory of similar long names stays linear to fill.
+class short_names
+{
+public:
+    void make(std::wstring_view name, char *out)
+    {
+        std::string main, ext;
+        bool lossy = false;
+        auto add = [&](std::string &part, size_t max, wchar_t c) {
+            if (c == L' ' || c == L'.')
+            {
+                lossy = true;
+                return;
+            }
+            if (part.size() == max)
+            {
+                lossy = true;
+                return;
+            }
+            if (short_name_char(c))
+            {
+                part.push_back(toupper((int)c));
+            }
+            else
+            {
+                part.push_back('_');
+                lossy = true;
+            }
+        };
+        auto dot = name.find_last_of(L'.');
+        if (dot == std::wstring_view::npos)
+            dot = name.length();
+        for (size_t i = 0; i < dot; ++i)
+        {
+            add(main, 8, name[i]);
+        }
+        for (size_t i = dot + 1; i < name.length(); ++i)
+        {
+            add(ext, 3, name[i]);
+        }
+        if (main.empty())
+        {
+            main = "_";
+            lossy = true;
+        }
+
+        auto compose = [&](const std::string &m) {
+            std::string res(11, ' ');
+            memcpy(&res[0], m.data(), m.size());
+            memcpy(&res[8], ext.data(), ext.size());
+            return res;
+        };
+        auto basis = compose(main);
+        if (!lossy && used.insert(basis).second)
+        {
+            memcpy(out, basis.data(), 11);
+            return;
+        }
+        auto &n = next[basis];
+        while (true)
+        {
+            auto tail = "~" + std::to_string(++n);
+            auto res = compose(main.substr(0, 8 - tail.size()) + tail);
+            if (used.insert(res).second)
+            {
+                memcpy(out, res.data(), 11);
+                return;
+            }
+        }
+    }
+
+private:
+    std::unordered_set<std::string> used;
+    std::unordered_map<std::string, unsigned> next;
+};
+
+} // namespace
+
+image_builder::image_builder(const std::string &src)
+{
+    if (!fs::is_directory(src))
+        throw std::runtime_error(src + " is not a directory");
+    node root;
+    root.path = src;
+    root.isdir = true;
+    root.size = 0;
+    root.wrt_time = to_filetime(fs::last_write_time(src));
+    memset(root.short_name, 0x20, sizeof(root.short_name));
+    root.parent = 0;
+    nodes.push_back(std::move(root));
+    for (uint32_t id = 0; id < nodes.size(); ++id)
+    {
+        if (nodes[id].isdir)
+            scan(id);
+    }
+}
+
+void image_builder::scan(uint32_t id)
+{
+    std::vector<fs::directory_entry> list(fs::directory_iterator(nodes[id].path), fs::directory_iterator());
+    std::sort(list.begin(), list.end(), [](const fs::directory_entry &a, const fs::directory_entry &b) {
+        return a.path().filename() < b.path().filename();
+    });
+
+    short_names shorts;
+    std::unordered_set<std::wstring> seen;
+    uint64_t slots = id ? 2 : 0;
+    for (auto &e : list)
+    {
+        auto path = e.path().string();
+        auto status = e.status();
+        if (e.is_symlink() && fs::is_directory(status))
+        {
+            skipped_paths.push_back(path);
+            continue;
+        }
+        if (!fs::is_directory(status) && !fs::is_regular_file(status))
+        {
+            skipped_paths.push_back(path);
+            continue;
+        }
+
+        node n;
+        n.name = host_name(e.path());
+        auto len = utf16_len(n.name);
+        if (len > 255 || !std::all_of(n.name.begin(), n.name.end(), long_name_char))
+            throw std::runtime_error(path + " has a name FAT32 cannot store");
+        if (!seen.insert(fold_case(n.name)).second)
+            throw std::runtime_error(path + " differs from another name in its directory only in case");
+        n.path = e.path();
+        n.isdir = fs::is_directory(status);
+        n.size = n.isdir ? 0 : fs::file_size(e.path());
+        if (n.size > 0xffffffff)
+            throw std::runtime_error(path + " is larger than the 4 GiB FAT32 allows");
+        n.wrt_time = to_filetime(e.last_write_time());
+        shorts.make(n.name, n.short_name);
+        n.parent = id;
+        slots += 1 + (len + 12) / 13;
+
+        if (n.isdir)
+        {
+            ++dirs;
+        }
+        else
+        {
+            ++files;
+            bytes += n.size;
+        }
+        nodes[id].children.push_back(nodes.size());
+        nodes.push_back(std::move(n));
+    }
+    if (slots > 65536)
+        throw std::runtime_error(nodes[id].path.string() + " has more entries than a FAT32 directory can hold");
+    nodes[id].slots = slots;
+}
+
+void image_builder::build(blk_dev &img, uint32_t tot_block, uint16_t block_size, const format_options &opts, unsigned threads)
+{
+    fat32::BPB_t BPB;
+    fat32::FSInfo_t FSInfo;
+    set_BPB(tot_block, block_size, &BPB, opts);
+    set_FSInfo(&FSInfo, &BPB);
+    uint32_t clus_size = block_size * BPB.BPB_SecPerClus;
+    uint32_t data_sec = BPB.BPB_RsvdSecCnt + BPB.BPB_NumFATs * BPB.BPB_FATSz32;
+    uint32_t count_of_cluster = (tot_block - data_sec) / BPB.BPB_SecPerClus;
+    uint64_t data_begin = (uint64_t)data_sec * block_size;
+
+    // directories first, in the order they were scanned, then file data
+    uint64_t next = 2;
+    for (auto &n : nodes)
+    {
+        if (!n.isdir)
+            continue;
+        n.first_clus = next;
+        n.clusters = std::max<uint64_t>(1, ((uint64_t)n.slots * sizeof(fat32::DIR_Entry) + clus_size - 1) / clus_size);
+        next += n.clusters;
+    }
+    uint32_t file_clus = next;
+    for (auto &n : nodes)
+    {
+        if (n.isdir)
+            continue;
+        n.clusters = (n.size + clus_size - 1) / clus_size;
+        n.first_clus = n.clusters ? next : 0;
+        next += n.clusters;
+    }
+    if (next - 2 > count_of_cluster)
+    {
+        throw std::runtime_error("the tree needs " + std::to_string(next - 2) + " clusters of " + std::to_string(clus_size) +
+                                 " bytes, the volume has " + std::to_string(count_of_cluster));
+    }
+
+    std::vector<uint32_t> fat((uint64_t)BPB.BPB_FATSz32 * block_size / sizeof(uint32_t));
+    fat[0] = 0x0ffffff8;
+    fat[1] = 0x0fffffff;
+    for (auto &n : nodes)
+    {
+        for (uint32_t k = 0; k < n.clusters; ++k)
+        {
+            fat[n.first_clus + k] = k + 1 == n.clusters ? 0x0fffffff : n.first_clus + k + 1;
+        }
+    }
+    FSInfo.FSI_FreeCount = count_of_cluster - (next - 2);
+    FSInfo.FSI_Nxt_Free = next < count_of_cluster + 2 ? next : 0xffffffff;
+
+    std::vector<char> reserved((uint64_t)BPB.BPB_RsvdSecCnt * block_size);
+    memcpy(reserved.data(), &BPB, 512);
+    memcpy(reserved.data() + 6 * block_size, &BPB, 512);
+    memcpy(reserved.data() + 1 * block_size, &FSInfo, 512);
+    memcpy(reserved.data() + 7 * block_size, &FSInfo, 512);
+    write_range(img, 0, reserved.size(), reserved.data());
+    for (uint32_t copy = 0; copy < BPB.BPB_NumFATs; ++copy)
+    {
+        write_range(img, reserved.size() + (uint64_t)copy * fat.size() * sizeof(uint32_t), fat.size() * sizeof(uint32_t), fat.data());
+    }
+    write_dirs(img, data_begin, clus_size);
+    write_files(img, data_begin, clus_size, file_clus, threads);
+}
+
+void image_builder::write_dirs(blk_dev &img, uint64_t data_begin, uint32_t clus_size)
+{
+    std::vector<char> batch;
+    uint64_t offset = data_begin;
+    auto attr_of = [](const node &n) {
+        fat32::node_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = n.size;
+        attr.crt_time = attr.acc_time = attr.wrt_time = n.wrt_time;
+        attr.first_clus = n.first_clus;
+        attr.attr = n.isdir ? 0x10 : 0x20;
+        memcpy(attr.short_name, n.short_name, sizeof(attr.short_name));
+        return attr;
+    };
+    for (uint32_t id = 0; id < nodes.size(); ++id)
+    {
+        auto &dir = nodes[id];
+        if (!dir.isdir)
+            continue;
+        std::vector<fat32::DIR_Entry> entries((uint64_t)dir.clusters * clus_size / sizeof(fat32::DIR_Entry));
+        memset(entries.data(), 0, entries.size() * sizeof(fat32::DIR_Entry));
+        size_t pos = 0;
+        if (id)
+        {
+            auto attr = attr_of(dir);
+            memcpy(attr.short_name, this_folder, sizeof(this_folder));
+            Attr2DirEntry(L".", &attr, &entries[pos++], 0);
+            attr = attr_of(nodes[dir.parent]);
+            memcpy(attr.short_name, parent_folder, sizeof(parent_folder));
+            // the root is cluster 0 in '..'
+            if (!dir.parent)
+                attr.first_clus = 0;
+            Attr2DirEntry(L"..", &attr, &entries[pos++], 0);
+        }
+        for (auto c : dir.children)
+        {
+            auto attr = attr_of(nodes[c]);
+            Attr2DirEntry(nodes[c].name, &attr, &entries[pos], 1);
+            pos += 1 + (utf16_len(nodes[c].name) + 12) / 13;
+        }
+        auto raw = (const char *)entries.data();
+        batch.insert(batch.end(), raw, raw + entries.size() * sizeof(fat32::DIR_Entry));
+        if (batch.size() >= max_request)
+        {
+            write_range(img, offset, batch.size(), batch.data());
+            offset += batch.size();
+            batch.clear();
+        }
+    }
+    write_range(img, offset, batch.size(), batch.data());
+}
+
+void image_builder::write_files(blk_dev &img, uint64_t data_begin, uint32_t clus_size, uint32_t file_clus, unsigned threads)
+{
+    // The file extents follow each other, so the data region is cut into
+    // segments of up to max_request bytes, each made of pieces of files.
+    struct piece
+    {
+        uint32_t node;
+        uint64_t file_offset;
+        uint64_t buf_offset;
+        uint32_t len;
+    };
+    struct segment
+    {
+        uint32_t first_clus;
+        uint32_t clusters;
+        std::vector<piece> pieces;
+    };
+    uint32_t seg_clusters = std::max<uint64_t>(1, max_request / clus_size);
+    std::vector<segment> segments;
+    auto next = file_clus;
+    for (uint32_t id = 0; id < nodes.size(); ++id)
+    {
+        auto &n = nodes[id];
+        uint64_t done = 0;
+        while (done < n.size)
+        {
+            if (segments.empty() || segments.back().clusters == seg_clusters)
+                segments.push_back(segment{next, 0, {}});
+            auto &seg = segments.back();
+            uint64_t len = std::min<uint64_t>(n.size - done, (uint64_t)(seg_clusters - seg.clusters) * clus_size);
+            uint32_t clusters = (len + clus_size - 1) / clus_size;
+            seg.pieces.push_back(piece{id, done, (uint64_t)seg.clusters * clus_size, (uint32_t)len});
+            seg.clusters += clusters;
+            next += clusters;
+            done += len;
+        }
+    }
+
+    // readers fill segments ahead of the writer, which stores them in order
+    threads = std::max(1u, threads);
+    size_t window = 2 * threads;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::vector<char>> ready(segments.size());
+    size_t written = 0;
+    std::atomic<size_t> claimed{0};
+    std::exception_ptr error;
+
+    auto read_segments = [&] {
+        try
+        {
+            while (true)
+            {
+                auto i = claimed++;
+                if (i >= segments.size())
+                    return;
+                {
+                    std::unique_lock<std::mutex> lk(mtx);
+                    cv.wait(lk, [&] { return i < written + window || error; });
+                    if (error)
+                        return;
+                }
+                auto &seg = segments[i];
+                std::vector<char> buf((uint64_t)seg.clusters * clus_size);
+                for (auto &p : seg.pieces)
+                {
+                    auto &path = nodes[p.node].path;
+                    std::ifstream in(path, std::ios::binary);
+                    in.seekg(p.file_offset);
+                    in.read(buf.data() + p.buf_offset, p.len);
+                    if ((uint64_t)in.gcount() != p.len)
+                        throw std::runtime_error(path.string() + " could not be read or changed while the image was built");
+                }
+                std::lock_guard<std::mutex> lk(mtx);
+                ready[i] = std::move(buf);
+                cv.notify_all();
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (!error)
+                error = std::current_exception();
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        readers.emplace_back(read_segments);
+    }
+    try
+    {
+        for (size_t i = 0; i < segments.size(); ++i)
+        {
+            std::vector<char> buf;
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [&] { return !ready[i].empty() || error; });
+                if (error)
+                    break;
+                buf = std::move(ready[i]);
+            }
+            write_range(img, data_begin + (uint64_t)(segments[i].first_clus - 2) * clus_size, buf.size(), buf.data());
+            std::lock_guard<std::mutex> lk(mtx);
+            ++written;
+            cv.notify_all();
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (!error)
+            error = std::current_exception();
+        cv.notify_all();
+    }
+    for (auto &r : readers)
+        r.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+} // namespace dev_io
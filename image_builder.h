@@ -0,0 +1,64 @@
+#ifndef IMAGE_BUILDER_H
+#define IMAGE_BUILDER_H
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "dev_io.h"
+
+namespace dev_io
+{
+
+// Formats an image and fills it with a copy of a host directory tree in one
+// pass, without going through dev_t. Directories are laid out in memory,
+// every file gets one contiguous extent, and the image is written front to
+// back: boot sectors, FATs, all directories, then file data in large
+// sequential requests while host files are read in parallel.
+class image_builder
+{
+public:
+    // Scans the tree under src. Throws std::runtime_error for anything that
+    // cannot be stored on FAT32.
+    explicit image_builder(const std::string &src);
+
+    uint64_t file_count() const noexcept { return files; }
+    uint64_t dir_count() const noexcept { return dirs; }
+    uint64_t data_bytes() const noexcept { return bytes; }
+    // Entries that are neither regular files nor directories, and symbolic
+    // links to directories, are left out.
+    const std::vector<std::string> &skipped() const noexcept { return skipped_paths; }
+
+    // img must hold tot_block blocks of block_size bytes. Throws
+    // std::runtime_error if the tree does not fit.
+    void build(blk_dev &img, uint32_t tot_block, uint16_t block_size, const format_options &opts, unsigned threads);
+
+private:
+    struct node
+    {
+        std::wstring name;
+        std::filesystem::path path;
+        bool isdir;
+        uint64_t size;
+        FILETIME wrt_time;
+        char short_name[11];
+        uint32_t parent;
+        uint32_t first_clus;
+        uint32_t clusters;
+        uint32_t slots; // directory entries of a directory, dots included
+        std::vector<uint32_t> children;
+    };
+
+    std::vector<node> nodes;
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    uint64_t bytes = 0;
+    std::vector<std::string> skipped_paths;
+
+    void scan(uint32_t id);
+    void write_dirs(blk_dev &img, uint64_t data_begin, uint32_t clus_size);
+    void write_files(blk_dev &img, uint64_t data_begin, uint32_t clus_size, uint32_t file_clus, unsigned threads);
+};
+
+} // namespace dev_io
+
+#endif
@@ -0,0 +1,93 @@
+#include <chrono>
+#include <vector>
+#include <string>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include "dev_io.h"
+
+// Bulk ingest of many small files into one directory, either with an
+// open/write/close triple per file or with dev_t::run_batch.
+
+std::wstring file_name(const wchar_t *prefix, int i)
+{
+    return prefix + std::to_wstring(i);
+}
+
+double ingest_calls(dev_io::dev_t &dev, int files, const std::vector<char> &data)
+{
+    auto begin = std::chrono::steady_clock::now();
+    bool exist;
+    bool isdir;
+    for (int i = 0; i < files; ++i)
+    {
+        auto fd = dev.open({L"calls", file_name(L"f", i)}, CREATE_NEW, 0x20, exist, isdir);
+        dev.write(fd, 0, data.size(), data.data());
+        dev.close(fd);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return files / std::chrono::duration<double>(end - begin).count();
+}
+
+double ingest_batch(dev_io::dev_t &dev, int files, int batch_size, const std::vector<char> &data)
+{
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<dev_io::batch_op> ops;
+    for (int i = 0; i < files; i += batch_size)
+    {
+        ops.clear();
+        for (int k = i; k < files && k < i + batch_size; ++k)
+        {
+            fat32::path path{L"batch", file_name(L"f", k)};
+            ops.push_back(dev_io::batch_op{dev_io::batch_op::CREATE, path, 0x20, 0, 0, nullptr, {}, false});
+            ops.push_back(dev_io::batch_op{dev_io::batch_op::WRITE, path, 0, 0, (uint32_t)data.size(), data.data(), {}, false});
+        }
+        for (auto &e : dev.run_batch(ops))
+        {
+            if (e)
+                std::rethrow_exception(e);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return files / std::chrono::duration<double>(end - begin).count();
+}
+
+int main(int argc, char *argv[])
+{
+    int files = argc > 1 ? atoi(argv[1]) : 2000;
+    uint32_t file_size = argc > 2 ? atoi(argv[2]) : 4096;
+    int batch_size = argc > 3 ? atoi(argv[3]) : 256;
+    const char *image = argc > 4 ? argv[4] : nullptr;
+    if (batch_size < 1)
+        batch_size = 1;
+
+    uint64_t img_size = (uint64_t)files * (file_size + 4096) * 2 * 2 + (64ull << 20);
+    uint32_t tot_block = img_size / 512;
+    std::unique_ptr<dev_io::blk_dev> img;
+    if (image)
+        img = std::make_unique<dev_io::file_dev>(image, (uint64_t)tot_block * 512);
+    else
+        img = std::make_unique<dev_io::ram_dev>((uint64_t)tot_block * 512);
+    dev_io::dev_t dev(std::move(img), tot_block, 512);
+
+    bool exist;
+    bool isdir;
+    dev.close(dev.open({L"calls"}, CREATE_NEW, 0x10, exist, isdir));
+    dev.close(dev.open({L"batch"}, CREATE_NEW, 0x10, exist, isdir));
+    std::vector<char> data(file_size, 'x');
+
+    printf("backend: %s, %d files of %u bytes\n", image ? image : "ram", files, file_size);
+    printf("%-16s %12s\n", "mode", "files/s");
+    printf("%-16s %12.0f\n", "open/write/close", ingest_calls(dev, files, data));
+    printf("%-16s %12.0f\n", ("batch of " + std::to_string(batch_size)).c_str(), ingest_batch(dev, files, batch_size, data));
+
+    auto fd = dev.open({L"batch"}, OPEN_EXISTING, 0, exist, isdir);
+    auto count = dev.opendir(fd).size();
+    dev.close(fd);
+    if (count != (size_t)files + 2)
+    {
+        fprintf(stderr, "expected %d entries, found %zu\n", files, count);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "dev_io.h"
+#include "io_trace.h"
+#include "stats.h"
+
+// Re-issues a block trace recorded with trace_dev. Writes carry whatever
+// the scratch buffer holds, so the target image's contents are destroyed;
+// only the request pattern is reproduced.
+
+option long_options[] = {
+    {"max-speed", no_argument, NULL, 'm'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_help(char *argv0)
+{
+    printf(
+        "Usage: %s [OPTION]... TRACE [IMAGE]\n"
+        "Replay the device requests in TRACE against IMAGE, or against a RAM\n"
+        "image large enough for the trace if IMAGE is omitted.\n"
+        "Arguments:\n"
+        "  -m, --max-speed            issue requests back to back instead of\n"
+        "                             at their recorded times\n"
+        "  -h, --help                 show help messages\n"
+        "Prints one JSON object: totals, the recorded latencies as trace.read\n"
+        "and trace.write, and the replayed ones as replay.read and replay.write.\n",
+        argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    extern int optind, opterr, optopt;
+
+    opterr = 0;
+    bool max_speed = false;
+
+    while (true)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "mh", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 'm':
+            max_speed = true;
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            fprintf(stderr, "invalid argument %c\n", (char)optopt);
+            print_help(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "no enough arguments\n");
+        print_help(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<dev_io::trace_record> records;
+    try
+    {
+        records = dev_io::load_trace(argv[optind]);
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "read trace %s failed, %s\n", argv[optind], e.what());
+        exit(EXIT_FAILURE);
+    }
+    // records are written as requests complete
+    std::stable_sort(records.begin(), records.end(),
+                     [](const dev_io::trace_record &a, const dev_io::trace_record &b) { return a.time < b.time; });
+
+    uint64_t dev_size = 0;
+    uint32_t max_len = 0;
+    for (const auto &r : records)
+    {
+        dev_size = std::max(dev_size, r.offset + r.length);
+        max_len = std::max(max_len, r.length);
+    }
+
+    std::unique_ptr<dev_io::blk_dev> dev;
+    try
+    {
+        if (optind + 1 < argc)
+            dev = std::make_unique<dev_io::file_dev>(argv[optind + 1]);
+        else
+            dev = std::make_unique<dev_io::ram_dev>(dev_size);
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "open image failed, %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+
+    auto trace_read = fat32::stats::register_op("trace.read");
+    auto trace_write = fat32::stats::register_op("trace.write");
+    auto replay_read = fat32::stats::register_op("replay.read");
+    auto replay_write = fat32::stats::register_op("replay.write");
+    std::vector<char> buf(max_len);
+    uint64_t reads = 0, writes = 0, read_bytes = 0, write_bytes = 0, late = 0;
+    auto begin = std::chrono::steady_clock::now();
+    try
+    {
+        for (const auto &r : records)
+        {
+            if (!max_speed)
+            {
+                auto due = begin + std::chrono::nanoseconds(r.time);
+                if (std::chrono::steady_clock::now() > due)
+                    ++late;
+                else
+                    std::this_thread::sleep_until(due);
+            }
+            auto start = fat32::stats::now();
+            if (r.write)
+            {
+                dev->write(r.offset, r.length, buf.data());
+                fat32::stats::record(replay_write, fat32::stats::now() - start);
+                fat32::stats::record(trace_write, r.latency);
+                ++writes;
+                write_bytes += r.length;
+            }
+            else
+            {
+                dev->read(r.offset, r.length, buf.data());
+                fat32::stats::record(replay_read, fat32::stats::now() - start);
+                fat32::stats::record(trace_read, r.latency);
+                ++reads;
+                read_bytes += r.length;
+            }
+        }
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "replay failed, %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    double traced = records.empty() ? 0 : (records.back().time + records.back().latency) / 1e9;
+
+    // how much of the device traffic each operation caused
+    std::vector<uint64_t> by_op(fat32::stats::max_ops + 1);
+    for (const auto &r : records)
+        by_op[std::min<uint32_t>(r.op, fat32::stats::max_ops)] += r.length;
+    std::string origin;
+    for (uint32_t op = 0; op <= fat32::stats::max_ops; ++op)
+    {
+        if (!by_op[op])
+            continue;
+        auto name = fat32::stats::op_name(op);
+        origin += origin.empty() ? "" : ",";
+        origin += "\"" + (name ? std::string(name) : op == fat32::stats::max_ops ? "none" : "op" + std::to_string(op)) +
+                  "\":" + std::to_string(by_op[op]);
+    }
+
+    auto stats = fat32::stats::to_json();
+    stats.pop_back();
+    printf("{\"records\":%zu,\"reads\":%llu,\"writes\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu,"
+           "\"traced_s\":%.6f,\"replay_s\":%.6f,\"iops\":%.0f,\"mb_s\":%.2f,\"late\":%llu,\"max_speed\":%s,"
+           "\"bytes_by_op\":{%s},\"latency\":%s}\n",
+           records.size(), (unsigned long long)reads, (unsigned long long)writes, (unsigned long long)read_bytes,
+           (unsigned long long)write_bytes, traced, secs, secs > 0 ? records.size() / secs : 0,
+           secs > 0 ? (read_bytes + write_bytes) / secs / 1e6 : 0, (unsigned long long)late,
+           max_speed ? "true" : "false", origin.c_str(), stats.c_str());
+    return 0;
+}
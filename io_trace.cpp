@@ -0,0 +1,140 @@
+#include <string.h>
+#include <algorithm>
+#include "io_trace.h"
+#include "stats.h"
+
+namespace dev_io
+{
+
+namespace
+{
+
+const size_t batch_records = 4096;
+
+} // namespace
+
+trace_dev::trace_dev(std::unique_ptr<blk_dev> dev, const char *trace_name)
+    : dev(std::move(dev)), file(fopen(trace_name, "wb")), origin(fat32::stats::now())
+{
+    if (!file)
+    {
+        throw disk_error(disk_error::DISK_OPEN_ERROR);
+    }
+    trace_header header;
+    memcpy(header.magic, trace_magic, sizeof(header.magic));
+    header.version = trace_version;
+    header.record_size = sizeof(trace_record);
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        fclose(file);
+        throw disk_error(disk_error::DISK_WRITE_ERROR);
+    }
+    pending.reserve(batch_records);
+}
+
+trace_dev::~trace_dev()
+{
+    flush_records();
+    fclose(file);
+}
+
+int32_t trace_dev::read(uint64_t offset, uint32_t size, void *buf)
+{
+    auto start = fat32::stats::now();
+    auto res = dev->read(offset, size, buf);
+    append(start, offset, size, false, fat32::stats::current_op);
+    return res;
+}
+
+int32_t trace_dev::write(uint64_t offset, uint32_t size, const void *buf)
+{
+    auto start = fat32::stats::now();
+    auto res = dev->write(offset, size, buf);
+    append(start, offset, size, true, fat32::stats::current_op);
+    return res;
+}
+
+void trace_dev::read_async(uint64_t offset, uint32_t size, void *buf, io_done done)
+{
+    auto start = fat32::stats::now();
+    auto op = fat32::stats::current_op;
+    dev->read_async(offset, size, buf, [this, start, offset, size, op, done = std::move(done)](std::exception_ptr error) {
+        if (!error)
+            append(start, offset, size, false, op);
+        done(error);
+    });
+}
+
+void trace_dev::write_async(uint64_t offset, uint32_t size, const void *buf, io_done done)
+{
+    auto start = fat32::stats::now();
+    auto op = fat32::stats::current_op;
+    dev->write_async(offset, size, buf, [this, start, offset, size, op, done = std::move(done)](std::exception_ptr error) {
+        if (!error)
+            append(start, offset, size, true, op);
+        done(error);
+    });
+}
+
+void trace_dev::append(uint64_t start, uint64_t offset, uint32_t size, bool write, uint32_t op)
+{
+    trace_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time = start - origin;
+    rec.offset = offset;
+    rec.length = size;
+    rec.latency = std::min<uint64_t>(fat32::stats::now() - start, UINT32_MAX);
+    rec.op = op;
+    rec.write = write;
+    std::lock_guard<std::mutex> g(mtx);
+    pending.push_back(rec);
+    if (pending.size() == batch_records)
+    {
+        flush_records();
+    }
+}
+
+void trace_dev::extend(uint64_t size)
+{
+    dev->extend(size);
+}
+
+uint32_t trace_dev::align() const
+{
+    return dev->align();
+}
+
+void trace_dev::flush_records()
+{
+    if (!pending.empty())
+    {
+        fwrite(pending.data(), sizeof(trace_record), pending.size(), file);
+        pending.clear();
+    }
+}
+
+std::vector<trace_record> load_trace(const char *trace_name)
+{
+    auto file = fopen(trace_name, "rb");
+    if (!file)
+    {
+        throw disk_error(disk_error::DISK_NOT_FOUND);
+    }
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, trace_magic, sizeof(header.magic)) ||
+        header.version != trace_version || header.record_size != sizeof(trace_record))
+    {
+        fclose(file);
+        throw disk_error(disk_error::DISK_SIGNATURE_ERROR);
+    }
+    std::vector<trace_record> records;
+    trace_record rec;
+    while (fread(&rec, sizeof(rec), 1, file) == 1)
+    {
+        records.push_back(rec);
+    }
+    fclose(file);
+    return records;
+}
+
+} // namespace dev_io
@@ -0,0 +1,69 @@
+#ifndef IO_TRACE_H
+#define IO_TRACE_H
+#include <stdio.h>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include "dev_io.h"
+
+namespace dev_io
+{
+
+// On-disk layout of a block trace: one trace_header, then one
+// trace_record per device request in completion order.
+struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct trace_record
+{
+    uint64_t time;      // ns from the start of the trace to submission
+    uint64_t offset;
+    uint32_t length;
+    uint32_t latency;   // ns, saturated
+    uint16_t op;        // fat32::stats op id, stats::max_ops outside any
+    uint8_t write;
+    uint8_t reserved[5];
+};
+
+static_assert(sizeof(trace_record) == 32, "trace_record is part of the file format");
+
+constexpr char trace_magic[8] = {'F', 'A', 'T', 'I', 'O', 'T', 'R', 'C'};
+constexpr uint32_t trace_version = 1;
+
+// Passes every request through to the wrapped device and appends a
+// trace_record for it, so wrapping the image before dev_t mounts it also
+// captures the mount and the final write-back.
+class trace_dev : public blk_dev
+{
+public:
+    trace_dev(std::unique_ptr<blk_dev> dev, const char *trace_name);
+    ~trace_dev();
+    int32_t read(uint64_t offset, uint32_t size, void *buf) override;
+    int32_t write(uint64_t offset, uint32_t size, const void *buf) override;
+    void read_async(uint64_t offset, uint32_t size, void *buf, io_done done) override;
+    void write_async(uint64_t offset, uint32_t size, const void *buf, io_done done) override;
+    void extend(uint64_t size) override;
+    uint32_t align() const override;
+
+private:
+    void append(uint64_t start, uint64_t offset, uint32_t size, bool write, uint32_t op);
+    void flush_records();
+
+    std::unique_ptr<blk_dev> dev;
+    FILE *file;
+    uint64_t origin;
+    std::mutex mtx;
+    std::vector<trace_record> pending;
+};
+
+// Reads a whole trace; throws disk_error if the file is not one.
+std::vector<trace_record> load_trace(const char *trace_name);
+
+} // namespace dev_io
+
+#endif
@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "win_compat.h"
+#include "dev_io.h"
+#include "fs_trace.h"
+#include "stats.h"
+
+// Drives dev_t directly from an operation trace recorded by a frontend,
+// so a production workload can be measured without mounting anything.
+
+option long_options[] = {
+    {"concurrent", no_argument, NULL, 'c'},
+    {"size", required_argument, NULL, 's'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_help(char *argv0)
+{
+    printf(
+        "Usage: %s [OPTION]... TRACE [IMAGE]\n"
+        "Replay the filesystem operations in TRACE against IMAGE, or against a\n"
+        "fresh RAM image holding the files the trace expects to exist.\n"
+        "Arguments:\n"
+        "  -c, --concurrent           one thread per recorded thread, each at its\n"
+        "                             recorded times; default is one thread\n"
+        "                             issuing every operation back to back\n"
+        "  -s, --size                 RAM image size in MiB, default 256\n"
+        "  -h, --help                 show help messages\n"
+        "Prints one JSON object with throughput, errors and the latency of every\n"
+        "replayed operation (replay.*) and dev_t call.\n",
+        argv0);
+}
+
+class replayer
+{
+public:
+    explicit replayer(dev_io::dev_t &dev) : dev(dev)
+    {
+        for (int op = 0; op < fs_trace::FS_OP_COUNT; ++op)
+        {
+            names[op] = std::string("replay.") + fs_trace::op_name((fs_trace::op_t)op);
+            ids[op] = fat32::stats::register_op(names[op].c_str());
+        }
+    }
+
+    void run(const fs_trace::event &e)
+    {
+        if (e.rec.op >= fs_trace::FS_OP_COUNT)
+            return;
+        fat32::stats::timer t(ids[e.rec.op]);
+        try
+        {
+            if (e.rec.op == fs_trace::FS_OPEN)
+                open(e);
+            else if (e.rec.op == fs_trace::FS_CLOSE)
+                close(e);
+            else
+                apply(e);
+        }
+        catch (const fat32::file_error &)
+        {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> reopened{0};
+
+private:
+    void open(const fs_trace::event &e)
+    {
+        bool exist;
+        bool isdir;
+        auto fd = dev.try_open(fat32::path_view(e.path), e.rec.arg, e.rec.attr, exist, isdir);
+        if (!fd)
+        {
+            // the recorded open failed too
+            if (e.rec.handle)
+                errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (!e.rec.handle)
+        {
+            dev.close(*fd);
+            return;
+        }
+        std::lock_guard<std::mutex> g(mtx);
+        auto res = handles.emplace(e.rec.handle, *fd);
+        if (!res.second)
+        {
+            dev.close(res.first->second);
+            res.first->second = *fd;
+        }
+    }
+
+    void close(const fs_trace::event &e)
+    {
+        uint64_t fd;
+        {
+            std::lock_guard<std::mutex> g(mtx);
+            auto itr = handles.find(e.rec.handle);
+            if (itr == handles.end())
+                return;
+            fd = itr->second;
+            handles.erase(itr);
+        }
+        if (e.rec.arg)
+            dev.unlink(fd);
+        dev.close(fd);
+    }
+
+    void apply(const fs_trace::event &e)
+    {
+        uint64_t fd = 0;
+        bool temp = false;
+        {
+            std::lock_guard<std::mutex> g(mtx);
+            auto itr = handles.find(e.rec.handle);
+            if (itr != handles.end())
+                fd = itr->second;
+        }
+        if (!fd)
+        {
+            // the frontend reopens stale handles by name, so do the same
+            bool exist;
+            bool isdir;
+            fd = dev.open(fat32::path_view(e.path), OPEN_EXISTING, 0, exist, isdir);
+            temp = true;
+            reopened.fetch_add(1, std::memory_order_relaxed);
+        }
+        try
+        {
+            apply(e, fd);
+        }
+        catch (...)
+        {
+            if (temp)
+                dev.close(fd);
+            throw;
+        }
+        if (temp)
+            dev.close(fd);
+    }
+
+    void apply(const fs_trace::event &e, uint64_t fd)
+    {
+        thread_local std::vector<char> buf;
+        BY_HANDLE_FILE_INFORMATION info;
+        switch (e.rec.op)
+        {
+        case fs_trace::FS_READ:
+            buf.resize(std::max<size_t>(buf.size(), e.rec.length));
+            dev.read(fd, e.rec.offset, e.rec.length, buf.data());
+            break;
+
+        case fs_trace::FS_WRITE:
+            buf.resize(std::max<size_t>(buf.size(), e.rec.length));
+            dev.write(fd, e.rec.offset, e.rec.length, buf.data());
+            break;
+
+        case fs_trace::FS_STAT:
+            dev.fstat(fd, &info);
+            break;
+
+        case fs_trace::FS_SETATTR:
+            dev.setattr(fd, e.rec.arg);
+            break;
+
+        case fs_trace::FS_SETTIME:
+        {
+            SYSTEMTIME time;
+            FILETIME now;
+            GetSystemTime(&time);
+            SystemTimeToFileTime(&time, &now);
+            dev.settime(fd, &now, &now, &now);
+            break;
+        }
+
+        case fs_trace::FS_SETEND:
+            dev.setend(fd, e.rec.offset);
+            break;
+
+        case fs_trace::FS_SETALLOC:
+            dev.setalloc(fd, e.rec.offset);
+            break;
+
+        case fs_trace::FS_RENAME:
+            if (!dev.rename(fd, fat32::path_view(e.new_path), e.rec.arg))
+                errors.fetch_add(1, std::memory_order_relaxed);
+            break;
+
+        case fs_trace::FS_DELETE:
+            dev.fstat(fd, &info);
+            if (info.dwFileAttributes & 0x10)
+                dev.opendir(fd);
+            break;
+
+        case fs_trace::FS_ENUM:
+            dev.opendir(fd);
+            break;
+        }
+    }
+
+    dev_io::dev_t &dev;
+    std::mutex mtx;
+    std::unordered_map<uint64_t, uint64_t> handles;
+    std::string names[fs_trace::FS_OP_COUNT];
+    uint32_t ids[fs_trace::FS_OP_COUNT];
+};
+
+// Files that the trace opens before it creates them were already on the
+// recorded volume. Recreates them, with every parent directory, as large
+// as the furthest read, so opens and reads behave as they did.
+size_t populate(dev_io::dev_t &dev, const std::vector<fs_trace::event> &events)
+{
+    struct file
+    {
+        bool isdir;
+        int64_t size;
+    };
+    std::map<std::wstring, file> existing;
+    std::unordered_set<std::wstring> seen;
+    std::unordered_map<uint64_t, std::wstring> paths;
+    for (const auto &e : events)
+    {
+        if (e.rec.op == fs_trace::FS_OPEN && e.rec.handle)
+        {
+            paths[e.rec.handle] = e.path;
+            if (seen.insert(e.path).second && e.rec.arg != CREATE_NEW && e.rec.arg != CREATE_ALWAYS)
+                existing.emplace(e.path, file{(bool)e.rec.isdir, 0});
+        }
+        else if (e.rec.op == fs_trace::FS_RENAME)
+        {
+            seen.insert(e.new_path);
+        }
+        else if (e.rec.op == fs_trace::FS_READ)
+        {
+            auto p = paths.find(e.rec.handle);
+            auto itr = existing.find(p != paths.end() ? p->second : e.path);
+            if (itr != existing.end())
+                itr->second.size = std::max<int64_t>(itr->second.size, e.rec.offset + e.rec.length);
+        }
+    }
+    bool exist;
+    bool isdir;
+    // std::map orders every parent before its children
+    for (const auto &f : existing)
+    {
+        fat32::path_view path(f.first);
+        if (path.empty())
+            continue;
+        fat32::path parent;
+        for (auto itr = path.begin(); !itr.last(); ++itr)
+        {
+            parent.push_back(std::wstring(itr->name));
+            auto fd = dev.try_open(parent, CREATE_NEW, 0x10, exist, isdir);
+            if (fd)
+                dev.close(*fd);
+        }
+        // dev_t only creates on CREATE_NEW and CREATE_ALWAYS
+        auto fd = dev.try_open(path, CREATE_NEW, f.second.isdir ? 0x10 : 0x20, exist, isdir);
+        if (!fd)
+            continue;
+        if (!isdir && f.second.size)
+            dev.setend(*fd, f.second.size);
+        dev.close(*fd);
+    }
+    return existing.size();
+}
+
+int main(int argc, char *argv[])
+{
+    extern char *optarg;
+    extern int optind, opterr, optopt;
+
+    opterr = 0;
+    bool concurrent = false;
+    uint64_t size_mib = 256;
+
+    while (true)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "cs:h", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 'c':
+            concurrent = true;
+            break;
+
+        case 's':
+            size_mib = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            fprintf(stderr, "invalid argument %c\n", (char)optopt);
+            print_help(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "no enough arguments\n");
+        print_help(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (size_mib < 64 || size_mib > (1u << 20))
+    {
+        fprintf(stderr, "%llu is not a valid image size\n", (unsigned long long)size_mib);
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<fs_trace::event> events;
+    try
+    {
+        events = fs_trace::load(argv[optind]);
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+    // entries are written when an operation returns
+    std::stable_sort(events.begin(), events.end(),
+                     [](const fs_trace::event &a, const fs_trace::event &b) { return a.rec.time < b.rec.time; });
+
+    std::unique_ptr<dev_io::dev_t> dev;
+    size_t populated = 0;
+    try
+    {
+        if (optind + 1 < argc)
+        {
+            dev = std::make_unique<dev_io::dev_t>(argv[optind + 1]);
+        }
+        else
+        {
+            uint32_t tot_block = (size_mib << 20) / 512;
+            dev = std::make_unique<dev_io::dev_t>(std::make_unique<dev_io::ram_dev>((uint64_t)tot_block * 512), tot_block, 512);
+            populated = populate(*dev, events);
+        }
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "open image failed, %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+    fat32::stats::reset();
+
+    replayer r(*dev);
+    uint16_t threads = 0;
+    for (const auto &e : events)
+        threads = std::max<uint16_t>(threads, e.rec.thread + 1);
+    auto begin = std::chrono::steady_clock::now();
+    if (!concurrent)
+    {
+        for (const auto &e : events)
+            r.run(e);
+    }
+    else
+    {
+        std::vector<std::vector<const fs_trace::event *>> per_thread(threads);
+        for (const auto &e : events)
+            per_thread[e.rec.thread].push_back(&e);
+        std::vector<std::thread> workers;
+        for (const auto &list : per_thread)
+        {
+            workers.emplace_back([&r, &list, begin] {
+                for (auto e : list)
+                {
+                    std::this_thread::sleep_until(begin + std::chrono::nanoseconds(e->rec.time));
+                    r.run(*e);
+                }
+            });
+        }
+        for (auto &w : workers)
+            w.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    double traced = events.empty() ? 0 : (events.back().rec.time + events.back().rec.latency) / 1e9;
+
+    auto stats = fat32::stats::to_json();
+    stats.pop_back();
+    printf("{\"events\":%zu,\"threads\":%u,\"concurrent\":%s,\"populated\":%zu,\"errors\":%llu,\"reopened\":%llu,"
+           "\"traced_s\":%.6f,\"replay_s\":%.6f,\"ops_s\":%.0f,\"latency\":%s}\n",
+           events.size(), threads, concurrent ? "true" : "false", populated,
+           (unsigned long long)r.errors.load(), (unsigned long long)r.reopened.load(), traced, secs,
+           secs > 0 ? events.size() / secs : 0, stats.c_str());
+    return 0;
+}
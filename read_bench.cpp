@@ -0,0 +1,119 @@
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include "dev_io.h"
+
+// Models device latency on top of the RAM image, so that overlapping
+// requests can be measured even on a machine with few cores.
+class slow_dev : public dev_io::ram_dev
+{
+public:
+    slow_dev(uint64_t size, int latency_us) : ram_dev(size), latency_us(latency_us) {}
+    int32_t read(uint64_t offset, uint32_t size, void *buf) override
+    {
+        if (latency_us)
+            std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+        return ram_dev::read(offset, size, buf);
+    }
+
+private:
+    int latency_us;
+};
+
+// Each thread reads its own file on a RAM image, either with a single mutex
+// around every call (the old global_mtx behaviour) or relying on the
+// per-node locks inside dev_t.
+double run(dev_io::dev_t &dev, const std::vector<uint64_t> &fds, int threads, uint32_t file_size,
+           int millis, std::mutex *global)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<int> ready(0);
+    std::vector<uint64_t> bytes(threads, 0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t] {
+            std::vector<char> buf(64 * 1024);
+            uint64_t total = 0;
+            int64_t offset = 0;
+            ready.fetch_add(1);
+            while (ready.load() < threads)
+                ;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                uint32_t len;
+                if (global)
+                {
+                    std::lock_guard<std::mutex> g(*global);
+                    len = dev.read(fds[t], offset, buf.size(), buf.data());
+                }
+                else
+                {
+                    len = dev.read(fds[t], offset, buf.size(), buf.data());
+                }
+                total += len;
+                offset = offset + len < file_size ? offset + len : 0;
+            }
+            bytes[t] = total;
+        });
+    }
+    while (ready.load() < threads)
+        std::this_thread::yield();
+    auto begin = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+    stop = true;
+    for (auto &w : workers)
+        w.join();
+    auto end = std::chrono::steady_clock::now();
+    uint64_t total = 0;
+    for (auto b : bytes)
+        total += b;
+    return total / std::chrono::duration<double>(end - begin).count() / (1024 * 1024);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    uint32_t file_size = (argc > 2 ? atoi(argv[2]) : 4) * 1024 * 1024;
+    int millis = argc > 3 ? atoi(argv[3]) : 500;
+    int latency_us = argc > 4 ? atoi(argv[4]) : 0;
+    if (max_threads < 1)
+        max_threads = 1;
+
+    uint64_t img_size = (uint64_t)max_threads * file_size * 5 / 4 + (300ull << 20);
+    uint32_t tot_block = img_size / 512;
+    dev_io::dev_t dev(std::make_unique<slow_dev>((uint64_t)tot_block * 512, latency_us), tot_block, 512);
+
+    std::vector<uint64_t> fds;
+    std::vector<char> data(file_size, 'x');
+    for (int i = 0; i < max_threads; ++i)
+    {
+        bool exist;
+        bool isdir;
+        fat32::path path{L"file" + std::to_wstring(i)};
+        auto fd = dev.open(path, CREATE_NEW, 0x20, exist, isdir);
+        dev.write(fd, 0, file_size, data.data());
+        fds.push_back(fd);
+    }
+
+    printf("files: %d x %u KiB, %d ms per run, %d us read latency\n", max_threads, file_size / 1024, millis, latency_us);
+    printf("%8s %14s %14s %8s\n", "threads", "global MiB/s", "node MiB/s", "ratio");
+    std::mutex global;
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        auto serial = run(dev, fds, threads, file_size, millis, &global);
+        auto parallel = run(dev, fds, threads, file_size, millis, nullptr);
+        printf("%8d %14.1f %14.1f %8.2f\n", threads, serial, parallel, parallel / serial);
+        if (threads < max_threads && threads * 2 > max_threads)
+            threads = max_threads / 2;
+    }
+    for (auto fd : fds)
+        dev.close(fd);
+    return 0;
+}
@@ -0,0 +1,217 @@
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include "dev_io.h"
+
+// Mixed workload against dev_t without a mount: every thread owns a few files
+// in a shared directory and issues reads, writes and metadata operations.
+// Reports throughput and latency percentiles for 1 to max_threads threads.
+
+const int files_per_thread = 4;
+const uint32_t file_size = 256 * 1024;
+const uint32_t io_size = 4096;
+
+struct result
+{
+    uint64_t ops;
+    double seconds;
+    std::vector<uint32_t> latency;
+};
+
+enum op_t
+{
+    OP_READ,
+    OP_WRITE,
+    OP_FSTAT,
+    OP_REOPEN,
+    OP_SETTIME,
+    OP_OPENDIR,
+    OP_CREATE,
+};
+
+op_t pick(uint32_t r)
+{
+    r %= 100;
+    if (r < 50)
+        return OP_READ;
+    if (r < 70)
+        return OP_WRITE;
+    if (r < 80)
+        return OP_FSTAT;
+    if (r < 88)
+        return OP_REOPEN;
+    if (r < 94)
+        return OP_SETTIME;
+    if (r < 97)
+        return OP_OPENDIR;
+    return OP_CREATE;
+}
+
+std::wstring file_name(int t, int k)
+{
+    return L"t" + std::to_wstring(t) + L"_" + std::to_wstring(k);
+}
+
+void worker(dev_io::dev_t &dev, int t, const std::vector<uint64_t> &fds, std::atomic<bool> &stop, result &res)
+{
+    std::mt19937 rng(t + 1);
+    std::vector<char> buf(io_size, 'a' + t % 26);
+    bool exist;
+    bool isdir;
+    uint64_t serial = 0;
+    res.ops = 0;
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        auto k = rng() % files_per_thread;
+        auto fd = fds[k];
+        int64_t offset = rng() % (file_size / io_size) * io_size;
+        auto begin = std::chrono::steady_clock::now();
+        switch (pick(rng()))
+        {
+        case OP_READ:
+            dev.read(fd, offset, io_size, buf.data());
+            break;
+
+        case OP_WRITE:
+            dev.write(fd, offset, io_size, buf.data());
+            break;
+
+        case OP_FSTAT:
+        {
+            BY_HANDLE_FILE_INFORMATION info;
+            dev.fstat(fd, &info);
+            break;
+        }
+
+        case OP_REOPEN:
+            dev.close(dev.open({L"data", file_name(t, k)}, OPEN_EXISTING, 0, exist, isdir));
+            break;
+
+        case OP_SETTIME:
+        {
+            FILETIME time;
+            SYSTEMTIME systime;
+            GetSystemTime(&systime);
+            SystemTimeToFileTime(&systime, &time);
+            dev.settime(fd, &time, &time, &time);
+            break;
+        }
+
+        case OP_OPENDIR:
+        {
+            auto dir = dev.open({L"data"}, OPEN_EXISTING, 0, exist, isdir);
+            dev.opendir(dir);
+            dev.close(dir);
+            break;
+        }
+
+        case OP_CREATE:
+        {
+            auto name = L"tmp" + std::to_wstring(t) + L"_" + std::to_wstring(serial++);
+            auto tmp = dev.open({L"data", name}, CREATE_NEW, 0x20, exist, isdir);
+            dev.write(tmp, 0, io_size, buf.data());
+            dev.unlink(tmp);
+            dev.close(tmp);
+            break;
+        }
+        }
+        auto end = std::chrono::steady_clock::now();
+        res.latency.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+        ++res.ops;
+    }
+}
+
+void run(dev_io::dev_t &dev, const std::vector<std::vector<uint64_t>> &fds, int threads, int millis)
+{
+    std::atomic<bool> stop(false);
+    std::vector<result> results(threads);
+    std::vector<std::thread> workers;
+    auto begin = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t)
+    {
+        results[t].latency.reserve(1 << 16);
+        workers.emplace_back(worker, std::ref(dev), t, std::cref(fds[t]), std::ref(stop), std::ref(results[t]));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+    stop = true;
+    for (auto &w : workers)
+        w.join();
+    auto end = std::chrono::steady_clock::now();
+
+    uint64_t ops = 0;
+    std::vector<uint32_t> latency;
+    for (auto &r : results)
+    {
+        ops += r.ops;
+        latency.insert(latency.end(), r.latency.begin(), r.latency.end());
+    }
+    auto seconds = std::chrono::duration<double>(end - begin).count();
+    double p50 = 0, p99 = 0;
+    if (!latency.empty())
+    {
+        auto mid = latency.begin() + latency.size() / 2;
+        std::nth_element(latency.begin(), mid, latency.end());
+        p50 = *mid / 1000.0;
+        auto tail = latency.begin() + latency.size() * 99 / 100;
+        std::nth_element(latency.begin(), tail, latency.end());
+        p99 = *tail / 1000.0;
+    }
+    printf("%8d %12.0f %10.1f %10.1f\n", threads, ops / seconds, p50, p99);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    int millis = argc > 2 ? atoi(argv[2]) : 1000;
+    const char *image = argc > 3 ? argv[3] : nullptr;
+    if (max_threads < 1)
+        max_threads = 1;
+
+    uint64_t img_size = (uint64_t)max_threads * files_per_thread * file_size * 2 + (300ull << 20);
+    uint32_t tot_block = img_size / 512;
+    std::unique_ptr<dev_io::blk_dev> img;
+    if (image)
+        img = std::make_unique<dev_io::file_dev>(image, (uint64_t)tot_block * 512);
+    else
+        img = std::make_unique<dev_io::ram_dev>((uint64_t)tot_block * 512);
+    dev_io::dev_t dev(std::move(img), tot_block, 512);
+
+    bool exist;
+    bool isdir;
+    auto dir = dev.open({L"data"}, CREATE_NEW, 0x10, exist, isdir);
+    std::vector<char> data(file_size, 'x');
+    std::vector<std::vector<uint64_t>> fds(max_threads);
+    for (int t = 0; t < max_threads; ++t)
+    {
+        for (int k = 0; k < files_per_thread; ++k)
+        {
+            auto fd = dev.open({L"data", file_name(t, k)}, CREATE_NEW, 0x20, exist, isdir);
+            dev.write(fd, 0, file_size, data.data());
+            fds[t].push_back(fd);
+        }
+    }
+
+    printf("backend: %s, %d ms per step, %u hardware threads\n", image ? image : "ram", millis,
+           std::thread::hardware_concurrency());
+    printf("%8s %12s %10s %10s\n", "threads", "ops/s", "p50 us", "p99 us");
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        run(dev, fds, threads, millis);
+        if (threads < max_threads && threads * 2 > max_threads)
+            threads = max_threads / 2;
+    }
+
+    for (auto &v : fds)
+        for (auto fd : v)
+            dev.close(fd);
+    dev.close(dir);
+    return 0;
+}
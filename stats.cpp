@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "stats.h"
+
+namespace fat32
+{
+
+namespace stats
+{
+
+namespace
+{
+
+// Log-linear buckets: 8 per power of two, so a bucket is at most 12.5%
+// wide and any latency from 1 ns up fits.
+const uint32_t sub_bits = 3;
+const uint32_t bucket_count = (64 - sub_bits + 1) << sub_bits;
+const uint32_t shard_count = 8;
+
+uint32_t bucket_of(uint64_t ns) noexcept
+{
+    if (ns < (1u << sub_bits))
+        return ns;
+    uint32_t e = 63 - __builtin_clzll(ns);
+    return ((e - sub_bits + 1) << sub_bits) | ((ns >> (e - sub_bits)) & ((1u << sub_bits) - 1));
+}
+
+uint64_t bucket_value(uint32_t i) noexcept
+{
+    if (i < (1u << sub_bits))
+        return i;
+    uint32_t e = (i >> sub_bits) + sub_bits - 1;
+    uint64_t low = (uint64_t)((1u << sub_bits) | (i & ((1u << sub_bits) - 1))) << (e - sub_bits);
+    return low + ((1ull << (e - sub_bits)) - 1) / 2;
+}
+
+struct histogram
+{
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+    std::atomic<uint64_t> buckets[bucket_count];
+};
+
+struct alignas(64) shard
+{
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    histogram ops[max_ops];
+};
+
+struct state
+{
+    shard shards[shard_count];
+    std::atomic<uint32_t> op_count{DEV_OP_COUNT};
+    const char *names[max_ops] = {
+        "open", "openat", "close", "read", "write", "read_async", "write_async", "fstat", "setattr", "settime",
+        "setend", "setalloc", "unlink", "remove", "rename", "renameat", "opendir", "run_batch", "get_disk_info"};
+    std::mutex mtx;
+    std::string dump_path;
+};
+
+const char *counter_names[COUNTER_COUNT] = {
+    "dev_reads", "dev_read_bytes", "dev_writes", "dev_write_bytes", "lookup_fast", "lookup_slow",
+    "index_hits", "index_misses", "dir_cache_hits", "dir_cache_misses"};
+
+// Never destroyed: other threads may still record while statics die.
+state &get_state()
+{
+    static auto s = new state();
+    return *s;
+}
+
+shard &local_shard() noexcept
+{
+    static std::atomic<uint32_t> next{0};
+    thread_local shard *s = &get_state().shards[next.fetch_add(1, std::memory_order_relaxed) % shard_count];
+    return *s;
+}
+
+void bump(std::atomic<uint64_t> &a, uint64_t n) noexcept
+{
+    // a shard is shared once there are more threads than shards
+    a.fetch_add(n, std::memory_order_relaxed);
+}
+
+double rate(uint64_t hits, uint64_t misses)
+{
+    return hits + misses ? (double)hits / (hits + misses) : 0;
+}
+
+bool write_dump(const std::string &path)
+{
+    auto tmp = path + ".tmp";
+    auto file = fopen(tmp.c_str(), "w");
+    if (!file)
+        return false;
+    auto json = to_json();
+    bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+    ok = fclose(file) == 0 && ok;
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return ok && !ec;
+}
+
+} // namespace
+
+std::atomic<bool> enabled(true);
+
+void set_enabled(bool on) noexcept
+{
+    enabled.store(on, std::memory_order_relaxed);
+}
+
+uint32_t register_op(const char *name)
+{
+    auto &s = get_state();
+    std::lock_guard<std::mutex> g(s.mtx);
+    auto count = s.op_count.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!strcmp(s.names[i], name))
+            return i;
+    }
+    if (count == max_ops)
+        return max_ops;
+    s.names[count] = name;
+    s.op_count.store(count + 1, std::memory_order_release);
+    return count;
+}
+
+const char *op_name(uint32_t op) noexcept
+{
+    auto &s = get_state();
+    return op < s.op_count.load(std::memory_order_acquire) ? s.names[op] : nullptr;
+}
+
+void add(counter_t counter, uint64_t n) noexcept
+{
+    if (enabled.load(std::memory_order_relaxed))
+        bump(local_shard().counters[counter], n);
+}
+
+void record(uint32_t op, uint64_t ns) noexcept
+{
+    if (op >= max_ops)
+        return;
+    auto &h = local_shard().ops[op];
+    bump(h.count, 1);
+    bump(h.sum, ns);
+    bump(h.buckets[bucket_of(ns)], 1);
+    auto m = h.max.load(std::memory_order_relaxed);
+    while (ns > m && !h.max.compare_exchange_weak(m, ns, std::memory_order_relaxed))
+        ;
+}
+
+std::string to_json()
+{
+    auto &s = get_state();
+    std::string out = "{\"ops\":{";
+    char buf[512];
+    bool first = true;
+    auto count = s.op_count.load(std::memory_order_acquire);
+    for (uint32_t op = 0; op < count; ++op)
+    {
+        uint64_t n = 0, sum = 0, max = 0;
+        static thread_local uint64_t buckets[bucket_count];
+        memset(buckets, 0, sizeof(buckets));
+        for (auto &sh : s.shards)
+        {
+            auto &h = sh.ops[op];
+            n += h.count.load(std::memory_order_relaxed);
+            sum += h.sum.load(std::memory_order_relaxed);
+            max = std::max(max, h.max.load(std::memory_order_relaxed));
+            for (uint32_t i = 0; i < bucket_count; ++i)
+                buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+        }
+        if (!n)
+            continue;
+        // buckets are read after count, so they may hold a few more calls
+        uint64_t total = 0;
+        for (auto b : buckets)
+            total += b;
+        const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        uint64_t values[4] = {};
+        uint64_t seen = 0;
+        uint32_t q = 0;
+        for (uint32_t i = 0; i < bucket_count && q < 4; ++i)
+        {
+            seen += buckets[i];
+            while (q < 4 && seen && seen >= quantiles[q] * total)
+                values[q++] = std::min(bucket_value(i), max);
+        }
+        snprintf(buf, sizeof(buf),
+                 "%s\"%s\":{\"count\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,"
+                 "\"p999_ns\":%llu,\"max_ns\":%llu}",
+                 first ? "" : ",", s.names[op], (unsigned long long)n, (unsigned long long)(sum / n),
+                 (unsigned long long)values[0], (unsigned long long)values[1], (unsigned long long)values[2],
+                 (unsigned long long)values[3], (unsigned long long)max);
+        out += buf;
+        first = false;
+    }
+    out += "},\"counters\":{";
+    uint64_t c[COUNTER_COUNT] = {};
+    for (auto &sh : s.shards)
+    {
+        for (uint32_t i = 0; i < COUNTER_COUNT; ++i)
+            c[i] += sh.counters[i].load(std::memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < COUNTER_COUNT; ++i)
+    {
+        snprintf(buf, sizeof(buf), "%s\"%s\":%llu", i ? "," : "", counter_names[i], (unsigned long long)c[i]);
+        out += buf;
+    }
+    snprintf(buf, sizeof(buf), "},\"rates\":{\"lookup_fast\":%.4f,\"index_hit\":%.4f,\"dir_cache_hit\":%.4f}}\n",
+             rate(c[LOOKUP_FAST], c[LOOKUP_SLOW]), rate(c[INDEX_HITS], c[INDEX_MISSES]),
+             rate(c[DIR_CACHE_HITS], c[DIR_CACHE_MISSES]));
+    out += buf;
+    return out;
+}
+
+void reset() noexcept
+{
+    for (auto &sh : get_state().shards)
+    {
+        for (auto &c : sh.counters)
+            c.store(0, std::memory_order_relaxed);
+        for (auto &h : sh.ops)
+        {
+            h.count.store(0, std::memory_order_relaxed);
+            h.sum.store(0, std::memory_order_relaxed);
+            h.max.store(0, std::memory_order_relaxed);
+            for (auto &b : h.buckets)
+                b.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool start_dump(const char *path, uint32_t interval_ms)
+{
+    auto &s = get_state();
+    {
+        std::lock_guard<std::mutex> g(s.mtx);
+        if (!s.dump_path.empty())
+            return false;
+        s.dump_path = path;
+    }
+    if (!write_dump(path))
+        return false;
+    std::thread([path = std::string(path), interval_ms] {
+        for (;;)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+            write_dump(path);
+        }
+    }).detach();
+    atexit([] { write_dump(get_state().dump_path); });
+    return true;
+}
+
+} // namespace stats
+
+} // namespace fat32
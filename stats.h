@@ -0,0 +1,121 @@
+#ifndef STATS_H
+#define STATS_H
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdint.h>
+
+namespace fat32
+{
+
+// Process-wide operation latencies and event counters. Every thread adds to
+// its own shard with relaxed atomics, so recording never takes a lock and
+// threads do not share cache lines; a snapshot sums the shards.
+namespace stats
+{
+
+enum op_t : uint32_t
+{
+    OP_OPEN,
+    OP_OPENAT,
+    OP_CLOSE,
+    OP_READ,
+    OP_WRITE,
+    OP_READ_ASYNC,
+    OP_WRITE_ASYNC,
+    OP_FSTAT,
+    OP_SETATTR,
+    OP_SETTIME,
+    OP_SETEND,
+    OP_SETALLOC,
+    OP_UNLINK,
+    OP_REMOVE,
+    OP_RENAME,
+    OP_RENAMEAT,
+    OP_OPENDIR,
+    OP_RUN_BATCH,
+    OP_GET_DISK_INFO,
+    DEV_OP_COUNT,
+};
+
+// Frontends register their own operations (Dokan callbacks, FUSE requests)
+// after the dev_t ones.
+constexpr uint32_t max_ops = 64;
+
+enum counter_t : uint32_t
+{
+    DEV_READS,
+    DEV_READ_BYTES,
+    DEV_WRITES,
+    DEV_WRITE_BYTES,
+    // open() resolved entirely from loaded nodes without a lock
+    LOOKUP_FAST,
+    LOOKUP_SLOW,
+    // a path component found in a directory's child table, or not
+    INDEX_HITS,
+    INDEX_MISSES,
+    // a directory's parsed entry cache was valid, or had to be rebuilt
+    DIR_CACHE_HITS,
+    DIR_CACHE_MISSES,
+    COUNTER_COUNT,
+};
+
+// Returns the id for name, registering it on first use. Returns max_ops
+// once the table is full; recording against that id is a no-op.
+uint32_t register_op(const char *name);
+
+void set_enabled(bool enabled) noexcept;
+extern std::atomic<bool> enabled;
+
+void add(counter_t counter, uint64_t n = 1) noexcept;
+void record(uint32_t op, uint64_t ns) noexcept;
+
+inline uint64_t now() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The innermost operation running on this thread, max_ops outside any.
+inline thread_local uint32_t current_op = max_ops;
+
+const char *op_name(uint32_t op) noexcept;
+
+// Records the lifetime of the scope as one call of op.
+class timer
+{
+public:
+    explicit timer(uint32_t op) noexcept
+        : op(op), outer(current_op), start(enabled.load(std::memory_order_relaxed) ? now() : 0)
+    {
+        current_op = op;
+    }
+    ~timer()
+    {
+        current_op = outer;
+        if (start)
+            record(op, now() - start);
+    }
+    timer(const timer &) = delete;
+    timer &operator=(const timer &) = delete;
+
+private:
+    uint32_t op;
+    uint32_t outer;
+    uint64_t start;
+};
+
+// Count, mean, p50/p90/p99/p99.9 and max of every operation seen so far,
+// all counters and the derived hit rates, as one JSON object.
+std::string to_json();
+void reset() noexcept;
+
+// Rewrites path with to_json() every interval_ms milliseconds from a
+// background thread until the process exits. The file is replaced
+// atomically, so a reader never sees a partial dump.
+bool start_dump(const char *path, uint32_t interval_ms);
+
+} // namespace stats
+
+} // namespace fat32
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef VFAT_IOCTL_H
+#define VFAT_IOCTL_H
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Requests fuse_disk accepts on any file or directory of a mounted volume.
+
+// Grows the volume to the given size in bytes, see dev_t::grow.
+#define VFAT_IOC_GROW _IOW('V', 1, uint64_t)
+
+#endif
@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <string.h>
+#include "volume.h"
+#include "dir_scan.h"
+
+namespace dev_io
+{
+
+namespace
+{
+
+// keeps single requests within what pread and the RAM image accept
+const uint64_t max_request = 16 << 20;
+
+void read_range(blk_dev &img, uint64_t offset, uint64_t size, void *buf)
+{
+    for (uint64_t done = 0; done < size; done += max_request)
+    {
+        img.read(offset + done, std::min(max_request, size - done), (char *)buf + done);
+    }
+}
+
+void write_range(blk_dev &img, uint64_t offset, uint64_t size, const void *buf)
+{
+    for (uint64_t done = 0; done < size; done += max_request)
+    {
+        img.write(offset + done, std::min(max_request, size - done), (const char *)buf + done);
+    }
+}
+
+std::wstring short_name(const fat32::DIR_Entry &e)
+{
+    std::wstring name;
+    for (int k = 0; k < 8 && e.DIR_Name[k] != 0x20; ++k)
+    {
+        uint8_t c = e.DIR_Name[k];
+        name.push_back(k == 0 && c == 0x05 ? 0xe5 : c);
+    }
+    if (e.DIR_Name[8] != 0x20)
+    {
+        name.push_back(L'.');
+        for (int k = 8; k < 11 && e.DIR_Name[k] != 0x20; ++k)
+        {
+            name.push_back((uint8_t)e.DIR_Name[k]);
+        }
+    }
+    return name;
+}
+
+// Checks the fragments in [ldir, ldir + count) against the short entry
+// behind them and decodes the name they hold.
+bool long_name(const fat32::LDIR_Entry *ldir, size_t count, const fat32::DIR_Entry &entry, std::wstring &name)
+{
+    if (count > 20 || !(ldir[0].LDIR_Ord & 0x40))
+    {
+        return false;
+    }
+    auto sum = ChkSum((unsigned char *)entry.DIR_Name);
+    uint16_t buf[20 * 13 + 1];
+    size_t len = 0;
+    for (size_t k = 0; k < count; ++k)
+    {
+        const auto &frag = ldir[count - 1 - k];
+        if ((frag.LDIR_Ord & 0x3f) != k + 1 || frag.LDIR_Chksum != sum)
+        {
+            return false;
+        }
+        memcpy(buf + len, frag.LDIR_Name1, sizeof(frag.LDIR_Name1));
+        memcpy(buf + len + 5, frag.LDIR_Name2, sizeof(frag.LDIR_Name2));
+        memcpy(buf + len + 11, frag.LDIR_Name3, sizeof(frag.LDIR_Name3));
+        len += 13;
+    }
+    buf[len] = 0;
+    len = 0;
+    while (buf[len])
+    {
+        ++len;
+    }
+    if (!len || len > 255)
+    {
+        return false;
+    }
+    wchar_t out[256];
+    utf16_decode(buf, len, out);
+    name = out;
+    return true;
+}
+
+} // namespace
+
+volume::volume(std::unique_ptr<blk_dev> img) : img(std::move(img))
+{
+    this->img->read(0, sizeof(BPB), &BPB);
+    auto bytes = BPB.BPB_BytsPerSec;
+    auto spc = BPB.BPB_SecPerClus;
+    if (BPB.Signature_word != 0xaa55 || (bytes != 512 && bytes != 1024 && bytes != 2048 && bytes != 4096) ||
+        !spc || (spc & (spc - 1)) || !BPB.BPB_NumFATs || !BPB.BPB_FATSz32)
+    {
+        throw disk_error(disk_error::DISK_SIGNATURE_ERROR);
+    }
+    uint64_t data_sec = BPB.BPB_RsvdSecCnt + (uint64_t)BPB.BPB_NumFATs * BPB.BPB_FATSz32;
+    if (BPB.BPB_TotSec32 <= data_sec)
+    {
+        throw disk_error(disk_error::DISK_SIGNATURE_ERROR);
+    }
+    this->img->read((uint64_t)BPB.BPB_FSInfo * bytes, sizeof(FSInfo), &FSInfo);
+    clus_bytes = (uint32_t)bytes * spc;
+    fat_begin = (uint64_t)BPB.BPB_RsvdSecCnt * bytes;
+    fat_bytes = (uint64_t)BPB.BPB_FATSz32 * bytes;
+    data_begin = data_sec * bytes;
+    // the FAT may be too small for the data region of a hand-made image
+    clus_count = std::min<uint64_t>((BPB.BPB_TotSec32 - data_sec) / spc, fat_bytes / sizeof(uint32_t) - 2);
+}
+
+volume::volume(const char *dev_name) : volume(std::make_unique<file_dev>(dev_name))
+{
+}
+
+uint64_t volume::clus_offset(uint32_t clus) const noexcept
+{
+    return data_begin + (uint64_t)(clus - 2) * clus_bytes;
+}
+
+std::vector<uint32_t> volume::read_fat(uint32_t copy, unsigned threads)
+{
+    std::vector<uint32_t> fat(clus_count + 2);
+    auto base = fat_begin + copy * fat_bytes;
+    for_chunks(fat.size(), threads, [&](size_t begin, size_t end) {
+        read_range(*img, base + begin * sizeof(uint32_t), (end - begin) * sizeof(uint32_t), fat.data() + begin);
+        for (auto i = begin; i < end; ++i)
+        {
+            fat[i] &= 0x0fffffff;
+        }
+    });
+    return fat;
+}
+
+void volume::write_fat(const std::vector<uint32_t> &fat, unsigned threads)
+{
+    for (uint32_t copy = 0; copy < BPB.BPB_NumFATs; ++copy)
+    {
+        auto base = fat_begin + copy * fat_bytes;
+        for_chunks(fat.size(), threads, [&](size_t begin, size_t end) {
+            write_range(*img, base + begin * sizeof(uint32_t), (end - begin) * sizeof(uint32_t), fat.data() + begin);
+        });
+    }
+}
+
+void volume::write_fsinfo()
+{
+    img->write((uint64_t)BPB.BPB_FSInfo * BPB.BPB_BytsPerSec, sizeof(FSInfo), &FSInfo);
+}
+
+void volume::read_chain(const std::vector<uint32_t> &chain, void *buf)
+{
+    size_t i = 0;
+    while (i < chain.size())
+    {
+        size_t run = 1;
+        while (i + run < chain.size() && chain[i + run] == chain[i] + run && (run + 1) * clus_bytes <= max_request)
+        {
+            ++run;
+        }
+        img->read(clus_offset(chain[i]), run * clus_bytes, (char *)buf + i * clus_bytes);
+        i += run;
+    }
+}
+
+void volume::write_chain(const std::vector<uint32_t> &chain, const void *buf)
+{
+    size_t i = 0;
+    while (i < chain.size())
+    {
+        size_t run = 1;
+        while (i + run < chain.size() && chain[i + run] == chain[i] + run && (run + 1) * clus_bytes <= max_request)
+        {
+            ++run;
+        }
+        img->write(clus_offset(chain[i]), run * clus_bytes, (const char *)buf + i * clus_bytes);
+        i += run;
+    }
+}
+
+void volume::write_clus(uint32_t clus, const void *buf)
+{
+    img->write(clus_offset(clus), clus_bytes, buf);
+}
+
+bool read_fat_chain(const std::vector<uint32_t> &fat, uint32_t first, std::vector<uint32_t> &chain)
+{
+    auto limit = chain.size() + fat.size();
+    auto clus = first;
+    while (true)
+    {
+        if (clus < 2 || clus >= fat.size() || !fat[clus] || chain.size() == limit)
+        {
+            return false;
+        }
+        chain.push_back(clus);
+        if (is_eoc(fat[clus]))
+        {
+            return true;
+        }
+        clus = fat[clus];
+    }
+}
+
+std::vector<raw_entry> parse_dir(const fat32::DIR_Entry *entries, size_t count, std::vector<orphan_run> *orphans)
+{
+    std::vector<raw_entry> res;
+    std::vector<uint8_t> types(count);
+    dir_scan::classify(entries, count, types.data());
+    size_t i = 0;
+    while (i < count && types[i] != dir_scan::ENTRY_END)
+    {
+        if (types[i] == dir_scan::ENTRY_DELETED)
+        {
+            ++i;
+            continue;
+        }
+        auto begin = i;
+        while (i < count && types[i] == dir_scan::ENTRY_LONG)
+        {
+            ++i;
+        }
+        if (i == count || types[i] != dir_scan::ENTRY_SHORT)
+        {
+            if (orphans)
+                orphans->push_back(orphan_run{(uint32_t)begin, (uint32_t)(i - begin)});
+            continue;
+        }
+        raw_entry e;
+        e.entry = entries[i];
+        e.index = begin;
+        e.slots = i - begin + 1;
+        e.bad_long = false;
+        if (i == begin || !long_name((const fat32::LDIR_Entry *)entries + begin, i - begin, entries[i], e.name))
+        {
+            e.bad_long = i != begin;
+            e.name = short_name(entries[i]);
+        }
+        res.push_back(std::move(e));
+        ++i;
+    }
+    return res;
+}
+
+void for_chunks(size_t count, unsigned threads, const std::function<void(size_t, size_t)> &fn)
+{
+    threads = std::max<size_t>(1, std::min<size_t>(threads, count));
+    if (threads == 1)
+    {
+        fn(0, count);
+        return;
+    }
+    size_t chunk = (count + threads - 1) / threads;
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t] {
+            try
+            {
+                auto begin = std::min(count, t * chunk);
+                fn(begin, std::min(count, begin + chunk));
+            }
+            catch (...)
+            {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+    for (auto &w : workers)
+        w.join();
+    for (auto &e : errors)
+    {
+        if (e)
+            std::rethrow_exception(e);
+    }
+}
+
+} // namespace dev_io
@@ -0,0 +1,100 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "dev_io.h"
+
+namespace dev_io
+{
+
+// One live directory entry as found on disk, long name included.
+struct raw_entry
+{
+    std::wstring name;      // the long name if it is intact, otherwise the short one
+    fat32::DIR_Entry entry; // the short entry
+    uint32_t index;         // slot of the first long name fragment, or of the short entry
+    uint32_t slots;
+    bool bad_long;          // fragments out of order or with the wrong checksum
+
+    uint32_t first_clus() const noexcept
+    {
+        return ((uint32_t)entry.DIR_FstClusHI << 16) + entry.DIR_FstClusLO;
+    }
+    bool isdir() const noexcept { return entry.DIR_Attr & 0x10; }
+    bool is_dot() const noexcept { return entry.DIR_Name[0] == '.'; }
+    bool is_label() const noexcept { return (entry.DIR_Attr & 0x18) == 0x08; }
+};
+
+// Long name fragments that no short entry follows.
+struct orphan_run
+{
+    uint32_t index;
+    uint32_t slots;
+};
+
+// Offline access to a FAT32 image for the image tools. Unlike dev_t nothing
+// is loaded or cached: callers read the FAT and directories they need and
+// write back what they change.
+class volume
+{
+public:
+    // Throws disk_error if img does not hold a FAT32 volume.
+    explicit volume(std::unique_ptr<blk_dev> img);
+    explicit volume(const char *dev_name);
+
+    const fat32::BPB_t &bpb() const noexcept { return BPB; }
+    fat32::FSInfo_t &fsinfo() noexcept { return FSInfo; }
+    uint32_t clus_size() const noexcept { return clus_bytes; }
+    // Data clusters are numbered 2 to count_of_cluster() + 1.
+    uint32_t count_of_cluster() const noexcept { return clus_count; }
+    bool valid(uint32_t clus) const noexcept { return clus >= 2 && clus < clus_count + 2; }
+    uint64_t clus_offset(uint32_t clus) const noexcept;
+
+    // Reads FAT copy `copy` in chunks spread over `threads` readers. The
+    // result has one entry per cluster number, reserved bits cleared.
+    std::vector<uint32_t> read_fat(uint32_t copy, unsigned threads);
+    // Writes fat to every copy.
+    void write_fat(const std::vector<uint32_t> &fat, unsigned threads);
+    void write_fsinfo();
+
+    // Reads or writes the clusters of chain, one request per contiguous run.
+    void read_chain(const std::vector<uint32_t> &chain, void *buf);
+    void write_chain(const std::vector<uint32_t> &chain, const void *buf);
+    void write_clus(uint32_t clus, const void *buf);
+    blk_dev &device() noexcept { return *img; }
+
+private:
+    std::unique_ptr<blk_dev> img;
+    fat32::BPB_t BPB;
+    fat32::FSInfo_t FSInfo;
+    uint32_t clus_bytes;
+    uint32_t clus_count;
+    uint64_t fat_begin;
+    uint64_t fat_bytes;
+    uint64_t data_begin;
+};
+
+inline bool is_eoc(uint32_t next) noexcept
+{
+    return (next & 0x0fffffff) >= 0x0ffffff8;
+}
+
+const uint32_t bad_clus = 0x0ffffff7;
+
+// Appends the chain starting at first to chain. Returns false if it leaves
+// the volume, runs into a free cluster or is longer than the volume.
+bool read_fat_chain(const std::vector<uint32_t> &fat, uint32_t first, std::vector<uint32_t> &chain);
+
+// Decodes every live entry of a directory in slot order.
+std::vector<raw_entry> parse_dir(const fat32::DIR_Entry *entries, size_t count, std::vector<orphan_run> *orphans = nullptr);
+
+// Calls fn(begin, end) for consecutive chunks of [0, count) on up to
+// `threads` threads and rethrows the first exception.
+void for_chunks(size_t count, unsigned threads, const std::function<void(size_t, size_t)> &fn);
+
+} // namespace dev_io
+
+#endif
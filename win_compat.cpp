@@ -0,0 +1,174 @@
+#ifndef _WIN32
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include "win_compat.h"
+
+static const uint64_t EPOCH_DIFF = 116444736000000000ULL;
+static const uint64_t TICKS_PER_SEC = 10000000ULL;
+
+static uint64_t get_ticks(CONST FILETIME *ft)
+{
+    return ((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+static void set_ticks(uint64_t ticks, LPFILETIME ft)
+{
+    ft->dwLowDateTime = (DWORD)ticks;
+    ft->dwHighDateTime = (DWORD)(ticks >> 32);
+}
+
+static int64_t local_offset(time_t t)
+{
+    tm local;
+    localtime_r(&t, &local);
+    return local.tm_gmtoff;
+}
+
+void GetSystemTime(LPSYSTEMTIME lpSystemTime)
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    FILETIME ft;
+    set_ticks(ts.tv_sec * TICKS_PER_SEC + ts.tv_nsec / 100 + EPOCH_DIFF, &ft);
+    FileTimeToSystemTime(&ft, lpSystemTime);
+}
+
+BOOL SystemTimeToFileTime(CONST SYSTEMTIME *lpSystemTime, LPFILETIME lpFileTime)
+{
+    tm t;
+    memset(&t, 0, sizeof(tm));
+    t.tm_year = lpSystemTime->wYear - 1900;
+    t.tm_mon = lpSystemTime->wMonth - 1;
+    t.tm_mday = lpSystemTime->wDay;
+    t.tm_hour = lpSystemTime->wHour;
+    t.tm_min = lpSystemTime->wMinute;
+    t.tm_sec = lpSystemTime->wSecond;
+    if (lpSystemTime->wYear < 1601 || lpSystemTime->wMonth < 1 || lpSystemTime->wMonth > 12 ||
+        lpSystemTime->wDay < 1 || lpSystemTime->wDay > 31 || lpSystemTime->wHour > 23 ||
+        lpSystemTime->wMinute > 59 || lpSystemTime->wSecond > 59 || lpSystemTime->wMilliseconds > 999)
+    {
+        return FALSE;
+    }
+    int64_t secs = timegm(&t);
+    set_ticks(secs * TICKS_PER_SEC + lpSystemTime->wMilliseconds * 10000ULL + EPOCH_DIFF, lpFileTime);
+    return TRUE;
+}
+
+BOOL FileTimeToSystemTime(CONST FILETIME *lpFileTime, LPSYSTEMTIME lpSystemTime)
+{
+    uint64_t ticks = get_ticks(lpFileTime);
+    time_t secs = (int64_t)(ticks / TICKS_PER_SEC) - (int64_t)(EPOCH_DIFF / TICKS_PER_SEC);
+    tm t;
+    if (!gmtime_r(&secs, &t))
+    {
+        return FALSE;
+    }
+    lpSystemTime->wYear = t.tm_year + 1900;
+    lpSystemTime->wMonth = t.tm_mon + 1;
+    lpSystemTime->wDayOfWeek = t.tm_wday;
+    lpSystemTime->wDay = t.tm_mday;
+    lpSystemTime->wHour = t.tm_hour;
+    lpSystemTime->wMinute = t.tm_min;
+    lpSystemTime->wSecond = t.tm_sec;
+    lpSystemTime->wMilliseconds = ticks % TICKS_PER_SEC / 10000;
+    return TRUE;
+}
+
+BOOL FileTimeToLocalFileTime(CONST FILETIME *lpFileTime, LPFILETIME lpLocalFileTime)
+{
+    uint64_t ticks = get_ticks(lpFileTime);
+    time_t secs = (int64_t)(ticks / TICKS_PER_SEC) - (int64_t)(EPOCH_DIFF / TICKS_PER_SEC);
+    set_ticks(ticks + local_offset(secs) * (int64_t)TICKS_PER_SEC, lpLocalFileTime);
+    return TRUE;
+}
+
+BOOL LocalFileTimeToFileTime(CONST FILETIME *lpLocalFileTime, LPFILETIME lpFileTime)
+{
+    uint64_t ticks = get_ticks(lpLocalFileTime);
+    time_t secs = (int64_t)(ticks / TICKS_PER_SEC) - (int64_t)(EPOCH_DIFF / TICKS_PER_SEC);
+    set_ticks(ticks - local_offset(secs) * (int64_t)TICKS_PER_SEC, lpFileTime);
+    return TRUE;
+}
+
+int MultiByteToWideChar(UINT CodePage, DWORD dwFlags, const char *lpMultiByteStr, int cbMultiByte,
+                        wchar_t *lpWideCharStr, int cchWideChar)
+{
+    auto s = (const unsigned char *)lpMultiByteStr;
+    size_t len = cbMultiByte < 0 ? strlen(lpMultiByteStr) + 1 : cbMultiByte;
+    int count = 0;
+    for (size_t i = 0; i < len;)
+    {
+        uint32_t c = s[i];
+        int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+        if (extra)
+        {
+            c &= 0x3f >> extra;
+        }
+        ++i;
+        for (; extra && i < len && (s[i] & 0xc0) == 0x80; --extra, ++i)
+        {
+            c = (c << 6) | (s[i] & 0x3f);
+        }
+        if (lpWideCharStr)
+        {
+            if (count >= cchWideChar)
+            {
+                return 0;
+            }
+            lpWideCharStr[count] = c;
+        }
+        ++count;
+    }
+    return count;
+}
+
+int WideCharToMultiByte(UINT CodePage, DWORD dwFlags, const wchar_t *lpWideCharStr, int cchWideChar,
+                        char *lpMultiByteStr, int cbMultiByte, const char *lpDefaultChar, BOOL *lpUsedDefaultChar)
+{
+    size_t len = cchWideChar < 0 ? wcslen(lpWideCharStr) + 1 : cchWideChar;
+    int count = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        uint32_t c = lpWideCharStr[i];
+        char buf[4];
+        int n;
+        if (c < 0x80)
+        {
+            buf[0] = c;
+            n = 1;
+        }
+        else if (c < 0x800)
+        {
+            buf[0] = 0xc0 | (c >> 6);
+            buf[1] = 0x80 | (c & 0x3f);
+            n = 2;
+        }
+        else if (c < 0x10000)
+        {
+            buf[0] = 0xe0 | (c >> 12);
+            buf[1] = 0x80 | ((c >> 6) & 0x3f);
+            buf[2] = 0x80 | (c & 0x3f);
+            n = 3;
+        }
+        else
+        {
+            buf[0] = 0xf0 | (c >> 18);
+            buf[1] = 0x80 | ((c >> 12) & 0x3f);
+            buf[2] = 0x80 | ((c >> 6) & 0x3f);
+            buf[3] = 0x80 | (c & 0x3f);
+            n = 4;
+        }
+        if (lpMultiByteStr)
+        {
+            if (count + n > cbMultiByte)
+            {
+                return 0;
+            }
+            memcpy(lpMultiByteStr + count, buf, n);
+        }
+        count += n;
+    }
+    return count;
+}
+#endif